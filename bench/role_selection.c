@@ -0,0 +1,492 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+
+/* Microbenchmark of the role selection (13.26.23 updtRolesTree) on a tree
+ * of 1000 ports, and of the priority vector comparisons it is made of.
+ *
+ * "before" is the field by field memcmp() comparison mstpd used until the
+ * vectors were compared as host order keys, kept here as the reference;
+ * "after" is the code in mstp.c, which is included below so that its
+ * static functions can be called. Both are built with the mstpd CFLAGS.
+ * The two comparisons are also checked to agree on every vector pair, so
+ * the benchmark runs as a test under "make check".
+ *
+ * Usage: role_selection [iterations]
+ */
+
+#include "mstp.c"
+
+#define NUM_PORTS   1000
+#define NUM_VECTORS 4096
+#define NUM_RUNS    5
+
+/* Stubs of what mstpd provides outside of mstp.c */
+int log_level = LOG_LEVEL_ERROR;
+int ctl_in_handler = 0;
+
+void Dprintf(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    if(level > log_level)
+        return;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+void _ctl_err_log(char *fmt, ...)
+{
+}
+
+void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state)
+{
+}
+
+void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
+{
+}
+
+void MSTP_OUT_flush_all_mstids(per_tree_port_t *ptp)
+{
+}
+
+void MSTP_OUT_set_ageing_time(port_t *prt, unsigned int ageingTime)
+{
+}
+
+void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
+{
+}
+
+void MSTP_OUT_shutdown_port(port_t *prt)
+{
+}
+
+/* Reference comparisons, as they were before the host order keys */
+static bool samePriorityAndTimers_memcmp(port_priority_vector_t *vec1,
+                                         port_priority_vector_t *vec2,
+                                         times_t *time1,
+                                         times_t *time2,
+                                         bool cist)
+{
+    if(cist)
+    {
+        if(cmp(time1->Forward_Delay, !=, time2->Forward_Delay))
+            return false;
+        if(cmp(time1->Max_Age, !=, time2->Max_Age))
+            return false;
+        if(cmp(time1->Message_Age, !=, time2->Message_Age))
+            return false;
+        if(cmp(time1->Hello_Time, !=, time2->Hello_Time))
+            return false;
+
+        if(cmp(vec1->RootID, !=, vec2->RootID))
+            return false;
+        if(cmp(vec1->ExtRootPathCost, !=, vec2->ExtRootPathCost))
+            return false;
+    }
+
+    if(cmp(time1->remainingHops, !=, time2->remainingHops))
+        return false;
+
+    if(cmp(vec1->RRootID, !=, vec2->RRootID))
+        return false;
+    if(cmp(vec1->IntRootPathCost, !=, vec2->IntRootPathCost))
+        return false;
+    if(cmp(vec1->DesignatedBridgeID, !=, vec2->DesignatedBridgeID))
+        return false;
+    if(cmp(vec1->DesignatedPortID, !=, vec2->DesignatedPortID))
+        return false;
+
+    return true;
+}
+
+static bool betterorsamePriority_memcmp(port_priority_vector_t *vec1,
+                                        port_priority_vector_t *vec2,
+                                        port_identifier_t pId1,
+                                        port_identifier_t pId2,
+                                        bool cist)
+{
+    int result;
+
+    if(cist)
+    {
+        if(0 < (result = _ncmp(vec1->RootID, vec2->RootID)))
+            return false; /* worse */
+        else if(0 > result)
+            return true; /* better */
+        if(0 < (result = _ncmp(vec1->ExtRootPathCost, vec2->ExtRootPathCost)))
+            return false; /* worse */
+        else if(0 > result)
+            return true; /* better */
+    }
+
+    if(0 < (result = _ncmp(vec1->RRootID, vec2->RRootID)))
+        return false; /* worse */
+    else if(0 > result)
+        return true; /* better */
+    if(0 < (result = _ncmp(vec1->IntRootPathCost, vec2->IntRootPathCost)))
+        return false; /* worse */
+    else if(0 > result)
+        return true; /* better */
+    if(0 < (result = _ncmp(vec1->DesignatedBridgeID, vec2->DesignatedBridgeID)))
+        return false; /* worse */
+    else if(0 > result)
+        return true; /* better */
+    if(0 < (result = _ncmp(vec1->DesignatedPortID, vec2->DesignatedPortID)))
+        return false; /* worse */
+    else if(0 > result)
+        return true; /* better */
+
+    /* Port ID is a tie-breaker */
+    return cmp(pId1, <=, pId2);
+}
+
+/* Fixed seed, so that every run looks at the same vectors */
+static __u32 rnd_state = 2463534242u;
+
+static __u32 rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+static bridge_identifier_t rnd_bridge_id(unsigned int choices)
+{
+    bridge_identifier_t id;
+
+    id.u = __cpu_to_be64(((__u64)(0x8000 + rnd() % choices) << 48)
+                         | (0x020000000000ull + rnd() % choices));
+    return id;
+}
+
+/* Few distinct values per field, so that vectors often share a prefix and
+ * the comparisons have to look past the first fields */
+static void rnd_vector(port_priority_vector_t *vec)
+{
+    vec->RootID = rnd_bridge_id(2);
+    vec->ExtRootPathCost = __cpu_to_be32(20000 * (rnd() % 4));
+    vec->RRootID = rnd_bridge_id(2);
+    vec->IntRootPathCost = __cpu_to_be32(20000 * (rnd() % 4));
+    vec->DesignatedBridgeID = rnd_bridge_id(4);
+    vec->DesignatedPortID = __cpu_to_be16(0x8000 + 1 + rnd() % 4);
+}
+
+static port_priority_vector_t vectors[NUM_VECTORS];
+static times_t times[NUM_VECTORS];
+static port_identifier_t port_ids[NUM_VECTORS];
+
+static inline __u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+    return (x > y) - (x < y);
+}
+
+static __u64 median(__u64 *runs)
+{
+    qsort(runs, NUM_RUNS, sizeof(*runs), cmp_u64);
+    return runs[NUM_RUNS / 2];
+}
+
+/* Keeps the results of the timed calls alive */
+static volatile unsigned int sink;
+
+/* Time per call in ns, median of NUM_RUNS runs of iterations passes over
+ * the vector pairs (i, i + 1); same_times makes the times equal */
+#define BENCH_PAIRS(_result, _iterations, _call)                         \
+    ({                                                                   \
+        __u64 _runs[NUM_RUNS], _start;                                   \
+        unsigned int _r, _n, _i, _acc = 0;                               \
+        for(_r = 0; _r < NUM_RUNS; ++_r)                                 \
+        {                                                                \
+            _start = now_ns();                                           \
+            for(_n = 0; _n < (_iterations); ++_n)                        \
+                for(_i = 0; _i < NUM_VECTORS - 1; ++_i)                  \
+                    _acc += (_call);                                     \
+            _runs[_r] = now_ns() - _start;                               \
+        }                                                                \
+        sink = _acc;                                                     \
+        (_result) = (double)median(_runs)                                \
+                    / ((double)(_iterations) * (NUM_VECTORS - 1));       \
+    })
+
+static bool check_comparisons(void)
+{
+    unsigned int i, j;
+    bool ok = true;
+
+    for(i = 0; i < NUM_VECTORS; ++i)
+        for(j = i; j < i + 64 && j < NUM_VECTORS; ++j)
+        {
+            if(betterorsamePriority(&vectors[i], &vectors[j], port_ids[i],
+                                    port_ids[j], i & 1)
+               != betterorsamePriority_memcmp(&vectors[i], &vectors[j],
+                                              port_ids[i], port_ids[j],
+                                              i & 1))
+            {
+                fprintf(stderr, "betterorsamePriority differs for %u, %u\n",
+                        i, j);
+                ok = false;
+            }
+            if(samePriorityAndTimers(&vectors[i], &vectors[j], &times[i],
+                                     &times[j], i & 1)
+               != samePriorityAndTimers_memcmp(&vectors[i], &vectors[j],
+                                               &times[i], &times[j], i & 1))
+            {
+                fprintf(stderr, "samePriorityAndTimers differs for %u, %u\n",
+                        i, j);
+                ok = false;
+            }
+        }
+    return ok;
+}
+
+/* 13.26.23 a), b): the best root path priority vector of the tree */
+static per_tree_port_t *root_select_memcmp(tree_t *tree)
+{
+    per_tree_port_t *ptp, *root_ptp = NULL;
+    port_priority_vector_t root_priority, root_path_priority;
+    port_identifier_t root_port_id = 0;
+    bool cist = (0 == tree->MSTID);
+
+    root_priority = tree->BridgePriority;
+    FOREACH_PTP_IN_TREE(ptp, tree)
+    {
+        if(!calcRootPathPriority(ptp, &root_path_priority))
+            continue;
+        if(betterorsamePriority_memcmp(&root_path_priority, &root_priority,
+                                       ptp->portId, root_port_id, cist))
+        {
+            assign(root_priority, root_path_priority);
+            root_port_id = ptp->portId;
+            root_ptp = ptp;
+        }
+    }
+    return root_ptp;
+}
+
+/* The same, as updtRolesTreeFull() does it */
+static per_tree_port_t *root_select_key(tree_t *tree)
+{
+    per_tree_port_t *ptp, *root_ptp = NULL;
+    port_priority_vector_t root_path_priority;
+    prio_key_t root_key, key;
+    bool cist = (0 == tree->MSTID);
+
+    prio_key(&root_key, &tree->BridgePriority, 0, cist);
+    FOREACH_PTP_IN_TREE(ptp, tree)
+    {
+        if(!calcRootPathPriority(ptp, &root_path_priority))
+            continue;
+        prio_key(&key, &root_path_priority, ptp->portId, cist);
+        if(0 >= prio_key_cmp(&key, &root_key))
+        {
+            root_key = key;
+            root_ptp = ptp;
+        }
+    }
+    return root_ptp;
+}
+
+/* Bridge with NUM_PORTS ports, each with received info on the CIST */
+static bridge_t *create_bridge(void)
+{
+    static __u8 macaddr[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x01};
+    bridge_t *br;
+    port_t *prt;
+    per_tree_port_t *ptp;
+    tree_t *cist;
+    int i;
+
+    if(!(br = calloc(1, sizeof(*br))) || !MSTP_IN_bridge_create(br, macaddr))
+        return NULL;
+    cist = GET_CIST_TREE(br);
+    for(i = 0; i < NUM_PORTS; ++i)
+    {
+        if(!(prt = calloc(1, sizeof(*prt))))
+            return NULL;
+        prt->bridge = br;
+        snprintf(prt->sysdeps.name, IFNAMSIZ, "p%d", i + 1);
+        if(!MSTP_IN_port_create_and_add_tail(prt, i + 1))
+            return NULL;
+        assign(prt->ExternalPortPathCost, 20000u);
+        ptp = GET_CIST_PTP_FROM_PORT(prt);
+        ptp->infoIs = ioReceived;
+        rnd_vector(&ptp->portPriority);
+        assign(ptp->portTimes, cist->BridgeTimes);
+    }
+    return br;
+}
+
+/* Median time of updtRolesTree() in ns. With one_port a port's received
+ * vector changes before each run, to one that can't make it the root port,
+ * so the incremental selection looks at that port only. */
+static __u64 bench_roles(tree_t *tree, unsigned int iterations, bool one_port)
+{
+    per_tree_port_t *ptp, *ptps[NUM_PORTS];
+    __u64 runs[NUM_RUNS], start, elapsed;
+    unsigned int r, n, num_ptps = 0;
+
+    FOREACH_PTP_IN_TREE(ptp, tree)
+        ptps[num_ptps++] = ptp;
+
+    for(r = 0; r < NUM_RUNS; ++r)
+    {
+        elapsed = 0;
+        for(n = 0; n < iterations; ++n)
+        {
+            if(one_port)
+            {
+                do
+                    ptp = ptps[rnd() % num_ptps];
+                while(ptp->portId == tree->rootPortId);
+                ptp->portPriority.RootID.u = ~0ull;
+                ptp_roles_dirty(ptp);
+            }
+            else
+                tree->rolesFullRecalc = true;
+            start = now_ns();
+            updtRolesTree(tree);
+            elapsed += now_ns() - start;
+            /* Let the PRTSM take the selected role */
+            if(one_port)
+                ptp->role = ptp->selectedRole;
+            else
+                FOREACH_PTP_IN_TREE(ptp, tree)
+                    ptp->role = ptp->selectedRole;
+        }
+        runs[r] = elapsed / iterations;
+    }
+    return median(runs);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int iterations = 100, i;
+    double before, after;
+    __u64 runs[NUM_RUNS], start;
+    per_tree_port_t *root_memcmp, *root_key;
+    bridge_t *br;
+    tree_t *tree;
+    int r;
+
+    if(argc > 1)
+        iterations = atoi(argv[1]);
+    if(iterations < 1)
+        iterations = 1;
+
+    for(i = 0; i < NUM_VECTORS; ++i)
+    {
+        rnd_vector(&vectors[i]);
+        times[i].Forward_Delay = 15;
+        times[i].Max_Age = 20;
+        times[i].Message_Age = rnd() % 2;
+        times[i].Hello_Time = 2;
+        times[i].remainingHops = 20;
+        port_ids[i] = __cpu_to_be16(0x8000 + 1 + rnd() % 8);
+    }
+    if(!check_comparisons())
+        return 1;
+
+    printf("role selection benchmark, %d ports, median of %d runs\n",
+           NUM_PORTS, NUM_RUNS);
+    printf("  %-38s %-12s %s\n", "", "before", "after");
+
+    BENCH_PAIRS(before, iterations,
+                betterorsamePriority_memcmp(&vectors[_i], &vectors[_i + 1],
+                                            port_ids[_i], port_ids[_i + 1],
+                                            true));
+    BENCH_PAIRS(after, iterations,
+                betterorsamePriority(&vectors[_i], &vectors[_i + 1],
+                                     port_ids[_i], port_ids[_i + 1], true));
+    printf("  %-38s %-12.1f %.1f\n", "betterorsamePriority ns", before, after);
+
+    BENCH_PAIRS(before, iterations,
+                samePriorityAndTimers_memcmp(&vectors[_i], &vectors[_i + 1],
+                                             &times[_i], &times[_i + 1],
+                                             true));
+    BENCH_PAIRS(after, iterations,
+                samePriorityAndTimers(&vectors[_i], &vectors[_i + 1],
+                                      &times[_i], &times[_i + 1], true));
+    printf("  %-38s %-12.1f %.1f\n", "samePriorityAndTimers, differ ns",
+           before, after);
+
+    BENCH_PAIRS(before, iterations,
+                samePriorityAndTimers_memcmp(&vectors[_i], &vectors[_i],
+                                             &times[_i], &times[_i], true));
+    BENCH_PAIRS(after, iterations,
+                samePriorityAndTimers(&vectors[_i], &vectors[_i],
+                                      &times[_i], &times[_i], true));
+    printf("  %-38s %-12.1f %.1f\n", "samePriorityAndTimers, equal ns",
+           before, after);
+
+    if(!(br = create_bridge()))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    tree = GET_CIST_TREE(br);
+
+    root_memcmp = root_select_memcmp(tree);
+    root_key = root_select_key(tree);
+    if(root_memcmp != root_key)
+    {
+        fprintf(stderr, "Root port differs: %s, %s\n",
+                root_memcmp ? root_memcmp->port->sysdeps.name : "none",
+                root_key ? root_key->port->sysdeps.name : "none");
+        return 1;
+    }
+    for(r = 0; r < NUM_RUNS; ++r)
+    {
+        start = now_ns();
+        for(i = 0; i < iterations; ++i)
+            sink = !!root_select_memcmp(tree);
+        runs[r] = now_ns() - start;
+    }
+    before = (double)median(runs) / iterations / 1000;
+    for(r = 0; r < NUM_RUNS; ++r)
+    {
+        start = now_ns();
+        for(i = 0; i < iterations; ++i)
+            sink = !!root_select_key(tree);
+        runs[r] = now_ns() - start;
+    }
+    after = (double)median(runs) / iterations / 1000;
+    printf("  %-38s %-12.1f %.1f\n", "root port selection us", before, after);
+
+    printf("  %-38s %-12s %.1f\n", "updtRolesTree, full us", "",
+           (double)bench_roles(tree, iterations, false) / 1000);
+    printf("  %-38s %-12s %.1f\n", "updtRolesTree, 1 port changed us", "",
+           (double)bench_roles(tree, iterations, true) / 1000);
+
+    return 0;
+}
@@ -31,6 +31,8 @@
 #include <net/if.h>
 #include <linux/if_ether.h>
 
+#include "cpu_acct.h"
+
 #define SYSDEP_BR               1
 #define SYSDEP_IF               2
 
@@ -59,8 +61,27 @@ typedef struct
     __u8 vlan_state[4095];         /* current per vlan state */
 
     bool mst_en;                   /* kernel MST support enabled */
+
+    /* Ports known to be enslaved but not created yet.
+     * They are added by bridge_add_pending_ports() a few per loop iteration.
+     */
+    int *pending_ports;            /* if_index of each pending port */
+    int num_pending_ports;
+    int next_pending_port;         /* first not yet processed entry */
+
+    cpu_acct_t cpu_acct;           /* see cpu_acct.h */
 } sysdep_br_data_t;
 
+struct llc_header
+{
+    __u8 dest_addr[ETH_ALEN];
+    __u8 src_addr[ETH_ALEN];
+    __be16 len8023;
+    __u8 d_sap;
+    __u8 s_sap;
+    __u8 llc_ctrl;
+} __attribute__((packed));
+
 typedef struct
 {
     int type;
@@ -72,6 +93,9 @@ typedef struct
     __u8 vlan_state[4095];         /* current per vlan state */
 
     int speed, duplex;
+
+    /* LLC header for transmitted BPDUs, only len8023 changes per BPDU */
+    struct llc_header tx_llc_header;
 } sysdep_if_data_t;
 
 #define GET_PORT_SPEED(port)    ((port)->sysdeps.speed)
@@ -111,8 +135,21 @@ int init_bridge_ops(void);
 int bridge_notify(int br_index, int if_index, const char *if_name, bool newlink, unsigned flags);
 
 void bridge_bpdu_rcv(int ifindex, const unsigned char *data, int len);
+/* Sending a BPDU on ifindex failed with errno err */
+void bridge_bpdu_tx_error(int ifindex, int err);
+
+/* Number of timer slots per second, see -H */
+unsigned int bridge_timer_slots(void);
+/* Timer tick of slot (0 starts a new second), which was due at deadline
+ * (ns, CLOCK_MONOTONIC) */
+void bridge_tick(unsigned int slot, __u64 deadline_ns);
+/* Account one timer wakeup: lateness of the first expiration (ns), number of
+ * expirations which came on top of it and how many of them were skipped */
+void bridge_timer_account(__u64 late_ns, __u64 missed, __u64 skipped);
+
+bool bridge_has_pending_ports(void);
 
-void bridge_one_second(void);
+void bridge_add_pending_ports(void);
 
 int bridge_mst_notify(int if_index, bool mst_en);
 
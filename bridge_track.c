@@ -25,8 +25,10 @@
 ******************************************************************************/
 
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <linux/param.h>
 #include <netinet/in.h>
 #include <linux/if_bridge.h>
@@ -40,16 +42,22 @@
 #include "mstp.h"
 #include "libnetlink.h"
 #include "mstpd_conf.h"
+#include "mstp_trace.h"
+#include "probes.h"
 
 #ifndef SYSFS_CLASS_NET
 #define SYSFS_CLASS_NET "/sys/class/net"
 #endif
 
+/* Max number of pending bridge ports created per main loop iteration */
+#define PENDING_PORTS_PER_ITERATION 8
+
 static LIST_HEAD(bridges);
 static LIST_HEAD(ports);
 
 static int br_set_vlan_state(struct rtnl_handle *rth, unsigned ifindex, __u16 vid, __u8 state);
 static int br_set_state(struct rtnl_handle *rth, unsigned ifindex, __u8 state);
+static void init_tx_llc_header(port_t *prt);
 
 static bridge_t * create_br(int if_index)
 {
@@ -59,6 +67,7 @@ static bridge_t * create_br(int if_index)
     /* Init system dependent info */
     br->sysdeps.type = SYSDEP_BR;
     br->sysdeps.if_index = if_index;
+    cpu_acct_reset(&br->sysdeps.cpu_acct);
     if (!index_to_name(if_index, br->sysdeps.name))
         goto err;
     if (get_hwaddr(br->sysdeps.name, br->sysdeps.macaddr))
@@ -95,6 +104,17 @@ static bridge_t * find_br(int if_index)
     return NULL;
 }
 
+bridge_t * find_br_byname(const char *name)
+{
+    bridge_t *br;
+    list_for_each_entry(br, &bridges, list)
+    {
+        if(0 == strncmp(br->sysdeps.name, name, IFNAMSIZ))
+            return br;
+    }
+    return NULL;
+}
+
 static port_t * create_if(bridge_t * br, int if_index)
 {
     port_t *prt;
@@ -107,6 +127,7 @@ static port_t * create_if(bridge_t * br, int if_index)
         goto err;
     if (get_hwaddr(prt->sysdeps.name, prt->sysdeps.macaddr))
         goto err;
+    init_tx_llc_header(prt);
 
     int portno;
     if(0 > (portno = get_bridge_portno(prt->sysdeps.name)))
@@ -129,6 +150,7 @@ static port_t * create_if(bridge_t * br, int if_index)
     if(!MSTP_IN_port_create_and_add_tail(prt, portno))
         goto err;
     list_add_tail(&prt->list, &ports);
+    packet_sock_add_port(if_index);
 
     if (mstpd_conf_load_prt(prt))
         INFO("Config applied for %s", prt->sysdeps.name);
@@ -163,18 +185,66 @@ static port_t * find_if(bridge_t * br, int if_index)
     return NULL;
 }
 
+port_t * find_if_byname(bridge_t * br, const char *name)
+{
+    port_t *prt;
+    list_for_each_entry(prt, &br->ports, br_list)
+    {
+        if(0 == strncmp(prt->sysdeps.name, name, IFNAMSIZ))
+            return prt;
+    }
+    return NULL;
+}
+
 static inline void delete_if(port_t *prt)
 {
+    packet_sock_del_port(prt->sysdeps.if_index);
     list_del(&prt->list);
     MSTP_IN_delete_port(prt);
     free(prt);
 }
 
+static void free_pending_ports(bridge_t *br)
+{
+    free(br->sysdeps.pending_ports);
+    br->sysdeps.pending_ports = NULL;
+    br->sysdeps.num_pending_ports = 0;
+    br->sysdeps.next_pending_port = 0;
+}
+
+static int count_pending_ports(bridge_t *br)
+{
+    int i, count = 0;
+    for(i = br->sysdeps.next_pending_port;
+        i < br->sysdeps.num_pending_ports; ++i)
+    {
+        if(0 != br->sysdeps.pending_ports[i])
+            ++count;
+    }
+    return count;
+}
+
+/* Forget pending port, return true if it was in the pending list */
+static bool cancel_pending_port(bridge_t *br, int if_index)
+{
+    int i;
+    for(i = br->sysdeps.next_pending_port;
+        i < br->sysdeps.num_pending_ports; ++i)
+    {
+        if(br->sysdeps.pending_ports[i] == if_index)
+        {
+            br->sysdeps.pending_ports[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
 static inline bool delete_if_byindex(bridge_t * br, int if_index)
 {
     port_t *prt;
     if(!(prt = find_if(br, if_index)))
-        return false;
+        return cancel_pending_port(br, if_index);
     delete_if(prt);
     return true;
 }
@@ -182,22 +252,62 @@ static inline bool delete_if_byindex(bridge_t * br, int if_index)
 static bool delete_br_byindex(int if_index)
 {
     bridge_t *br;
+    port_t *prt;
     if(!(br = find_br(if_index)))
         return false;
 
     INFO("Delete bridge %s (%d)", br->sysdeps.name, if_index);
 
+    /* Ports are freed by MSTP_IN_delete_bridge() */
+    list_for_each_entry(prt, &br->ports, br_list)
+    {
+        packet_sock_del_port(prt->sysdeps.if_index);
+        list_del(&prt->list);
+    }
     list_del(&br->list);
     MSTP_IN_delete_bridge(br);
+    free_pending_ports(br);
     free(br);
     return true;
 }
 
-void bridge_one_second(void)
+unsigned int bridge_timer_slots(void)
+{
+    return MSTP_hello_slots;
+}
+
+void bridge_tick(unsigned int slot, __u64 deadline_ns)
 {
     bridge_t *br;
+    cpu_acct_frame_t f;
+
     list_for_each_entry(br, &bridges, list)
-        MSTP_IN_one_second(br);
+    {
+        MSTP_IN_tick_begin(br, deadline_ns);
+        PROBE(tick_start, br->sysdeps.if_index, slot, deadline_ns);
+        cpu_acct_enter(&f, &br->sysdeps.cpu_acct, CPU_ACCT_TIMERS);
+        if(0 == slot)
+            MSTP_IN_one_second(br);
+        MSTP_IN_hello_slot(br, slot);
+        cpu_acct_leave(&f);
+        PROBE(tick_done, br->sysdeps.if_index, slot);
+    }
+}
+
+/* Daemon-wide part of the TickStats */
+static TickStats tick_stats;
+
+void bridge_timer_account(__u64 late_ns, __u64 missed, __u64 skipped)
+{
+    unsigned long long late = late_ns / 1000;
+
+    tick_stats.ticks += 1 + missed - skipped;
+    tick_stats.missed += missed;
+    tick_stats.skipped += skipped;
+    log2_hist_add(tick_stats.late, late);
+    if(late > tick_stats.late_max)
+        tick_stats.late_max = late;
+    log2_hist_add(tick_stats.missed_per_wakeup, missed);
 }
 
 /* New MAC address is stored in addr, which also holds the old value on entry.
@@ -280,6 +390,7 @@ static void set_if_up(port_t *prt, bool up)
     if(check_mac_address(prt->sysdeps.name, prt->sysdeps.macaddr))
     {
         /* MAC address changed */
+        init_tx_llc_header(prt);
         if(check_mac_address(prt->bridge->sysdeps.name,
            prt->bridge->sysdeps.macaddr))
         {
@@ -420,6 +531,8 @@ int bridge_notify(int br_index, int if_index, const char *if_name, bool newlink,
         {
             if(!newlink)
             {
+                if(cancel_pending_port(br, if_index))
+                    return 0;
                 INFO("Got DELLINK for unknown port %d on "
                      "bridge %d", if_index, br_index);
                 return -1;
@@ -635,48 +748,31 @@ int bridge_vlan_notify(int if_index, bool newvlan, __u16 vid, __u8 state)
     {
         if(0 != mstid && prt->sysdeps.vlan_state[vid] == VLAN_STATE_UNASSIGNED)
         {
-            list_for_each_entry(ptp, &prt->trees, port_list)
+            if((ptp = find_ptp_by_mstid(prt, __be16_to_cpu(mstid))))
             {
-                if(ptp->MSTID == mstid)
-                {
-                    LOG_PRTNAME(br, prt, "Port did not have msti %hu yet, setting msti STP state %s",
-                                mstid, stp_state_name(ptp->state));
-                    if(0 > br_set_msti_state(&rth_state,
-                                             prt->sysdeps.if_index, mstid,
-                                             ptp->state))
-                        ERROR_MSTINAME(br, prt, ptp, "Couldn't set kernel bridge state %s",
-                                       stp_state_name(ptp->state));
-                    break;
-                }
+                LOG_PRTNAME(br, prt, "Port did not have msti %hu yet, setting msti STP state %s",
+                            mstid, stp_state_name(ptp->state));
+                if(0 > br_set_msti_state(&rth_state,
+                                         prt->sysdeps.if_index, mstid,
+                                         ptp->state))
+                    ERROR_MSTINAME(br, prt, ptp, "Couldn't set kernel bridge state %s",
+                                   stp_state_name(ptp->state));
             }
         }
     }
-    else
-        list_for_each_entry(ptp, &prt->trees, port_list)
-            if (ptp->MSTID == mstid)
-            {
-                if (ptp->state != state)
-                    if (0 > br_set_vlan_state(&rth_state, if_index, vid, ptp->state))
-                        ERROR_MSTINAME(br, prt, ptp, "VID %hu: failed setting STP state %s in kernel",
-                                       vid, stp_state_name(ptp->state));
-                break;
-            }
+    else if((ptp = find_ptp_by_mstid(prt, __be16_to_cpu(mstid))))
+    {
+        if (ptp->state != state)
+            if (0 > br_set_vlan_state(&rth_state, if_index, vid, ptp->state))
+                ERROR_MSTINAME(br, prt, ptp, "VID %hu: failed setting STP state %s in kernel",
+                               vid, stp_state_name(ptp->state));
+    }
 
     prt->sysdeps.vlan_state[vid] = state;
 
     return 0;
 }
 
-struct llc_header
-{
-    __u8 dest_addr[ETH_ALEN];
-    __u8 src_addr[ETH_ALEN];
-    __be16 len8023;
-    __u8 d_sap;
-    __u8 s_sap;
-    __u8 llc_ctrl;
-} __attribute__((packed));
-
 /* LLC_PDU_xxx defines snitched from linux/net/llc_pdu.h */
 #define LLC_PDU_LEN_U   3   /* header and 1 control byte */
 #define LLC_PDU_TYPE_U  3   /* first two bits */
@@ -688,6 +784,82 @@ static const __u8 bridge_group_address[ETH_ALEN] =
     0x01, 0x80, 0xc2, 0x00, 0x00, 0x00
 };
 
+static void init_tx_llc_header(port_t *prt)
+{
+    struct llc_header *h = &prt->sysdeps.tx_llc_header;
+
+    memcpy(h->dest_addr, bridge_group_address, ETH_ALEN);
+    memcpy(h->src_addr, prt->sysdeps.macaddr, ETH_ALEN);
+    h->d_sap = h->s_sap = LLC_SAP_BSPAN;
+    h->llc_ctrl = LLC_PDU_TYPE_U;
+}
+
+/* BPDU ingress policer (GCRA, a token bucket of bpduPoliceBurst BPDUs
+ * refilled at bpduPoliceRate BPDUs per second).
+ * Runs before anything else looks at the BPDU, so that a flood on one port
+ * costs us as little as possible and can't starve the other ports.
+ * Return false if the BPDU is to be dropped.
+ */
+static bool bpdu_police(port_t *prt)
+{
+    struct timespec ts;
+    __u64 now, interval;
+
+    if(0 == prt->bpduPoliceRate)
+        return true;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    interval = 1000000000ull / prt->bpduPoliceRate;
+    if(prt->bpduPoliceTat < now)
+        prt->bpduPoliceTat = now;
+    if(prt->bpduPoliceTat - now > (prt->bpduPoliceBurst - 1) * interval)
+    {
+        ++(prt->bpdu_counters.rx_drops[rxDropPoliced]);
+        if(!prt->bpduRateExceeded)
+        {
+            prt->bpduRateExceeded = true;
+            ++(prt->num_bpdu_rate_exceeded);
+            ERROR_PRTNAME(prt->bridge, prt,
+                          "BPDU rate exceeded %u/s, dropping BPDUs",
+                          prt->bpduPoliceRate);
+        }
+        return false;
+    }
+    prt->bpduPoliceTat += interval;
+    if(prt->bpduRateExceeded)
+    {
+        prt->bpduRateExceeded = false;
+        INFO_PRTNAME(prt->bridge, prt, "BPDU rate back within %u/s, "
+                     "%llu BPDUs dropped so far", prt->bpduPoliceRate,
+                     prt->bpdu_counters.rx_drops[rxDropPoliced]);
+    }
+    return true;
+}
+
+void bridge_bpdu_tx_error(int if_index, int err)
+{
+    port_t *prt = find_if(NULL, if_index);
+
+    if(!prt)
+        return;
+    /* No room in the socket buffer or (bypassing the qdisc) in the device
+     * queue: the BPDU is lost, but there is nothing wrong with the port */
+    if((EAGAIN == err) || (EWOULDBLOCK == err) || (ENOBUFS == err))
+        ++(prt->num_tx_eagain);
+    else
+    {
+        ++(prt->num_tx_errors);
+        ERROR_PRTNAME(prt->bridge, prt, "BPDU send failed: %s",
+                      strerror(err));
+    }
+}
+
+static void bpdu_rx_drop(port_t *prt, rx_drop_reason_t reason)
+{
+    ++(prt->bpdu_counters.rx_drops[reason]);
+}
+
 void bridge_bpdu_rcv(int if_index, const unsigned char *data, int len)
 {
     port_t *prt = NULL;
@@ -703,31 +875,43 @@ void bridge_bpdu_rcv(int if_index, const unsigned char *data, int len)
     if(!prt)
         return;
 
+    /* Called within the CPU_ACCT_RX frame of the packet */
+    cpu_acct_set_target(&br->sysdeps.cpu_acct);
+
+    if(!bpdu_police(prt))
+        return;
+
     /* sanity checks */
     TSTM(br == prt->bridge,, "Bridge mismatch. This bridge is '%s' but port "
         "'%s' belongs to bridge '%s'", br->sysdeps.name, prt->sysdeps.name, prt->bridge->sysdeps.name);
-    TSTM(prt->sysdeps.up,, "Port '%s' should be up", prt->sysdeps.name);
+    TSTM(prt->sysdeps.up, bpdu_rx_drop(prt, rxDropPortDown),
+         "Port '%s' should be up", prt->sysdeps.name);
 
     /* Validate Ethernet and LLC header,
      * maybe we can skip this check thanks to Berkeley filter in packet socket?
      */
     struct llc_header *h;
     unsigned int l;
-    TST(len > sizeof(struct llc_header),);
+    TST(len > sizeof(struct llc_header), bpdu_rx_drop(prt, rxDropBadHeader));
     h = (struct llc_header *)data;
-    TST(0 == memcmp(h->dest_addr, bridge_group_address, ETH_ALEN),
-             INFO("ifindex %d, len %d, %02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
-                  if_index, len,
-                  h->dest_addr[0], h->dest_addr[1], h->dest_addr[2],
-                  h->dest_addr[3], h->dest_addr[4], h->dest_addr[5])
-       );
+    TSTM(0 == memcmp(h->dest_addr, bridge_group_address, ETH_ALEN),
+         bpdu_rx_drop(prt, rxDropBadHeader),
+         "ifindex %d, len %d, %02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
+         if_index, len,
+         h->dest_addr[0], h->dest_addr[1], h->dest_addr[2],
+         h->dest_addr[3], h->dest_addr[4], h->dest_addr[5]);
     l = __be16_to_cpu(h->len8023);
-    TST(l <= ETH_DATA_LEN && l <= len - ETH_HLEN && l >= LLC_PDU_LEN_U, );
-    TST(h->d_sap == LLC_SAP_BSPAN && h->s_sap == LLC_SAP_BSPAN && (h->llc_ctrl & 0x3) == LLC_PDU_TYPE_U,);
+    TST(l <= ETH_DATA_LEN && l <= len - ETH_HLEN && l >= LLC_PDU_LEN_U,
+        bpdu_rx_drop(prt, rxDropBadHeader));
+    TST(h->d_sap == LLC_SAP_BSPAN && h->s_sap == LLC_SAP_BSPAN && (h->llc_ctrl & 0x3) == LLC_PDU_TYPE_U,
+        bpdu_rx_drop(prt, rxDropBadHeader));
 
+    cpu_acct_frame_t f;
+    cpu_acct_enter(&f, NULL, CPU_ACCT_BPDU);
     MSTP_IN_rx_bpdu(prt,
                     /* Don't include LLC header */
                     (bpdu_t *)(data + sizeof(*h)), l - LLC_PDU_LEN_U);
+    cpu_acct_leave(&f);
 }
 
 static int br_set_vlan_state(struct rtnl_handle *rth, unsigned ifindex, __u16 vid, __u8 state)
@@ -845,9 +1029,11 @@ void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state)
     const char * state_name;
     port_t *prt = ptp->port;
     bridge_t *br = prt->bridge;
+    cpu_acct_frame_t f;
 
     if(ptp->state == new_state)
         return;
+    cpu_acct_enter(&f, &br->sysdeps.cpu_acct, CPU_ACCT_NETLINK);
     ptp->state = new_state;
     state_name = stp_state_name(ptp->state);
 
@@ -863,6 +1049,8 @@ void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state)
             break;
     }
     INFO_MSTINAME(br, prt, ptp, "entering %s state", state_name);
+    PROBE(state_start, br->sysdeps.if_index, prt->sysdeps.if_index,
+          __be16_to_cpu(ptp->MSTID), new_state);
 
     if(have_per_vlan_state && !br->sysdeps.mst_en)
     {
@@ -894,19 +1082,20 @@ void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state)
             ERROR_MSTINAME(br, prt, ptp, "Couldn't set kernel bridge state %s",
                            state_name);
     }
+    PROBE(state_done, br->sysdeps.if_index, prt->sysdeps.if_index,
+          __be16_to_cpu(ptp->MSTID), new_state);
+    cpu_acct_leave(&f);
 }
 
-void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
+static void set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
 {
     if(!br->sysdeps.mst_en)
         return;
 
     if(br->sysdeps.vlan_state[vid] != VLAN_STATE_UNASSIGNED)
     {
-        __be16 MSTID = __cpu_to_be16(mstid);
         tree_t *tree;
         per_tree_port_t *ptp;
-        bool found = false;
 
         if (0 > br_set_vlan_msti(&rth_state, br->sysdeps.if_index, vid, mstid))
         {
@@ -914,14 +1103,7 @@ void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
             return;
         }
 
-        list_for_each_entry(tree, &br->trees, bridge_list)
-            if(tree->MSTID == MSTID)
-            {
-                found = true;
-                break;
-            }
-
-        if(!found)
+        if(!(tree = find_tree_by_mstid(br, mstid)))
         {
             ERROR_BRNAME(br, "Couldn't find MSTI with ID %hu", mstid);
             return;
@@ -946,6 +1128,15 @@ void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
     }
 }
 
+void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
+{
+    cpu_acct_frame_t f;
+
+    cpu_acct_enter(&f, &br->sysdeps.cpu_acct, CPU_ACCT_NETLINK);
+    set_vid2mstid(br, vid, mstid);
+    cpu_acct_leave(&f);
+}
+
 /* This function initiates process of flushing
  * all entries for the given port in all FIDs for the
  * given tree.
@@ -956,8 +1147,12 @@ void MSTP_OUT_flush_all_mstids(per_tree_port_t * ptp)
 {
     port_t *prt = ptp->port;
     bridge_t *br = prt->bridge;
+    cpu_acct_frame_t f;
 
+    cpu_acct_enter(&f, &br->sysdeps.cpu_acct, CPU_ACCT_NETLINK);
     INFO_MSTINAME(br, prt, ptp, "Flushing forwarding database");
+    PROBE(flush_start, br->sysdeps.if_index, prt->sysdeps.if_index,
+          __be16_to_cpu(ptp->MSTID));
 
     /* Translate CIST flushing to the kernel bridge code */
     if(have_per_vlan_state)
@@ -981,6 +1176,9 @@ void MSTP_OUT_flush_all_mstids(per_tree_port_t * ptp)
             ERROR_PRTNAME(br, prt,
                           "Couldn't flush kernel bridge forwarding database");
     }
+    PROBE(flush_done, br->sysdeps.if_index, prt->sysdeps.if_index,
+          __be16_to_cpu(ptp->MSTID));
+    cpu_acct_leave(&f);
 
     MSTP_IN_all_mstids_flushed(ptp);
 }
@@ -988,7 +1186,9 @@ void MSTP_OUT_flush_all_mstids(per_tree_port_t * ptp)
 void MSTP_OUT_set_ageing_time(port_t *prt, unsigned int ageingTime)
 {
     bridge_t *br = prt->bridge;
+    cpu_acct_frame_t f;
 
+    cpu_acct_enter(&f, &br->sysdeps.cpu_acct, CPU_ACCT_NETLINK);
     INFO_PRTNAME(br, prt, "Setting new ageing time to %u", ageingTime);
 
     /*
@@ -998,12 +1198,16 @@ void MSTP_OUT_set_ageing_time(port_t *prt, unsigned int ageingTime)
      */
     if(0 > br_set_ageing_time(br->sysdeps.name, ageingTime))
         ERROR_BRNAME(br, "Couldn't set new ageing time in kernel bridge");
+    cpu_acct_leave(&f);
 }
 
 void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t * bpdu, int size)
 {
     char *bpdu_type, *tcflag;
     bridge_t *br = prt->bridge;
+    cpu_acct_frame_t f;
+
+    cpu_acct_enter(&f, &br->sysdeps.cpu_acct, CPU_ACCT_TX);
 
     switch(bpdu->protocolVersion)
     {
@@ -1012,9 +1216,11 @@ void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t * bpdu, int size)
             {
                 case bpduTypeConfig:
                     bpdu_type = "STP-Config";
+                    ++(prt->bpdu_counters.tx[bpduKindConfig]);
                     break;
                 case bpduTypeTCN:
                     bpdu_type = "STP-TCN";
+                    ++(prt->bpdu_counters.tx[bpduKindTCN]);
                     break;
                 default:
                     bpdu_type = "STP-UnknownType";
@@ -1022,9 +1228,14 @@ void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t * bpdu, int size)
             break;
         case protoRSTP:
             bpdu_type = "RST";
+            ++(prt->bpdu_counters.tx[bpduKindRST]);
             break;
         case protoMSTP:
             bpdu_type = "MST";
+            ++(prt->bpdu_counters.tx[bpduKindMST]);
+            prt->bpdu_counters.tx_msti_msgs +=
+                (size - MST_BPDU_SIZE_WO_MSTI_MSGS)
+                / sizeof(msti_configuration_message_t);
             break;
         default:
             bpdu_type = "UnknownProto";
@@ -1047,26 +1258,29 @@ void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t * bpdu, int size)
         LOG_PRTNAME(br, prt, "sending %s BPDU%s", bpdu_type, tcflag);
     }
 
-    struct llc_header h;
-    memcpy(h.dest_addr, bridge_group_address, ETH_ALEN);
-    memcpy(h.src_addr, prt->sysdeps.macaddr, ETH_ALEN);
-    h.len8023 = __cpu_to_be16(size + LLC_PDU_LEN_U);
-    h.d_sap = h.s_sap = LLC_SAP_BSPAN;
-    h.llc_ctrl = LLC_PDU_TYPE_U;
+    struct llc_header *h = &prt->sysdeps.tx_llc_header;
+    h->len8023 = __cpu_to_be16(size + LLC_PDU_LEN_U);
 
     struct iovec iov[2] =
     {
-        { .iov_base = &h, .iov_len = sizeof(h) },
+        { .iov_base = h, .iov_len = sizeof(*h) },
         { .iov_base = bpdu, .iov_len = size }
     };
 
-    packet_send(prt->sysdeps.if_index, iov, 2, sizeof(h) + size);
+    trace_bpdu(TRACE_TX_BPDU, br->sysdeps.if_index, prt->sysdeps.if_index,
+               bpdu, size);
+    packet_send(prt->sysdeps.if_index, iov, 2, sizeof(*h) + size);
+    cpu_acct_leave(&f);
 }
 
 void MSTP_OUT_shutdown_port(port_t *prt)
 {
+    cpu_acct_frame_t f;
+
+    cpu_acct_enter(&f, &prt->bridge->sysdeps.cpu_acct, CPU_ACCT_NETLINK);
     if(0 > if_shutdown(prt->sysdeps.name))
         ERROR_PRTNAME(prt->bridge, prt, "Couldn't shutdown port");
+    cpu_acct_leave(&f);
 }
 
 /* User interface commands */
@@ -1077,7 +1291,8 @@ void MSTP_OUT_shutdown_port(port_t *prt)
     {                                                          \
         ERROR("Couldn't find bridge with index %d", br_index); \
         return -1;                                             \
-    }
+    }                                                          \
+    cpu_acct_set_target(&br->sysdeps.cpu_acct)
 
 #define CTL_CHECK_BRIDGE_PORT                                              \
     CTL_CHECK_BRIDGE;                                                      \
@@ -1090,16 +1305,8 @@ void MSTP_OUT_shutdown_port(port_t *prt)
 
 #define CTL_CHECK_BRIDGE_TREE                                      \
     CTL_CHECK_BRIDGE;                                              \
-    tree_t *tree;                                                  \
-    bool found = false;                                            \
-    __be16 MSTID = __cpu_to_be16(mstid);                           \
-    list_for_each_entry(tree, &br->trees, bridge_list)             \
-        if(tree->MSTID == MSTID)                                   \
-        {                                                          \
-            found = true;                                          \
-            break;                                                 \
-        }                                                          \
-    if(!found)                                                     \
+    tree_t *tree = find_tree_by_mstid(br, mstid);                  \
+    if(NULL == tree)                                               \
     {                                                              \
         ERROR_BRNAME(br, "Couldn't find MSTI with ID %hu", mstid); \
         return -1;                                                 \
@@ -1107,16 +1314,8 @@ void MSTP_OUT_shutdown_port(port_t *prt)
 
 #define CTL_CHECK_BRIDGE_PERTREEPORT                                     \
     CTL_CHECK_BRIDGE_PORT;                                               \
-    per_tree_port_t *ptp;                                                \
-    bool found = false;                                                  \
-    __be16 MSTID = __cpu_to_be16(mstid);                                 \
-    list_for_each_entry(ptp, &prt->trees, port_list)                     \
-        if(ptp->MSTID == MSTID)                                          \
-        {                                                                \
-            found = true;                                                \
-            break;                                                       \
-        }                                                                \
-    if(!found)                                                           \
+    per_tree_port_t *ptp = find_ptp_by_mstid(prt, mstid);                \
+    if(NULL == ptp)                                                      \
     {                                                                    \
         ERROR_PRTNAME(br, prt, "Couldn't find MSTI with ID %hu", mstid); \
         return -1;                                                       \
@@ -1130,6 +1329,7 @@ int CTL_get_cist_bridge_status(int br_index, CIST_BridgeStatus *status,
 
     CTL_CHECK_BRIDGE;
     MSTP_IN_get_cist_bridge_status(br, status);
+    status->num_ports_pending = count_pending_ports(br);
 
     /* find root port name by root_port_id */
     cist = GET_CIST_TREE(br);
@@ -1143,6 +1343,55 @@ int CTL_get_cist_bridge_status(int br_index, CIST_BridgeStatus *status,
     return 0;
 }
 
+int CTL_get_alloc_stats(int br_index, BridgeAllocStats *stats)
+{
+    CTL_CHECK_BRIDGE;
+    MSTP_IN_get_alloc_stats(br, stats);
+    return 0;
+}
+
+int CTL_get_loop_stats(epoll_loop_stats_t *stats)
+{
+    epoll_get_loop_stats(stats);
+    return 0;
+}
+
+int CTL_get_cpu_stats(int br_index, cpu_acct_t *bridge, cpu_acct_t *daemon,
+                      __u64 *now)
+{
+    CTL_CHECK_BRIDGE;
+    *bridge = br->sysdeps.cpu_acct;
+    *daemon = cpu_acct_daemon;
+    *now = cpu_acct_now();
+    return 0;
+}
+
+int CTL_reset_cpu_stats(void)
+{
+    bridge_t *br;
+
+    list_for_each_entry(br, &bridges, list)
+        cpu_acct_reset(&br->sysdeps.cpu_acct);
+    cpu_acct_reset(&cpu_acct_daemon);
+    return 0;
+}
+
+int CTL_get_tick_stats(int br_index, TickStats *stats)
+{
+    CTL_CHECK_BRIDGE;
+    *stats = tick_stats;
+    stats->slots = MSTP_hello_slots;
+    MSTP_IN_get_bridge_tick_stats(br, stats);
+    return 0;
+}
+
+int CTL_get_tx_slot_stats(int br_index, BridgeTxSlotStats *stats)
+{
+    CTL_CHECK_BRIDGE;
+    MSTP_IN_get_tx_slot_stats(br, stats);
+    return 0;
+}
+
 int CTL_get_msti_bridge_status(int br_index, __u16 mstid,
                                MSTI_BridgeStatus *status, char *root_port_name)
 {
@@ -1273,17 +1522,159 @@ int CTL_set_vids2mstids(int br_index, __u16 *vids2mstids)
     return MSTP_IN_set_all_vids2mstids(br, vids2mstids) ? 0 : -1;
 }
 
+int CTL_set_port_configs(int br_index, int num_entries,
+                         PortConfigEntry *entries)
+{
+    int i, r = 0;
+    port_t *prt;
+    per_tree_port_t *ptp;
+
+    CTL_CHECK_BRIDGE;
+    if((0 > num_entries) || (MAX_PORT_CONFIG_ENTRIES < num_entries))
+    {
+        ERROR_BRNAME(br, "Bad number of port config entries (%d)",
+                     num_entries);
+        return -1;
+    }
+
+    MSTP_IN_config_begin(br);
+    for(i = 0; i < num_entries; ++i)
+    {
+        if(NULL == (prt = find_if(br, entries[i].port_index)))
+        {
+            ERROR_BRNAME(br, "Couldn't find port with index %d",
+                         entries[i].port_index);
+            r = -1;
+            break;
+        }
+        if(0 == entries[i].mstid)
+        {
+            if((r = MSTP_IN_set_cist_port_config(prt, &entries[i].cist_cfg)))
+                break;
+        }
+        if(NULL == (ptp = find_ptp_by_mstid(prt, entries[i].mstid)))
+        {
+            ERROR_PRTNAME(br, prt, "Couldn't find MSTI with ID %hu",
+                          entries[i].mstid);
+            r = -1;
+            break;
+        }
+        if((r = MSTP_IN_set_msti_port_config(ptp, &entries[i].msti_cfg)))
+            break;
+    }
+    MSTP_IN_config_commit(br);
+
+    return r;
+}
+
+static void add_if(bridge_t *br, int if_index)
+{
+    bridge_t *other_br;
+    port_t *prt;
+    int if_flags;
+
+    if(NULL != find_if(br, if_index))
+        return;
+    /* Check if this interface is slave of another bridge */
+    list_for_each_entry(other_br, &bridges, list)
+    {
+        if(other_br != br)
+            if(delete_if_byindex(other_br, if_index))
+            {
+                INFO("Device %d has come to bridge %s. "
+                     "Missed notify for deletion from bridge %s",
+                     if_index, br->sysdeps.name, other_br->sysdeps.name);
+                break;
+            }
+    }
+    if(NULL == (prt = create_if(br, if_index)))
+    {
+        INFO("Couldn't create data for interface %d (master %s)",
+             if_index, br->sysdeps.name);
+        return;
+    }
+    if(0 <= (if_flags = get_flags(prt->sysdeps.name)))
+        set_if_up(prt, (IFF_UP | IFF_RUNNING) ==
+                       (if_flags & (IFF_UP | IFF_RUNNING))
+                 );
+}
+
+/* Create at most max_count pending ports of the bridge.
+ * Return number of ports processed.
+ */
+static int add_pending_ports(bridge_t *br, int max_count)
+{
+    sysdep_br_data_t *sd = &br->sysdeps;
+    int if_index, count = 0;
+
+    if(NULL == sd->pending_ports)
+        return 0;
+
+    /* Run state machines once for the whole batch */
+    MSTP_IN_config_begin(br);
+    while((count < max_count)
+          && (sd->next_pending_port < sd->num_pending_ports))
+    {
+        if_index = sd->pending_ports[sd->next_pending_port++];
+        if(0 == if_index)
+            continue; /* cancelled */
+        add_if(br, if_index);
+        ++count;
+    }
+    MSTP_IN_config_commit(br);
+
+    if(sd->next_pending_port >= sd->num_pending_ports)
+    {
+        INFO("All ports of bridge %s are added", sd->name);
+        free_pending_ports(br);
+    }
+    return count;
+}
+
+bool bridge_has_pending_ports(void)
+{
+    bridge_t *br;
+    list_for_each_entry(br, &bridges, list)
+    {
+        if(NULL != br->sysdeps.pending_ports)
+            return true;
+    }
+    return false;
+}
+
+/* Called once per main loop iteration. Bridges are served in list order,
+ * so the first bridge becomes fully operational before the later ones.
+ */
+void bridge_add_pending_ports(void)
+{
+    bridge_t *br;
+    int budget = PENDING_PORTS_PER_ITERATION;
+
+    list_for_each_entry(br, &bridges, list)
+    {
+        if(0 >= budget)
+            break;
+        budget -= add_pending_ports(br, budget);
+    }
+}
+
+/* Ports which are not created yet are only queued here and added later
+ * from the main loop by bridge_add_pending_ports(), so that large bridges
+ * do not block BPDU handling for the bridges already running.
+ * The first batch of ports is created immediately.
+ */
 int CTL_add_bridges(int *br_array, int* *ifaces_lists)
 {
     int i, j, ifcount, brcount = br_array[0];
-    bridge_t *br, *other_br;
+    bridge_t *br;
     port_t *prt, *nxt;
-    int br_flags, if_flags;
+    int br_flags;
     int *if_array;
-    bool found;
+    bool found, new_br;
 
     for(i = 1; i <= brcount; ++i)
     {
+        new_br = false;
         if(NULL == (br = find_br(br_array[i])))
         {
             if(NULL == (br = create_br(br_array[i])))
@@ -1292,9 +1683,12 @@ int CTL_add_bridges(int *br_array, int* *ifaces_lists)
                       br_array[i]);
                 return -1;
             }
-            if(0 <= (br_flags = get_flags(br->sysdeps.name)))
-                set_br_up(br, !!(br_flags & IFF_UP));
+            new_br = true;
         }
+        /* Run state machines once for all port changes of this bridge */
+        MSTP_IN_config_begin(br);
+        if(new_br && (0 <= (br_flags = get_flags(br->sysdeps.name))))
+            set_br_up(br, !!(br_flags & IFF_UP));
         if_array = ifaces_lists[i - 1];
         ifcount = if_array[0];
         /* delete all interfaces which are not in list */
@@ -1312,40 +1706,33 @@ int CTL_add_bridges(int *br_array, int* *ifaces_lists)
             if(!found)
                 delete_if(prt);
         }
-        /* add all new interfaces from the list */
+        MSTP_IN_config_commit(br);
+
+        /* queue all new interfaces from the list */
+        free_pending_ports(br);
+        if(0 >= ifcount)
+            continue;
+        TST(NULL != (br->sysdeps.pending_ports =
+                         malloc(ifcount * sizeof(int))), -1);
         for(j = 1; j <= ifcount; ++j)
         {
-            if(NULL != find_if(br, if_array[j]))
-                continue;
-            /* Check if this interface is slave of another bridge */
-            list_for_each_entry(other_br, &bridges, list)
-            {
-                if(other_br != br)
-                    if(delete_if_byindex(other_br, if_array[j]))
-                    {
-                        INFO("Device %d has come to bridge %s. "
-                             "Missed notify for deletion from bridge %s",
-                             if_array[j], br->sysdeps.name,
-                             other_br->sysdeps.name);
-                        break;
-                    }
-            }
-            if(NULL == (prt = create_if(br, if_array[j])))
-            {
-                INFO("Couldn't create data for interface %d (master %s)",
-                     if_array[j], br->sysdeps.name);
-                continue;
-            }
-            if(0 <= (if_flags = get_flags(prt->sysdeps.name)))
-                set_if_up(prt, (IFF_UP | IFF_RUNNING) ==
-                               (if_flags & (IFF_UP | IFF_RUNNING))
-                         );
+            if(NULL == find_if(br, if_array[j]))
+                br->sysdeps.pending_ports[br->sysdeps.num_pending_ports++]
+                    = if_array[j];
         }
+        add_pending_ports(br, PENDING_PORTS_PER_ITERATION);
     }
 
     return 0;
 }
 
+int CTL_get_trace(unsigned int seq, unsigned int *first, unsigned int *head,
+                  unsigned int *count, trace_record_t *recs)
+{
+    *count = trace_read(seq, recs, TRACE_CHUNK_RECORDS, first, head);
+    return 0;
+}
+
 int CTL_del_bridges(int *br_array)
 {
     int i, brcount = br_array[0];
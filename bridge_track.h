@@ -21,6 +21,10 @@
 #ifndef MSTPD_BRIDGE_TRACK_H
 #define MSTPD_BRIDGE_TRACK_H
 
+#include "mstp.h"
+
+bridge_t * find_br_byname(const char *name);
+port_t * find_if_byname(bridge_t * br, const char *name);
 
 int bridge_track_fini(void);
 
@@ -321,9 +321,22 @@ int fill_vlan_table(sysdep_uni_data_t *uni_data)
     return 0;
 }
 
+/* Netlink datagrams read per loop iteration */
+#define NETLINK_BUDGET 16
+
 static inline void br_ev_handler(uint32_t events, struct epoll_event_handler *h)
 {
-    if(rtnl_listen(&rth, dump_listen_msg, stdout) < 0)
+    if(rtnl_listen_budget(&rth, dump_listen_msg, stdout, h->budget) < 0)
+    {
+        ERROR("Error on bridge monitoring socket\n");
+    }
+}
+
+/* Datagram received by the io_uring event loop */
+static void br_ev_recv(struct epoll_event_handler *h, void *data, int len,
+                       int msg_flags, const void *from, unsigned int from_len)
+{
+    if(rtnl_listen_buf(data, len, msg_flags, dump_listen_msg, stdout) < 0)
     {
         ERROR("Error on bridge monitoring socket\n");
     }
@@ -370,6 +383,11 @@ int init_bridge_ops(void)
     br_handler.fd = rth.fd;
     br_handler.arg = NULL;
     br_handler.handler = br_ev_handler;
+    br_handler.prio = EPOLL_PRIO_NETLINK;
+    br_handler.budget = NETLINK_BUDGET;
+    br_handler.recv_handler = br_ev_recv;
+    br_handler.rx_size = 16384; /* as rtnl_listen() */
+    br_handler.rx_from_len = sizeof(struct sockaddr_nl);
 
     if(add_epoll(&br_handler) < 0)
         return -1;
@@ -0,0 +1,117 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#include <string.h>
+#include <time.h>
+
+#include "cpu_acct.h"
+
+cpu_acct_t cpu_acct_daemon;
+
+/* Innermost frame of the thread. The counters themselves are shared by
+ * the state machine threads, so they are updated atomically. */
+static __thread cpu_acct_frame_t *cpu_acct_cur;
+
+__u64 cpu_acct_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+__u64 cpu_acct_thread_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void cpu_acct_reset(cpu_acct_t *acct)
+{
+    memset(acct, 0, sizeof(*acct));
+    acct->since = cpu_acct_now();
+}
+
+static inline void charge(cpu_acct_frame_t *f, __u64 now)
+{
+    __atomic_fetch_add(&f->acct->ns[f->subsys], now - f->start,
+                       __ATOMIC_RELAXED);
+}
+
+void cpu_acct_enter(cpu_acct_frame_t *f, cpu_acct_t *acct,
+                    cpu_acct_subsys_t subsys)
+{
+    __u64 now = cpu_acct_now();
+
+    if(cpu_acct_cur)
+        charge(cpu_acct_cur, now);
+    if(!acct)
+        acct = cpu_acct_cur ? cpu_acct_cur->acct : &cpu_acct_daemon;
+    f->outer = cpu_acct_cur;
+    f->acct = acct;
+    f->subsys = subsys;
+    f->start = now;
+    __atomic_fetch_add(&acct->calls[subsys], 1, __ATOMIC_RELAXED);
+    cpu_acct_cur = f;
+}
+
+void cpu_acct_leave(cpu_acct_frame_t *f)
+{
+    __u64 now = cpu_acct_now();
+
+    charge(f, now);
+    if((cpu_acct_cur = f->outer))
+        cpu_acct_cur->start = now;
+}
+
+void cpu_acct_set_target(cpu_acct_t *acct)
+{
+    cpu_acct_frame_t *f = cpu_acct_cur;
+    __u64 now;
+
+    if(!f || (f->acct == acct))
+        return;
+    now = cpu_acct_now();
+    charge(f, now);
+    /* The call is now the target's */
+    if(f->acct->calls[f->subsys])
+        __atomic_fetch_sub(&f->acct->calls[f->subsys], 1,
+                           __ATOMIC_RELAXED);
+    __atomic_fetch_add(&acct->calls[f->subsys], 1, __ATOMIC_RELAXED);
+    f->acct = acct;
+    f->start = now;
+}
+
+void cpu_acct_pause(void)
+{
+    if(cpu_acct_cur)
+        charge(cpu_acct_cur, cpu_acct_now());
+}
+
+void cpu_acct_resume(void)
+{
+    if(cpu_acct_cur)
+        cpu_acct_cur->start = cpu_acct_now();
+}
+
+void cpu_acct_charge(cpu_acct_t *acct, cpu_acct_subsys_t subsys, __u64 ns)
+{
+    __atomic_fetch_add(&acct->ns[subsys], ns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#ifndef CPU_ACCT_H
+#define CPU_ACCT_H
+
+#include <linux/types.h>
+
+/* Where the daemon's CPU time goes, per bridge.
+ *
+ * Code of a subsystem is bracketed by cpu_acct_enter() and cpu_acct_leave()
+ * with a frame on the caller's stack. Frames nest (the state machines run
+ * from within BPDU processing, which logs, ...) and each one is charged
+ * only the time not spent in the frames nested in it, so the subsystems
+ * add up to the total. A frame started without a cpu_acct_t charges the one
+ * of the enclosing frame, or cpu_acct_daemon if there is none.
+ *
+ * Frames measure wall time. Code that waits for other threads in a frame
+ * pauses it for the wait, and the other threads' CPU time is added to the
+ * subsystem with cpu_acct_charge().
+ */
+typedef enum
+{
+    CPU_ACCT_RX,      /* BPDU receive and validation */
+    CPU_ACCT_BPDU,    /* MSTP_IN_rx_bpdu() */
+    CPU_ACCT_SM,      /* state machine runs */
+    CPU_ACCT_TIMERS,  /* MSTP_IN_one_second() and the hello slots */
+    CPU_ACCT_TX,      /* MSTP_OUT_tx_bpdu() */
+    CPU_ACCT_NETLINK, /* the other MSTP_OUT_*(): kernel bridge programming */
+    CPU_ACCT_LOG,     /* vDprintf() */
+    CPU_ACCT_CTL,     /* control requests */
+    CPU_ACCT_COUNT
+} cpu_acct_subsys_t;
+
+typedef struct
+{
+    __u64 since; /* ns, CLOCK_MONOTONIC, of creation or last reset */
+    unsigned long long calls[CPU_ACCT_COUNT];
+    unsigned long long ns[CPU_ACCT_COUNT];
+} cpu_acct_t;
+
+typedef struct cpu_acct_frame_s
+{
+    struct cpu_acct_frame_s *outer;
+    cpu_acct_t *acct;
+    cpu_acct_subsys_t subsys;
+    __u64 start;
+} cpu_acct_frame_t;
+
+/* Time that can't be attributed to a bridge */
+extern cpu_acct_t cpu_acct_daemon;
+
+__u64 cpu_acct_now(void);
+/* CPU time of the calling thread */
+__u64 cpu_acct_thread_now(void);
+void cpu_acct_reset(cpu_acct_t *acct);
+void cpu_acct_enter(cpu_acct_frame_t *f, cpu_acct_t *acct,
+                    cpu_acct_subsys_t subsys);
+void cpu_acct_leave(cpu_acct_frame_t *f);
+/* Charge the innermost frame to acct from now on, e.g. once the bridge a
+ * BPDU or a request is for has been found */
+void cpu_acct_set_target(cpu_acct_t *acct);
+/* Stop and restart charging the innermost frame */
+void cpu_acct_pause(void);
+void cpu_acct_resume(void);
+void cpu_acct_charge(cpu_acct_t *acct, cpu_acct_subsys_t subsys, __u64 ns);
+
+#endif /* CPU_ACCT_H */
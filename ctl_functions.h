@@ -36,6 +36,8 @@
 #include <asm/byteorder.h>
 
 #include "mstp.h"
+#include "mstp_trace.h"
+#include "epoll_loop.h"
 
 struct ctl_msg_hdr
 {
@@ -402,6 +404,155 @@ struct set_vids2mstids_OUT
 #define set_vids2mstids_CALL (in->br_index, in->vids2mstids)
 CTL_DECLARE(set_vids2mstids);
 
+/* set_port_configs */
+#define CMD_CODE_set_port_configs   127
+#define MAX_PORT_CONFIG_ENTRIES     64
+typedef struct
+{
+    int port_index;
+    __u16 mstid;
+    CIST_PortConfig cist_cfg; /* used only for mstid 0 (CIST) */
+    MSTI_PortConfig msti_cfg;
+} PortConfigEntry;
+#define set_port_configs_ARGS (int br_index, int num_entries, \
+                               PortConfigEntry *entries)
+struct set_port_configs_IN
+{
+    int br_index;
+    int num_entries;
+    PortConfigEntry entries[MAX_PORT_CONFIG_ENTRIES];
+};
+struct set_port_configs_OUT
+{
+};
+#define set_port_configs_COPY_IN  ({ in->br_index = br_index;          \
+    in->num_entries = num_entries; memset(in->entries, 0,               \
+    sizeof(in->entries)); memcpy(in->entries, entries,                  \
+    num_entries * sizeof(in->entries[0])); })
+#define set_port_configs_COPY_OUT ({ (void)0; })
+#define set_port_configs_CALL (in->br_index, in->num_entries, in->entries)
+CTL_DECLARE(set_port_configs);
+
+/* get_trace */
+#define CMD_CODE_get_trace      128
+#define get_trace_ARGS (unsigned int seq, unsigned int *first, \
+                        unsigned int *head, unsigned int *count, \
+                        trace_record_t *recs)
+struct get_trace_IN
+{
+    unsigned int seq;
+};
+struct get_trace_OUT
+{
+    unsigned int first, head, count;
+    trace_record_t recs[TRACE_CHUNK_RECORDS];
+};
+#define get_trace_COPY_IN  ({ in->seq = seq; })
+#define get_trace_COPY_OUT ({ *first = out->first; *head = out->head; \
+                              *count = out->count; \
+                              memcpy(recs, out->recs, \
+                                     out->count * sizeof(*recs)); })
+#define get_trace_CALL (in->seq, &out->first, &out->head, &out->count, \
+                        out->recs)
+CTL_DECLARE(get_trace);
+
+/* get_alloc_stats */
+#define CMD_CODE_get_alloc_stats    129
+#define get_alloc_stats_ARGS (int br_index, BridgeAllocStats *stats)
+struct get_alloc_stats_IN
+{
+    int br_index;
+};
+struct get_alloc_stats_OUT
+{
+    BridgeAllocStats stats;
+};
+#define get_alloc_stats_COPY_IN  ({ in->br_index = br_index; })
+#define get_alloc_stats_COPY_OUT ({ *stats = out->stats; })
+#define get_alloc_stats_CALL (in->br_index, &out->stats)
+CTL_DECLARE(get_alloc_stats);
+
+/* get_tx_slot_stats */
+#define CMD_CODE_get_tx_slot_stats  130
+#define get_tx_slot_stats_ARGS (int br_index, BridgeTxSlotStats *stats)
+struct get_tx_slot_stats_IN
+{
+    int br_index;
+};
+struct get_tx_slot_stats_OUT
+{
+    BridgeTxSlotStats stats;
+};
+#define get_tx_slot_stats_COPY_IN  ({ in->br_index = br_index; })
+#define get_tx_slot_stats_COPY_OUT ({ *stats = out->stats; })
+#define get_tx_slot_stats_CALL (in->br_index, &out->stats)
+CTL_DECLARE(get_tx_slot_stats);
+
+/* get_tick_stats */
+#define CMD_CODE_get_tick_stats     131
+#define get_tick_stats_ARGS (int br_index, TickStats *stats)
+struct get_tick_stats_IN
+{
+    int br_index;
+};
+struct get_tick_stats_OUT
+{
+    TickStats stats;
+};
+#define get_tick_stats_COPY_IN  ({ in->br_index = br_index; })
+#define get_tick_stats_COPY_OUT ({ *stats = out->stats; })
+#define get_tick_stats_CALL (in->br_index, &out->stats)
+CTL_DECLARE(get_tick_stats);
+
+/* get_loop_stats */
+#define CMD_CODE_get_loop_stats     132
+#define get_loop_stats_ARGS (epoll_loop_stats_t *stats)
+struct get_loop_stats_IN
+{
+};
+struct get_loop_stats_OUT
+{
+    epoll_loop_stats_t stats;
+};
+#define get_loop_stats_COPY_IN  ({ (void)0; })
+#define get_loop_stats_COPY_OUT ({ *stats = out->stats; })
+#define get_loop_stats_CALL (&out->stats)
+CTL_DECLARE(get_loop_stats);
+
+/* get_cpu_stats */
+#define CMD_CODE_get_cpu_stats      134
+#define get_cpu_stats_ARGS (int br_index, cpu_acct_t *bridge, \
+                            cpu_acct_t *daemon, __u64 *now)
+struct get_cpu_stats_IN
+{
+    int br_index;
+};
+struct get_cpu_stats_OUT
+{
+    cpu_acct_t bridge, daemon;
+    __u64 now;
+};
+#define get_cpu_stats_COPY_IN  ({ in->br_index = br_index; })
+#define get_cpu_stats_COPY_OUT ({ *bridge = out->bridge; \
+                                  *daemon = out->daemon; *now = out->now; })
+#define get_cpu_stats_CALL (in->br_index, &out->bridge, &out->daemon, \
+                            &out->now)
+CTL_DECLARE(get_cpu_stats);
+
+/* reset_cpu_stats */
+#define CMD_CODE_reset_cpu_stats    135
+#define reset_cpu_stats_ARGS (void)
+struct reset_cpu_stats_IN
+{
+};
+struct reset_cpu_stats_OUT
+{
+};
+#define reset_cpu_stats_COPY_IN  ({ (void)0; })
+#define reset_cpu_stats_COPY_OUT ({ (void)0; })
+#define reset_cpu_stats_CALL ()
+CTL_DECLARE(reset_cpu_stats);
+
 /* add bridges */
 #define CMD_CODE_add_bridges    (122 | RESPONSE_FIRST_HANDLE_LATER)
 #define add_bridges_ARGS (int *br_array, int* *ifaces_lists)
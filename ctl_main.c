@@ -30,10 +30,13 @@
 #include <errno.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ctl_socket_client.h"
 #include "log.h"
 #include "netif_utils.h"
+#include "mstp_trace.h"
 
 static int get_index_die(const char *ifname, const char *doc, bool die)
 {
@@ -136,6 +139,7 @@ typedef enum {
     PARAM_TOPCHNGTIME,
     PARAM_TOPCHNGCNT,
     PARAM_TOPCHNGSTATE,
+    PARAM_PORTSPENDING,
     /* port params */
     PARAM_ROLE,
     PARAM_STATE,
@@ -168,6 +172,16 @@ typedef enum {
     PARAM_NUMRXBPDU,
     PARAM_NUMTXTCN,
     PARAM_NUMRXTCN,
+    PARAM_NUMRXREPEATED,
+    PARAM_NUMRXQUEUED,
+    PARAM_NUMRXQUEUEDROPS,
+    PARAM_RXQUEUEHIGHWATER,
+    PARAM_BPDUPOLICERATE,
+    PARAM_BPDUPOLICEBURST,
+    PARAM_NUMRXPOLICED,
+    PARAM_NUMRATEEXCEEDED,
+    PARAM_NUMTXERRORS,
+    PARAM_NUMTXEAGAIN,
     PARAM_NUMTRANSFWD,
     PARAM_NUMTRANSBLK,
     PARAM_NUMBPDUFILTERED,
@@ -204,6 +218,7 @@ static const cmd_param_t cist_bridge_params[] = {
     { PARAM_TOPCHNGTIME,  "time-since-topology-change" },
     { PARAM_TOPCHNGCNT,   "topology-change-count" },
     { PARAM_TOPCHNGSTATE, "topology-change" },
+    { PARAM_PORTSPENDING, "ports-pending" },
 };
 
 static int do_showbridge_fmt_plain(const CIST_BridgeStatus *s,
@@ -253,6 +268,9 @@ static int do_showbridge_fmt_plain(const CIST_BridgeStatus *s,
                    s->topology_change_port);
             printf("  last topology change port  %s\n",
                    s->last_topology_change_port);
+            if(0 != s->num_ports_pending)
+                printf("  ports pending              %u\n",
+                       s->num_ports_pending);
             break;
         case PARAM_ENABLED:
             printf("%s\n", BOOL_STR(s->enabled));
@@ -313,6 +331,9 @@ static int do_showbridge_fmt_plain(const CIST_BridgeStatus *s,
         case PARAM_TOPCHNGSTATE:
             printf("%s\n", BOOL_STR(s->topology_change));
             break;
+        case PARAM_PORTSPENDING:
+            printf("%u\n", s->num_ports_pending);
+            break;
         default:
             return -2; /* -2 = unknown param */
     }
@@ -368,8 +389,9 @@ static int do_showbridge_fmt_json(const CIST_BridgeStatus *s,
                    BOOL_STR(s->topology_change));
             printf("\"topology-change-port\":\"%s\",",
                    s->topology_change_port);
-            printf("\"last-topology-change-port\":\"%s\"",
+            printf("\"last-topology-change-port\":\"%s\",",
                    s->last_topology_change_port);
+            printf("\"ports-pending\":\"%u\"", s->num_ports_pending);
             printf("}");
             break;
         case PARAM_ENABLED:
@@ -391,6 +413,7 @@ static int do_showbridge_fmt_json(const CIST_BridgeStatus *s,
         case PARAM_TOPCHNGTIME:
         case PARAM_TOPCHNGCNT:
         case PARAM_TOPCHNGSTATE:
+        case PARAM_PORTSPENDING:
             /* Output individual parameters for the JSON
                format as plain text in quotes */
             printf("\"");
@@ -714,6 +737,16 @@ static const cmd_param_t cist_port_params[] = {
     { PARAM_NUMRXBPDU,      "num-rx-bpdu" },
     { PARAM_NUMTXTCN,       "num-tx-tcn" },
     { PARAM_NUMRXTCN,       "num-rx-tcn" },
+    { PARAM_NUMRXREPEATED,  "num-rx-bpdu-repeated" },
+    { PARAM_NUMRXQUEUED,    "num-rx-bpdu-queued" },
+    { PARAM_NUMRXQUEUEDROPS,"num-rx-queue-drops" },
+    { PARAM_RXQUEUEHIGHWATER,"rx-queue-high-water" },
+    { PARAM_BPDUPOLICERATE, "bpdu-police-rate" },
+    { PARAM_BPDUPOLICEBURST,"bpdu-police-burst" },
+    { PARAM_NUMRXPOLICED,   "num-rx-bpdu-policed" },
+    { PARAM_NUMRATEEXCEEDED,"num-bpdu-rate-exceeded" },
+    { PARAM_NUMTXERRORS,    "num-tx-errors" },
+    { PARAM_NUMTXEAGAIN,    "num-tx-eagain" },
     { PARAM_NUMTRANSFWD,    "num-transition-fwd" },
     { PARAM_NUMTRANSBLK,    "num-transition-blk" },
     { PARAM_NUMBPDUFILTERED,"num-rx-bpdu-filtered" },
@@ -732,6 +765,8 @@ static int do_showport_fmt_plain(const CIST_PortStatus *s,
                                  const char *port_name,
                                  param_id_t param_id)
 {
+    const port_bpdu_counters_t *c = &s->bpdu_counters;
+
     switch(param_id)
     {
         case PARAM_NULL:
@@ -789,13 +824,56 @@ static int do_showport_fmt_plain(const CIST_PortStatus *s,
                        BOOL_STR(s->ba_inconsistent));
                 printf("  bpdu filter port   %-23s ",
                        BOOL_STR(s->bpdu_filter_port));
-                printf("Num RX BPDU Filtered %u\n", s->num_rx_bpdu_filtered);
-                printf("  Num TX BPDU        %-23u ", s->num_tx_bpdu);
-                printf("Num TX TCN           %u\n", s->num_tx_tcn);
-                printf("  Num RX BPDU        %-23u ", s->num_rx_bpdu);
-                printf("Num RX TCN           %u\n", s->num_rx_tcn);
+                printf("Num RX BPDU Filtered %llu\n",
+                       c->rx_drops[rxDropBpduFilter]);
+                printf("  Num TX BPDU        %-23llu ", s->num_tx_bpdu);
+                printf("Num TX TCN           %llu\n", s->num_tx_tcn);
+                printf("  Num RX BPDU        %-23llu ", s->num_rx_bpdu);
+                printf("Num RX TCN           %llu\n", s->num_rx_tcn);
+                printf("  Num RX Repeated    %-23llu ",
+                       s->num_rx_bpdu_repeated);
+                printf("Num RX Queued        %llu\n", s->num_rx_bpdu_queued);
+                printf("  RX Queue High Water %-22u ",
+                       s->rx_queue_high_water);
+                printf("Num RX Queue Drops   %llu\n",
+                       c->rx_drops[rxDropQueueFull]);
+                printf("  BPDU Police Rate   %-23u ", s->bpdu_police_rate);
+                printf("BPDU Police Burst    %u\n", s->bpdu_police_burst);
+                printf("  Num RX Policed     %-23llu ",
+                       c->rx_drops[rxDropPoliced]);
+                printf("Num Rate Exceeded    %u\n",
+                       s->num_bpdu_rate_exceeded);
+                printf("  Num TX Errors      %-23u ", s->num_tx_errors);
+                printf("Num TX EAGAIN        %u\n", s->num_tx_eagain);
                 printf("  Num Transition FWD %-23u ", s->num_trans_fwd);
                 printf("Num Transition BLK   %u\n", s->num_trans_blk);
+                printf("  Num RX Config      %-23llu ",
+                       c->rx[bpduKindConfig]);
+                printf("Num TX Config        %llu\n", c->tx[bpduKindConfig]);
+                printf("  Num RX STP TCN     %-23llu ", c->rx[bpduKindTCN]);
+                printf("Num TX STP TCN       %llu\n", c->tx[bpduKindTCN]);
+                printf("  Num RX RST         %-23llu ", c->rx[bpduKindRST]);
+                printf("Num TX RST           %llu\n", c->tx[bpduKindRST]);
+                printf("  Num RX MST         %-23llu ", c->rx[bpduKindMST]);
+                printf("Num TX MST           %llu\n", c->tx[bpduKindMST]);
+                printf("  Num RX MSTI Msgs   %-23llu ", c->rx_msti_msgs);
+                printf("Num TX MSTI Msgs     %llu\n", c->tx_msti_msgs);
+                printf("  RX Drop Port Down  %-23llu ",
+                       c->rx_drops[rxDropPortDown]);
+                printf("RX Drop Bad Header   %llu\n",
+                       c->rx_drops[rxDropBadHeader]);
+                printf("  RX Drop Policed    %-23llu ",
+                       c->rx_drops[rxDropPoliced]);
+                printf("RX Drop BPDU Guard   %llu\n",
+                       c->rx_drops[rxDropBpduGuard]);
+                printf("  RX Drop BPDU Filter %-22llu ",
+                       c->rx_drops[rxDropBpduFilter]);
+                printf("RX Drop Br Disabled  %llu\n",
+                       c->rx_drops[rxDropBridgeDisabled]);
+                printf("  RX Drop Invalid    %-23llu ",
+                       c->rx_drops[rxDropInvalid]);
+                printf("RX Drop Queue Full   %llu\n",
+                       c->rx_drops[rxDropQueueFull]);
                 printf("  Rcvd BPDU          %-23s ", BOOL_STR(s->rcvdBpdu));
                 printf("Rcvd STP             %s\n", BOOL_STR(s->rcvdSTP));
                 printf("  Rcvd RSTP          %-23s ", BOOL_STR(s->rcvdRSTP));
@@ -906,16 +984,46 @@ static int do_showport_fmt_plain(const CIST_PortStatus *s,
             printf("%s\n", BOOL_STR(s->ba_inconsistent));
             break;
         case PARAM_NUMTXBPDU:
-            printf("%u\n", s->num_tx_bpdu);
+            printf("%llu\n", s->num_tx_bpdu);
             break;
         case PARAM_NUMRXBPDU:
-            printf("%u\n", s->num_rx_bpdu);
+            printf("%llu\n", s->num_rx_bpdu);
             break;
         case PARAM_NUMTXTCN:
-            printf("%u\n", s->num_tx_tcn);
+            printf("%llu\n", s->num_tx_tcn);
             break;
         case PARAM_NUMRXTCN:
-            printf("%u\n", s->num_rx_tcn);
+            printf("%llu\n", s->num_rx_tcn);
+            break;
+        case PARAM_NUMRXREPEATED:
+            printf("%llu\n", s->num_rx_bpdu_repeated);
+            break;
+        case PARAM_NUMRXQUEUED:
+            printf("%llu\n", s->num_rx_bpdu_queued);
+            break;
+        case PARAM_NUMRXQUEUEDROPS:
+            printf("%llu\n", s->bpdu_counters.rx_drops[rxDropQueueFull]);
+            break;
+        case PARAM_RXQUEUEHIGHWATER:
+            printf("%u\n", s->rx_queue_high_water);
+            break;
+        case PARAM_BPDUPOLICERATE:
+            printf("%u\n", s->bpdu_police_rate);
+            break;
+        case PARAM_BPDUPOLICEBURST:
+            printf("%u\n", s->bpdu_police_burst);
+            break;
+        case PARAM_NUMRXPOLICED:
+            printf("%llu\n", s->bpdu_counters.rx_drops[rxDropPoliced]);
+            break;
+        case PARAM_NUMRATEEXCEEDED:
+            printf("%u\n", s->num_bpdu_rate_exceeded);
+            break;
+        case PARAM_NUMTXERRORS:
+            printf("%u\n", s->num_tx_errors);
+            break;
+        case PARAM_NUMTXEAGAIN:
+            printf("%u\n", s->num_tx_eagain);
             break;
         case PARAM_NUMTRANSFWD:
             printf("%u\n", s->num_trans_fwd);
@@ -924,7 +1032,7 @@ static int do_showport_fmt_plain(const CIST_PortStatus *s,
             printf("%u\n", s->num_trans_blk);
             break;
         case PARAM_NUMBPDUFILTERED:
-            printf("%u\n", s->num_rx_bpdu_filtered);
+            printf("%llu\n", s->bpdu_counters.rx_drops[rxDropBpduFilter]);
             break;
         case PARAM_RCVDBPDU:
             printf("%s\n", BOOL_STR(s->rcvdBpdu));
@@ -956,6 +1064,8 @@ static int do_showport_fmt_json(const CIST_PortStatus *s,
                                 const char *port_name,
                                 param_id_t param_id)
 {
+    const port_bpdu_counters_t *c = &s->bpdu_counters;
+
     switch(param_id)
     {
         case PARAM_NULL:
@@ -1019,16 +1129,60 @@ static int do_showport_fmt_json(const CIST_PortStatus *s,
                        BOOL_STR(s->network_port));
                 printf("\"ba-inconsistent\":\"%s\",",
                        BOOL_STR(s->ba_inconsistent));
-                printf("\"num-tx-bpdu\":\"%u\",", s->num_tx_bpdu);
-                printf("\"num-rx-bpdu\":\"%u\",", s->num_rx_bpdu);
-                printf("\"num-rx-bpdu-filtered\":\"%u\",",
-                       s->num_rx_bpdu_filtered);
-                printf("\"num-tx-tcn\":\"%u\",", s->num_tx_tcn);
-                printf("\"num-rx-tcn\":\"%u\",", s->num_rx_tcn);
+                printf("\"num-tx-bpdu\":\"%llu\",", s->num_tx_bpdu);
+                printf("\"num-rx-bpdu\":\"%llu\",", s->num_rx_bpdu);
+                printf("\"num-rx-bpdu-filtered\":\"%llu\",",
+                       c->rx_drops[rxDropBpduFilter]);
+                printf("\"num-tx-tcn\":\"%llu\",", s->num_tx_tcn);
+                printf("\"num-rx-tcn\":\"%llu\",", s->num_rx_tcn);
+                printf("\"num-rx-bpdu-repeated\":\"%llu\",",
+                       s->num_rx_bpdu_repeated);
+                printf("\"num-rx-bpdu-queued\":\"%llu\",",
+                       s->num_rx_bpdu_queued);
+                printf("\"num-rx-queue-drops\":\"%llu\",",
+                       c->rx_drops[rxDropQueueFull]);
+                printf("\"rx-queue-high-water\":\"%u\",",
+                       s->rx_queue_high_water);
+                printf("\"bpdu-police-rate\":\"%u\",",
+                       s->bpdu_police_rate);
+                printf("\"bpdu-police-burst\":\"%u\",",
+                       s->bpdu_police_burst);
+                printf("\"num-rx-bpdu-policed\":\"%llu\",",
+                       c->rx_drops[rxDropPoliced]);
+                printf("\"num-bpdu-rate-exceeded\":\"%u\",",
+                       s->num_bpdu_rate_exceeded);
+                printf("\"num-tx-errors\":\"%u\",", s->num_tx_errors);
+                printf("\"num-tx-eagain\":\"%u\",", s->num_tx_eagain);
                 printf("\"num-transition-fwd\":\"%u\",",
                        s->num_trans_fwd);
                 printf("\"num-transition-blk\":\"%u\",",
                        s->num_trans_blk);
+                printf("\"num-rx-config\":\"%llu\",", c->rx[bpduKindConfig]);
+                printf("\"num-rx-stp-tcn\":\"%llu\",", c->rx[bpduKindTCN]);
+                printf("\"num-rx-rst\":\"%llu\",", c->rx[bpduKindRST]);
+                printf("\"num-rx-mst\":\"%llu\",", c->rx[bpduKindMST]);
+                printf("\"num-rx-msti-msgs\":\"%llu\",", c->rx_msti_msgs);
+                printf("\"num-tx-config\":\"%llu\",", c->tx[bpduKindConfig]);
+                printf("\"num-tx-stp-tcn\":\"%llu\",", c->tx[bpduKindTCN]);
+                printf("\"num-tx-rst\":\"%llu\",", c->tx[bpduKindRST]);
+                printf("\"num-tx-mst\":\"%llu\",", c->tx[bpduKindMST]);
+                printf("\"num-tx-msti-msgs\":\"%llu\",", c->tx_msti_msgs);
+                printf("\"num-rx-drop-port-down\":\"%llu\",",
+                       c->rx_drops[rxDropPortDown]);
+                printf("\"num-rx-drop-bad-header\":\"%llu\",",
+                       c->rx_drops[rxDropBadHeader]);
+                printf("\"num-rx-drop-policed\":\"%llu\",",
+                       c->rx_drops[rxDropPoliced]);
+                printf("\"num-rx-drop-bpdu-guard\":\"%llu\",",
+                       c->rx_drops[rxDropBpduGuard]);
+                printf("\"num-rx-drop-bpdu-filter\":\"%llu\",",
+                       c->rx_drops[rxDropBpduFilter]);
+                printf("\"num-rx-drop-bridge-disabled\":\"%llu\",",
+                       c->rx_drops[rxDropBridgeDisabled]);
+                printf("\"num-rx-drop-invalid\":\"%llu\",",
+                       c->rx_drops[rxDropInvalid]);
+                printf("\"num-rx-drop-queue-full\":\"%llu\",",
+                       c->rx_drops[rxDropQueueFull]);
                 printf("\"received-bpdu\":\"%s\",",
                        BOOL_STR(s->rcvdBpdu));
                 printf("\"received-stp\":\"%s\",",
@@ -1103,6 +1257,16 @@ static int do_showport_fmt_json(const CIST_PortStatus *s,
         case PARAM_NUMRXBPDU:
         case PARAM_NUMTXTCN:
         case PARAM_NUMRXTCN:
+        case PARAM_NUMRXREPEATED:
+        case PARAM_NUMRXQUEUED:
+        case PARAM_NUMRXQUEUEDROPS:
+        case PARAM_RXQUEUEHIGHWATER:
+        case PARAM_BPDUPOLICERATE:
+        case PARAM_BPDUPOLICEBURST:
+        case PARAM_NUMRXPOLICED:
+        case PARAM_NUMRATEEXCEEDED:
+        case PARAM_NUMTXERRORS:
+        case PARAM_NUMTXEAGAIN:
         case PARAM_NUMTRANSFWD:
         case PARAM_NUMTRANSBLK:
         case PARAM_NUMBPDUFILTERED:
@@ -1709,6 +1873,28 @@ static int cmd_setportbpdufilter(int argc, char *const *argv)
     return set_port_cfg(bpdu_filter_port, getyesno(argv[3], "yes", "no"));
 }
 
+static int cmd_setportbpdurate(int argc, char *const *argv)
+{
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+    int port_index = get_index(argv[2], "port");
+    if(0 > port_index)
+        return port_index;
+    return set_port_cfg(bpdu_police_rate, getuint(argv[3]));
+}
+
+static int cmd_setportbpduburst(int argc, char *const *argv)
+{
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+    int port_index = get_index(argv[2], "port");
+    if(0 > port_index)
+        return port_index;
+    return set_port_cfg(bpdu_police_burst, getuint(argv[3]));
+}
+
 static int cmd_setportnetwork(int argc, char *const *argv)
 {
     int br_index = get_index(argv[1], "bridge");
@@ -1765,6 +1951,169 @@ static int cmd_settreeportcost(int argc, char *const *argv)
     return set_tree_port_cfg(admin_internal_port_path_cost, path_cost);
 }
 
+static PortConfigEntry *get_port_config_entry(PortConfigEntry *entries,
+                                              int *num_entries,
+                                              int port_index, __u16 mstid)
+{
+    int i;
+
+    for(i = 0; i < *num_entries; ++i)
+        if((entries[i].port_index == port_index)
+           && (entries[i].mstid == mstid))
+            return &entries[i];
+
+    if(MAX_PORT_CONFIG_ENTRIES <= *num_entries)
+    {
+        fprintf(stderr, "Too many port/mstid pairs, max %d\n",
+                MAX_PORT_CONFIG_ENTRIES);
+        return NULL;
+    }
+
+    memset(&entries[i], 0, sizeof(entries[i]));
+    entries[i].port_index = port_index;
+    entries[i].mstid = mstid;
+    ++(*num_entries);
+    return &entries[i];
+}
+
+static int cmd_setportconfigs(int argc, char *const *argv)
+{
+    PortConfigEntry entries[MAX_PORT_CONFIG_ENTRIES], *e;
+    int i, num_entries = 0;
+    const char *p2p_opts[] = { "no", "yes", "auto", NULL };
+    int p2p_vals[] = { p2pForceFalse, p2pForceTrue, p2pAuto };
+
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+    int port_index = get_index(argv[2], "port");
+    if(0 > port_index)
+        return port_index;
+    int mstid = 0;
+
+    if(0 != ((argc - 3) % 2))
+    {
+        fprintf(stderr, "Option %s has no value\n", argv[argc - 1]);
+        return -1;
+    }
+
+    for(i = 3; i < argc; i += 2)
+    {
+        const char *opt = argv[i], *val = argv[i + 1];
+
+        if(!strcmp(opt, "port"))
+        {
+            if(0 > (port_index = get_index(val, "port")))
+                return port_index;
+            mstid = 0;
+            continue;
+        }
+        if(!strcmp(opt, "mstid"))
+        {
+            if(0 > (mstid = get_id(val, "mstid", MAX_MSTID)))
+                return mstid;
+            continue;
+        }
+
+        if(!(e = get_port_config_entry(entries, &num_entries,
+                                       port_index, mstid)))
+            return -1;
+
+        if(!strcmp(opt, "prio"))
+        {
+            unsigned int prio = getuint(val);
+            e->msti_cfg.port_priority = (prio > 255) ? 255 : prio;
+            e->msti_cfg.set_port_priority = true;
+            continue;
+        }
+        if(!strcmp(opt, "int-cost"))
+        {
+            unsigned int cost = getuint(val);
+            e->msti_cfg.admin_internal_port_path_cost =
+                (cost > 210000000) ? 210000000 : cost;
+            e->msti_cfg.set_admin_internal_port_path_cost = true;
+            continue;
+        }
+
+        if(0 != mstid)
+        {
+            fprintf(stderr, "Option %s is not applicable to MSTI %d\n",
+                    opt, mstid);
+            return -1;
+        }
+
+        if(!strcmp(opt, "ext-cost"))
+        {
+            unsigned int cost = getuint(val);
+            e->cist_cfg.admin_external_port_path_cost =
+                (cost > 210000000) ? 210000000 : cost;
+            e->cist_cfg.set_admin_external_port_path_cost = true;
+        }
+        else if(!strcmp(opt, "admin-edge"))
+        {
+            e->cist_cfg.admin_edge_port = getyesno(val, "yes", "no");
+            e->cist_cfg.set_admin_edge_port = true;
+        }
+        else if(!strcmp(opt, "auto-edge"))
+        {
+            e->cist_cfg.auto_edge_port = getyesno(val, "yes", "no");
+            e->cist_cfg.set_auto_edge_port = true;
+        }
+        else if(!strcmp(opt, "p2p"))
+        {
+            e->cist_cfg.admin_p2p = p2p_vals[getenum(val, p2p_opts)];
+            e->cist_cfg.set_admin_p2p = true;
+        }
+        else if(!strcmp(opt, "rest-role"))
+        {
+            e->cist_cfg.restricted_role = getyesno(val, "yes", "no");
+            e->cist_cfg.set_restricted_role = true;
+        }
+        else if(!strcmp(opt, "rest-tcn"))
+        {
+            e->cist_cfg.restricted_tcn = getyesno(val, "yes", "no");
+            e->cist_cfg.set_restricted_tcn = true;
+        }
+        else if(!strcmp(opt, "bpdu-guard"))
+        {
+            e->cist_cfg.bpdu_guard_port = getyesno(val, "yes", "no");
+            e->cist_cfg.set_bpdu_guard_port = true;
+        }
+        else if(!strcmp(opt, "bpdu-filter"))
+        {
+            e->cist_cfg.bpdu_filter_port = getyesno(val, "yes", "no");
+            e->cist_cfg.set_bpdu_filter_port = true;
+        }
+        else if(!strcmp(opt, "network"))
+        {
+            e->cist_cfg.network_port = getyesno(val, "yes", "no");
+            e->cist_cfg.set_network_port = true;
+        }
+        else if(!strcmp(opt, "dont-txmt"))
+        {
+            e->cist_cfg.dont_txmt = getyesno(val, "yes", "no");
+            e->cist_cfg.set_dont_txmt = true;
+        }
+        else if(!strcmp(opt, "bpdu-rate"))
+        {
+            e->cist_cfg.bpdu_police_rate = getuint(val);
+            e->cist_cfg.set_bpdu_police_rate = true;
+        }
+        else if(!strcmp(opt, "bpdu-burst"))
+        {
+            e->cist_cfg.bpdu_police_burst = getuint(val);
+            e->cist_cfg.set_bpdu_police_burst = true;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown port option %s\n", opt);
+            return -1;
+        }
+    }
+
+    return CTL_set_port_configs(br_index, num_entries, entries);
+}
+
 static int cmd_portmcheck(int argc, char *const *argv)
 {
     int br_index = get_index(argv[1], "bridge");
@@ -1784,6 +2133,301 @@ static int cmd_debuglevel(int argc, char *const *argv)
     return CTL_set_debug_level(level);
 }
 
+/* Add the name of ifindex to names[], unless it is there already */
+static void trace_add_name(trace_file_name_t *names, int *num_names,
+                           unsigned int ifindex)
+{
+    int i;
+
+    if(0 == ifindex)
+        return;
+    for(i = 0; i < *num_names; ++i)
+    {
+        if(names[i].ifindex == ifindex)
+            return;
+    }
+    names[i].ifindex = ifindex;
+    if(NULL == if_indextoname(ifindex, names[i].name))
+        snprintf(names[i].name, IFNAMSIZ, "if%u", ifindex);
+    ++(*num_names);
+}
+
+/* The records are fetched from mstpd and the file is written here, with
+ * the permissions of the caller: mstpd never opens a path it is given.
+ */
+static int cmd_dumptrace(int argc, char *const *argv)
+{
+    trace_file_header_t hdr;
+    trace_file_name_t *names = NULL;
+    trace_record_t *recs;
+    unsigned int seq, first, head, end, count, num = 0, i;
+    int num_names = 0, r = -1;
+    FILE *f;
+
+    if(NULL == (recs = malloc((TRACE_RING_SIZE + TRACE_CHUNK_RECORDS)
+                              * sizeof(*recs))))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    /* Records written while we read go up to TRACE_RING_SIZE; records
+     * overwritten between two requests are skipped */
+    if(CTL_get_trace(0, &first, &end, &count, recs))
+        goto out;
+    num = count;
+    seq = first + count;
+    while((0 < (int)(end - seq)) && (TRACE_RING_SIZE > num))
+    {
+        if(CTL_get_trace(seq, &first, &head, &count, recs + num))
+            goto out;
+        if(0 == count)
+            break;
+        num += count;
+        seq = first + count;
+    }
+    if(TRACE_RING_SIZE < num)
+        num = TRACE_RING_SIZE;
+
+    if(NULL == (names = calloc(2 * num + 1, sizeof(*names))))
+    {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+    for(i = 0; i < num; ++i)
+    {
+        trace_add_name(names, &num_names, recs[i].br_ifindex);
+        trace_add_name(names, &num_names, recs[i].port_ifindex);
+    }
+
+    if(NULL == (f = fopen(argv[1], "w")))
+    {
+        fprintf(stderr, "Can't open %s: %m\n", argv[1]);
+        goto out;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_FILE_VERSION;
+    hdr.record_size = sizeof(trace_record_t);
+    hdr.num_names = num_names;
+    hdr.num_records = num;
+    if((1 == fwrite(&hdr, sizeof(hdr), 1, f))
+       && (num_names == fwrite(names, sizeof(*names), num_names, f))
+       && (num == fwrite(recs, sizeof(*recs), num, f)))
+        r = 0;
+    if(fclose(f))
+        r = -1;
+    if(r)
+        fprintf(stderr, "Couldn't write %s: %m\n", argv[1]);
+out:
+    free(names);
+    free(recs);
+    return r;
+}
+
+static const char *const trace_prsm_states[] = {
+    [PRSM_DISCARD] = "DISCARD",
+    [PRSM_RECEIVE] = "RECEIVE",
+};
+
+static const char *const trace_pism_states[] = {
+    [PISM_DISABLED] = "DISABLED",
+    [PISM_AGED] = "AGED",
+    [PISM_UPDATE] = "UPDATE",
+    [PISM_SUPERIOR_DESIGNATED] = "SUPERIOR_DESIGNATED",
+    [PISM_REPEATED_DESIGNATED] = "REPEATED_DESIGNATED",
+    [PISM_INFERIOR_DESIGNATED] = "INFERIOR_DESIGNATED",
+    [PISM_NOT_DESIGNATED] = "NOT_DESIGNATED",
+    [PISM_OTHER] = "OTHER",
+    [PISM_CURRENT] = "CURRENT",
+    [PISM_RECEIVE] = "RECEIVE",
+};
+
+static const char *const trace_prtsm_states[] = {
+    [PRTSM_INIT_PORT] = "INIT_PORT",
+    [PRTSM_DISABLE_PORT] = "DISABLE_PORT",
+    [PRTSM_DISABLED_PORT] = "DISABLED_PORT",
+    [PRTSM_MASTER_PROPOSED] = "MASTER_PROPOSED",
+    [PRTSM_MASTER_AGREED] = "MASTER_AGREED",
+    [PRTSM_MASTER_SYNCED] = "MASTER_SYNCED",
+    [PRTSM_MASTER_RETIRED] = "MASTER_RETIRED",
+    [PRTSM_MASTER_FORWARD] = "MASTER_FORWARD",
+    [PRTSM_MASTER_LEARN] = "MASTER_LEARN",
+    [PRTSM_MASTER_DISCARD] = "MASTER_DISCARD",
+    [PRTSM_MASTER_PORT] = "MASTER_PORT",
+    [PRTSM_ROOT_PROPOSED] = "ROOT_PROPOSED",
+    [PRTSM_ROOT_AGREED] = "ROOT_AGREED",
+    [PRTSM_ROOT_SYNCED] = "ROOT_SYNCED",
+    [PRTSM_REROOT] = "REROOT",
+    [PRTSM_ROOT_FORWARD] = "ROOT_FORWARD",
+    [PRTSM_ROOT_LEARN] = "ROOT_LEARN",
+    [PRTSM_REROOTED] = "REROOTED",
+    [PRTSM_ROOT_PORT] = "ROOT_PORT",
+    [PRTSM_DESIGNATED_PROPOSE] = "DESIGNATED_PROPOSE",
+    [PRTSM_DESIGNATED_AGREED] = "DESIGNATED_AGREED",
+    [PRTSM_DESIGNATED_SYNCED] = "DESIGNATED_SYNCED",
+    [PRTSM_DESIGNATED_RETIRED] = "DESIGNATED_RETIRED",
+    [PRTSM_DESIGNATED_FORWARD] = "DESIGNATED_FORWARD",
+    [PRTSM_DESIGNATED_LEARN] = "DESIGNATED_LEARN",
+    [PRTSM_DESIGNATED_DISCARD] = "DESIGNATED_DISCARD",
+    [PRTSM_DESIGNATED_PORT] = "DESIGNATED_PORT",
+    [PRTSM_BLOCK_PORT] = "BLOCK_PORT",
+    [PRTSM_BACKUP_PORT] = "BACKUP_PORT",
+    [PRTSM_ALTERNATE_PROPOSED] = "ALTERNATE_PROPOSED",
+    [PRTSM_ALTERNATE_AGREED] = "ALTERNATE_AGREED",
+    [PRTSM_ALTERNATE_PORT] = "ALTERNATE_PORT",
+};
+
+static const char *const trace_pstsm_states[] = {
+    [PSTSM_DISCARDING] = "DISCARDING",
+    [PSTSM_LEARNING] = "LEARNING",
+    [PSTSM_FORWARDING] = "FORWARDING",
+};
+
+static const char *const trace_tcsm_states[] = {
+    [TCSM_INACTIVE] = "INACTIVE",
+    [TCSM_LEARNING] = "LEARNING",
+    [TCSM_DETECTED] = "DETECTED",
+    [TCSM_NOTIFIED_TCN] = "NOTIFIED_TCN",
+    [TCSM_NOTIFIED_TC] = "NOTIFIED_TC",
+    [TCSM_PROPAGATING] = "PROPAGATING",
+    [TCSM_ACKNOWLEDGED] = "ACKNOWLEDGED",
+    [TCSM_ACTIVE] = "ACTIVE",
+};
+
+static const struct {
+    const char *name;
+    const char *const *states;
+    int num_states;
+} trace_sms[] = {
+    [TRACE_SM_PRSM] =
+        { "PRSM", trace_prsm_states, COUNT_OF(trace_prsm_states) },
+    [TRACE_SM_PISM] =
+        { "PISM", trace_pism_states, COUNT_OF(trace_pism_states) },
+    [TRACE_SM_PRTSM] =
+        { "PRTSM", trace_prtsm_states, COUNT_OF(trace_prtsm_states) },
+    [TRACE_SM_PSTSM] =
+        { "PSTSM", trace_pstsm_states, COUNT_OF(trace_pstsm_states) },
+    [TRACE_SM_TCSM] =
+        { "TCSM", trace_tcsm_states, COUNT_OF(trace_tcsm_states) },
+};
+
+static const char *trace_ifname(const trace_file_name_t *names, int num_names,
+                                __u32 ifindex, char *buf)
+{
+    int i;
+    for(i = 0; i < num_names; ++i)
+        if(names[i].ifindex == ifindex)
+            return names[i].name;
+    sprintf(buf, "if%u", ifindex);
+    return buf;
+}
+
+static const char *trace_state(__u8 sm, __u8 state, char *buf)
+{
+    if((sm < COUNT_OF(trace_sms)) && trace_sms[sm].name
+       && (state < trace_sms[sm].num_states) && trace_sms[sm].states[state])
+        return trace_sms[sm].states[state];
+    sprintf(buf, "%hhu", state);
+    return buf;
+}
+
+static const char *trace_bpdu_type(const trace_record_t *rec)
+{
+    switch(rec->from)
+    {
+        case protoSTP:
+            return (bpduTypeTCN == rec->sm) ? "STP-TCN" : "STP-Config";
+        case protoRSTP:
+            return "RST";
+        case protoMSTP:
+            return "MST";
+        default:
+            return "Unknown";
+    }
+}
+
+static void trace_print_record(const trace_record_t *rec,
+                               const trace_file_name_t *names, int num_names)
+{
+    char br_buf[16], prt_buf[16], from_buf[8], to_buf[8], tm_buf[32];
+    time_t t = rec->time_ns / 1000000000ull;
+    const char *br_name = trace_ifname(names, num_names, rec->br_ifindex,
+                                       br_buf);
+    const char *prt_name = trace_ifname(names, num_names, rec->port_ifindex,
+                                        prt_buf);
+
+    strftime(tm_buf, sizeof(tm_buf), "%F %T", localtime(&t));
+    printf("%s.%06u %s:%s ", tm_buf,
+           (unsigned int)(rec->time_ns % 1000000000ull) / 1000,
+           br_name, prt_name);
+
+    switch(rec->type)
+    {
+        case TRACE_SM:
+            printf("mstid %hu %s %s -> %s\n", rec->mstid,
+                   (rec->sm < COUNT_OF(trace_sms) && trace_sms[rec->sm].name)
+                     ? trace_sms[rec->sm].name : "SM?",
+                   trace_state(rec->sm, rec->from, from_buf),
+                   trace_state(rec->sm, rec->to, to_buf));
+            break;
+        case TRACE_RX_BPDU:
+        case TRACE_TX_BPDU:
+            printf("%s %s BPDU size %hu flags 0x%02hhx%s digest %08x\n",
+                   (TRACE_RX_BPDU == rec->type) ? "rx" : "tx",
+                   trace_bpdu_type(rec), rec->size, rec->to,
+                   (rec->to & (1 << offsetTc)) ? " (TC)" : "", rec->digest);
+            break;
+        default:
+            printf("unknown record type %hhu\n", rec->type);
+    }
+}
+
+static int cmd_showtrace(int argc, char *const *argv)
+{
+    trace_file_header_t hdr;
+    trace_file_name_t *names = NULL;
+    trace_record_t rec;
+    FILE *f;
+    int i, r = -1;
+
+    if(NULL == (f = fopen(argv[1], "r")))
+    {
+        fprintf(stderr, "Can't open %s: %m\n", argv[1]);
+        return -1;
+    }
+    if((1 != fread(&hdr, sizeof(hdr), 1, f))
+       || strncmp(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic))
+       || (TRACE_FILE_VERSION != hdr.version)
+       || (sizeof(rec) != hdr.record_size))
+    {
+        fprintf(stderr, "%s is not a mstpd trace file\n", argv[1]);
+        goto out;
+    }
+    if((NULL == (names = calloc(hdr.num_names + 1, sizeof(*names))))
+       || (hdr.num_names != fread(names, sizeof(*names), hdr.num_names, f)))
+    {
+        fprintf(stderr, "Can't read interface names from %s\n", argv[1]);
+        goto out;
+    }
+    for(i = 0; i < hdr.num_names; ++i)
+        names[i].name[IFNAMSIZ - 1] = 0;
+
+    for(i = 0; i < hdr.num_records; ++i)
+    {
+        if(1 != fread(&rec, sizeof(rec), 1, f))
+        {
+            fprintf(stderr, "%s is truncated\n", argv[1]);
+            goto out;
+        }
+        trace_print_record(&rec, names, hdr.num_names);
+    }
+    r = 0;
+out:
+    free(names);
+    fclose(f);
+    return r;
+}
+
 static int do_showmstilist_fmt_plain(const char *br_name,
                                      int num_mstis,
                                      const __u16 *mstids)
@@ -1840,6 +2484,459 @@ static int cmd_showmstilist(int argc, char *const *argv)
     }
 }
 
+#define PTP_LAYOUT_STR(_layout) \
+    ((ptpLayoutPort == (_layout)) ? "port" : "tree")
+
+static int do_showallocstats_fmt_plain(const BridgeAllocStats *s,
+                                       const char *br_name)
+{
+    printf("%s allocator stats\n", br_name);
+    printf("  ptp layout          %s\n", PTP_LAYOUT_STR(s->ptp_layout));
+    printf("  trees               %-10u chunks    %u\n",
+           s->trees, s->tree_chunks);
+    printf("  ptps                %-10u chunks    %u\n",
+           s->ptps, s->ptp_chunks);
+    printf("  ptps capacity       %u\n", s->ptps_capacity);
+    printf("  ptp allocs          %-10llu frees     %llu\n",
+           s->ptp_allocs, s->ptp_frees);
+    printf("  bytes               %llu\n", s->bytes);
+
+    return 0;
+}
+
+static int do_showallocstats_fmt_json(const BridgeAllocStats *s,
+                                      const char *br_name)
+{
+    printf("{");
+    printf("\"bridge\":\"%s\",", br_name);
+    printf("\"ptp-layout\":\"%s\",", PTP_LAYOUT_STR(s->ptp_layout));
+    printf("\"trees\":\"%u\",", s->trees);
+    printf("\"tree-chunks\":\"%u\",", s->tree_chunks);
+    printf("\"ptps\":\"%u\",", s->ptps);
+    printf("\"ptp-chunks\":\"%u\",", s->ptp_chunks);
+    printf("\"ptps-capacity\":\"%u\",", s->ptps_capacity);
+    printf("\"ptp-allocs\":\"%llu\",", s->ptp_allocs);
+    printf("\"ptp-frees\":\"%llu\",", s->ptp_frees);
+    printf("\"bytes\":\"%llu\"", s->bytes);
+    printf("}");
+
+    return 0;
+}
+
+static int cmd_showallocstats(int argc, char *const *argv)
+{
+    BridgeAllocStats s;
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+
+    if(CTL_get_alloc_stats(br_index, &s))
+        return -1;
+
+    switch(format)
+    {
+        case FORMAT_PLAIN:
+            return do_showallocstats_fmt_plain(&s, argv[1]);
+        case FORMAT_JSON:
+            return do_showallocstats_fmt_json(&s, argv[1]);
+        default:
+            return -3; /* -3 = unsupported or unknown format */
+    }
+}
+
+static int do_showtxslots_fmt_plain(const BridgeTxSlotStats *s,
+                                    const char *br_name)
+{
+    unsigned int i;
+    unsigned long long min, max, sum;
+
+    min = max = sum = s->periodic[0];
+    for(i = 1; i < s->slots; ++i)
+    {
+        if(s->periodic[i] < min)
+            min = s->periodic[i];
+        if(s->periodic[i] > max)
+            max = s->periodic[i];
+        sum += s->periodic[i];
+    }
+
+    printf("%s transmit slots\n", br_name);
+    printf("  slots               %-10u slot ms   %u\n",
+           s->slots, 1000 / s->slots);
+    printf("  periodic min        %-10llu max       %llu\n", min, max);
+    printf("  periodic avg        %llu\n", sum / s->slots);
+    printf("  slot  periodic    total\n");
+    for(i = 0; i < s->slots; ++i)
+        printf("  %-4u  %-10llu  %llu\n", i, s->periodic[i], s->total[i]);
+
+    return 0;
+}
+
+static int do_showtxslots_fmt_json(const BridgeTxSlotStats *s,
+                                   const char *br_name)
+{
+    unsigned int i;
+
+    printf("{");
+    printf("\"bridge\":\"%s\",", br_name);
+    printf("\"slots\":\"%u\",", s->slots);
+    printf("\"periodic\":[");
+    for(i = 0; i < s->slots; ++i)
+        printf("%s\"%llu\"", i ? "," : "", s->periodic[i]);
+    printf("],\"total\":[");
+    for(i = 0; i < s->slots; ++i)
+        printf("%s\"%llu\"", i ? "," : "", s->total[i]);
+    printf("]}");
+
+    return 0;
+}
+
+static int cmd_showtxslots(int argc, char *const *argv)
+{
+    BridgeTxSlotStats s;
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+
+    if(CTL_get_tx_slot_stats(br_index, &s))
+        return -1;
+    if(s.slots < 1 || s.slots > MAX_HELLO_SLOTS)
+        return -1;
+
+    switch(format)
+    {
+        case FORMAT_PLAIN:
+            return do_showtxslots_fmt_plain(&s, argv[1]);
+        case FORMAT_JSON:
+            return do_showtxslots_fmt_json(&s, argv[1]);
+        default:
+            return -3; /* -3 = unsupported or unknown format */
+    }
+}
+
+static void print_hist_range(unsigned int b)
+{
+    char range[48];
+
+    if(LOG2_HIST_BUCKETS - 1 == b)
+        snprintf(range, sizeof(range), "%llu-", LOG2_HIST_LOW(b));
+    else
+        snprintf(range, sizeof(range), "%llu-%llu", LOG2_HIST_LOW(b),
+                 LOG2_HIST_HIGH(b));
+    printf("  %-20s", range);
+}
+
+static int do_showtickstats_fmt_plain(const TickStats *s, const char *br_name)
+{
+    unsigned int i;
+
+    printf("%s tick stats\n", br_name);
+    printf("  ticks per second    %-10u ticks     %llu\n",
+           s->slots, s->ticks);
+    printf("  missed ticks        %-10llu skipped   %llu\n",
+           s->missed, s->skipped);
+    printf("  max tick late us    %-10llu hellos    %llu\n",
+           s->late_max, s->hellos);
+    printf("  max tick lag us     %-10llu bridge ticks %llu\n",
+           s->tick_lag_max, s->bridge_ticks);
+    printf("  max hello jitter us %-10llu hellos sent %llu\n",
+           s->hello_jitter_max, s->hello_tx);
+    printf("  max hello delay us  %llu\n", s->hello_tx_delay_max);
+    printf("  lag limit us        %-10u warnings  %llu\n",
+           s->lag_limit_us, s->lag_warnings);
+    printf("  %-20s %-12s %-12s %-12s %-15s %s\n", "range", "tick late us",
+           "missed", "tick lag us", "hello jitter us", "hello delay us");
+    for(i = 0; i < LOG2_HIST_BUCKETS; ++i)
+    {
+        if(!s->late[i] && !s->missed_per_wakeup[i] && !s->tick_lag[i]
+           && !s->hello_jitter[i] && !s->hello_tx_delay[i])
+            continue;
+        print_hist_range(i);
+        printf(" %-12llu %-12llu %-12llu %-15llu %llu\n", s->late[i],
+               s->missed_per_wakeup[i], s->tick_lag[i], s->hello_jitter[i],
+               s->hello_tx_delay[i]);
+    }
+
+    return 0;
+}
+
+static void print_log2_hist_json(const char *name,
+                                 const unsigned long long *hist)
+{
+    unsigned int i;
+
+    printf("\"%s\":[", name);
+    for(i = 0; i < LOG2_HIST_BUCKETS; ++i)
+        printf("%s\"%llu\"", i ? "," : "", hist[i]);
+    printf("]");
+}
+
+static int do_showtickstats_fmt_json(const TickStats *s, const char *br_name)
+{
+    printf("{");
+    printf("\"bridge\":\"%s\",", br_name);
+    printf("\"ticks-per-second\":\"%u\",", s->slots);
+    printf("\"ticks\":\"%llu\",", s->ticks);
+    printf("\"missed-ticks\":\"%llu\",", s->missed);
+    printf("\"skipped-ticks\":\"%llu\",", s->skipped);
+    printf("\"max-tick-late-us\":\"%llu\",", s->late_max);
+    printf("\"bridge-ticks\":\"%llu\",", s->bridge_ticks);
+    printf("\"max-tick-lag-us\":\"%llu\",", s->tick_lag_max);
+    printf("\"hellos\":\"%llu\",", s->hellos);
+    printf("\"max-hello-jitter-us\":\"%llu\",", s->hello_jitter_max);
+    printf("\"hellos-sent\":\"%llu\",", s->hello_tx);
+    printf("\"max-hello-delay-us\":\"%llu\",", s->hello_tx_delay_max);
+    printf("\"lag-limit-us\":\"%u\",", s->lag_limit_us);
+    printf("\"lag-warnings\":\"%llu\",", s->lag_warnings);
+    print_log2_hist_json("tick-late-us", s->late);
+    printf(",");
+    print_log2_hist_json("missed-per-wakeup", s->missed_per_wakeup);
+    printf(",");
+    print_log2_hist_json("tick-lag-us", s->tick_lag);
+    printf(",");
+    print_log2_hist_json("hello-jitter-us", s->hello_jitter);
+    printf(",");
+    print_log2_hist_json("hello-delay-us", s->hello_tx_delay);
+    printf("}");
+
+    return 0;
+}
+
+static int cmd_showtickstats(int argc, char *const *argv)
+{
+    TickStats s;
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+
+    if(CTL_get_tick_stats(br_index, &s))
+        return -1;
+
+    switch(format)
+    {
+        case FORMAT_PLAIN:
+            return do_showtickstats_fmt_plain(&s, argv[1]);
+        case FORMAT_JSON:
+            return do_showtickstats_fmt_json(&s, argv[1]);
+        default:
+            return -3; /* -3 = unsupported or unknown format */
+    }
+}
+
+#define LOOP_BACKEND_STR(_backend) \
+    ((LOOP_BACKEND_IO_URING == (_backend)) ? "io_uring" : "epoll")
+
+static const char *loop_source_names[EPOLL_PRIO_COUNT] =
+{
+    [EPOLL_PRIO_TIMER] = "timer",
+    [EPOLL_PRIO_BPDU] = "bpdu",
+    [EPOLL_PRIO_NETLINK] = "netlink",
+    [EPOLL_PRIO_CTL] = "control",
+};
+
+static int do_showloopstats_fmt_plain(const epoll_loop_stats_t *s)
+{
+    unsigned int i;
+    int prio;
+
+    printf("main loop stats\n");
+    printf("  backend             %s\n", LOOP_BACKEND_STR(s->backend));
+    printf("  iterations          %llu\n", s->iterations);
+    printf("  syscalls            %-10llu packets   %llu\n",
+           s->syscalls, s->packets);
+    printf("  latency limit ms    %-10u warnings  %llu\n",
+           s->latency_limit_ms, s->latency_warnings);
+    printf("  %-10s %-12s %-14s %-12s %s\n", "source", "calls",
+           "total us", "avg us", "max us");
+    for(prio = EPOLL_PRIO_COUNT - 1; prio >= 0; --prio)
+    {
+        const epoll_source_stats_t *src = &s->src[prio];
+        printf("  %-10s %-12llu %-14llu %-12llu %llu\n",
+               loop_source_names[prio], src->calls, src->time_ns / 1000,
+               src->calls ? src->time_ns / src->calls / 1000 : 0,
+               src->max_ns / 1000);
+    }
+    printf("  %-20s", "range us");
+    for(prio = EPOLL_PRIO_COUNT - 1; prio >= 0; --prio)
+        printf(" %-10s", loop_source_names[prio]);
+    printf("\n");
+    for(i = 0; i < LOG2_HIST_BUCKETS; ++i)
+    {
+        for(prio = EPOLL_PRIO_COUNT - 1; prio >= 0; --prio)
+            if(s->src[prio].hist[i])
+                break;
+        if(prio < 0)
+            continue;
+        print_hist_range(i);
+        for(prio = EPOLL_PRIO_COUNT - 1; prio >= 0; --prio)
+            printf(" %-10llu", s->src[prio].hist[i]);
+        printf("\n");
+    }
+
+    return 0;
+}
+
+static int do_showloopstats_fmt_json(const epoll_loop_stats_t *s)
+{
+    int prio;
+
+    printf("{");
+    printf("\"backend\":\"%s\",", LOOP_BACKEND_STR(s->backend));
+    printf("\"syscalls\":\"%llu\",", s->syscalls);
+    printf("\"packets\":\"%llu\",", s->packets);
+    printf("\"latency-limit-ms\":\"%u\",", s->latency_limit_ms);
+    printf("\"latency-warnings\":\"%llu\",", s->latency_warnings);
+    printf("\"iterations\":\"%llu\"", s->iterations);
+    for(prio = EPOLL_PRIO_COUNT - 1; prio >= 0; --prio)
+    {
+        const epoll_source_stats_t *src = &s->src[prio];
+        printf(",\"%s\":{", loop_source_names[prio]);
+        printf("\"calls\":\"%llu\",", src->calls);
+        printf("\"total-us\":\"%llu\",", src->time_ns / 1000);
+        printf("\"max-us\":\"%llu\",", src->max_ns / 1000);
+        print_log2_hist_json("us", src->hist);
+        printf("}");
+    }
+    printf("}");
+
+    return 0;
+}
+
+static int cmd_showloopstats(int argc, char *const *argv)
+{
+    epoll_loop_stats_t s;
+
+    if(CTL_get_loop_stats(&s))
+        return -1;
+
+    switch(format)
+    {
+        case FORMAT_PLAIN:
+            return do_showloopstats_fmt_plain(&s);
+        case FORMAT_JSON:
+            return do_showloopstats_fmt_json(&s);
+        default:
+            return -3; /* -3 = unsupported or unknown format */
+    }
+}
+
+/* Everything about how late mstpd is for the bridge, in one go */
+static int cmd_showstats(int argc, char *const *argv)
+{
+    TickStats s;
+    epoll_loop_stats_t loop;
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+
+    if(CTL_get_tick_stats(br_index, &s) || CTL_get_loop_stats(&loop))
+        return -1;
+
+    switch(format)
+    {
+        case FORMAT_PLAIN:
+            do_showtickstats_fmt_plain(&s, argv[1]);
+            return do_showloopstats_fmt_plain(&loop);
+        case FORMAT_JSON:
+            printf("{\"tick-stats\":");
+            do_showtickstats_fmt_json(&s, argv[1]);
+            printf(",\"loop-stats\":");
+            do_showloopstats_fmt_json(&loop);
+            printf("}");
+            return 0;
+        default:
+            return -3; /* -3 = unsupported or unknown format */
+    }
+}
+
+static const char *const cpu_subsys_names[CPU_ACCT_COUNT] =
+{
+    [CPU_ACCT_RX] = "rx",
+    [CPU_ACCT_BPDU] = "bpdu",
+    [CPU_ACCT_SM] = "sm",
+    [CPU_ACCT_TIMERS] = "timers",
+    [CPU_ACCT_TX] = "tx",
+    [CPU_ACCT_NETLINK] = "netlink",
+    [CPU_ACCT_LOG] = "log",
+    [CPU_ACCT_CTL] = "control",
+};
+
+static void print_cpu_acct_plain(const char *title, const cpu_acct_t *a,
+                                 __u64 now)
+{
+    unsigned long long elapsed_us = (now - a->since) / 1000, total = 0;
+    int i;
+
+    for(i = 0; i < CPU_ACCT_COUNT; ++i)
+        total += a->ns[i] / 1000;
+    printf("%s, %llu.%03llu s\n", title, elapsed_us / 1000000,
+           elapsed_us / 1000 % 1000);
+    printf("  %-10s %-12s %-14s %-10s %s\n", "subsystem", "calls",
+           "total us", "avg us", "% of time");
+    for(i = 0; i < CPU_ACCT_COUNT; ++i)
+    {
+        unsigned long long us = a->ns[i] / 1000;
+        printf("  %-10s %-12llu %-14llu %-10llu %.3f\n", cpu_subsys_names[i],
+               a->calls[i], us, a->calls[i] ? us / a->calls[i] : 0,
+               elapsed_us ? 100.0 * us / elapsed_us : 0.0);
+    }
+    printf("  %-10s %-12s %-14llu %-10s %.3f\n", "total", "", total, "",
+           elapsed_us ? 100.0 * total / elapsed_us : 0.0);
+}
+
+static void print_cpu_acct_json(const char *name, const cpu_acct_t *a,
+                                 __u64 now)
+{
+    int i;
+
+    printf("\"%s\":{", name);
+    printf("\"elapsed-us\":\"%llu\"", (now - a->since) / 1000);
+    for(i = 0; i < CPU_ACCT_COUNT; ++i)
+    {
+        printf(",\"%s\":{", cpu_subsys_names[i]);
+        printf("\"calls\":\"%llu\",", a->calls[i]);
+        printf("\"total-us\":\"%llu\"", a->ns[i] / 1000);
+        printf("}");
+    }
+    printf("}");
+}
+
+static int cmd_showcpustats(int argc, char *const *argv)
+{
+    cpu_acct_t bridge, daemon;
+    __u64 now;
+    char title[IFNAMSIZ + 32];
+    int br_index = get_index(argv[1], "bridge");
+    if(0 > br_index)
+        return br_index;
+
+    if(CTL_get_cpu_stats(br_index, &bridge, &daemon, &now))
+        return -1;
+
+    switch(format)
+    {
+        case FORMAT_PLAIN:
+            snprintf(title, sizeof(title), "%s cpu stats", argv[1]);
+            print_cpu_acct_plain(title, &bridge, now);
+            print_cpu_acct_plain("not attributed to a bridge", &daemon, now);
+            return 0;
+        case FORMAT_JSON:
+            printf("{\"bridge\":\"%s\",", argv[1]);
+            print_cpu_acct_json("cpu", &bridge, now);
+            printf(",");
+            print_cpu_acct_json("daemon-cpu", &daemon, now);
+            printf("}");
+            return 0;
+        default:
+            return -3; /* -3 = unsupported or unknown format */
+    }
+}
+
+static int cmd_resetcpustats(int argc, char *const *argv)
+{
+    return CTL_reset_cpu_stats();
+}
+
 static int do_showmstconfid_fmt_plain(
                             const mst_configuration_identifier_t *cfgid,
                             const char *br_name)
@@ -2141,6 +3238,20 @@ static const struct command commands[] =
      "<bridge>", "Show MST ConfigId"},
     {1, 0, "showvid2mstid", cmd_showvid2mstid,
      "<bridge>", "Show VID-to-MSTID allocation table"},
+    {1, 0, "showallocstats", cmd_showallocstats,
+     "<bridge>", "Show memory used for trees and per-tree port data"},
+    {1, 0, "showtxslots", cmd_showtxslots,
+     "<bridge>", "Show BPDUs transmitted in each slot of the second"},
+    {1, 0, "showtickstats", cmd_showtickstats,
+     "<bridge>", "Show timer tick lateness and hello timeliness histograms"},
+    {0, 0, "showloopstats", cmd_showloopstats,
+     "", "Show time spent in the main loop per event source"},
+    {1, 0, "showstats", cmd_showstats,
+     "<bridge>", "Show how late mstpd is for the bridge (tick and loop stats)"},
+    {1, 0, "showcpustats", cmd_showcpustats,
+     "<bridge>", "Show CPU time spent per subsystem"},
+    {0, 0, "resetcpustats", cmd_resetcpustats,
+     "", "Reset the CPU time counters of all bridges"},
     /* Show global port */
     {1, 32, "showport", cmd_showport,
      "<bridge> [<port>...[port] [param]]", "Show port state for the CIST"},
@@ -2216,9 +3327,21 @@ static const struct command commands[] =
      "<bridge> <port> {yes|no}", "Disable/Enable sending BPDU"},
     {3, 0, "setportbpdufilter", cmd_setportbpdufilter,
      "<bridge> <port> {yes|no}", "Set BPDU filter state"},
+    {3, 0, "setportbpdurate", cmd_setportbpdurate,
+     "<bridge> <port> <rate>", "Set max BPDUs/s accepted on port (0 = any)"},
+    {3, 0, "setportbpduburst", cmd_setportbpduburst,
+     "<bridge> <port> <burst>", "Set BPDU burst allowed above the rate"},
+    {4, 254, "setportconfigs", cmd_setportconfigs,
+     "<bridge> <port> <option> <value> [<option> <value> ...]",
+     "Set several port options at once, options as in the port config file;"
+     " \"port <port>\" and \"mstid <mstid>\" select what follows"},
 
     /* Other */
     {1, 0, "debuglevel", cmd_debuglevel, "<level>", "Level of verbosity (1-4)"},
+    {1, 0, "dumptrace", cmd_dumptrace,
+     "<file>", "Save the state machine and BPDU trace to <file>"},
+    {1, 0, "showtrace", cmd_showtrace,
+     "<file>", "Decode trace file saved by dumptrace"},
 };
 
 static const struct command *command_lookup(const char *cmd)
@@ -2458,6 +3581,13 @@ int main(int argc, char *const *argv)
     if((argc == optind) && !batch_file)
         goto help;
 
+    /* Decoding a trace file does not need the daemon */
+    if(!batch_file && !strcmp(argv[optind], "showtrace"))
+    {
+        cmd = command_lookup_and_validate(argc - optind, argv + optind, 0);
+        return cmd ? cmd->func(argc - optind, argv + optind) : 1;
+    }
+
     if(ctl_client_init())
     {
         fprintf(stderr, "can't setup control connection\n");
@@ -2504,6 +3634,14 @@ CLIENT_SIDE_FUNCTION(set_mstconfid)
 CLIENT_SIDE_FUNCTION(get_vids2mstids)
 CLIENT_SIDE_FUNCTION(set_vid2mstid)
 CLIENT_SIDE_FUNCTION(set_vids2mstids)
+CLIENT_SIDE_FUNCTION(set_port_configs)
+CLIENT_SIDE_FUNCTION(get_trace)
+CLIENT_SIDE_FUNCTION(get_alloc_stats)
+CLIENT_SIDE_FUNCTION(get_tx_slot_stats)
+CLIENT_SIDE_FUNCTION(get_tick_stats)
+CLIENT_SIDE_FUNCTION(get_loop_stats)
+CLIENT_SIDE_FUNCTION(get_cpu_stats)
+CLIENT_SIDE_FUNCTION(reset_cpu_stats)
 
 CTL_DECLARE(add_bridges)
 {
@@ -29,7 +29,9 @@
 
 #include "ctl_socket_client.h"
 #include "epoll_loop.h"
+#include "cpu_acct.h"
 #include "log.h"
+#include "probes.h"
 
 static int server_socket(void)
 {
@@ -56,8 +58,8 @@ static int server_socket(void)
     return s;
 }
 
-static int handle_message(int cmd, void *inbuf, int lin,
-                          void *outbuf, int lout)
+static int dispatch_message(int cmd, void *inbuf, int lin,
+                            void *outbuf, int lout)
 {
     switch(cmd)
     {
@@ -79,6 +81,14 @@ static int handle_message(int cmd, void *inbuf, int lin,
         SERVER_MESSAGE_CASE(get_vids2mstids);
         SERVER_MESSAGE_CASE(set_vid2mstid);
         SERVER_MESSAGE_CASE(set_vids2mstids);
+        SERVER_MESSAGE_CASE(set_port_configs);
+        SERVER_MESSAGE_CASE(get_trace);
+        SERVER_MESSAGE_CASE(get_alloc_stats);
+        SERVER_MESSAGE_CASE(get_tx_slot_stats);
+        SERVER_MESSAGE_CASE(get_tick_stats);
+        SERVER_MESSAGE_CASE(get_loop_stats);
+        SERVER_MESSAGE_CASE(get_cpu_stats);
+        SERVER_MESSAGE_CASE(reset_cpu_stats);
 
         case CMD_CODE_add_bridges:
         {
@@ -171,6 +181,21 @@ bad_lin1:       LOG("Bad sizes: lin %d < %d", lin,
     }
 }
 
+static int handle_message(int cmd, void *inbuf, int lin,
+                          void *outbuf, int lout)
+{
+    cpu_acct_frame_t f;
+    int r;
+
+    /* Charged to the bridge by CTL_CHECK_BRIDGE, if there is one */
+    cpu_acct_enter(&f, NULL, CPU_ACCT_CTL);
+    PROBE(ctl_start, cmd);
+    r = dispatch_message(cmd, inbuf, lin, outbuf, lout);
+    PROBE(ctl_done, cmd, r);
+    cpu_acct_leave(&f);
+    return r;
+}
+
 int ctl_in_handler = 0;
 static unsigned char msg_logbuf[LOG_STRING_LEN];
 static unsigned int msg_log_offset;
@@ -197,7 +222,11 @@ void _ctl_err_log(char *fmt, ...)
 static unsigned char msg_inbuf[MSG_BUF_LEN];
 static unsigned char msg_outbuf[MSG_BUF_LEN];
 
-static void ctl_rcv_handler(uint32_t events, struct epoll_event_handler *p)
+/* Control requests handled per loop iteration */
+#define CTL_BUDGET 8
+
+/* Return false if there was no request */
+static bool ctl_rcv_one(int fd)
 {
     struct ctl_msg_hdr mhdr;
     struct msghdr msg;
@@ -217,8 +246,10 @@ static void ctl_rcv_handler(uint32_t events, struct epoll_event_handler *p)
     iov[1].iov_len = MSG_BUF_LEN;
     iov[2].iov_base = NULL;
     iov[2].iov_len = 0;
-    l = recvmsg(p->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
-    TST(l > 0,);
+    l = recvmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(0 > l && (EAGAIN == errno || EWOULDBLOCK == errno))
+        return false;
+    TST(l > 0, false);
     if((0 != msg.msg_flags) || (sizeof(mhdr) > l)
        || (l != sizeof(mhdr) + mhdr.lin)
        || (MSG_BUF_LEN < mhdr.lout)
@@ -226,7 +257,7 @@ static void ctl_rcv_handler(uint32_t events, struct epoll_event_handler *p)
       )
     {
         ERROR("CTL: Unexpected message. Ignoring");
-        return;
+        return true;
     }
 
     msg_log_offset = 0;
@@ -248,7 +279,7 @@ static void ctl_rcv_handler(uint32_t events, struct epoll_event_handler *p)
     iov[1].iov_len = mhdr.lout;
     iov[2].iov_base = msg_logbuf;
     iov[2].iov_len = mhdr.llog;
-    l = sendmsg(p->fd, &msg, MSG_NOSIGNAL);
+    l = sendmsg(fd, &msg, MSG_NOSIGNAL);
     if(0 > l)
         ERROR("CTL: Couldn't send response: %m");
     else if(l != sizeof(mhdr) + mhdr.lout + mhdr.llog)
@@ -260,6 +291,18 @@ static void ctl_rcv_handler(uint32_t events, struct epoll_event_handler *p)
 
     if(mhdr.cmd & RESPONSE_FIRST_HANDLE_LATER)
         handle_message(mhdr.cmd, msg_inbuf, mhdr.lin, msg_outbuf, mhdr.lout);
+    return true;
+}
+
+static void ctl_rcv_handler(uint32_t events, struct epoll_event_handler *p)
+{
+    unsigned int n;
+
+    for(n = 0; !p->budget || n < p->budget; ++n)
+    {
+        if(!ctl_rcv_one(p->fd))
+            break;
+    }
 }
 
 static struct epoll_event_handler ctl_handler = {0};
@@ -272,6 +315,8 @@ int ctl_socket_init(void)
 
     ctl_handler.fd = s;
     ctl_handler.handler = ctl_rcv_handler;
+    ctl_handler.prio = EPOLL_PRIO_CTL;
+    ctl_handler.budget = CTL_BUDGET;
 
     TST(add_epoll(&ctl_handler) == 0, -1);
     return 0;
@@ -29,18 +29,44 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <linux/types.h>
 
 #include "log.h"
 #include "epoll_loop.h"
 #include "bridge_ctl.h"
 #include "clock_gettime.h"
+#include "io_uring_loop.h"
 
 /* globals */
+loop_backend_t loop_backend = LOOP_BACKEND_EPOLL;
+unsigned int loop_latency_limit_ms;
 static int epoll_fd = -1;
-static struct timespec nexttimeout;
+/* The second is divided into timer_slots slots, see bridge_tick() */
+static unsigned int timer_slots = 1, cur_slot;
+static long slot_nsec = 1000000000;
+static struct epoll_event_handler timer_event;
+static __u64 next_expiry; /* ns, CLOCK_MONOTONIC */
+static epoll_loop_stats_t loop_stats;
 
 int init_epoll(void)
 {
+    if(LOOP_BACKEND_IO_URING == loop_backend)
+    {
+#ifdef HAVE_IO_URING_LOOP
+        if(0 == uring_init())
+        {
+            loop_stats.backend = loop_backend;
+            return 0;
+        }
+#else
+        ERROR("mstpd is built without io_uring support");
+#endif
+        INFO("Falling back to the epoll event loop");
+        loop_backend = LOOP_BACKEND_EPOLL;
+    }
+
     int r = epoll_create(128);
     if(r < 0)
     {
@@ -59,6 +85,10 @@ int add_epoll(struct epoll_event_handler *h)
         .data.ptr = h,
     };
     h->ref_ev = NULL;
+#ifdef HAVE_IO_URING_LOOP
+    if(LOOP_BACKEND_IO_URING == loop_backend)
+        return uring_add(h);
+#endif
     int r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->fd, &ev);
     if(r < 0)
     {
@@ -70,6 +100,10 @@ int add_epoll(struct epoll_event_handler *h)
 
 int remove_epoll(struct epoll_event_handler *h)
 {
+#ifdef HAVE_IO_URING_LOOP
+    if(LOOP_BACKEND_IO_URING == loop_backend)
+        return uring_remove(h);
+#endif
     int r = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->fd, NULL);
     if(r < 0)
     {
@@ -86,69 +120,248 @@ int remove_epoll(struct epoll_event_handler *h)
 
 void clear_epoll(void)
 {
+#ifdef HAVE_IO_URING_LOOP
+    uring_fini();
+#endif
     if(epoll_fd >= 0)
         close(epoll_fd);
 }
 
-static inline int time_diff(struct timespec *second, struct timespec *first)
+static inline __u64 timespec_ns(const struct timespec *ts)
+{
+    return (__u64)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+int loop_sendmsg(int fd, const struct msghdr *msg, int len,
+                 loop_send_error_t on_error)
+{
+#ifdef HAVE_IO_URING_LOOP
+    if(LOOP_BACKEND_IO_URING == loop_backend)
+        return uring_sendmsg(fd, msg, len, on_error);
+#endif
+    loop_account_io(1, 0);
+    return sendmsg(fd, msg, 0);
+}
+
+void loop_account_io(unsigned int syscalls, unsigned int packets)
+{
+    loop_stats.syscalls += syscalls;
+    loop_stats.packets += packets;
+}
+
+static const char *const prio_names[EPOLL_PRIO_COUNT] =
+{
+    [EPOLL_PRIO_TIMER] = "Timer",
+    [EPOLL_PRIO_BPDU] = "BPDU",
+    [EPOLL_PRIO_NETLINK] = "Netlink",
+    [EPOLL_PRIO_CTL] = "Control",
+};
+
+void loop_account_time(epoll_prio_t prio, const struct timespec *start)
+{
+    epoll_source_stats_t *st = &loop_stats.src[prio];
+    struct timespec now;
+    __u64 ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = timespec_ns(&now) - timespec_ns(start);
+    ++(st->calls);
+    st->time_ns += ns;
+    if(ns > st->max_ns)
+        st->max_ns = ns;
+    log2_hist_add(st->hist, ns / 1000);
+    if(loop_latency_limit_ms && (ns > loop_latency_limit_ms * 1000000ULL))
+    {
+        ++(loop_stats.latency_warnings);
+        INFO("%s handler ran for %llu us, limit is %u ms",
+             prio_names[prio], ns / 1000, loop_latency_limit_ms);
+    }
+}
+
+static inline void run_timeouts(__u64 deadline)
+{
+    bridge_tick(cur_slot, deadline);
+    if(++cur_slot >= timer_slots)
+        cur_slot = 0;
+}
+
+/* Do not catch up with more than that many seconds of missed ticks */
+#define MAX_CATCH_UP_SECONDS 4
+
+static void timer_rcv(uint32_t events, struct epoll_event_handler *h)
+{
+    uint64_t expirations, to_run;
+    struct timespec now;
+    __u64 now_ns, late, deadline;
+
+    if(read(h->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = timespec_ns(&now);
+
+    /* Lateness of the first of the expirations */
+    late = (now_ns > next_expiry) ? (now_ns - next_expiry) : 0;
+    deadline = next_expiry;
+    next_expiry += expirations * slot_nsec;
+    if(loop_latency_limit_ms && (late > loop_latency_limit_ms * 1000000ULL))
+    {
+        ++(loop_stats.latency_warnings);
+        INFO("Timer tick handled %llu us late, limit is %u ms",
+             late / 1000, loop_latency_limit_ms);
+    }
+
+    /* The protocol timers count seconds, so run the missed ticks
+     * back to back, unless we were stuck for a really long time */
+    to_run = expirations;
+    if(to_run > MAX_CATCH_UP_SECONDS * timer_slots)
+    {
+        INFO("Timer %llu ticks behind, skipping them",
+             (unsigned long long)(to_run - 1));
+        to_run = 1;
+    }
+    bridge_timer_account(late, expirations - 1, expirations - to_run);
+
+    /* The ticks run are the last to_run ones */
+    deadline += (expirations - to_run) * slot_nsec;
+    for(; to_run; --to_run, deadline += slot_nsec)
+        run_timeouts(deadline);
+}
+
+static int init_timer(void)
+{
+    struct itimerspec its;
+    struct timespec now;
+    int fd;
+
+    timer_slots = bridge_timer_slots();
+    if(timer_slots < 1)
+        timer_slots = 1;
+    slot_nsec = 1000000000 / timer_slots;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd < 0)
+    {
+        ERROR("timerfd_create failed: %m\n");
+        return -1;
+    }
+
+    /* First tick in a second, then one each slot */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    its.it_value.tv_sec = now.tv_sec + 1;
+    its.it_value.tv_nsec = now.tv_nsec;
+    its.it_interval.tv_sec = slot_nsec / 1000000000;
+    its.it_interval.tv_nsec = slot_nsec % 1000000000;
+    next_expiry = timespec_ns(&its.it_value);
+    if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    {
+        ERROR("timerfd_settime failed: %m\n");
+        close(fd);
+        return -1;
+    }
+
+    timer_event.fd = fd;
+    timer_event.arg = NULL;
+    timer_event.handler = timer_rcv;
+    timer_event.prio = EPOLL_PRIO_TIMER;
+    if(add_epoll(&timer_event))
+    {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+void epoll_get_loop_stats(epoll_loop_stats_t *stats)
 {
-    return (second->tv_sec - first->tv_sec) * 1000
-            + (second->tv_nsec - first->tv_nsec) / 1000000;
+    loop_stats.latency_limit_ms = loop_latency_limit_ms;
+    *stats = loop_stats;
 }
 
-static inline void run_timeouts(void)
+static inline void dispatch(struct epoll_event *ev)
 {
-    bridge_one_second();
-    ++(nexttimeout.tv_sec);
+    struct epoll_event_handler *p = ev->data.ptr;
+    struct timespec t0;
+
+    /* Handler may have been removed by the previous one */
+    if(!p || !p->handler)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    p->handler(ev->events, p);
+    loop_account_time(p->prio, &t0);
 }
 
+#ifdef HAVE_IO_URING_LOOP
+static int uring_main_loop(volatile bool *quit)
+{
+    while(!*quit)
+    {
+        int prio;
+
+        /* Do not sleep while there are bridge ports waiting to be added */
+        if(0 > uring_wait(!bridge_has_pending_ports()))
+            return -1;
+        ++(loop_stats.iterations);
+        for(prio = EPOLL_PRIO_COUNT - 1; prio >= 0; --prio)
+            uring_dispatch(prio);
+        bridge_add_pending_ports();
+    }
+    return 0;
+}
+#endif
+
 int epoll_main_loop(volatile bool *quit)
 {
-    clock_gettime(CLOCK_MONOTONIC, &nexttimeout);
-    ++(nexttimeout.tv_sec);
-#define EV_SIZE 8
+#define EV_SIZE 64
     struct epoll_event ev[EV_SIZE];
 
+    if(init_timer())
+        return -1;
+
+#ifdef HAVE_IO_URING_LOOP
+    if(LOOP_BACKEND_IO_URING == loop_backend)
+    {
+        int r = uring_main_loop(quit);
+        remove_epoll(&timer_event);
+        close(timer_event.fd);
+        return r;
+    }
+#endif
+
     while(!*quit)
     {
-        int r, i;
-        int timeout;
+        int r, i, prio;
+        int timeout = -1;
 
-        struct timespec tv;
-        clock_gettime(CLOCK_MONOTONIC, &tv);
-        timeout = time_diff(&nexttimeout, &tv);
-        if(timeout < 0 || timeout > 1000)
-        {
-            run_timeouts();
-            /*
-             * Check if system time has changed.
-             */
-            if(timeout < -4000 || timeout > 1000)
-            {
-                /* Most probably, system time has changed */
-                nexttimeout.tv_nsec = tv.tv_nsec;
-                nexttimeout.tv_sec = tv.tv_sec + 1;
-            }
+        /* Do not sleep while there are bridge ports waiting to be added */
+        if(bridge_has_pending_ports())
             timeout = 0;
-        }
 
+        loop_account_io(1, 0);
         r = epoll_wait(epoll_fd, ev, EV_SIZE, timeout);
         if(r < 0 && errno != EINTR)
         {
             ERROR("epoll_wait: %m\n");
             return -1;
         }
+        ++(loop_stats.iterations);
         for(i = 0; i < r; ++i)
         {
             struct epoll_event_handler *p = ev[i].data.ptr;
             if(p != NULL)
                 p->ref_ev = &ev[i];
         }
-        for (i = 0; i < r; ++i)
+        /* Each handler does at most its budget of work, so the protocol
+         * timers and BPDUs wait for at most one budget of netlink and
+         * control work per iteration */
+        for(prio = EPOLL_PRIO_COUNT - 1; prio >= 0; --prio)
         {
-            struct epoll_event_handler *p = ev[i].data.ptr;
-            if(p && p->handler)
-                p->handler(ev[i].events, p);
+            for(i = 0; i < r; ++i)
+            {
+                struct epoll_event_handler *p = ev[i].data.ptr;
+                if(p && p->prio == prio)
+                    dispatch(&ev[i]);
+            }
         }
         for (i = 0; i < r; ++i)
         {
@@ -156,7 +369,10 @@ int epoll_main_loop(volatile bool *quit)
             if(p != NULL)
                 p->ref_ev = NULL;
         }
+        bridge_add_pending_ports();
     }
 
+    remove_epoll(&timer_event);
+    close(timer_event.fd);
     return 0;
 }
@@ -28,9 +28,22 @@
 #define EPOLL_LOOP_H
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <sys/time.h>
 
+#include "log2_hist.h"
+
+/* Ready sources are dispatched in the order of decreasing priority */
+typedef enum
+{
+    EPOLL_PRIO_CTL,     /* control socket, config watch; the default */
+    EPOLL_PRIO_NETLINK, /* netlink notifications */
+    EPOLL_PRIO_BPDU,    /* BPDU rx/tx */
+    EPOLL_PRIO_TIMER,   /* protocol timers */
+    EPOLL_PRIO_COUNT
+} epoll_prio_t;
+
 struct epoll_event_handler
 {
     int fd;
@@ -38,8 +51,72 @@ struct epoll_event_handler
     void (*handler) (uint32_t events, struct epoll_event_handler * p);
     struct epoll_event *ref_ev; /* if set, epoll loop has reference to this,
                                    so mark that ref as NULL while freeing */
+    epoll_prio_t prio;
+    /* Max units of work (messages, packets) the handler does per call,
+     * whatever is left waits for the next loop iteration. 0 = no limit */
+    unsigned int budget;
+    /* Optional, for datagram sockets. With the io_uring backend the loop
+     * receives the datagrams itself and passes each one here instead of
+     * calling handler. rx_size is the largest datagram, rx_from_len the
+     * size of the sender address to receive. msg_flags as of recvmsg() */
+    void (*recv_handler) (struct epoll_event_handler *p, void *data, int len,
+                          int msg_flags, const void *from,
+                          unsigned int from_len);
+    unsigned int rx_size, rx_from_len;
 };
 
+/* Event loop backends */
+typedef enum
+{
+    LOOP_BACKEND_EPOLL,
+    LOOP_BACKEND_IO_URING, /* see io_uring_loop.c */
+} loop_backend_t;
+
+/* Backend to use, must be set before init_epoll() */
+extern loop_backend_t loop_backend;
+
+/* Warn when the tick is handled, or a handler runs, for longer than that
+ * many ms. 0 disables the check. */
+extern unsigned int loop_latency_limit_ms;
+
+/* Called with the errno of a send that failed after loop_sendmsg()
+ * returned, and the message (only its msg_name is meaningful) */
+typedef void (*loop_send_error_t)(const struct msghdr *msg, int err);
+
+/* Send a datagram on a socket of the loop. With the io_uring backend the
+ * send is queued and submitted together with the others at the end of the
+ * loop iteration; the result is then len and errors are reported later
+ * to on_error. Otherwise returns what sendmsg() does. */
+int loop_sendmsg(int fd, const struct msghdr *msg, int len,
+                 loop_send_error_t on_error);
+
+/* Count syscalls and packets of the protocol traffic, for comparing
+ * the backends */
+void loop_account_io(unsigned int syscalls, unsigned int packets);
+
+/* Time spent in the handlers of one priority */
+typedef struct
+{
+    unsigned long long calls;
+    unsigned long long time_ns, max_ns;
+    unsigned long long hist[LOG2_HIST_BUCKETS]; /* time per call, us */
+} epoll_source_stats_t;
+
+typedef struct
+{
+    loop_backend_t backend;
+    unsigned long long iterations;
+    unsigned long long syscalls, packets; /* see loop_account_io() */
+    unsigned int latency_limit_ms;
+    unsigned long long latency_warnings; /* see loop_latency_limit_ms */
+    epoll_source_stats_t src[EPOLL_PRIO_COUNT];
+} epoll_loop_stats_t;
+
+void epoll_get_loop_stats(epoll_loop_stats_t *stats);
+
+/* For the backends: account the time since start to the handlers of prio */
+void loop_account_time(epoll_prio_t prio, const struct timespec *start);
+
 int init_epoll(void);
 
 void clear_epoll(void);
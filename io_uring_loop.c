@@ -0,0 +1,697 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+/*
+ * io_uring backend of the event loop.
+ * Sources with a recv_handler (packet and netlink sockets) get a multishot
+ * recvmsg into a group of provided buffers, so a datagram costs no syscall
+ * at all. The other sources get a one-shot poll, re-armed after their
+ * handler has run, which keeps the level-triggered behaviour of epoll (and
+ * so the work budgets). Sends are queued and submitted in one
+ * io_uring_enter() together with the re-arms, which is also the one that
+ * waits for the next completions.
+ * The ring is driven by raw syscalls, no liburing needed.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "io_uring_loop.h"
+#include "log.h"
+
+#ifdef HAVE_IO_URING_LOOP
+
+#define URING_ENTRIES       256
+#define URING_BATCH         64  /* completions handled per loop iteration */
+#define URING_MAX_SOURCES   32
+#define URING_TX_SLOTS      128
+#define URING_TX_SIZE       2048
+#define URING_RX_BUFS       64  /* provided buffers per receiving source */
+#define URING_TX_PENDING_MAX 1024 /* sends waiting for a free tx slot */
+
+/* What a request is, kept in the lowest byte of its user_data */
+enum
+{
+    URING_OP_POLL = 1,
+    URING_OP_RECV,
+    URING_OP_PROVIDE,
+    URING_OP_TX,
+    URING_OP_CANCEL,
+};
+
+#define URING_UD(_op, _idx, _gen) \
+    ((__u64)(_op) | ((__u64)(_idx) << 8) | ((__u64)(_gen) << 32))
+#define URING_UD_OP(_ud)    ((unsigned int)((_ud) & 0xff))
+#define URING_UD_IDX(_ud)   ((unsigned int)(((_ud) >> 8) & 0xffffff))
+#define URING_UD_GEN(_ud)   ((unsigned int)((_ud) >> 32))
+
+typedef struct
+{
+    struct epoll_event_handler *h; /* NULL = free slot */
+    unsigned int gen; /* bumped on removal, stale completions are ignored */
+    bool armed;
+    /* Receiving sources only */
+    struct msghdr msg; /* template for the multishot recvmsg */
+    unsigned char *bufs;
+    unsigned int buf_size;
+} uring_source_t;
+
+typedef struct
+{
+    bool busy;
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    int len;
+    loop_send_error_t on_error;
+    unsigned char data[URING_TX_SIZE];
+} uring_tx_slot_t;
+
+/* A send which found no free tx slot or sqe (or is too big for a slot).
+ * Pending sends go out in order and before any newer one, so that the
+ * BPDUs of a port are never reordered. */
+typedef struct uring_tx_pending_s
+{
+    struct uring_tx_pending_s *next;
+    int fd;
+    int len;
+    loop_send_error_t on_error;
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    unsigned char data[];
+} uring_tx_pending_t;
+
+static int ring_fd = -1;
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int sq_entries, sq_local_tail, sq_to_submit;
+static struct io_uring_sqe *sqes;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static void *ring_ptr; /* sq and cq ring share the mapping */
+static size_t ring_size, sqes_size;
+
+static uring_source_t sources[URING_MAX_SOURCES];
+static uring_tx_slot_t *tx_slots;
+static unsigned int tx_busy; /* number of busy tx slots */
+static uring_tx_pending_t *tx_pending, **tx_pending_tail = &tx_pending;
+static unsigned int tx_num_pending;
+
+static struct io_uring_cqe batch[URING_BATCH];
+static int batch_len;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int uring_submit(bool wait)
+{
+    int r;
+
+    loop_account_io(1, 0);
+    r = sys_io_uring_enter(sq_to_submit, wait ? 1 : 0,
+                           wait ? IORING_ENTER_GETEVENTS : 0);
+    if(r < 0)
+    {
+        if(EINTR == errno || EBUSY == errno || EAGAIN == errno)
+            return 0;
+        ERROR("io_uring_enter failed: %m");
+        return -1;
+    }
+    sq_to_submit -= r;
+    return 0;
+}
+
+/* Zeroed sqe, to be filled and then committed with sqe_commit() */
+static struct io_uring_sqe *get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if(sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)
+       >= sq_entries)
+    {
+        /* Ring is full, push it to the kernel */
+        if(uring_submit(false) || (sq_local_tail
+               - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries))
+            return NULL;
+    }
+    sqe = &sqes[sq_local_tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void sqe_commit(void)
+{
+    unsigned int idx = sq_local_tail & *sq_mask;
+
+    sq_array[idx] = idx;
+    ++sq_local_tail;
+    ++sq_to_submit;
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static int provide_buffers(unsigned int idx, unsigned int bid,
+                           unsigned int count)
+{
+    uring_source_t *src = &sources[idx];
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if(!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (unsigned long)(src->bufs + (size_t)bid * src->buf_size);
+    sqe->len = src->buf_size;
+    sqe->off = bid;
+    sqe->buf_group = idx;
+    sqe->user_data = URING_UD(URING_OP_PROVIDE, idx, src->gen);
+    sqe_commit();
+    return 0;
+}
+
+static int arm_source(unsigned int idx)
+{
+    uring_source_t *src = &sources[idx];
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if(!sqe)
+        return -1;
+    sqe->fd = src->h->fd;
+    if(src->bufs)
+    {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (unsigned long)&src->msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = idx;
+        sqe->user_data = URING_UD(URING_OP_RECV, idx, src->gen);
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = URING_UD(URING_OP_POLL, idx, src->gen);
+    }
+    sqe_commit();
+    src->armed = true;
+    return 0;
+}
+
+int uring_init(void)
+{
+    struct io_uring_params p;
+    size_t cq_size;
+
+    memset(&p, 0, sizeof(p));
+    /* SINGLE_ISSUER also makes sure the kernel is new enough (6.0) for
+     * the multishot recvmsg */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN
+              | IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * URING_ENTRIES;
+    ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if(ring_fd < 0)
+    {
+        ERROR("io_uring_setup failed: %m");
+        return -1;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)
+       || !(p.features & IORING_FEAT_NODROP))
+    {
+        ERROR("io_uring of this kernel is too old");
+        goto err_close;
+    }
+
+    ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(cq_size > ring_size)
+        ring_size = cq_size;
+    ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == ring_ptr)
+    {
+        ERROR("io_uring mmap failed: %m");
+        goto err_close;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if(MAP_FAILED == sqes)
+    {
+        ERROR("io_uring mmap failed: %m");
+        goto err_unmap;
+    }
+
+    sq_head = ring_ptr + p.sq_off.head;
+    sq_tail = ring_ptr + p.sq_off.tail;
+    sq_mask = ring_ptr + p.sq_off.ring_mask;
+    sq_array = ring_ptr + p.sq_off.array;
+    sq_entries = p.sq_entries;
+    sq_local_tail = *sq_tail;
+    cq_head = ring_ptr + p.cq_off.head;
+    cq_tail = ring_ptr + p.cq_off.tail;
+    cq_mask = ring_ptr + p.cq_off.ring_mask;
+    cqes = ring_ptr + p.cq_off.cqes;
+
+    tx_slots = calloc(URING_TX_SLOTS, sizeof(*tx_slots));
+    if(!tx_slots)
+    {
+        ERROR("Out of memory for io_uring tx slots");
+        goto err_unmap_sqes;
+    }
+    INFO("Using io_uring event loop");
+    return 0;
+
+err_unmap_sqes:
+    munmap(sqes, sqes_size);
+err_unmap:
+    munmap(ring_ptr, ring_size);
+err_close:
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+void uring_fini(void)
+{
+    unsigned int i;
+
+    if(ring_fd < 0)
+        return;
+    munmap(sqes, sqes_size);
+    munmap(ring_ptr, ring_size);
+    /* Kernel lets go of all the buffers with the ring */
+    close(ring_fd);
+    ring_fd = -1;
+    for(i = 0; i < URING_MAX_SOURCES; ++i)
+    {
+        free(sources[i].bufs);
+        sources[i].bufs = NULL;
+    }
+    free(tx_slots);
+    tx_slots = NULL;
+    tx_busy = 0;
+    while(tx_pending)
+    {
+        uring_tx_pending_t *p = tx_pending;
+        tx_pending = p->next;
+        free(p);
+    }
+    tx_pending_tail = &tx_pending;
+    tx_num_pending = 0;
+}
+
+int uring_add(struct epoll_event_handler *h)
+{
+    unsigned int idx;
+    uring_source_t *src;
+
+    for(idx = 0; idx < URING_MAX_SOURCES; ++idx)
+        if(!sources[idx].h && !sources[idx].bufs)
+            break;
+    if(URING_MAX_SOURCES == idx)
+    {
+        ERROR("Too many io_uring event sources");
+        return -1;
+    }
+    src = &sources[idx];
+    src->h = h;
+    src->armed = false;
+
+    if(h->recv_handler)
+    {
+        /* Buffer = io_uring_recvmsg_out + sender address + datagram */
+        src->buf_size = sizeof(struct io_uring_recvmsg_out) + h->rx_from_len
+                        + h->rx_size;
+        src->bufs = malloc((size_t)src->buf_size * URING_RX_BUFS);
+        if(!src->bufs)
+        {
+            ERROR("Out of memory for io_uring buffers");
+            src->h = NULL;
+            return -1;
+        }
+        memset(&src->msg, 0, sizeof(src->msg));
+        src->msg.msg_namelen = h->rx_from_len;
+        if(provide_buffers(idx, 0, URING_RX_BUFS))
+            return -1;
+    }
+    return arm_source(idx);
+}
+
+int uring_remove(struct epoll_event_handler *h)
+{
+    unsigned int idx;
+    uring_source_t *src;
+    struct io_uring_sqe *sqe;
+
+    for(idx = 0; idx < URING_MAX_SOURCES; ++idx)
+        if(sources[idx].h == h)
+            break;
+    if(URING_MAX_SOURCES == idx)
+        return -1;
+    src = &sources[idx];
+
+    if(src->armed && (sqe = get_sqe()))
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_UD(src->bufs ? URING_OP_RECV : URING_OP_POLL,
+                             idx, src->gen);
+        sqe->user_data = URING_UD(URING_OP_CANCEL, idx, src->gen);
+        sqe_commit();
+    }
+    /* The buffers (if any) stay with the slot: kernel may still hold
+     * some of them. They are freed by uring_fini(). */
+    src->h = NULL;
+    ++(src->gen);
+    return 0;
+}
+
+static size_t msg_size(const struct msghdr *msg)
+{
+    size_t size = 0;
+    unsigned int i;
+
+    for(i = 0; i < msg->msg_iovlen; ++i)
+        size += msg->msg_iov[i].iov_len;
+    return size;
+}
+
+/* Queue the send in a tx slot. Returns false if there is no room */
+static bool tx_queue(int fd, const struct msghdr *msg, int len,
+                     loop_send_error_t on_error)
+{
+    uring_tx_slot_t *slot = NULL;
+    struct io_uring_sqe *sqe;
+    unsigned int i;
+    size_t off;
+
+    if(msg_size(msg) > URING_TX_SIZE)
+        return false;
+    for(i = 0; i < URING_TX_SLOTS; ++i)
+        if(!tx_slots[i].busy)
+        {
+            slot = &tx_slots[i];
+            break;
+        }
+    if(!slot || !(sqe = get_sqe()))
+        return false;
+
+    for(i = 0, off = 0; i < msg->msg_iovlen; ++i)
+    {
+        memcpy(slot->data + off, msg->msg_iov[i].iov_base,
+               msg->msg_iov[i].iov_len);
+        off += msg->msg_iov[i].iov_len;
+    }
+    memcpy(&slot->addr, msg->msg_name, msg->msg_namelen);
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = off;
+    memset(&slot->msg, 0, sizeof(slot->msg));
+    slot->msg.msg_name = &slot->addr;
+    slot->msg.msg_namelen = msg->msg_namelen;
+    slot->msg.msg_iov = &slot->iov;
+    slot->msg.msg_iovlen = 1;
+    slot->len = len;
+    slot->on_error = on_error;
+    slot->busy = true;
+    ++tx_busy;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&slot->msg;
+    sqe->len = 1;
+    sqe->user_data = URING_UD(URING_OP_TX, slot - tx_slots, 0);
+    sqe_commit();
+    return true;
+}
+
+/* Send synchronously, only when nothing queued before it is in flight */
+static void tx_send_now(int fd, const struct msghdr *msg,
+                        loop_send_error_t on_error)
+{
+    loop_account_io(1, 0);
+    if((0 > sendmsg(fd, msg, 0)) && on_error)
+        on_error(msg, errno);
+}
+
+/* Move the pending sends, oldest first, to the tx slots */
+static void tx_drain(void)
+{
+    uring_tx_pending_t *p;
+
+    while((p = tx_pending))
+    {
+        if(msg_size(&p->msg) > URING_TX_SIZE)
+        {
+            if(tx_busy)
+                break;
+            tx_send_now(p->fd, &p->msg, p->on_error);
+        }
+        else if(!tx_queue(p->fd, &p->msg, p->len, p->on_error))
+            break;
+        if(!(tx_pending = p->next))
+            tx_pending_tail = &tx_pending;
+        --tx_num_pending;
+        free(p);
+    }
+}
+
+int uring_sendmsg(int fd, const struct msghdr *msg, int len,
+                  loop_send_error_t on_error)
+{
+    uring_tx_pending_t *p;
+    size_t size = msg_size(msg);
+    unsigned int i;
+    size_t off;
+
+    if(msg->msg_namelen > sizeof(p->addr))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(!tx_pending)
+    {
+        if(tx_queue(fd, msg, len, on_error))
+            return len;
+        /* Too big for a slot, but nothing to overtake */
+        if((size > URING_TX_SIZE) && !tx_busy)
+        {
+            loop_account_io(1, 0);
+            return sendmsg(fd, msg, 0);
+        }
+    }
+
+    /* Wait for a free slot behind the sends queued before */
+    if((URING_TX_PENDING_MAX <= tx_num_pending)
+       || !(p = malloc(sizeof(*p) + size)))
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    for(i = 0, off = 0; i < msg->msg_iovlen; ++i)
+    {
+        memcpy(p->data + off, msg->msg_iov[i].iov_base,
+               msg->msg_iov[i].iov_len);
+        off += msg->msg_iov[i].iov_len;
+    }
+    memcpy(&p->addr, msg->msg_name, msg->msg_namelen);
+    p->iov.iov_base = p->data;
+    p->iov.iov_len = size;
+    memset(&p->msg, 0, sizeof(p->msg));
+    p->msg.msg_name = &p->addr;
+    p->msg.msg_namelen = msg->msg_namelen;
+    p->msg.msg_iov = &p->iov;
+    p->msg.msg_iovlen = 1;
+    p->fd = fd;
+    p->len = len;
+    p->on_error = on_error;
+    p->next = NULL;
+    *tx_pending_tail = p;
+    tx_pending_tail = &p->next;
+    ++tx_num_pending;
+    return len;
+}
+
+static void tx_complete(const struct io_uring_cqe *cqe)
+{
+    unsigned int idx = URING_UD_IDX(cqe->user_data);
+    uring_tx_slot_t *slot;
+
+    if(idx >= URING_TX_SLOTS)
+        return;
+    slot = &tx_slots[idx];
+    if(cqe->res < 0)
+    {
+        if(slot->on_error)
+            slot->on_error(&slot->msg, -cqe->res);
+        else if(-EWOULDBLOCK != cqe->res)
+            ERROR("send failed: %s", strerror(-cqe->res));
+    }
+    else if(cqe->res != slot->len)
+        ERROR("short write in sendmsg: %d instead of %d", cqe->res,
+              slot->len);
+    slot->busy = false;
+    --tx_busy;
+}
+
+int uring_wait(bool wait)
+{
+    unsigned int head, tail;
+
+    tx_drain();
+    /* Collect what is already there before going to sleep */
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if((head == tail) || sq_to_submit)
+    {
+        if(uring_submit(wait && (head == tail)))
+            return -1;
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    batch_len = 0;
+    while((head != tail) && (batch_len < URING_BATCH))
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        ++head;
+        switch(URING_UD_OP(cqe->user_data))
+        {
+            case URING_OP_TX:
+                tx_complete(cqe);
+                break;
+            case URING_OP_PROVIDE:
+                if(cqe->res < 0)
+                    ERROR("io_uring provide buffers failed: %s",
+                          strerror(-cqe->res));
+                break;
+            case URING_OP_CANCEL:
+                break;
+            default:
+                batch[batch_len++] = *cqe;
+        }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    /* Slots freed by the completions, queued now, submitted next time */
+    tx_drain();
+    return batch_len;
+}
+
+static void recv_complete(unsigned int idx, uring_source_t *src,
+                          const struct io_uring_cqe *cqe)
+{
+    struct epoll_event_handler *h = src->h;
+    struct io_uring_recvmsg_out *out;
+    unsigned char *buf, *payload;
+    unsigned int bid, len, namelen;
+    size_t hdr_len = sizeof(*out) + src->msg.msg_namelen
+                     + src->msg.msg_controllen;
+
+    if(!(cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        if(-ENOBUFS != cqe->res)
+            ERROR("io_uring recvmsg failed: %s", strerror(-cqe->res));
+        return;
+    }
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = src->bufs + (size_t)bid * src->buf_size;
+
+    if(cqe->res >= (int)hdr_len)
+    {
+        struct timespec t0;
+        out = (struct io_uring_recvmsg_out *)buf;
+        payload = buf + hdr_len;
+        /* With MSG_TRUNC payloadlen/namelen are the full lengths, which
+         * may exceed what was copied into the buffer */
+        len = cqe->res - hdr_len;
+        if(out->payloadlen < len)
+            len = out->payloadlen;
+        namelen = out->namelen;
+        if(namelen > src->msg.msg_namelen)
+            namelen = src->msg.msg_namelen;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        h->recv_handler(h, payload, len, out->flags,
+                        buf + sizeof(*out), namelen);
+        loop_account_time(h->prio, &t0);
+    }
+    provide_buffers(idx, bid, 1);
+}
+
+void uring_dispatch(epoll_prio_t prio)
+{
+    int i;
+
+    for(i = 0; i < batch_len; ++i)
+    {
+        struct io_uring_cqe *cqe = &batch[i];
+        unsigned int idx = URING_UD_IDX(cqe->user_data);
+        uring_source_t *src;
+
+        if(idx >= URING_MAX_SOURCES)
+            continue;
+        src = &sources[idx];
+        /* Source has been removed, maybe by a handler in this batch */
+        if(!src->h || (src->gen != URING_UD_GEN(cqe->user_data)))
+            continue;
+        if(src->h->prio != prio)
+            continue;
+
+        switch(URING_UD_OP(cqe->user_data))
+        {
+            case URING_OP_RECV:
+                recv_complete(idx, src, cqe);
+                if(src->h && !(cqe->flags & IORING_CQE_F_MORE)
+                   && (src->gen == URING_UD_GEN(cqe->user_data)))
+                    arm_source(idx); /* multishot has ended */
+                break;
+            case URING_OP_POLL:
+                src->armed = false;
+                if(cqe->res < 0)
+                    ERROR("io_uring poll failed: %s", strerror(-cqe->res));
+                else if(src->h->handler)
+                {
+                    struct timespec t0;
+                    clock_gettime(CLOCK_MONOTONIC, &t0);
+                    src->h->handler(cqe->res, src->h);
+                    loop_account_time(prio, &t0);
+                }
+                /* Handler may have removed (or replaced) the source */
+                if(src->h && (src->gen == URING_UD_GEN(cqe->user_data)))
+                    arm_source(idx);
+                break;
+        }
+    }
+}
+
+#endif /* HAVE_IO_URING_LOOP */
@@ -0,0 +1,52 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#ifndef IO_URING_LOOP_H
+#define IO_URING_LOOP_H
+
+#include <stdbool.h>
+
+#include "epoll_loop.h"
+
+/* Multishot receives need the headers of Linux 6.0 or later */
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING_LOOP 1
+#endif
+#endif
+
+/* The io_uring backend of the event loop, used by epoll_loop.c only */
+#ifdef HAVE_IO_URING_LOOP
+/* Returns -1 if the kernel can't do what we need */
+int uring_init(void);
+void uring_fini(void);
+int uring_add(struct epoll_event_handler *h);
+int uring_remove(struct epoll_event_handler *h);
+int uring_sendmsg(int fd, const struct msghdr *msg, int len,
+                  loop_send_error_t on_error);
+/* Submit the queued requests, wait for a completion if wait is set and
+ * collect a batch of completions. Returns -1 on error. */
+int uring_wait(bool wait);
+/* Dispatch the collected completions of the sources of prio */
+void uring_dispatch(epoll_prio_t prio);
+#endif /* HAVE_IO_URING_LOOP */
+
+#endif /* IO_URING_LOOP_H */
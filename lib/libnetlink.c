@@ -1187,12 +1187,59 @@ int rtnl_listen_all_nsid(struct rtnl_handle *rth)
 	return 0;
 }
 
+static int rtnl_parse_datagram(struct rtnl_ctrl_data *ctrl,
+			       char *buf, int status, int msg_flags,
+			       rtnl_listen_filter_t handler, void *jarg)
+{
+	struct nlmsghdr *h;
+
+	for (h = (struct nlmsghdr *)buf; status >= sizeof(*h); ) {
+		int err;
+		int len = h->nlmsg_len;
+		int l = len - sizeof(*h);
+
+		if (l < 0 || len > status) {
+			if (msg_flags & MSG_TRUNC) {
+				ERROR("Truncated message");
+				return -1;
+			}
+			ERROR("!!!malformed message: len=%d", len);
+			exit(1);
+		}
+
+		err = handler(ctrl, h, jarg);
+		if (err < 0)
+			return err;
+
+		status -= NLMSG_ALIGN(len);
+		h = (struct nlmsghdr *)((char *)h + NLMSG_ALIGN(len));
+	}
+	if (msg_flags & MSG_TRUNC) {
+		ERROR("Message truncated");
+		return 0;
+	}
+	if (status) {
+		ERROR("!!!Remnant of size %d", status);
+		exit(1);
+	}
+	return 0;
+}
+
 int rtnl_listen(struct rtnl_handle *rtnl,
 		rtnl_listen_filter_t handler,
 		void *jarg)
 {
-	int status;
-	struct nlmsghdr *h;
+	return rtnl_listen_budget(rtnl, handler, jarg, 0);
+}
+
+/* Like rtnl_listen(), but return after reading budget datagrams
+ * (0 = no limit) */
+int rtnl_listen_budget(struct rtnl_handle *rtnl,
+		       rtnl_listen_filter_t handler,
+		       void *jarg, unsigned int budget)
+{
+	unsigned int received = 0;
+	int status, err;
 	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
 	struct iovec iov;
 	struct msghdr msg = {
@@ -1209,6 +1256,9 @@ int rtnl_listen(struct rtnl_handle *rtnl,
 		struct rtnl_ctrl_data ctrl;
 		struct cmsghdr *cmsg;
 
+		if (budget && received++ >= budget)
+			return 0;
+
 		if (rtnl->flags & RTNL_HANDLE_F_LISTEN_ALL_NSID) {
 			msg.msg_control = &cmsgbuf;
 			msg.msg_controllen = sizeof(cmsgbuf);
@@ -1252,36 +1302,21 @@ int rtnl_listen(struct rtnl_handle *rtnl,
 				}
 		}
 
-		for (h = (struct nlmsghdr *)buf; status >= sizeof(*h); ) {
-			int err;
-			int len = h->nlmsg_len;
-			int l = len - sizeof(*h);
-
-			if (l < 0 || len > status) {
-				if (msg.msg_flags & MSG_TRUNC) {
-					ERROR("Truncated message");
-					return -1;
-				}
-				ERROR("!!!malformed message: len=%d", len);
-				exit(1);
-			}
+		err = rtnl_parse_datagram(&ctrl, buf, status, msg.msg_flags,
+					  handler, jarg);
+		if (err < 0)
+			return err;
+	}
+}
 
-			err = handler(&ctrl, h, jarg);
-			if (err < 0)
-				return err;
+/* Pass the messages of one datagram received by somebody else
+ * (the io_uring event loop) to handler */
+int rtnl_listen_buf(void *buf, int len, int msg_flags,
+		    rtnl_listen_filter_t handler, void *jarg)
+{
+	struct rtnl_ctrl_data ctrl = { .nsid = -1 };
 
-			status -= NLMSG_ALIGN(len);
-			h = (struct nlmsghdr *)((char *)h + NLMSG_ALIGN(len));
-		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			ERROR("Message truncated");
-			continue;
-		}
-		if (status) {
-			ERROR("!!!Remnant of size %d", status);
-			exit(1);
-		}
-	}
+	return rtnl_parse_datagram(&ctrl, buf, len, msg_flags, handler, jarg);
 }
 
 int rtnl_from_file(FILE *rtnl, rtnl_listen_filter_t handler,
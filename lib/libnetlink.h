@@ -304,6 +304,10 @@ static inline int rta_type(const struct rtattr *rta)
 int rtnl_listen_all_nsid(struct rtnl_handle *);
 int rtnl_listen(struct rtnl_handle *, rtnl_listen_filter_t handler,
 		void *jarg);
+int rtnl_listen_budget(struct rtnl_handle *, rtnl_listen_filter_t handler,
+		       void *jarg, unsigned int budget);
+int rtnl_listen_buf(void *buf, int len, int msg_flags,
+		    rtnl_listen_filter_t handler, void *jarg);
 int rtnl_from_file(FILE *, rtnl_listen_filter_t handler,
 		   void *jarg);
 
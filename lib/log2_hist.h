@@ -0,0 +1,41 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#ifndef LOG2_HIST_H
+#define LOG2_HIST_H
+
+/* Histogram with power of two buckets: bucket 0 counts zeros, bucket i
+ * counts values in [2^(i-1), 2^i), the last bucket also counts all above.
+ */
+#define LOG2_HIST_BUCKETS 24
+static inline void log2_hist_add(unsigned long long *hist,
+                                 unsigned long long value)
+{
+    unsigned int b = value ? (64 - __builtin_clzll(value)) : 0;
+    if(b >= LOG2_HIST_BUCKETS)
+        b = LOG2_HIST_BUCKETS - 1;
+    ++hist[b];
+}
+
+/* Lower and upper bound of bucket b */
+#define LOG2_HIST_LOW(_b)   ((_b) ? (1ull << ((_b) - 1)) : 0ull)
+#define LOG2_HIST_HIGH(_b)  ((_b) ? ((1ull << (_b)) - 1) : 0ull)
+
+#endif /* LOG2_HIST_H */
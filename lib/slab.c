@@ -0,0 +1,147 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define SLAB_ALIGN  64 /* chunks and objects start on a cache line */
+
+typedef struct
+{
+    struct list_head list; /* anchor in slab's list of chunks */
+    unsigned int num_objs;
+    unsigned int used;     /* objects carved so far */
+} slab_chunk_t;
+
+#define SLAB_CHUNK_HDR  \
+    ((sizeof(slab_chunk_t) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+void slab_init(slab_t *slab, size_t obj_size, unsigned int chunk_objs,
+               slab_stats_t *stats)
+{
+    /* Keep neighbours off each other's cache lines where it is cheap,
+     * otherwise just align to the pointer stored in free objects */
+    if(obj_size >= SLAB_ALIGN)
+        obj_size = (obj_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    else
+        obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    slab->obj_size = obj_size;
+    slab->first_chunk_objs = chunk_objs ? chunk_objs : 1;
+    slab->next_chunk_objs = slab->first_chunk_objs;
+    INIT_LIST_HEAD(&slab->chunks);
+    slab->free_list = NULL;
+    slab->in_use = 0;
+    slab->stats = stats;
+}
+
+static slab_chunk_t *slab_new_chunk(slab_t *slab)
+{
+    slab_chunk_t *chunk;
+    size_t size = SLAB_CHUNK_HDR + slab->obj_size * slab->next_chunk_objs;
+
+    if(posix_memalign((void **)&chunk, SLAB_ALIGN, size))
+        return NULL;
+    chunk->num_objs = slab->next_chunk_objs;
+    chunk->used = 0;
+    list_add_tail(&chunk->list, &slab->chunks);
+    if(slab->stats)
+    {
+        ++slab->stats->chunks;
+        slab->stats->capacity += chunk->num_objs;
+        slab->stats->bytes += size;
+    }
+    if(slab->next_chunk_objs < SLAB_MAX_CHUNK_OBJS)
+    {
+        slab->next_chunk_objs *= 2;
+        if(slab->next_chunk_objs > SLAB_MAX_CHUNK_OBJS)
+            slab->next_chunk_objs = SLAB_MAX_CHUNK_OBJS;
+    }
+    return chunk;
+}
+
+void *slab_alloc(slab_t *slab)
+{
+    slab_chunk_t *chunk;
+    void *obj;
+
+    if((obj = slab->free_list))
+        slab->free_list = *(void **)obj;
+    else
+    {
+        chunk = list_empty(&slab->chunks) ? NULL
+                : list_entry(slab->chunks.prev, slab_chunk_t, list);
+        if(!chunk || (chunk->used == chunk->num_objs))
+        {
+            if(!(chunk = slab_new_chunk(slab)))
+                return NULL;
+        }
+        obj = (char *)chunk + SLAB_CHUNK_HDR
+              + slab->obj_size * chunk->used++;
+    }
+
+    memset(obj, 0, slab->obj_size);
+    ++slab->in_use;
+    if(slab->stats)
+    {
+        ++slab->stats->in_use;
+        ++slab->stats->allocs;
+    }
+    return obj;
+}
+
+void slab_free(slab_t *slab, void *obj)
+{
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    --slab->in_use;
+    if(slab->stats)
+    {
+        --slab->stats->in_use;
+        ++slab->stats->frees;
+    }
+}
+
+void slab_destroy(slab_t *slab)
+{
+    slab_chunk_t *chunk, *nxt;
+
+    list_for_each_entry_safe(chunk, nxt, &slab->chunks, list)
+    {
+        if(slab->stats)
+        {
+            --slab->stats->chunks;
+            slab->stats->capacity -= chunk->num_objs;
+            slab->stats->bytes -= SLAB_CHUNK_HDR
+                                  + slab->obj_size * chunk->num_objs;
+        }
+        free(chunk);
+    }
+    if(slab->stats)
+    {
+        slab->stats->in_use -= slab->in_use;
+        slab->stats->frees += slab->in_use;
+    }
+    INIT_LIST_HEAD(&slab->chunks);
+    slab->free_list = NULL;
+    slab->in_use = 0;
+    slab->next_chunk_objs = slab->first_chunk_objs;
+}
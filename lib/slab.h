@@ -0,0 +1,69 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "list.h"
+
+/*
+ * Simple slab of fixed size objects.
+ * Objects are carved out of chunks in allocation order, so objects allocated
+ * one after another are adjacent in memory. Freed objects go to a free list
+ * and are reused before new space is taken. slab_destroy() releases all
+ * chunks at once, without touching the individual objects.
+ */
+
+/* Counters, may be shared by several slabs */
+typedef struct
+{
+    unsigned int chunks;
+    unsigned int in_use;    /* objects handed out */
+    unsigned int capacity;  /* objects in all chunks */
+    size_t bytes;           /* memory held in chunks */
+    unsigned long long allocs, frees;
+} slab_stats_t;
+
+typedef struct
+{
+    size_t obj_size;
+    unsigned int first_chunk_objs;
+    unsigned int next_chunk_objs; /* size of the next chunk, in objects */
+    struct list_head chunks; /* the last one is being carved */
+    void *free_list;
+    unsigned int in_use;
+    slab_stats_t *stats;
+} slab_t;
+
+/* chunk_objs is the size of the first chunk; following chunks double in size
+ * up to SLAB_MAX_CHUNK_OBJS. stats == NULL means no accounting.
+ */
+#define SLAB_MAX_CHUNK_OBJS 256
+void slab_init(slab_t *slab, size_t obj_size, unsigned int chunk_objs,
+               slab_stats_t *stats);
+/* Returns zeroed object or NULL */
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *obj);
+/* Free all the chunks. Slab can be used again after that */
+void slab_destroy(slab_t *slab);
+
+#endif /* SLAB_H */
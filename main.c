@@ -33,6 +33,7 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sched.h>
 #include <sys/types.h>
 
 #include "epoll_loop.h"
@@ -43,12 +44,22 @@
 #include "mstp.h"
 #include "ctl_socket_server.h"
 #include "bridge_track.h"
+#include "mstpd_conf.h"
+#include "cpu_acct.h"
 
 #define APP_NAME    "mstpd"
 
+/* Default loop latency limit under SCHED_FIFO, see loop_latency_limit_ms */
+#define RT_LATENCY_LIMIT_MS 10
+
 static int print_to_syslog = 0;
 int log_level = LOG_LEVEL_DEFAULT;
 
+static int log_async_init(void);
+static int rt_set_affinity(const char *cpus);
+static int rt_set_scheduler(int prio);
+static int rt_lock_memory(void);
+
 #ifdef MISC_TEST_FUNCS
 static bool test_ports_trees_mesh(void);
 #endif /* MISC_TEST_FUNCS */
@@ -115,8 +126,13 @@ int main(int argc, char *argv[])
 {
     int c;
     int daemonize = 1;
+    int sm_threads = 0;
+    const char *rt_cpus = NULL;
+    int rt_prio = 0;
+    bool rt_mlock = false;
+    bool latency_limit_set = false;
 
-    while((c = getopt(argc, argv, "Vdsmv:")) != -1)
+    while((c = getopt(argc, argv, "VdsmRUML:T:H:X:c:P:W:v:")) != -1)
     {
         switch (c)
         {
@@ -129,6 +145,109 @@ int main(int argc, char *argv[])
             case 'm':
                 handle_all_bridges = 0;
                 break;
+            case 'R':
+                /* Check incremental role selection against the full one */
+                MSTP_verify_role_selection = true;
+                break;
+            case 'U':
+                /* io_uring event loop instead of epoll */
+                loop_backend = LOOP_BACKEND_IO_URING;
+                break;
+            case 'L':
+                /* Layout of the per-tree port data in memory */
+                if(!strcmp(optarg, "tree"))
+                    MSTP_ptp_layout = ptpLayoutTree;
+                else if(!strcmp(optarg, "port"))
+                    MSTP_ptp_layout = ptpLayoutPort;
+                else
+                {
+                    ERROR("Invalid layout %s, expected tree or port", optarg);
+                    exit(1);
+                }
+                break;
+            case 'X':
+                /* How to send BPDUs, see packet_tx_mode_t */
+                if(!strcmp(optarg, "plain"))
+                    packet_tx_mode = PACKET_TX_PLAIN;
+                else if(!strcmp(optarg, "prio"))
+                    packet_tx_mode = PACKET_TX_PRIO;
+                else if(!strcmp(optarg, "bypass"))
+                    packet_tx_mode = PACKET_TX_BYPASS;
+                else
+                {
+                    ERROR("Invalid tx mode %s, expected plain, prio or bypass",
+                          optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+            {
+                char *end;
+                long l;
+                l = strtol(optarg, &end, 0);
+                if(*optarg == 0 || *end != 0 || l < 0 || l > MAX_IMPLEMENTATION_MSTIS)
+                {
+                    ERROR("Invalid number of state machine threads %s", optarg);
+                    exit(1);
+                }
+                sm_threads = l;
+                break;
+            }
+            case 'H':
+            {
+                /* Divide the second into that many slots, each port
+                 * transmitting in its own slot of the Hello Time */
+                char *end;
+                long l;
+                l = strtol(optarg, &end, 0);
+                if(*optarg == 0 || *end != 0 || l < 1 || l > MAX_HELLO_SLOTS)
+                {
+                    ERROR("Invalid number of hello slots %s", optarg);
+                    exit(1);
+                }
+                MSTP_hello_slots = l;
+                break;
+            }
+            case 'c':
+                /* CPUs to run on, e.g. "2" or "0,2-3" */
+                rt_cpus = optarg;
+                break;
+            case 'P':
+            {
+                /* Run the protocol under SCHED_FIFO with that priority */
+                char *end;
+                long l;
+                l = strtol(optarg, &end, 0);
+                if(*optarg == 0 || *end != 0
+                   || l < sched_get_priority_min(SCHED_FIFO)
+                   || l > sched_get_priority_max(SCHED_FIFO))
+                {
+                    ERROR("Invalid SCHED_FIFO priority %s", optarg);
+                    exit(1);
+                }
+                rt_prio = l;
+                break;
+            }
+            case 'M':
+                /* Lock all memory, current and future, once started */
+                rt_mlock = true;
+                break;
+            case 'W':
+            {
+                /* Warn when the loop, the timers of a bridge or a hello
+                 * are late by more than that many ms */
+                char *end;
+                long l;
+                l = strtol(optarg, &end, 0);
+                if(*optarg == 0 || *end != 0 || l < 0 || l > 60000)
+                {
+                    ERROR("Invalid loop latency limit %s", optarg);
+                    exit(1);
+                }
+                loop_latency_limit_ms = l;
+                latency_limit_set = true;
+                break;
+            }
             case 'v':
             {
                 char *end;
@@ -179,46 +298,404 @@ int main(int argc, char *argv[])
         fclose(f);
     }
 
+    cpu_acct_reset(&cpu_acct_daemon);
+
+    /* Before any thread is started, so that they all inherit it */
+    if(rt_cpus && rt_set_affinity(rt_cpus))
+        return -1;
+
+    /* The logging thread is started before switching to SCHED_FIFO and
+     * stays a normal one: syslog() may block, the protocol must not */
+    if(log_async_init())
+        INFO("Logging synchronously");
+    if(rt_prio)
+    {
+        if(rt_set_scheduler(rt_prio))
+            return -1;
+        /* Unless told otherwise, keep an eye on what SCHED_FIFO buys us */
+        if(!latency_limit_set)
+            loop_latency_limit_ms = RT_LATENCY_LIMIT_MS;
+    }
+    /* The same limit for the timers and hellos of each bridge */
+    MSTP_lag_limit_us = loop_latency_limit_ms * 1000;
+    if(MSTP_IN_start_sm_threads(sm_threads))
+        INFO("Running state machines serially");
+
     TST(signal_init() == 0, -1);
     TST(init_epoll() == 0, -1);
     TST(ctl_socket_init() == 0, -1);
     TST(packet_sock_init() == 0, -1);
     TST(netsock_init() == 0, -1);
     TST(init_bridge_ops() == 0, -1);
+    TST(mstpd_conf_watch_init() == 0, -1);
+
+    if(rt_mlock && rt_lock_memory())
+        return -1;
 
     c = epoll_main_loop(&quit);
+    mstpd_conf_watch_fini();
     bridge_track_fini();
     ctl_socket_cleanup();
 
     return c;
 }
 
+/*********************** Real-time mode *********************/
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Stack touched in advance by rt_lock_memory() */
+#define RT_PREFAULT_STACK   (256 * 1024)
+
+/* cpus is a list of CPUs and ranges, like taskset -c takes */
+static int rt_set_affinity(const char *cpus)
+{
+    cpu_set_t set;
+    const char *p = cpus;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(&set);
+    do
+    {
+        first = strtol(p, &end, 10);
+        if(end == p)
+            goto bad_list;
+        last = first;
+        if('-' == *end)
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p)
+                goto bad_list;
+        }
+        if(first < 0 || last < first || last >= CPU_SETSIZE)
+            goto bad_list;
+        for(; first <= last; ++first)
+            CPU_SET(first, &set);
+        p = end + 1;
+    } while(',' == *end);
+    if(*end)
+        goto bad_list;
+
+    if(sched_setaffinity(0, sizeof(set), &set))
+    {
+        ERROR("Couldn't pin to CPUs %s: %m", cpus);
+        return -1;
+    }
+    INFO("Pinned to CPUs %s", cpus);
+    return 0;
+
+bad_list:
+    ERROR("Invalid CPU list %s", cpus);
+    return -1;
+}
+
+/* For the calling thread and the threads it starts afterwards */
+static int rt_set_scheduler(int prio)
+{
+    struct sched_param sp = { .sched_priority = prio };
+    int r;
+
+    if((r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)))
+    {
+        ERROR("Couldn't switch to SCHED_FIFO priority %d: %s",
+              prio, strerror(r));
+        return -1;
+    }
+    INFO("Running under SCHED_FIFO priority %d", prio);
+    return 0;
+}
+
+/* Touch one byte per page of the stack we may need. Each store goes
+ * through a volatile lvalue, so the compiler can't drop them. */
+static void __attribute__((noinline)) rt_prefault_stack(void)
+{
+    volatile char stack[RT_PREFAULT_STACK];
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    if(0 >= page)
+        page = 4096;
+    for(i = 0; i < sizeof(stack); i += page)
+        stack[i] = 0;
+    stack[sizeof(stack) - 1] = 0;
+}
+
+/* Called once everything is set up. With MCL_FUTURE the kernel populates
+ * each new mapping as it is made, so the bridges, ports and trees created
+ * later (including the slab chunks behind them) are faulted in when they
+ * are allocated rather than when the protocol first touches them. Freed
+ * memory is kept by malloc, so that it is not faulted in again. */
+static int rt_lock_memory(void)
+{
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if(mlockall(MCL_CURRENT | MCL_FUTURE))
+    {
+        ERROR("Couldn't lock memory: %m");
+        return -1;
+    }
+    rt_prefault_stack();
+    INFO("Memory locked");
+    return 0;
+}
+
 /*********************** Logging *********************/
 
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+/* Messages are formatted by the caller directly into a slot of a
+ * ring and written out (to stdout or syslog) by a separate thread, so that
+ * a slow syslog() does not block the main loop. Producers (the main thread
+ * and the state machine threads, see MSTP_IN_start_sm_threads()) are
+ * serialized by log_producer_mutex.
+ * Before log_async_init() and if the thread can't be started messages are
+ * written synchronously.
+ */
+#define LOG_MSG_LEN     256
+#define LOG_RING_SIZE   1024 /* must be a power of 2 */
+
+/* Each call site (identified by its format string) may emit at most
+ * LOG_RATE_BURST messages per second, the rest are counted and reported
+ * when the next message from that site gets through.
+ */
+#define LOG_RATE_BURST  50
+#define LOG_RATE_SITES  256 /* must be a power of 2 */
+
+typedef struct
+{
+    time_t time;
+    int level;
+    char text[LOG_MSG_LEN];
+} log_msg_t;
 
-void vDprintf(int level, const char *fmt, va_list ap)
+typedef struct
 {
-    if(level > log_level)
-        return;
+    const char *fmt;
+    time_t window;
+    unsigned int count;
+    unsigned int suppressed;
+} log_site_t;
+
+static log_msg_t log_ring[LOG_RING_SIZE];
+static unsigned int log_head; /* written by producer only */
+static unsigned int log_tail; /* written by consumer only */
+static unsigned int log_dropped; /* written by producer only */
+static unsigned int log_dropped_reported; /* written by consumer only */
+static bool log_async;
+static volatile bool log_thread_quit;
+static int log_event_fd = -1;
+static pthread_t log_thread;
+static pthread_mutex_t log_producer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static log_site_t log_sites[LOG_RATE_SITES];
+
+/* Return number of suppressed messages to report, or -1 to drop message */
+static int log_rate_check(const char *fmt, time_t now)
+{
+    unsigned int i, n, h = ((unsigned long)fmt >> 3) & (LOG_RATE_SITES - 1);
+    log_site_t *site;
+    int suppressed;
 
-    if(!print_to_syslog)
+    for(n = 0, i = h; n < LOG_RATE_SITES;
+        ++n, i = (i + 1) & (LOG_RATE_SITES - 1))
+    {
+        site = &log_sites[i];
+        if(NULL == site->fmt)
+        {
+            site->fmt = fmt;
+            site->window = now;
+            site->count = 1;
+            return 0;
+        }
+        if(fmt != site->fmt)
+            continue;
+        if(now != site->window)
+        {
+            site->window = now;
+            site->count = 0;
+        }
+        if(LOG_RATE_BURST <= site->count)
+        {
+            ++(site->suppressed);
+            return -1;
+        }
+        ++(site->count);
+        suppressed = site->suppressed;
+        site->suppressed = 0;
+        return suppressed;
+    }
+    /* Table is full, do not limit this site */
+    return 0;
+}
+
+static inline const char *log_time_str(time_t t)
+{
+    static time_t cached_time = -1;
+    static char cached_str[32];
+
+    if(t != cached_time)
     {
-        char logbuf[256];
-        logbuf[255] = 0;
-        time_t clock;
-        struct tm *local_tm;
-        time(&clock);
-        local_tm = localtime(&clock);
-        int l = strftime(logbuf, sizeof(logbuf) - 1, "%F %T ", local_tm);
-        vsnprintf(logbuf + l, sizeof(logbuf) - l - 1, fmt, ap);
-        printf("%s\n", logbuf);
+        strftime(cached_str, sizeof(cached_str), "%F %T", localtime(&t));
+        cached_time = t;
     }
+    return cached_str;
+}
+
+static void log_write(time_t t, int level, const char *text)
+{
+    if(!print_to_syslog)
+        printf("%s %s\n", log_time_str(t), text);
     else
+        syslog((level <= LOG_LEVEL_INFO) ? LOG_INFO : LOG_DEBUG, "%s", text);
+}
+
+static void *log_thread_main(void *arg)
+{
+    unsigned int head, tail, dropped;
+    uint64_t ev;
+    log_msg_t *msg;
+    char buf[64];
+
+    while(true)
     {
-        vsyslog((level <= LOG_LEVEL_INFO) ? LOG_INFO : LOG_DEBUG, fmt, ap);
+        tail = log_tail;
+        while(tail != (head = __atomic_load_n(&log_head, __ATOMIC_SEQ_CST)))
+        {
+            do {
+                msg = &log_ring[tail & (LOG_RING_SIZE - 1)];
+                log_write(msg->time, msg->level, msg->text);
+            } while(++tail != head);
+            __atomic_store_n(&log_tail, tail, __ATOMIC_SEQ_CST);
+        }
+        dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if(dropped != log_dropped_reported)
+        {
+            snprintf(buf, sizeof(buf), "%u log messages dropped",
+                     dropped - log_dropped_reported);
+            log_write(time(NULL), LOG_LEVEL_ERROR, buf);
+            log_dropped_reported = dropped;
+        }
+        if(!print_to_syslog)
+            fflush(stdout);
+        if(log_thread_quit)
+            break;
+        if((0 > read(log_event_fd, &ev, sizeof(ev))) && (EINTR != errno))
+            break;
     }
+    return NULL;
+}
+
+static void log_async_fini(void)
+{
+    uint64_t ev = 1;
+
+    if(!log_async)
+        return;
+    log_thread_quit = true;
+    if(0 > write(log_event_fd, &ev, sizeof(ev)))
+        return;
+    pthread_join(log_thread, NULL);
+    log_async = false;
+    close(log_event_fd);
+    log_event_fd = -1;
+}
+
+/* Must be called after daemon(), as the thread does not survive fork() */
+static int log_async_init(void)
+{
+    sigset_t set, oldset;
+    int r;
+
+    TST(0 <= (log_event_fd = eventfd(0, EFD_CLOEXEC)), -1);
+
+    /* Signals are handled by the main thread only */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    r = pthread_create(&log_thread, NULL, log_thread_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if(r)
+    {
+        ERROR("Couldn't start logging thread: %s", strerror(r));
+        close(log_event_fd);
+        log_event_fd = -1;
+        return -1;
+    }
+
+    log_async = true;
+    atexit(log_async_fini);
+    return 0;
+}
+
+static void log_produce(int level, const char *fmt, va_list ap)
+{
+    unsigned int head, tail;
+    log_msg_t *msg;
+    time_t now;
+    int suppressed, l = 0;
+    uint64_t ev = 1;
+
+    time(&now);
+    if(0 > (suppressed = log_rate_check(fmt, now)))
+        return;
+
+    if(!log_async)
+    {
+        char logbuf[LOG_MSG_LEN];
+        if(suppressed)
+            l = snprintf(logbuf, sizeof(logbuf),
+                         "(%d similar messages suppressed) ", suppressed);
+        vsnprintf(logbuf + l, sizeof(logbuf) - l, fmt, ap);
+        log_write(now, level, logbuf);
+        return;
+    }
+
+    head = log_head;
+    tail = __atomic_load_n(&log_tail, __ATOMIC_SEQ_CST);
+    if(LOG_RING_SIZE <= (head - tail))
+    {
+        __atomic_store_n(&log_dropped, log_dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    msg = &log_ring[head & (LOG_RING_SIZE - 1)];
+    msg->time = now;
+    msg->level = level;
+    if(suppressed)
+        l = snprintf(msg->text, sizeof(msg->text),
+                     "(%d similar messages suppressed) ", suppressed);
+    vsnprintf(msg->text + l, sizeof(msg->text) - l, fmt, ap);
+    __atomic_store_n(&log_head, head + 1, __ATOMIC_SEQ_CST);
+
+    /* Wake up the writer only if it could have seen the ring empty.
+     * tail is reloaded after publishing head: the writer stores tail
+     * before it reloads head, so either it sees our message or we see
+     * that it had caught up with the previous ones and may be sleeping.
+     */
+    if(head == __atomic_load_n(&log_tail, __ATOMIC_SEQ_CST))
+        if(0 > write(log_event_fd, &ev, sizeof(ev)))
+            return;
+}
+
+void vDprintf(int level, const char *fmt, va_list ap)
+{
+    cpu_acct_frame_t f;
+
+    if(level > log_level)
+        return;
+
+    cpu_acct_enter(&f, NULL, CPU_ACCT_LOG);
+    pthread_mutex_lock(&log_producer_mutex);
+    log_produce(level, fmt, ap);
+    pthread_mutex_unlock(&log_producer_mutex);
+    cpu_acct_leave(&f);
 }
 
 void Dprintf(int level, const char *fmt, ...)
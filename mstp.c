@@ -38,6 +38,8 @@
 #include <config.h>
 
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <linux/if_bridge.h>
 #include <asm/byteorder.h>
@@ -46,15 +48,55 @@
 #include "log.h"
 #include "clock_gettime.h"
 #include "hmac_md5.h"
+#include "mstp_trace.h"
+
+/* Change state of the port (_PRT_) or per-tree-port (_PTP_) state machine
+ * and record the transition in the trace ring.
+ * PISM and PRTSM transitions change inputs of the role selection, so they
+ * also put the port on the rolesDirty list of the tree (see updtRolesTree).
+ */
+#define PRT_SM_SET_STATE(_prt, _sm, _new)                        \
+    ({                                                           \
+        trace_sm((_prt)->bridge->sysdeps.if_index,               \
+                 (_prt)->sysdeps.if_index, 0,                    \
+                 TRACE_SM_##_sm, (_prt)->_sm##_state, (_new));   \
+        (_prt)->_sm##_state = (_new);                            \
+    })
+#define PTP_SM_SET_STATE(_ptp, _sm, _new)                        \
+    ({                                                           \
+        sm_trace((_ptp), TRACE_SM_##_sm, (_ptp)->_sm##_state, (_new)); \
+        if(TRACE_SM_PISM == TRACE_SM_##_sm)                      \
+        {                                                        \
+            if(0 == (_ptp)->MSTID)                               \
+                prt_roles_dirty((_ptp)->port);                   \
+            else                                                 \
+                ptp_roles_dirty(_ptp);                           \
+        }                                                        \
+        else if(TRACE_SM_PRTSM == TRACE_SM_##_sm)                \
+            ptp_roles_dirty(_ptp);                               \
+        (_ptp)->_sm##_state = (_new);                            \
+    })
 
 static void PTSM_tick(port_t *prt);
+static bool rx_bpdu_repeated(port_t *prt, bpdu_t *bpdu, int size);
 static bool TCSM_run(per_tree_port_t *ptp, bool dry_run);
 static void BDSM_begin(port_t *prt);
 static void br_state_machines_begin(bridge_t *br);
+static void br_invalidate_tx_bpdus(bridge_t *br);
 static void prt_state_machines_begin(port_t *prt);
 static void tree_state_machines_begin(tree_t *tree);
 static void br_state_machines_run(bridge_t *br);
+static void br_state_machines_run_now(bridge_t *br);
 static void updtbrAssuRcvdInfoWhile(port_t *prt);
+static void ptp_roles_forget(per_tree_port_t *ptp);
+static void sm_trace(per_tree_port_t *ptp, trace_sm_t sm, int from, int to);
+static void sm_set_state(per_tree_port_t *ptp, int new_state);
+static void sm_flush_all_mstids(per_tree_port_t *ptp);
+static void sm_rapid_ageing(port_t *prt, unsigned int FwdDelay);
+static void sm_set_newInfoMsti(port_t *prt);
+static void sm_set_infoInternal(port_t *prt);
+static void ptp_roles_dirty(per_tree_port_t *ptp);
+static void prt_roles_dirty(port_t *prt);
 
 #define FOREACH_PORT_IN_BRIDGE(port, bridge) \
     list_for_each_entry((port), &(bridge)->ports, br_list)
@@ -65,6 +107,17 @@ static void updtbrAssuRcvdInfoWhile(port_t *prt);
 #define FOREACH_PTP_IN_PORT(ptp, port) \
     list_for_each_entry((ptp), &(port)->trees, port_list)
 
+/* An input of the ptp's MSTI Configuration Message in prt->txBpdu changed:
+ * role, flags, designatedPriority, designatedTimes or tcWhile to/from 0.
+ * txMstp() refills only the messages marked so.
+ */
+static inline void ptp_tx_dirty(per_tree_port_t *ptp)
+{
+    ptp->txMsgDirty = true;
+    /* MSTIs of the same port may run on different state machine threads */
+    __atomic_store_n(&ptp->port->txMsgsDirty, true, __ATOMIC_RELAXED);
+}
+
 /* 17.20.11 of 802.1D */
 #define rstpVersion(br) ((br)->ForceProtocolVersion >= protoRSTP)
 /* Bridge assurance is operational only when NetworkPort type is configured
@@ -123,13 +176,21 @@ static void port_default_internal_vars(port_t *prt)
     assign(prt->rapidAgeingWhile, 0u);
     assign(prt->brAssuRcvdInfoWhile, 0u);
     prt->BaInconsistent = false;
-    prt->num_rx_bpdu_filtered = 0;
     prt->num_rx_bpdu = 0;
     prt->num_rx_tcn = 0;
+    prt->num_rx_bpdu_repeated = 0;
+    prt->num_rx_bpdu_queued = 0;
+    prt->rx_queue_high_water = 0;
+    prt->num_bpdu_rate_exceeded = 0;
+    prt->rxQueueHead = 0;
+    prt->rxQueueLen = 0;
     prt->num_tx_bpdu = 0;
     prt->num_tx_tcn = 0;
+    prt->num_tx_errors = 0;
+    prt->num_tx_eagain = 0;
     prt->num_trans_fwd = 0;
     prt->num_trans_blk = 0;
+    memset(&prt->bpdu_counters, 0, sizeof(prt->bpdu_counters));
 
     /* The following are initialized in BEGIN state:
      * - mdelayWhile. mcheck, sendRSTP: in Port Protocol Migration SM
@@ -151,6 +212,7 @@ static void ptp_default_internal_vars(per_tree_port_t *ptp)
     ptp->mastered = false;
     memset(&ptp->msgPriority, 0, sizeof(ptp->msgPriority));
     memset(&ptp->msgTimes, 0, sizeof(ptp->msgTimes));
+    ptp_tx_dirty(ptp);
 
     /* The following are initialized in BEGIN state:
      * - rcvdMsg: in Port Receive SM
@@ -164,10 +226,40 @@ static void ptp_default_internal_vars(per_tree_port_t *ptp)
      */
 }
 
+ptp_layout_t MSTP_ptp_layout = ptpLayoutTree;
+
+unsigned int MSTP_hello_slots = 1;
+
+unsigned int MSTP_lag_limit_us;
+
+/* Trees come from the bridge's tree_slab, the per-tree port data from the
+ * slab of either its tree or its port (br->ptpLayout). Both kinds of slabs
+ * count into the bridge's ptp_stats.
+ */
+static inline slab_t *ptp_slab(tree_t *tree, port_t *prt)
+{
+    return (ptpLayoutPort == tree->bridge->ptpLayout) ? &prt->ptp_slab
+                                                      : &tree->ptp_slab;
+}
+
+static inline void free_ptp(per_tree_port_t *ptp)
+{
+    slab_free(ptp_slab(ptp->tree, ptp->port), ptp);
+}
+
+/* Frees also the tree's ptps in ptpLayoutTree */
+static void free_tree(tree_t *tree)
+{
+    free(tree->rootHeap);
+    free(tree->smOps);
+    slab_destroy(&tree->ptp_slab);
+    slab_free(&tree->bridge->tree_slab, tree);
+}
+
 static tree_t * create_tree(bridge_t *br, __u8 *macaddr, __be16 MSTID)
 {
     /* Initialize all fields except anchor */
-    tree_t *tree = calloc(1, sizeof(*tree));
+    tree_t *tree = slab_alloc(&br->tree_slab);
     if(!tree)
     {
         ERROR_BRNAME(br, "Out of memory");
@@ -176,6 +268,9 @@ static tree_t * create_tree(bridge_t *br, __u8 *macaddr, __be16 MSTID)
     tree->bridge = br;
     tree->MSTID = MSTID;
     INIT_LIST_HEAD(&tree->ports);
+    slab_init(&tree->ptp_slab, sizeof(per_tree_port_t), 16, &br->ptp_stats);
+    INIT_LIST_HEAD(&tree->rolesDirty);
+    tree->rolesFullRecalc = true;
 
     memcpy(tree->BridgeIdentifier.s.mac_address, macaddr, ETH_ALEN);
     /* 0x8000 = default bridge priority (17.14 of 802.1D) */
@@ -198,7 +293,7 @@ static tree_t * create_tree(bridge_t *br, __u8 *macaddr, __be16 MSTID)
 static per_tree_port_t * create_ptp(tree_t *tree, port_t *prt)
 {
     /* Initialize all fields except anchors */
-    per_tree_port_t *ptp = calloc(1, sizeof(*ptp));
+    per_tree_port_t *ptp = slab_alloc(ptp_slab(tree, prt));
     if(!ptp)
     {
         ERROR_PRTNAME(prt->bridge, prt, "Out of memory");
@@ -218,6 +313,8 @@ static per_tree_port_t * create_ptp(tree_t *tree, port_t *prt)
     assign(ptp->portTimes, tree->BridgeTimes);
 
     ptp->calledFromFlushRoutine = false;
+    ptp->rolesDirty = false;
+    ptp->rootHeapPos = -1;
 
     ptp_default_internal_vars(ptp);
 
@@ -234,7 +331,11 @@ bool MSTP_IN_bridge_create(bridge_t *br, __u8 *macaddr)
     INIT_LIST_HEAD(&br->ports);
     INIT_LIST_HEAD(&br->trees);
     br->bridgeEnabled = false;
+    br->config_depth = 0;
+    br->config_run_pending = false;
     memset(br->vid2mstid, 0, sizeof(br->vid2mstid));
+    memset(br->mstid2slot, NO_TREE_SLOT, sizeof(br->mstid2slot));
+    memset(br->slot2tree, 0, sizeof(br->slot2tree));
     assign(br->MstConfigId.s.selector, (__u8)0);
     sprintf((char *)br->MstConfigId.s.configuration_name,
             "%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
@@ -253,10 +354,18 @@ bool MSTP_IN_bridge_create(bridge_t *br, __u8 *macaddr)
 
     bridge_default_internal_vars(br);
 
+    br->ptpLayout = MSTP_ptp_layout;
+    memset(&br->tree_stats, 0, sizeof(br->tree_stats));
+    memset(&br->ptp_stats, 0, sizeof(br->ptp_stats));
+    slab_init(&br->tree_slab, sizeof(tree_t), 4, &br->tree_stats);
+
     /* Create CIST */
     if(!(cist = create_tree(br, macaddr, 0)))
         return false;
     list_add_tail(&cist->bridge_list, &br->trees);
+    cist->slot = 0;
+    br->mstid2slot[0] = 0;
+    br->slot2tree[0] = cist;
 
     return true;
 }
@@ -269,6 +378,8 @@ bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
 
     /* Initialize all fields except sysdeps and bridge */
     INIT_LIST_HEAD(&prt->trees);
+    memset(prt->slot2ptp, 0, sizeof(prt->slot2ptp));
+    slab_init(&prt->ptp_slab, sizeof(per_tree_port_t), 4, &br->ptp_stats);
     prt->port_number = __cpu_to_be16(portno);
 
     assign(prt->AdminExternalPortPathCost, 0u);
@@ -289,7 +400,12 @@ bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
     prt->NetworkPort = false;
     prt->dontTxmtBpdu = false;
     prt->bpduFilterPort = false;
+    prt->bpduPoliceRate = 0;
+    prt->bpduPoliceBurst = 10;
+    prt->bpduPoliceTat = 0;
+    prt->bpduRateExceeded = false;
     prt->deleted = false;
+    prt->txBpduValid = false;
 
     port_default_internal_vars(prt);
 
@@ -303,12 +419,17 @@ bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
             {
                 list_del(&ptp->port_list);
                 list_del(&ptp->tree_list);
-                free(ptp);
+                prt->slot2ptp[ptp->tree->slot] = NULL;
+                if(ptpLayoutTree == br->ptpLayout)
+                    free_ptp(ptp);
             }
+            /* Releases the ptps of ptpLayoutPort and the port's slab */
+            slab_destroy(&prt->ptp_slab);
             return false;
         }
         list_add_tail(&ptp->port_list, &prt->trees);
         list_add_tail(&ptp->tree_list, &tree->ports);
+        prt->slot2ptp[tree->slot] = ptp;
     }
 
     /* Add new port to the tail of the list in the bridge */
@@ -331,15 +452,20 @@ void MSTP_IN_delete_port(port_t *prt)
     if(prt->portEnabled)
     {
         prt->portEnabled = false;
-        br_state_machines_run(br);
+        /* Can't be deferred by config transaction: other ports must see
+         * this one disabled before its per-tree data is freed */
+        br_state_machines_run_now(br);
     }
 
     list_for_each_entry_safe(ptp, nxt, &prt->trees, port_list)
     {
+        ptp_roles_forget(ptp);
         list_del(&ptp->port_list);
         list_del(&ptp->tree_list);
-        free(ptp);
+        if(ptpLayoutTree == br->ptpLayout)
+            free_ptp(ptp);
     }
+    slab_destroy(&prt->ptp_slab);
 
     list_del(&prt->br_list);
     br_state_machines_run(br);
@@ -352,24 +478,25 @@ void MSTP_IN_delete_bridge(bridge_t *br)
 
     br->bridgeEnabled = false;
 
-    /* We SHOULD first delete all ports and only THEN delete all tree_t
-     * structures as the tree_t structure contains the head for the per-port
-     * list of tree data (tree_t.ports).
-     * If this list_head will be deleted before all the per_tree_ports
-     * bad things will happen ;)
+    /* Everything goes away, so there is no need to unlink the per-tree
+     * port data one by one: it is released together with the slabs of
+     * the ports and trees holding it.
      */
-
     list_for_each_entry_safe(prt, nxt_prt, &br->ports, br_list)
     {
-        MSTP_IN_delete_port(prt);
+        list_del(&prt->br_list);
+        slab_destroy(&prt->ptp_slab);
         free(prt);
     }
 
     list_for_each_entry_safe(tree, nxt_tree, &br->trees, bridge_list)
     {
         list_del(&tree->bridge_list);
-        free(tree);
+        free(tree->rootHeap);
+        free(tree->smOps);
+        slab_destroy(&tree->ptp_slab);
     }
+    slab_destroy(&br->tree_slab);
 }
 
 void MSTP_IN_set_bridge_address(bridge_t *br, __u8 *macaddr)
@@ -447,6 +574,7 @@ void MSTP_IN_set_port_enable(port_t *prt, bool up, int speed, int duplex)
         if(prt->ExternalPortPathCost != new_ExternalPathCost)
         {
             assign(prt->ExternalPortPathCost, new_ExternalPathCost);
+            prt_roles_dirty(prt);
             changed = true;
         }
         FOREACH_PTP_IN_PORT(ptp, prt)
@@ -457,6 +585,7 @@ void MSTP_IN_set_port_enable(port_t *prt, bool up, int speed, int duplex)
             if(ptp->InternalPortPathCost != new_InternalPathCost)
             {
                 assign(ptp->InternalPortPathCost, new_InternalPathCost);
+                ptp_roles_dirty(ptp);
                 changed = true;
             }
         }
@@ -485,11 +614,17 @@ void MSTP_IN_set_port_enable(port_t *prt, bool up, int speed, int duplex)
             prt->portEnabled = true;
             prt->BpduGuardError = false;
             prt->BaInconsistent = false;
-            prt->num_rx_bpdu_filtered = 0;
             prt->num_rx_bpdu = 0;
             prt->num_rx_tcn = 0;
+            prt->num_rx_bpdu_repeated = 0;
+            prt->num_rx_bpdu_queued = 0;
+            prt->rx_queue_high_water = 0;
+            prt->num_bpdu_rate_exceeded = 0;
             prt->num_tx_bpdu = 0;
             prt->num_tx_tcn = 0;
+            prt->num_tx_errors = 0;
+            prt->num_tx_eagain = 0;
+            memset(&prt->bpdu_counters, 0, sizeof(prt->bpdu_counters));
             changed = true;
             /* When port is enabled, initialize bridge assurance timer,
              * so that enough time is given before port is put in
@@ -542,6 +677,99 @@ void MSTP_IN_one_second(bridge_t *br)
     br_state_machines_run(br);
 }
 
+static inline __u64 monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void MSTP_IN_tick_begin(bridge_t *br, __u64 deadline_ns)
+{
+    __u64 now = monotonic_ns();
+    unsigned long long lag = (now > deadline_ns)
+                             ? (now - deadline_ns) / 1000 : 0;
+
+    br->tickDeadline = deadline_ns;
+    ++(br->numTicks);
+    log2_hist_add(br->tickLag, lag);
+    if(lag > br->tickLagMax)
+        br->tickLagMax = lag;
+    if(MSTP_lag_limit_us && (lag > MSTP_lag_limit_us))
+    {
+        ++(br->lagWarnings);
+        INFO_BRNAME(br, "Timers run %llu us after the tick, limit is %u us",
+                    lag, MSTP_lag_limit_us);
+    }
+}
+
+/* Slot of the Hello Time in which the port sends its periodic BPDUs:
+ * phase % MSTP_hello_slots is the slot of the second in which its
+ * helloWhen is decremented, phase / MSTP_hello_slots the second of the
+ * Hello Time in which it runs out. Consecutive ports of a bridge get
+ * consecutive slots, the bridge's if_index shifts the whole sequence so
+ * that small bridges do not all start at 0.
+ */
+static inline unsigned int hello_phase(port_t *prt, unsigned int hello_time)
+{
+    unsigned int br_phase =
+        ((unsigned int)prt->bridge->sysdeps.if_index * 2654435761u) >> 16;
+    return (__be16_to_cpu(prt->port_number) + br_phase)
+           % (MSTP_hello_slots * hello_time);
+}
+
+/* Value to start helloWhen with, so that it runs out in the port's second
+ * of the Hello Time: Hello Time after the periodic BPDU, sooner after an
+ * event-triggered one.
+ */
+static unsigned int hello_interval(port_t *prt, unsigned int hello_time)
+{
+    bridge_t *br = prt->bridge;
+    unsigned int phase, second;
+
+    if(MSTP_hello_slots < 2 || hello_time < 2)
+        return hello_time;
+    phase = hello_phase(prt, hello_time);
+    /* Second in which helloWhen will be decremented next */
+    second = br->helloSecond;
+    if(phase % MSTP_hello_slots <= br->helloSlot)
+        ++second;
+    return (phase / MSTP_hello_slots + hello_time - second % hello_time)
+           % hello_time + 1;
+}
+
+/* Called MSTP_hello_slots times a second, slot 0 right after
+ * MSTP_IN_one_second(). Does nothing but remember the slot unless
+ * the staggering is on.
+ */
+void MSTP_IN_hello_slot(bridge_t *br, unsigned int slot)
+{
+    port_t *prt;
+    bool changed = false;
+
+    br->helloSlot = slot;
+    if(0 == slot)
+        ++(br->helloSecond);
+
+    if(MSTP_hello_slots < 2 || !br->bridgeEnabled)
+        return;
+
+    FOREACH_PORT_IN_BRIDGE(prt, br)
+    {
+        unsigned int hello_time =
+            GET_CIST_PTP_FROM_PORT(prt)->portTimes.Hello_Time;
+        if(prt->helloWhen
+           && (hello_phase(prt, hello_time) % MSTP_hello_slots == slot))
+        {
+            if(0 == --(prt->helloWhen))
+                changed = true;
+        }
+    }
+
+    if(changed)
+        br_state_machines_run(br);
+}
+
 void MSTP_IN_all_mstids_flushed(per_tree_port_t *ptp)
 {
     bridge_t *br = ptp->port->bridge;
@@ -555,19 +783,60 @@ void MSTP_IN_all_mstids_flushed(per_tree_port_t *ptp)
     }
 }
 
+/* Append validated BPDU to the port's receive queue.
+ * If the queue is full, the oldest queued BPDU is dropped: every BPDU
+ * carries the complete port information, so the newer ones matter more.
+ */
+static void rx_queue_add(port_t *prt, bpdu_t *bpdu, int size, int num_mstis)
+{
+    unsigned int i;
+
+    if(RX_BPDU_QUEUE_LEN == prt->rxQueueLen)
+    {
+        ERROR_PRTNAME(prt->bridge, prt,
+                      "BPDU receive queue full, dropping oldest BPDU");
+        ++(prt->bpdu_counters.rx_drops[rxDropQueueFull]);
+        prt->rxQueueHead = (prt->rxQueueHead + 1) % RX_BPDU_QUEUE_LEN;
+        --(prt->rxQueueLen);
+    }
+    i = (prt->rxQueueHead + prt->rxQueueLen) % RX_BPDU_QUEUE_LEN;
+    assign(prt->rxQueue[i].bpdu, *bpdu);
+    prt->rxQueue[i].size = size;
+    prt->rxQueue[i].numOfMstis = num_mstis;
+    ++(prt->num_rx_bpdu_queued);
+    if(++(prt->rxQueueLen) > prt->rx_queue_high_water)
+        prt->rx_queue_high_water = prt->rxQueueLen;
+}
+
+/* Move the oldest queued BPDU to rcvdBpduData */
+static void rx_queue_pop(port_t *prt)
+{
+    unsigned int i = prt->rxQueueHead;
+
+    assign(prt->rcvdBpduData, prt->rxQueue[i].bpdu);
+    prt->rcvdBpduSize = prt->rxQueue[i].size;
+    prt->rcvdBpduNumOfMstis = prt->rxQueue[i].numOfMstis;
+    prt->rcvdBpdu = true;
+    prt->rxQueueHead = (i + 1) % RX_BPDU_QUEUE_LEN;
+    --(prt->rxQueueLen);
+}
+
 /* NOTE: bpdu pointer is unaligned, but it works because
  * bpdu_t is packed. Don't try to cast bpdu to non-packed type ;)
  */
 void MSTP_IN_rx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
 {
-    int mstis_size;
+    int mstis_size, num_mstis = 0;
     bridge_t *br = prt->bridge;
 
+    trace_bpdu(TRACE_RX_BPDU, br->sysdeps.if_index, prt->sysdeps.if_index,
+               bpdu, size);
     ++(prt->num_rx_bpdu);
 
     if(prt->BpduGuardPort)
     {
         prt->BpduGuardError = true;
+        ++(prt->bpdu_counters.rx_drops[rxDropBpduGuard]);
         ERROR_PRTNAME(br, prt,
                       "Received BPDU on BPDU Guarded Port - Port Down");
         MSTP_OUT_shutdown_port(prt);
@@ -578,19 +847,14 @@ void MSTP_IN_rx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
     {
         LOG_PRTNAME(br, prt,
                    "Received BPDU on BPDU Filtered Port - discarded");
-        ++(prt->num_rx_bpdu_filtered);
+        ++(prt->bpdu_counters.rx_drops[rxDropBpduFilter]);
         return;
     }
 
     if(!br->bridgeEnabled)
     {
         INFO_PRTNAME(br, prt, "Received BPDU while bridge is disabled");
-        return;
-    }
-
-    if(prt->rcvdBpdu)
-    {
-        ERROR_PRTNAME(br, prt, "Port hasn't processed previous BPDU");
+        ++(prt->bpdu_counters.rx_drops[rxDropBridgeDisabled]);
         return;
     }
 
@@ -599,6 +863,7 @@ void MSTP_IN_rx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
     {
 bpdu_validation_failed:
         INFO_PRTNAME(br, prt, "BPDU validation failed");
+        ++(prt->bpdu_counters.rx_drops[rxDropInvalid]);
         return;
     }
     switch(bpdu->bpduType)
@@ -607,6 +872,7 @@ bpdu_validation_failed:
             /* 14.4.b) */
             /* Valid TCN BPDU */
             bpdu->protocolVersion = protoSTP;
+            ++(prt->bpdu_counters.rx[bpduKindTCN]);
             LOG_PRTNAME(br, prt, "received TCN BPDU");
             break;
         case bpduTypeConfig:
@@ -615,6 +881,7 @@ bpdu_validation_failed:
                 goto bpdu_validation_failed;
             /* Valid Config BPDU */
             bpdu->protocolVersion = protoSTP;
+            ++(prt->bpdu_counters.rx[bpduKindConfig]);
             LOG_PRTNAME(br, prt, "received Config BPDU%s",
                         (bpdu->flags & (1 << offsetTc)) ? ", tcFlag" : ""
                        );
@@ -626,6 +893,7 @@ bpdu_validation_failed:
                     goto bpdu_validation_failed;
                 /* Valid RST BPDU */
                 /* bpdu->protocolVersion = protoRSTP; */
+                ++(prt->bpdu_counters.rx[bpduKindRST]);
                 LOG_PRTNAME(br, prt, "received RST BPDU%s",
                             (bpdu->flags & (1 << offsetTc)) ? ", tcFlag" : ""
                            );
@@ -651,17 +919,19 @@ bpdu_validation_failed:
             { /* 14.4.d) */
                 /* Valid RST BPDU */
                 bpdu->protocolVersion = protoRSTP;
+                ++(prt->bpdu_counters.rx[bpduKindRST]);
                 LOG_PRTNAME(br, prt, "received RST BPDU");
                 break;
             }
             /* 14.4.e) */
             /* Valid MST BPDU */
             bpdu->protocolVersion = protoMSTP;
-            prt->rcvdBpduNumOfMstis = mstis_size
-                                      / sizeof(msti_configuration_message_t);
+            num_mstis = mstis_size / sizeof(msti_configuration_message_t);
+            ++(prt->bpdu_counters.rx[bpduKindMST]);
+            prt->bpdu_counters.rx_msti_msgs += num_mstis;
             LOG_PRTNAME(br, prt, "received MST BPDU%s with %d MSTIs",
                         (bpdu->flags & (1 << offsetTc)) ? ", tcFlag" : "",
-                        prt->rcvdBpduNumOfMstis
+                        num_mstis
                        );
             break;
         default:
@@ -678,8 +948,25 @@ bpdu_validation_failed:
             ++(prt->num_rx_tcn);
     }
 
-    assign(prt->rcvdBpduData, *bpdu);
-    prt->rcvdBpdu = true;
+    if(prt->rcvdBpdu || prt->rxQueueLen)
+    {
+        /* Previous BPDU is not processed yet (e.g. the state machines run
+         * is deferred by a config transaction): queue this one after it */
+        rx_queue_add(prt, bpdu, size, num_mstis);
+    }
+    else if(rx_bpdu_repeated(prt, bpdu, size))
+    {
+        ++(prt->num_rx_bpdu_repeated);
+        updtbrAssuRcvdInfoWhile(prt);
+        return;
+    }
+    else
+    {
+        assign(prt->rcvdBpduData, *bpdu);
+        prt->rcvdBpduSize = size;
+        prt->rcvdBpduNumOfMstis = num_mstis;
+        prt->rcvdBpdu = true;
+    }
 
     /* Reset bridge assurance on receipt of valid BPDU */
     if(prt->BaInconsistent)
@@ -724,6 +1011,45 @@ void MSTP_IN_get_cist_bridge_status(bridge_t *br, CIST_BridgeStatus *status)
     assign(status->Ageing_Time, br->Ageing_Time);
 }
 
+/* Not in standard */
+void MSTP_IN_get_tx_slot_stats(bridge_t *br, BridgeTxSlotStats *stats)
+{
+    stats->slots = MSTP_hello_slots;
+    memcpy(stats->total, br->txSlotTotal, sizeof(stats->total));
+    memcpy(stats->periodic, br->txSlotPeriodic, sizeof(stats->periodic));
+}
+
+/* Not in standard */
+void MSTP_IN_get_bridge_tick_stats(bridge_t *br, TickStats *stats)
+{
+    stats->bridge_ticks = br->numTicks;
+    stats->tick_lag_max = br->tickLagMax;
+    memcpy(stats->tick_lag, br->tickLag, sizeof(stats->tick_lag));
+    stats->hellos = br->numHellos;
+    stats->hello_jitter_max = br->helloJitterMax;
+    memcpy(stats->hello_jitter, br->helloJitter, sizeof(stats->hello_jitter));
+    stats->hello_tx = br->numHelloTx;
+    stats->hello_tx_delay_max = br->helloTxDelayMax;
+    memcpy(stats->hello_tx_delay, br->helloTxDelay,
+           sizeof(stats->hello_tx_delay));
+    stats->lag_limit_us = MSTP_lag_limit_us;
+    stats->lag_warnings = br->lagWarnings;
+}
+
+/* Not in standard */
+void MSTP_IN_get_alloc_stats(bridge_t *br, BridgeAllocStats *stats)
+{
+    stats->ptp_layout = br->ptpLayout;
+    stats->trees = br->tree_stats.in_use;
+    stats->tree_chunks = br->tree_stats.chunks;
+    stats->ptps = br->ptp_stats.in_use;
+    stats->ptps_capacity = br->ptp_stats.capacity;
+    stats->ptp_chunks = br->ptp_stats.chunks;
+    stats->bytes = br->tree_stats.bytes + br->ptp_stats.bytes;
+    stats->ptp_allocs = br->ptp_stats.allocs;
+    stats->ptp_frees = br->ptp_stats.frees;
+}
+
 /* 12.8.1.2 Read MSTI Bridge Protocol Parameters */
 void MSTP_IN_get_msti_bridge_status(tree_t *tree, MSTI_BridgeStatus *status)
 {
@@ -865,6 +1191,7 @@ int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
       )
     {
         br->ForceProtocolVersion = cfg->protocol_version;
+        br_invalidate_tx_bpdus(br);
         changed = init = true;
     }
 
@@ -918,6 +1245,7 @@ int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
             assign(tree->BridgeTimes.Forward_Delay, br->Forward_Delay);
             assign(tree->BridgeTimes.Max_Age, br->Max_Age);
             assign(tree->BridgeTimes.Hello_Time, br->Hello_Time);
+            tree->rolesFullRecalc = true;
         /* Comment found in rstpd by Srinivas Aji:
          * Do this for any change in BridgeTimes.
          * Otherwise we fail UNH rstp.op_D test 3.2 since when administratively
@@ -968,6 +1296,7 @@ int MSTP_IN_set_msti_bridge_config(tree_t *tree, __u16 bridge_priority)
     SET_PRIORITY_IN_IDENTIFIER(valuePri, tree->BridgeIdentifier);
     tree->BridgePriority.RootID = tree->BridgePriority.RRootID =
         tree->BridgePriority.DesignatedBridgeID = tree->BridgeIdentifier;
+    tree->rolesFullRecalc = true;
     /* 12.8.1.4.4 do not require reselect, but I think it is needed,
      *  because 12.8.1.3.4.c) requires it */
     FOREACH_PTP_IN_TREE(ptp, tree)
@@ -1018,13 +1347,21 @@ void MSTP_IN_get_cist_port_status(port_t *prt, CIST_PortStatus *status)
     status->network_port = prt->NetworkPort;
     status->ba_inconsistent = prt->BaInconsistent;
     status->bpdu_filter_port = prt->bpduFilterPort;
-    status->num_rx_bpdu_filtered = prt->num_rx_bpdu_filtered;
     status->num_rx_bpdu = prt->num_rx_bpdu;
     status->num_rx_tcn = prt->num_rx_tcn;
+    status->num_rx_bpdu_repeated = prt->num_rx_bpdu_repeated;
+    status->num_rx_bpdu_queued = prt->num_rx_bpdu_queued;
+    status->rx_queue_high_water = prt->rx_queue_high_water;
+    status->bpdu_police_rate = prt->bpduPoliceRate;
+    status->bpdu_police_burst = prt->bpduPoliceBurst;
+    status->num_bpdu_rate_exceeded = prt->num_bpdu_rate_exceeded;
     status->num_tx_bpdu = prt->num_tx_bpdu;
     status->num_tx_tcn = prt->num_tx_tcn;
+    status->num_tx_errors = prt->num_tx_errors;
+    status->num_tx_eagain = prt->num_tx_eagain;
     status->num_trans_fwd = prt->num_trans_fwd;
     status->num_trans_blk = prt->num_trans_blk;
+    assign(status->bpdu_counters, prt->bpdu_counters);
     status->rcvdBpdu = prt->rcvdBpdu;
     status->rcvdRSTP = prt->rcvdRSTP;
     status->rcvdSTP = prt->rcvdSTP;
@@ -1075,6 +1412,11 @@ int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
                 cfg->admin_p2p = p2pAuto;
         }
     }
+    if(cfg->set_bpdu_police_burst && (0 == cfg->bpdu_police_burst))
+    {
+        ERROR_PRTNAME(br, prt, "BPDU police burst must be at least 1");
+        return -1;
+    }
 
     /* Secondly, do set */
     changed = false;
@@ -1088,6 +1430,7 @@ int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
         if(prt->ExternalPortPathCost != new_ExternalPathCost)
         {
             assign(prt->ExternalPortPathCost, new_ExternalPathCost);
+            prt_roles_dirty(prt);
             changed = true;
             /* 12.8.2.3.4 */
             cist = GET_CIST_PTP_FROM_PORT(prt);
@@ -1143,6 +1486,7 @@ int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
         if(prt->restrictedRole != cfg->restricted_role)
         {
             prt->restrictedRole = cfg->restricted_role;
+            prt_roles_dirty(prt);
             changed = true;
         }
     }
@@ -1197,11 +1541,33 @@ int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
         if (prt->bpduFilterPort != cfg->bpdu_filter_port)
         {
             prt->bpduFilterPort = cfg->bpdu_filter_port;
-            prt->num_rx_bpdu_filtered = 0;
+            prt->bpdu_counters.rx_drops[rxDropBpduFilter] = 0;
             INFO_PRTNAME(br, prt,"bpduFilterPort new=%d", prt->bpduFilterPort);
         }
     }
 
+    if(cfg->set_bpdu_police_rate)
+    {
+        if(prt->bpduPoliceRate != cfg->bpdu_police_rate)
+        {
+            prt->bpduPoliceRate = cfg->bpdu_police_rate;
+            prt->bpduPoliceTat = 0;
+            INFO_PRTNAME(br, prt, "bpduPoliceRate new=%u",
+                         prt->bpduPoliceRate);
+        }
+    }
+
+    if(cfg->set_bpdu_police_burst)
+    {
+        if(prt->bpduPoliceBurst != cfg->bpdu_police_burst)
+        {
+            prt->bpduPoliceBurst = cfg->bpdu_police_burst;
+            prt->bpduPoliceTat = 0;
+            INFO_PRTNAME(br, prt, "bpduPoliceBurst new=%u",
+                         prt->bpduPoliceBurst);
+        }
+    }
+
     if(changed && prt->portEnabled)
         br_state_machines_run(prt->bridge);
 
@@ -1237,6 +1603,7 @@ int MSTP_IN_set_msti_port_config(per_tree_port_t *ptp, MSTI_PortConfig *cfg)
         if(GET_PRIORITY_FROM_IDENTIFIER(ptp->portId) != valuePri)
         {
             SET_PRIORITY_IN_IDENTIFIER(valuePri, ptp->portId);
+            ptp_roles_dirty(ptp);
             changed = true;
         }
     }
@@ -1257,6 +1624,7 @@ int MSTP_IN_set_msti_port_config(per_tree_port_t *ptp, MSTI_PortConfig *cfg)
         if(ptp->InternalPortPathCost != new_InternalPathCost)
         {
             assign(ptp->InternalPortPathCost, new_InternalPathCost);
+            ptp_roles_dirty(ptp);
             changed = true;
         }
     }
@@ -1283,6 +1651,7 @@ int MSTP_IN_port_mcheck(port_t *prt)
     {
         prt->mcheck = true;
         cist->proposing = true;
+        ptp_tx_dirty(cist);
         br_state_machines_run(br);
     }
 
@@ -1292,9 +1661,7 @@ int MSTP_IN_port_mcheck(port_t *prt)
 /* 12.10.3.8 and 12.12.2.2 Set VID to MSTID allocation */
 bool MSTP_IN_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
 {
-    tree_t *tree;
     __be16 MSTID;
-    bool found;
 
     if((vid < 1) || (vid > MAX_VID))
     {
@@ -1312,17 +1679,7 @@ bool MSTP_IN_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
         return false;
     }
 
-    MSTID = __cpu_to_be16(mstid);
-    found = false;
-    FOREACH_TREE_IN_BRIDGE(tree, br)
-    {
-        if(tree->MSTID == MSTID)
-        {
-            found = true;
-            break;
-        }
-    }
-    if(!found)
+    if(!find_tree_by_mstid(br, mstid))
     {
         ERROR_BRNAME(br,
             "Error allocating VID(%hu) to MSTID(%hu): MSTID not found",
@@ -1330,6 +1687,7 @@ bool MSTP_IN_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
         return false;
     }
 
+    MSTID = __cpu_to_be16(mstid);
     if (br->vid2mstid[vid] != MSTID)
       {
         br->vid2mstid[vid] = MSTID;
@@ -1344,8 +1702,7 @@ bool MSTP_IN_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
 /* Set all VID-to-MSTID mappings at once */
 bool MSTP_IN_set_all_vids2mstids(bridge_t *br, __u16 *vids2mstids)
 {
-    tree_t *tree;
-    bool ret,found,vid2mstid_changed;
+    bool ret,vid2mstid_changed;
     __be16 MSTID;
     int vid;
 
@@ -1368,16 +1725,7 @@ bool MSTP_IN_set_all_vids2mstids(bridge_t *br, __u16 *vids2mstids)
         }
         else
             MSTID = __cpu_to_be16(vids2mstids[vid]);
-        found = false;
-        FOREACH_TREE_IN_BRIDGE(tree, br)
-        {
-            if(tree->MSTID == MSTID)
-            {
-                found = true;
-                break;
-            }
-        }
-        if(!found)
+        if(!find_tree_by_mstid(br, __be16_to_cpu(MSTID)))
         {
             ERROR_BRNAME(br,
                 "Error allocating VID(%hu) to MSTID(%hu): MSTID not found",
@@ -1426,7 +1774,7 @@ tree_t *MSTP_IN_create_msti(bridge_t *br, __u16 mstid)
 {
     tree_t *tree, *tree_after, *new_tree;
     per_tree_port_t *ptp, *nxt, *ptp_after, *new_ptp;
-    int num_of_mstis;
+    int num_of_mstis, slot;
     __be16 MSTID;
 
     if((mstid < 1) || (mstid > MAX_MSTID))
@@ -1435,20 +1783,20 @@ tree_t *MSTP_IN_create_msti(bridge_t *br, __u16 mstid)
         return NULL;
     }
 
+    if((tree = find_tree_by_mstid(br, mstid)))
+    {
+        INFO_BRNAME(br, "MSTID(%hu) is already in the list", mstid);
+        return tree; /* yes, it is success */
+    }
+
     MSTID = __cpu_to_be16(mstid);
     /* Find place where to insert new MSTID.
-     * Also check if such MSTID is already in the list.
      * Also count existing mstis.
      */
     tree_after = NULL;
     num_of_mstis = 0;
     FOREACH_TREE_IN_BRIDGE(tree, br)
     {
-        if(tree->MSTID == MSTID)
-        {
-            INFO_BRNAME(br, "MSTID(%hu) is already in the list", mstid);
-            return tree; /* yes, it is success */
-        }
         if(cmp(tree->MSTID, <, MSTID))
             tree_after = tree;
         ++num_of_mstis;
@@ -1469,10 +1817,15 @@ tree_t *MSTP_IN_create_msti(bridge_t *br, __u16 mstid)
         return NULL;
     }
 
+    /* Count check above guarantees that there is a free slot */
+    for(slot = 1; br->slot2tree[slot]; ++slot)
+        ;
+
     /* Create new tree and its list of PerTreePort structures */
     tree = GET_CIST_TREE(br);
     if(!(new_tree=create_tree(br,tree->BridgeIdentifier.s.mac_address,MSTID)))
         return NULL;
+    new_tree->slot = slot;
 
     FOREACH_PTP_IN_TREE(ptp_after, tree_after)
     {
@@ -1483,15 +1836,21 @@ tree_t *MSTP_IN_create_msti(bridge_t *br, __u16 mstid)
             {
                 list_del(&ptp->port_list);
                 list_del(&ptp->tree_list);
-                free(ptp);
+                ptp->port->slot2ptp[slot] = NULL;
+                free_ptp(ptp);
             }
+            free_tree(new_tree);
             return NULL;
         }
         list_add(&new_ptp->port_list, &ptp_after->port_list);
         list_add_tail(&new_ptp->tree_list, &new_tree->ports);
+        ptp_after->port->slot2ptp[slot] = new_ptp;
     }
 
     list_add(&new_tree->bridge_list, &tree_after->bridge_list);
+    br->slot2tree[slot] = new_tree;
+    br->mstid2slot[mstid] = slot;
+    br_invalidate_tx_bpdus(br); /* number of MSTI messages changed */
     /* There are no FIDs allocated to this MSTID, so VID-to-MSTID mapping
      *  did not change. So, no need in RecalcConfigDigest.
      * Just initialize state machines for this tree.
@@ -1506,7 +1865,6 @@ bool MSTP_IN_delete_msti(bridge_t *br, __u16 mstid)
     tree_t *tree;
     per_tree_port_t *ptp, *nxt;
     int vid;
-    bool found;
     __be16 MSTID = __cpu_to_be16(mstid);
 
     if((mstid < 1) || (mstid > MAX_MSTID))
@@ -1527,29 +1885,25 @@ bool MSTP_IN_delete_msti(bridge_t *br, __u16 mstid)
         }
     }
 
-    found = false;
-    FOREACH_TREE_IN_BRIDGE(tree, br)
-    {
-        if(tree->MSTID == MSTID)
-        {
-            found = true;
-            break;
-        }
-    }
-    if(!found)
+    if(!(tree = find_tree_by_mstid(br, mstid)))
     {
         INFO_BRNAME(br, "MSTID(%hu) is not in the list", mstid);
         return true; /* yes, it is success */
     }
 
     list_del(&tree->bridge_list);
+    br->mstid2slot[mstid] = NO_TREE_SLOT;
+    br->slot2tree[tree->slot] = NULL;
     list_for_each_entry_safe(ptp, nxt, &tree->ports, tree_list)
     {
         list_del(&ptp->port_list);
         list_del(&ptp->tree_list);
-        free(ptp);
+        ptp->port->slot2ptp[tree->slot] = NULL;
+        if(ptpLayoutPort == br->ptpLayout)
+            free_ptp(ptp);
     }
-    free(tree);
+    free_tree(tree);
+    br_invalidate_tx_bpdus(br); /* number of MSTI messages changed */
 
     /* There are no FIDs allocated to this MSTID, so VID-to-MSTID mapping
      *  did not change. So, no need in RecalcConfigDigest.
@@ -1579,6 +1933,28 @@ void MSTP_IN_set_mst_config_id(bridge_t *br, __u16 revision, __u8 *name)
     }
 }
 
+void MSTP_IN_config_begin(bridge_t *br)
+{
+    ++(br->config_depth);
+}
+
+void MSTP_IN_config_commit(bridge_t *br)
+{
+    if(0 == br->config_depth)
+    {
+        ERROR_BRNAME(br, "Config commit without begin");
+        return;
+    }
+    if(0 != --(br->config_depth))
+        return;
+
+    if(br->config_run_pending)
+    {
+        br->config_run_pending = false;
+        br_state_machines_run(br);
+    }
+}
+
 /*
  * If hint_SetToYes == true, some tcWhile in this tree has non-zero value.
  * If hint_SetToYes == false, some tcWhile in this tree has just became zero,
@@ -1618,43 +1994,73 @@ static void set_TopologyChange(tree_t *tree, bool hint_SetToYes, port_t *port)
     }
 }
 
-/* Helper functions, compare two priority vectors */
+/* Helper functions, compare two priority vectors.
+ *
+ * Priority vectors are kept in network byte order, as they are sent in
+ * BPDUs and shown to the user. For ordering they are loaded into host
+ * order 64-bit words, which compare the same way as the vectors
+ * themselves (13.10, 13.11): Bridge Identifiers fill a whole word, path
+ * costs and Port Identifiers are packed together with the neighbouring
+ * fields. Equality does not depend on byte order, so it is checked on
+ * the raw fields. Both are a few integer operations without branches
+ * instead of a memcmp() per vector component.
+ */
+static inline __u64 bridge_id_key(bridge_identifier_t id)
+{
+    return __be64_to_cpu(id.u);
+}
+
+/* pId is the tie-breaker appended to the vector, see betterorsamePriority */
+static inline void prio_key(prio_key_t *key, port_priority_vector_t *vec,
+                            port_identifier_t pId, bool cist)
+{
+    __u64 rroot = bridge_id_key(vec->RRootID);
+
+    key->w[0] = cist ? bridge_id_key(vec->RootID) : 0;
+    key->w[1] = (cist ? ((__u64)__be32_to_cpu(vec->ExtRootPathCost) << 32) : 0)
+                | (rroot >> 32);
+    key->w[2] = (rroot << 32) | __be32_to_cpu(vec->IntRootPathCost);
+    key->w[3] = bridge_id_key(vec->DesignatedBridgeID);
+    key->w[4] = ((__u64)__be16_to_cpu(vec->DesignatedPortID) << 16)
+                | __be16_to_cpu(pId);
+}
+
+#define KEY_WORD_CMP(_key1, _key2, _i) \
+    (((_key1)->w[_i] > (_key2)->w[_i]) - ((_key1)->w[_i] < (_key2)->w[_i]))
+
+/* <0, 0, >0 as memcmp(). Each word compares to -1, 0 or 1 and a word
+ * outweighs all the following ones together, so the first differing
+ * word decides the sign of the sum.
+ */
+static inline int prio_key_cmp(const prio_key_t *key1, const prio_key_t *key2)
+{
+    return 16 * KEY_WORD_CMP(key1, key2, 0) + 8 * KEY_WORD_CMP(key1, key2, 1)
+           + 4 * KEY_WORD_CMP(key1, key2, 2) + 2 * KEY_WORD_CMP(key1, key2, 3)
+           + KEY_WORD_CMP(key1, key2, 4);
+}
+
 static bool samePriorityAndTimers(port_priority_vector_t *vec1,
                                   port_priority_vector_t *vec2,
                                   times_t *time1,
                                   times_t *time2,
                                   bool cist)
 {
-    if(cist)
-    {
-        if(cmp(time1->Forward_Delay, !=, time2->Forward_Delay))
-            return false;
-        if(cmp(time1->Max_Age, !=, time2->Max_Age))
-            return false;
-        if(cmp(time1->Message_Age, !=, time2->Message_Age))
-            return false;
-        if(cmp(time1->Hello_Time, !=, time2->Hello_Time))
-            return false;
-
-        if(cmp(vec1->RootID, !=, vec2->RootID))
-            return false;
-        if(cmp(vec1->ExtRootPathCost, !=, vec2->ExtRootPathCost))
-            return false;
-    }
-
-    if(cmp(time1->remainingHops, !=, time2->remainingHops))
-        return false;
+    __u64 diff;
 
-    if(cmp(vec1->RRootID, !=, vec2->RRootID))
-        return false;
-    if(cmp(vec1->IntRootPathCost, !=, vec2->IntRootPathCost))
-        return false;
-    if(cmp(vec1->DesignatedBridgeID, !=, vec2->DesignatedBridgeID))
-        return false;
-    if(cmp(vec1->DesignatedPortID, !=, vec2->DesignatedPortID))
-        return false;
+    diff = (vec1->RRootID.u ^ vec2->RRootID.u)
+           | (vec1->IntRootPathCost ^ vec2->IntRootPathCost)
+           | (vec1->DesignatedBridgeID.u ^ vec2->DesignatedBridgeID.u)
+           | (vec1->DesignatedPortID ^ vec2->DesignatedPortID)
+           | (time1->remainingHops ^ time2->remainingHops);
+    if(cist)
+        diff |= (vec1->RootID.u ^ vec2->RootID.u)
+                | (vec1->ExtRootPathCost ^ vec2->ExtRootPathCost)
+                | (time1->Forward_Delay ^ time2->Forward_Delay)
+                | (time1->Max_Age ^ time2->Max_Age)
+                | (time1->Message_Age ^ time2->Message_Age)
+                | (time1->Hello_Time ^ time2->Hello_Time);
 
-    return true;
+    return 0 == diff;
 }
 
 static bool betterorsamePriority(port_priority_vector_t *vec1,
@@ -1663,48 +2069,13 @@ static bool betterorsamePriority(port_priority_vector_t *vec1,
                                  port_identifier_t pId2,
                                  bool cist)
 {
-    int result;
-
-    if(cist)
-    {
-        if(0 < (result = _ncmp(vec1->RootID, vec2->RootID)))
-            return false; /* worse */
-        else if(0 > result)
-            return true; /* better */
-        /* The same. Check further. */
-        if(0 < (result = _ncmp(vec1->ExtRootPathCost, vec2->ExtRootPathCost)))
-            return false; /* worse */
-        else if(0 > result)
-            return true; /* better */
-        /* The same. Check further. */
-    }
-
-    if(0 < (result = _ncmp(vec1->RRootID, vec2->RRootID)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
-
-    if(0 < (result = _ncmp(vec1->IntRootPathCost, vec2->IntRootPathCost)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
-
-    if(0 < (result = _ncmp(vec1->DesignatedBridgeID, vec2->DesignatedBridgeID)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
-
-    if(0 < (result = _ncmp(vec1->DesignatedPortID, vec2->DesignatedPortID)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
+    prio_key_t key1, key2;
 
     /* Port ID is a tie-breaker */
-    return cmp(pId1, <=, pId2);
+    prio_key(&key1, vec1, pId1, cist);
+    prio_key(&key2, vec2, pId2, cist);
+
+    return 0 >= prio_key_cmp(&key1, &key2);
 }
 
 /* 13.26.1 betterorsameInfo */
@@ -1773,18 +2144,20 @@ static void newTcWhile(per_tree_port_t *ptp)
         per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
 
         ptp->tcWhile = cist->portTimes.Hello_Time + 1;
+        ptp_tx_dirty(ptp);
         set_TopologyChange(tree, true, prt);
 
         if(0 == ptp->MSTID)
             prt->newInfo = true;
         else
-            prt->newInfoMsti = true;
+            sm_set_newInfoMsti(prt);
         return;
     }
 
     times_t *times = &tree->rootTimes;
 
     ptp->tcWhile = times->Max_Age + times->Forward_Delay;
+    ptp_tx_dirty(ptp);
     set_TopologyChange(tree, true, prt);
 }
 
@@ -1959,22 +2332,40 @@ static port_info_t rcvInfo(per_tree_port_t *ptp)
     return OtherInfo;
 }
 
+/* Condition of the 13.26.7 recordAgreement for the received message */
+static bool rcvdAgreement(per_tree_port_t *ptp)
+{
+    per_tree_port_t *cist;
+    port_t *prt = ptp->port;
+    bpdu_t *b = &(prt->rcvdBpduData);
+
+    if(0 == ptp->MSTID)
+    { /* CIST */
+        return rstpVersion(prt->bridge) && prt->operPointToPointMAC
+               && (b->flags & (1 << offsetAgreement));
+    }
+    /* MSTI */
+    cist = GET_CIST_PTP_FROM_PORT(prt);
+    return prt->operPointToPointMAC
+           && cmp(b->cistRootID, ==, cist->portPriority.RootID)
+           && cmp(b->cistExtRootPathCost, ==, cist->portPriority.ExtRootPathCost)
+           && cmp(b->cistRRootID, ==, cist->portPriority.RRootID)
+           && (ptp->rcvdMstiConfig->flags & (1 << offsetAgreement));
+}
+
 /* 13.26.7 recordAgreement */
 static void recordAgreement(per_tree_port_t *ptp)
 {
     bool cist_agreed, cist_proposing;
-    per_tree_port_t *cist;
     port_t *prt = ptp->port;
-    bpdu_t *b = &(prt->rcvdBpduData);
 
     if(0 == ptp->MSTID)
     { /* CIST */
-        if(rstpVersion(prt->bridge) && prt->operPointToPointMAC
-           && (b->flags & (1 << offsetAgreement))
-          )
+        if(rcvdAgreement(ptp))
         {
             ptp->agreed = true;
             ptp->proposing = false;
+            ptp_tx_dirty(ptp);
         }
         else
             ptp->agreed = false;
@@ -1985,20 +2376,16 @@ static void recordAgreement(per_tree_port_t *ptp)
             {
                 ptp->agreed = cist_agreed;
                 ptp->proposing = cist_proposing;
+                ptp_tx_dirty(ptp);
             }
         return;
     }
     /* MSTI */
-    cist = GET_CIST_PTP_FROM_PORT(prt);
-    if(prt->operPointToPointMAC 
-       && cmp(b->cistRootID, ==, cist->portPriority.RootID)
-       && cmp(b->cistExtRootPathCost, ==, cist->portPriority.ExtRootPathCost)
-       && cmp(b->cistRRootID, ==, cist->portPriority.RRootID)
-       && (ptp->rcvdMstiConfig->flags & (1 << offsetAgreement))
-      )
+    if(rcvdAgreement(ptp))
     {
         ptp->agreed = true;
         ptp->proposing = false;
+        ptp_tx_dirty(ptp);
     }
     else
         ptp->agreed = false;
@@ -2129,29 +2516,50 @@ static void set_fdbFlush(per_tree_port_t *ptp)
     if(rstpVersion(br))
     {
         ptp->fdbFlush = true;
-        ptp->calledFromFlushRoutine = true;
-        MSTP_OUT_flush_all_mstids(ptp);
-        ptp->calledFromFlushRoutine = false;
+        sm_flush_all_mstids(ptp);
     }
     else
     {
         per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
         unsigned int FwdDelay = cist->designatedTimes.Forward_Delay;
         /* Initiate rapid ageing */
-        MSTP_OUT_set_ageing_time(prt, FwdDelay);
-        assign(prt->rapidAgeingWhile, FwdDelay);
+        sm_rapid_ageing(prt, FwdDelay);
         ptp->fdbFlush = false;
     }
 }
 
+/* Map the MSTI configuration messages in the rcvdBpduData to the tree slots,
+ * first message for the MSTID wins. Slots without a message are NULL.
+ */
+static void rcvdMstiMsgsBySlot(port_t *prt,
+                               msti_configuration_message_t **slot2msg)
+{
+    msti_configuration_message_t *msti_msg;
+    int i;
+    __u16 msg_mstid;
+    __u8 slot;
+
+    memset(slot2msg, 0, NUM_TREE_SLOTS * sizeof(*slot2msg));
+    for(i = 0, msti_msg = prt->rcvdBpduData.mstConfiguration;
+        i < prt->rcvdBpduNumOfMstis;
+        ++i, ++msti_msg)
+    {
+        msg_mstid = __be16_to_cpu(msti_msg->mstiRRootID.s.priority) & 0x0FFF;
+        if((msg_mstid > MAX_MSTID)
+           || (NO_TREE_SLOT == (slot = prt->bridge->mstid2slot[msg_mstid]))
+           || slot2msg[slot])
+            continue;
+        slot2msg[slot] = msti_msg;
+    }
+}
+
 /* 13.26.12 setRcvdMsgs */
 static void setRcvdMsgs(port_t *prt)
 {
     msti_configuration_message_t *msti_msg;
-    int i;
-    __be16 msg_MSTID;
-    bool found;
     per_tree_port_t *ptp = GET_CIST_PTP_FROM_PORT(prt);
+    int i;
+    __u16 msg_mstid;
     ptp->rcvdMsg = true;
 
     /* 802.1Q-2005 says:
@@ -2162,37 +2570,32 @@ static void setRcvdMsgs(port_t *prt)
 
     if(prt->rcvdInternal)
     {
-        list_for_each_entry_continue(ptp, &prt->trees, port_list)
+        /* Find MSTIs for the messages conveyed in the BPDU.
+         * rcvdMsg is false for all trees here (PRSM is in RECEIVE only if
+         * !rcvdAnyMsg), so checking it makes first message for the MSTID win
+         * and skips messages with MSTID 0 (CIST flag is already set above).
+         */
+        for(i = 0, msti_msg = prt->rcvdBpduData.mstConfiguration;
+            i < prt->rcvdBpduNumOfMstis;
+            ++i, ++msti_msg)
         {
-            found = false;
-            /* Find if message for this MSTI is conveyed in the BPDU */
-            for(i = 0, msti_msg = prt->rcvdBpduData.mstConfiguration;
-                i < prt->rcvdBpduNumOfMstis;
-                ++i, ++msti_msg)
-            {
-                msg_MSTID = msti_msg->mstiRRootID.s.priority
-                            & __constant_cpu_to_be16(0x0FFF);
-                if(msg_MSTID == ptp->MSTID)
-                {
-                    found = true;
-                    break;
-                }
-            }
-            if(found)
-            {
-                ptp->rcvdMsg = true;
-                /* 802.1Q-2005 says:
-                 *   "Make available each MSTI message and the common parts of
-                 *    the CIST message priority (the CIST Root Identifier,
-                 *    External Root Path Cost and Regional Root Identifier)
-                 *    to the Port Information state machine for that MSTI"
-                 * We set pointer to the MSTI configuration message for
-                 * fast access, while do not anything special for common
-                 * parts of the message, as the whole message is available
-                 * in rcvdBpduData.
-                 */
-                ptp->rcvdMstiConfig = msti_msg;
-            }
+            msg_mstid = __be16_to_cpu(msti_msg->mstiRRootID.s.priority)
+                        & 0x0FFF;
+            if((NULL == (ptp = find_ptp_by_mstid(prt, msg_mstid)))
+               || ptp->rcvdMsg)
+                continue;
+            ptp->rcvdMsg = true;
+            /* 802.1Q-2005 says:
+             *   "Make available each MSTI message and the common parts of
+             *    the CIST message priority (the CIST Root Identifier,
+             *    External Root Path Cost and Regional Root Identifier)
+             *    to the Port Information state machine for that MSTI"
+             * We set pointer to the MSTI configuration message for
+             * fast access, while do not anything special for common
+             * parts of the message, as the whole message is available
+             * in rcvdBpduData.
+             */
+            ptp->rcvdMstiConfig = msti_msg;
         }
     }
 }
@@ -2295,11 +2698,42 @@ static void syncMaster(bridge_t *br)
                 ptp->agreed = false;
                 ptp->synced = false;
                 ptp->sync = true;
+                ptp_tx_dirty(ptp);
             }
         }
     }
 }
 
+/* The periodic BPDU is going out, helloWhen expired at prt->helloDue */
+static void hello_tx_account(port_t *prt)
+{
+    bridge_t *br = prt->bridge;
+    __u64 now = monotonic_ns();
+    unsigned long long delay = (now > prt->helloDue)
+                               ? (now - prt->helloDue) / 1000 : 0;
+
+    prt->helloDue = 0;
+    ++(br->numHelloTx);
+    log2_hist_add(br->helloTxDelay, delay);
+    if(delay > br->helloTxDelayMax)
+        br->helloTxDelayMax = delay;
+    if(MSTP_lag_limit_us && (delay > MSTP_lag_limit_us))
+    {
+        ++(br->lagWarnings);
+        INFO_PRTNAME(br, prt, "Hello sent %llu us after it was due, "
+                     "limit is %u us", delay, MSTP_lag_limit_us);
+    }
+}
+
+/* All BPDUs go out here, so that they are counted in the current slot */
+static inline void tx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
+{
+    ++(prt->bridge->txSlotTotal[prt->bridge->helloSlot]);
+    if(prt->helloDue)
+        hello_tx_account(prt);
+    MSTP_OUT_tx_bpdu(prt, bpdu, size);
+}
+
 /* 13.26.19 txConfig */
 static void txConfig(port_t *prt)
 {
@@ -2332,7 +2766,7 @@ static void txConfig(port_t *prt)
     b.ForwardDelay[0] = cist->designatedTimes.Forward_Delay;
     b.ForwardDelay[1] = 0;
 
-    MSTP_OUT_tx_bpdu(prt, &b, CONFIG_BPDU_SIZE);
+    tx_bpdu(prt, &b, CONFIG_BPDU_SIZE);
 }
 
 static inline __u8 message_role_from_port_role(per_tree_port_t *ptp)
@@ -2355,108 +2789,149 @@ static inline __u8 message_role_from_port_role(per_tree_port_t *ptp)
     }
 }
 
-/* 802.1Q-2005: 13.26.20 txMstp
- * 802.1Q-2011: 13.27.27 txRstp
+static void br_invalidate_tx_bpdus(bridge_t *br)
+{
+    port_t *prt;
+
+    FOREACH_PORT_IN_BRIDGE(prt, br)
+        prt->txBpduValid = false;
+}
+
+/* Fill the fields of prt->txBpdu which depend only on the configuration:
+ * protocol version, MST Configuration Identifier and number of MSTIs,
+ * and have all MSTI Configuration Messages refilled.
  */
-static void txMstp(port_t *prt)
+static void build_tx_bpdu(port_t *prt)
 {
-    bpdu_t b;
+    bpdu_t *b = &prt->txBpdu;
     bridge_t *br = prt->bridge;
-    per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
-    int msti_msgs_total_size;
     per_tree_port_t *ptp;
-    msti_configuration_message_t *msti_msg;
+    int msti_msgs_total_size;
 
-    if(prt->deleted || (roleDisabled == cist->role) || prt->dontTxmtBpdu)
-        return;
-
-    b.protocolIdentifier = 0;
-    b.bpduType = bpduTypeRST;
-    /* Standard says "{tcWhile, agree, proposing} ... for the Port".
-     * Which one {tcWhile, agree, proposing}?
-     * I guess that this means {tcWhile, agree, proposing} for the CIST.
-     * But that is only a guess and I could be wrong here ;)
-     */
-    b.flags = BPDU_FLAGS_ROLE_SET(message_role_from_port_role(cist));
-    if(0 != cist->tcWhile)
-        b.flags |= (1 << offsetTc);
-    if(cist->proposing)
-        b.flags |= (1 << offsetProposal);
-    if(cist->learning)
-        b.flags |= (1 << offsetLearnig);
-    if(cist->forwarding)
-        b.flags |= (1 << offsetForwarding);
-    if(cist->agree)
-        b.flags |= (1 << offsetAgreement);
-    assign(b.cistRootID, cist->designatedPriority.RootID);
-    assign(b.cistExtRootPathCost, cist->designatedPriority.ExtRootPathCost);
-    assign(b.cistRRootID, cist->designatedPriority.RRootID);
-    assign(b.cistPortID, cist->designatedPriority.DesignatedPortID);
-    b.MessageAge[0] = cist->designatedTimes.Message_Age;
-    b.MessageAge[1] = 0;
-    b.MaxAge[0] = cist->designatedTimes.Max_Age;
-    b.MaxAge[1] = 0;
-    b.HelloTime[0] = cist->portTimes.Hello_Time; /* ! use portTimes ! */
-    b.HelloTime[1] = 0;
-    b.ForwardDelay[0] = cist->designatedTimes.Forward_Delay;
-    b.ForwardDelay[1] = 0;
-
-    b.version1_len = 0;
+    /* Zeroes protocolIdentifier, version1_len and low octets of times */
+    memset(b, 0, sizeof(*b));
+    b->bpduType = bpduTypeRST;
 
     if(br->ForceProtocolVersion < protoMSTP)
     {
-        b.protocolVersion = protoRSTP;
-        MSTP_OUT_tx_bpdu(prt, &b, RST_BPDU_SIZE);
-        return;
+        b->protocolVersion = protoRSTP;
+        prt->txBpduSize = RST_BPDU_SIZE;
     }
+    else
+    {
+        b->protocolVersion = protoMSTP;
+        assign(b->mstConfigurationIdentifier, br->MstConfigId);
+        msti_msgs_total_size = 0;
+        ptp = GET_CIST_PTP_FROM_PORT(prt);
+        list_for_each_entry_continue(ptp, &prt->trees, port_list)
+        {
+            msti_msgs_total_size += sizeof(msti_configuration_message_t);
+            ptp->txMsgDirty = true;
+        }
+        prt->txMsgsDirty = true;
+        assign(b->version3_len, __cpu_to_be16(MST_BPDU_VER3LEN_WO_MSTI_MSGS
+                                              + msti_msgs_total_size));
+        prt->txBpduSize = MST_BPDU_SIZE_WO_MSTI_MSGS + msti_msgs_total_size;
+    }
+
+    prt->txBpduValid = true;
+}
+
+/* 802.1Q-2005: 13.26.20 txMstp
+ * 802.1Q-2011: 13.27.27 txRstp
+ */
+static void txMstp(port_t *prt)
+{
+    bpdu_t *b = &prt->txBpdu;
+    per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
+    per_tree_port_t *ptp;
+    msti_configuration_message_t *msti_msg;
 
-    b.protocolVersion = protoMSTP;
+    if(prt->deleted || (roleDisabled == cist->role) || prt->dontTxmtBpdu)
+        return;
 
-    /* MST specific fields */
-    assign(b.mstConfigurationIdentifier, br->MstConfigId);
-    assign(b.cistIntRootPathCost, cist->designatedPriority.IntRootPathCost);
-    assign(b.cistBridgeID, cist->designatedPriority.DesignatedBridgeID);
-    assign(b.cistRemainingHops, cist->designatedTimes.remainingHops);
+    if(!prt->txBpduValid)
+        build_tx_bpdu(prt);
 
-    msti_msgs_total_size = 0;
-    ptp = cist;
-    msti_msg = b.mstConfiguration;
-    /* 13.26.20.f) requires that msti configs should be inserted in
-     * MSTID order. This is met by inserting trees in port's list of trees
-     * in sorted (by MSTID) order (see MSTP_IN_create_msti) */
-    list_for_each_entry_continue(ptp, &prt->trees, port_list)
-    {
-        msti_msg->flags =
-            BPDU_FLAGS_ROLE_SET(message_role_from_port_role(ptp));
-        if(0 != ptp->tcWhile)
-            msti_msg->flags |= (1 << offsetTc);
-        if(ptp->proposing)
-            msti_msg->flags |= (1 << offsetProposal);
-        if(ptp->learning)
-            msti_msg->flags |= (1 << offsetLearnig);
-        if(ptp->forwarding)
-            msti_msg->flags |= (1 << offsetForwarding);
-        if(ptp->agree)
-            msti_msg->flags |= (1 << offsetAgreement);
-        if(ptp->master)
-            msti_msg->flags |= (1 << offsetMaster);
-        assign(msti_msg->mstiRRootID, ptp->designatedPriority.RRootID);
-        assign(msti_msg->mstiIntRootPathCost,
-               ptp->designatedPriority.IntRootPathCost);
-        msti_msg->bridgeIdentifierPriority =
-            GET_PRIORITY_FROM_IDENTIFIER(ptp->designatedPriority.DesignatedBridgeID);
-        msti_msg->portIdentifierPriority =
-            GET_PRIORITY_FROM_IDENTIFIER(ptp->designatedPriority.DesignatedPortID);
-        assign(msti_msg->remainingHops, ptp->designatedTimes.remainingHops);
-
-        msti_msgs_total_size += sizeof(msti_configuration_message_t);
-        ++msti_msg;
-    }
-
-    assign(b.version3_len, __cpu_to_be16(MST_BPDU_VER3LEN_WO_MSTI_MSGS
-                                         + msti_msgs_total_size));
-    MSTP_OUT_tx_bpdu(prt, &b, MST_BPDU_SIZE_WO_MSTI_MSGS
-                              + msti_msgs_total_size);
+    /* Standard says "{tcWhile, agree, proposing} ... for the Port".
+     * Which one {tcWhile, agree, proposing}?
+     * I guess that this means {tcWhile, agree, proposing} for the CIST.
+     * But that is only a guess and I could be wrong here ;)
+     */
+    b->flags = BPDU_FLAGS_ROLE_SET(message_role_from_port_role(cist));
+    if(0 != cist->tcWhile)
+        b->flags |= (1 << offsetTc);
+    if(cist->proposing)
+        b->flags |= (1 << offsetProposal);
+    if(cist->learning)
+        b->flags |= (1 << offsetLearnig);
+    if(cist->forwarding)
+        b->flags |= (1 << offsetForwarding);
+    if(cist->agree)
+        b->flags |= (1 << offsetAgreement);
+    assign(b->cistRootID, cist->designatedPriority.RootID);
+    assign(b->cistExtRootPathCost, cist->designatedPriority.ExtRootPathCost);
+    assign(b->cistRRootID, cist->designatedPriority.RRootID);
+    assign(b->cistPortID, cist->designatedPriority.DesignatedPortID);
+    b->MessageAge[0] = cist->designatedTimes.Message_Age;
+    b->MaxAge[0] = cist->designatedTimes.Max_Age;
+    b->HelloTime[0] = cist->portTimes.Hello_Time; /* ! use portTimes ! */
+    b->ForwardDelay[0] = cist->designatedTimes.Forward_Delay;
+
+    if(protoMSTP == b->protocolVersion)
+    {
+        /* MST specific fields */
+        assign(b->cistIntRootPathCost,
+               cist->designatedPriority.IntRootPathCost);
+        assign(b->cistBridgeID, cist->designatedPriority.DesignatedBridgeID);
+        assign(b->cistRemainingHops, cist->designatedTimes.remainingHops);
+
+        /* The MSTI messages are refilled only when ptp_tx_dirty() */
+        if(!__atomic_load_n(&prt->txMsgsDirty, __ATOMIC_RELAXED))
+            goto send;
+        prt->txMsgsDirty = false;
+        ptp = cist;
+        msti_msg = b->mstConfiguration;
+        /* 13.26.20.f) requires that msti configs should be inserted in
+         * MSTID order. This is met by inserting trees in port's list of
+         * trees in sorted (by MSTID) order (see MSTP_IN_create_msti) */
+        list_for_each_entry_continue(ptp, &prt->trees, port_list)
+        {
+            if(!ptp->txMsgDirty)
+            {
+                ++msti_msg;
+                continue;
+            }
+            ptp->txMsgDirty = false;
+            msti_msg->flags =
+                BPDU_FLAGS_ROLE_SET(message_role_from_port_role(ptp));
+            if(0 != ptp->tcWhile)
+                msti_msg->flags |= (1 << offsetTc);
+            if(ptp->proposing)
+                msti_msg->flags |= (1 << offsetProposal);
+            if(ptp->learning)
+                msti_msg->flags |= (1 << offsetLearnig);
+            if(ptp->forwarding)
+                msti_msg->flags |= (1 << offsetForwarding);
+            if(ptp->agree)
+                msti_msg->flags |= (1 << offsetAgreement);
+            if(ptp->master)
+                msti_msg->flags |= (1 << offsetMaster);
+            assign(msti_msg->mstiRRootID, ptp->designatedPriority.RRootID);
+            assign(msti_msg->mstiIntRootPathCost,
+                   ptp->designatedPriority.IntRootPathCost);
+            msti_msg->bridgeIdentifierPriority =
+                GET_PRIORITY_FROM_IDENTIFIER(ptp->designatedPriority.DesignatedBridgeID);
+            msti_msg->portIdentifierPriority =
+                GET_PRIORITY_FROM_IDENTIFIER(ptp->designatedPriority.DesignatedPortID);
+            assign(msti_msg->remainingHops,
+                   ptp->designatedTimes.remainingHops);
+            ++msti_msg;
+        }
+    }
+
+send:
+    tx_bpdu(prt, b, prt->txBpduSize);
 }
 
 /* 13.26.a) txTcn */
@@ -2472,7 +2947,7 @@ static void txTcn(port_t *prt)
     b.protocolVersion = protoSTP;
     b.bpduType = bpduTypeTCN;
 
-    MSTP_OUT_tx_bpdu(prt, &b, TCN_BPDU_SIZE);
+    tx_bpdu(prt, &b, TCN_BPDU_SIZE);
 }
 
 /* 13.26.21 updtBPDUVersion */
@@ -2525,6 +3000,83 @@ static void updtRcvdInfoWhile(per_tree_port_t *ptp)
         ptp->rcvdInfoWhile = 0;
 }
 
+/* Repeated BPDU fast path.
+ * Return true if the BPDU is byte-identical to the previous one and
+ * processing it by the state machines would only refresh the info timers:
+ * the port is in a steady state (PRSM in RECEIVE, PISM in CURRENT with
+ * received info equal to the message, flags and agreements unchanged)
+ * and the message has no TC, TC Ack or proposal and conveys the
+ * Designated role, so that rcvInfo() would return RepeatedDesignatedInfo.
+ * In that case do what PRSM RECEIVE and PISM REPEATED_DESIGNATED would do
+ * to the timers and skip the state machines run.
+ */
+static bool rx_bpdu_repeated(port_t *prt, bpdu_t *bpdu, int size)
+{
+    per_tree_port_t *ptp, *cist = GET_CIST_PTP_FROM_PORT(prt);
+    msti_configuration_message_t *msti_msg;
+    msti_configuration_message_t *slot2msg[NUM_TREE_SLOTS];
+    const __u8 bad_flags = (1 << offsetTc) | (1 << offsetProposal);
+
+    if((size != prt->rcvdBpduSize)
+       || (0 != memcmp(&prt->rcvdBpduData, bpdu, size)))
+        return false;
+
+    if((protoRSTP > bpdu->protocolVersion)
+       || (bpdu->flags & (bad_flags | (1 << offsetTcAck)))
+       || (encodedRoleDesignated != BPDU_FLAGS_ROLE_GET(bpdu->flags)))
+        return false;
+
+    if(!prt->portEnabled || (PRSM_RECEIVE != prt->PRSM_state)
+       || prt->operEdge || !prt->rcvdRSTP || prt->BaInconsistent
+       || (prt->infoInternal != prt->rcvdInternal))
+        return false;
+
+    if(prt->rcvdInternal)
+        rcvdMstiMsgsBySlot(prt, slot2msg);
+
+    FOREACH_PTP_IN_PORT(ptp, prt)
+    {
+        if(ptp->rcvdMsg)
+            return false;
+        if(ptp != cist)
+        {
+            if(!prt->rcvdInternal)
+            { /* MSTIs follow the CIST, see recordAgreement/recordProposal */
+                if((ptp->agreed != cist->agreed)
+                   || (ptp->proposing != cist->proposing)
+                   || (ptp->proposed != cist->proposed))
+                    return false;
+                continue;
+            }
+            if(NULL == (msti_msg = slot2msg[ptp->tree->slot]))
+                continue; /* This MSTI is not affected by the BPDU */
+            if((msti_msg != ptp->rcvdMstiConfig)
+               || (msti_msg->flags & bad_flags)
+               || (encodedRoleDesignated
+                   != BPDU_FLAGS_ROLE_GET(msti_msg->flags)))
+                return false;
+        }
+        if((PISM_CURRENT != ptp->PISM_state) || (ioReceived != ptp->infoIs)
+           || ptp->updtInfo
+           || !samePriorityAndTimers(&ptp->msgPriority, &ptp->portPriority,
+                                     &ptp->msgTimes, &ptp->portTimes,
+                                     ptp == cist)
+           || (ptp->agreed != rcvdAgreement(ptp))
+           || (ptp->agreed && ptp->proposing))
+            return false;
+    }
+
+    /* PRSM RECEIVE */
+    assign(prt->edgeDelayWhile, prt->bridge->Migrate_Time);
+    /* PISM REPEATED_DESIGNATED */
+    FOREACH_PTP_IN_PORT(ptp, prt)
+    {
+        if((ptp == cist) || (prt->rcvdInternal && slot2msg[ptp->tree->slot]))
+            updtRcvdInfoWhile(ptp);
+    }
+    return true;
+}
+
 static void updtbrAssuRcvdInfoWhile(port_t *prt)
 {
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
@@ -2539,6 +3091,7 @@ static void updtRolesDisabledTree(tree_t *tree)
 
     FOREACH_PTP_IN_TREE(ptp, tree)
         ptp->selectedRole = roleDisabled;
+    tree->rolesFullRecalc = true;
 }
 
 /* Aux function, not in standard.
@@ -2553,62 +3106,199 @@ static void reselectMSTIs(port_t *prt)
         ptp->reselect = true;
 }
 
-/* 13.26.23 updtRolesTree */
-static void updtRolesTree(tree_t *tree)
+/* Incremental role selection.
+ * Role selection (updtRolesTree) is run for every BPDU which brings new
+ * information, and looking at all ports of the tree each time does not
+ * scale to bridges with many ports. Instead, each tree keeps:
+ *  - rootHeap, a min-heap of the ports which can become Root Port, keyed
+ *    by their root path priority vector (13.26.23 b);
+ *  - rolesDirty, a list of the ports whose inputs of the selection
+ *    changed since the last run: state of the PISM/PRTSM, rcvdInternal,
+ *    infoInternal, sendRSTP, path costs, port priority, restrictedRole.
+ * Changes of the bridge configuration (BridgeIdentifier, BridgeTimes)
+ * set rolesFullRecalc and the next selection looks at all ports.
+ * With "mstpd -R" every incremental selection is checked against the full
+ * one and the differences are logged.
+ */
+bool MSTP_verify_role_selection = false;
+
+static void ptp_roles_dirty(per_tree_port_t *ptp)
 {
-    per_tree_port_t *ptp, *root_ptp = NULL;
-    port_priority_vector_t root_path_priority;
-    bridge_identifier_t prevRRootID = tree->rootPriority.RRootID;
-    __be32 prevExtRootPathCost = tree->rootPriority.ExtRootPathCost;
-    bool cist = (0 == tree->MSTID);
+    if(ptp->rolesDirty)
+        return;
+    ptp->rolesDirty = true;
+    list_add_tail(&ptp->roles_dirty_list, &ptp->tree->rolesDirty);
+}
 
-    /* a), b) Select new root priority vector = {rootPriority, rootPortId} */
-      /* Initial value = bridge priority vector = {BridgePriority, 0} */
-    assign(tree->rootPriority, tree->BridgePriority);
-    assign(tree->rootPortId, __constant_cpu_to_be16(0));
-      /* Now check root path priority vectors of all ports in tree and see if
-       * there is a better vector */
-    FOREACH_PTP_IN_TREE(ptp, tree)
+static void prt_roles_dirty(port_t *prt)
+{
+    per_tree_port_t *ptp;
+
+    FOREACH_PTP_IN_PORT(ptp, prt)
+        ptp_roles_dirty(ptp);
+}
+
+static inline bool root_heap_less(per_tree_port_t *ptp1,
+                                  per_tree_port_t *ptp2)
+{
+    return 0 > prio_key_cmp(&ptp1->rootPathKey, &ptp2->rootPathKey);
+}
+
+/* Move ptp at position pos up or down to its place in the heap */
+static void root_heap_sift(tree_t *tree, int pos)
+{
+    per_tree_port_t **heap = tree->rootHeap;
+    per_tree_port_t *ptp = heap[pos];
+    int parent, child;
+
+    while((0 < pos) && root_heap_less(ptp, heap[parent = (pos - 1) / 2]))
     {
-        port_t *prt = ptp->port;
-        /* 802.1Q says to calculate root priority vector only if port
-         * is not Disabled, but check (infoIs == ioReceived) covers
-         * the case (infoIs != ioDisabled).
-         */
-        if((ioReceived == ptp->infoIs) && !prt->restrictedRole
-           && cmp(ptp->portPriority.DesignatedBridgeID, !=,
-                  tree->BridgeIdentifier)
-          )
+        heap[pos] = heap[parent];
+        heap[pos]->rootHeapPos = pos;
+        pos = parent;
+    }
+    while((child = 2 * pos + 1) < tree->rootHeapSize)
+    {
+        if((child + 1 < tree->rootHeapSize)
+           && root_heap_less(heap[child + 1], heap[child]))
+            ++child;
+        if(!root_heap_less(heap[child], ptp))
+            break;
+        heap[pos] = heap[child];
+        heap[pos]->rootHeapPos = pos;
+        pos = child;
+    }
+    heap[pos] = ptp;
+    ptp->rootHeapPos = pos;
+}
+
+static bool root_heap_insert(tree_t *tree, per_tree_port_t *ptp)
+{
+    if(tree->rootHeapSize == tree->rootHeapAlloc)
+    {
+        int new_alloc = tree->rootHeapAlloc ? 2 * tree->rootHeapAlloc : 16;
+        per_tree_port_t **new_heap =
+            realloc(tree->rootHeap, new_alloc * sizeof(*new_heap));
+        if(!new_heap)
         {
-            root_path_priority = ptp->portPriority;
-            if(prt->rcvdInternal)
-            {
-                assign(root_path_priority.IntRootPathCost,
-                       __cpu_to_be32(__be32_to_cpu(root_path_priority.IntRootPathCost)
-                                     + ptp->InternalPortPathCost)
-                      );
-            }
-            else if(cist) /* Yes, this check might be superfluous,
-                           * but I want to be on the safe side */
-            {
-                assign(root_path_priority.ExtRootPathCost,
-                       __cpu_to_be32(__be32_to_cpu(root_path_priority.ExtRootPathCost)
-                                     + prt->ExternalPortPathCost)
-                      );
-                assign(root_path_priority.RRootID, tree->BridgeIdentifier);
-                assign(root_path_priority.IntRootPathCost,
-                       __constant_cpu_to_be32(0));
-            }
-            if(betterorsamePriority(&root_path_priority, &tree->rootPriority,
-                                    ptp->portId, tree->rootPortId, cist))
-            {
-                assign(tree->rootPriority, root_path_priority);
-                assign(tree->rootPortId, ptp->portId);
-                root_ptp = ptp;
-            }
+            ERROR_BRNAME(tree->bridge, "Out of memory");
+            return false;
         }
+        tree->rootHeap = new_heap;
+        tree->rootHeapAlloc = new_alloc;
+    }
+    tree->rootHeap[tree->rootHeapSize] = ptp;
+    ptp->rootHeapPos = tree->rootHeapSize++;
+    root_heap_sift(tree, ptp->rootHeapPos);
+    return true;
+}
+
+static void root_heap_remove(tree_t *tree, per_tree_port_t *ptp)
+{
+    int pos = ptp->rootHeapPos;
+
+    ptp->rootHeapPos = -1;
+    if(pos != --tree->rootHeapSize)
+    {
+        tree->rootHeap[pos] = tree->rootHeap[tree->rootHeapSize];
+        tree->rootHeap[pos]->rootHeapPos = pos;
+        root_heap_sift(tree, pos);
     }
+}
 
+/* Called before ptp is freed */
+static void ptp_roles_forget(per_tree_port_t *ptp)
+{
+    if(ptp->rolesDirty)
+    {
+        list_del(&ptp->roles_dirty_list);
+        ptp->rolesDirty = false;
+    }
+    if(0 <= ptp->rootHeapPos)
+        root_heap_remove(ptp->tree, ptp);
+}
+
+/* 13.26.23 b) Calculate root path priority vector for the port.
+ * Returns false if the port can't be selected as Root Port.
+ */
+static bool calcRootPathPriority(per_tree_port_t *ptp,
+                                 port_priority_vector_t *root_path_priority)
+{
+    port_t *prt = ptp->port;
+    tree_t *tree = ptp->tree;
+
+    /* 802.1Q says to calculate root priority vector only if port
+     * is not Disabled, but check (infoIs == ioReceived) covers
+     * the case (infoIs != ioDisabled).
+     */
+    if((ioReceived != ptp->infoIs) || prt->restrictedRole
+       || (ptp->portPriority.DesignatedBridgeID.u
+           == tree->BridgeIdentifier.u)
+      )
+        return false;
+
+    *root_path_priority = ptp->portPriority;
+    if(prt->rcvdInternal)
+    {
+        assign(root_path_priority->IntRootPathCost,
+               __cpu_to_be32(__be32_to_cpu(root_path_priority->IntRootPathCost)
+                             + ptp->InternalPortPathCost)
+              );
+    }
+    else if(0 == tree->MSTID) /* Yes, this check might be superfluous,
+                               * but I want to be on the safe side */
+    {
+        assign(root_path_priority->ExtRootPathCost,
+               __cpu_to_be32(__be32_to_cpu(root_path_priority->ExtRootPathCost)
+                             + prt->ExternalPortPathCost)
+              );
+        assign(root_path_priority->RRootID, tree->BridgeIdentifier);
+        assign(root_path_priority->IntRootPathCost,
+               __constant_cpu_to_be32(0));
+    }
+    return true;
+}
+
+/* Recalculate root path priority vector of the port and update its place
+ * in the rootHeap. Returns false if out of memory.
+ */
+static bool root_heap_update(per_tree_port_t *ptp)
+{
+    port_priority_vector_t root_path_priority;
+    tree_t *tree = ptp->tree;
+
+    if(!calcRootPathPriority(ptp, &root_path_priority))
+    {
+        if(0 <= ptp->rootHeapPos)
+            root_heap_remove(tree, ptp);
+        return true;
+    }
+    prio_key(&ptp->rootPathKey, &root_path_priority, ptp->portId,
+             0 == tree->MSTID);
+    if(0 <= ptp->rootHeapPos)
+    {
+        root_heap_sift(tree, ptp->rootHeapPos);
+        return true;
+    }
+    return root_heap_insert(tree, ptp);
+}
+
+static bool root_heap_rebuild(tree_t *tree)
+{
+    per_tree_port_t *ptp;
+
+    FOREACH_PTP_IN_TREE(ptp, tree)
+        ptp->rootHeapPos = -1;
+    tree->rootHeapSize = 0;
+    FOREACH_PTP_IN_TREE(ptp, tree)
+        if(!root_heap_update(ptp))
+            return false;
+    return true;
+}
+
+/* 13.26.23 c) Set new rootTimes */
+static void updtRootTimes(tree_t *tree, per_tree_port_t *root_ptp)
+{
     /* 802.1q-2005 says, that at some point we need compare portTimes with
      * "... one for the Root Port ...". Bad IEEE! Why not mention explicit
      * var names??? (see 13.26.23.g) for instance)
@@ -2620,8 +3310,6 @@ static void updtRolesTree(tree_t *tree)
      * NOTE: Both Alex Rozin (author of rstplib) and Srinivas Aji (author
      *   of rstpd) also compare portTimes with designatedTimes.
      */
-
-    /* c) Set new rootTimes */
     if(root_ptp)
     {
         assign(tree->rootTimes, root_ptp->portTimes);
@@ -2636,168 +3324,402 @@ static void updtRolesTree(tree_t *tree)
     }
     else
     {
-        assign(tree->rootTimes, tree->BridgeTimes);
+        assign(tree->rootTimes, tree->BridgeTimes);
+    }
+}
+
+/* 13.26.23 d) - m) for one port, root priority vector is already selected */
+static void updtRolePort(per_tree_port_t *ptp, per_tree_port_t *root_ptp)
+{
+    port_t *prt = ptp->port;
+    tree_t *tree = ptp->tree;
+    per_tree_port_t *cist_tree = GET_CIST_PTP_FROM_PORT(prt);
+    bool cist = (0 == tree->MSTID);
+
+    /* d) Set new designatedPriority */
+    assign(ptp->designatedPriority, tree->rootPriority);
+    assign(ptp->designatedPriority.DesignatedBridgeID,
+           tree->BridgeIdentifier);
+    assign(ptp->designatedPriority.DesignatedPortID, ptp->portId);
+    /* I am not sure which condition to check here, as 802.1Q-2005 says:
+     * "... If {Port} is attached to a LAN that has one or more STP Bridges
+     *  attached (as determined by the Port Protocol Migration state
+     * machine) ..." -- why not to mention explicit var name? Bad IEEE.
+     * But I guess that sendSTP (i.e. !sendRSTP) var will do ;)
+     */
+    if(cist && !prt->sendRSTP)
+        assign(ptp->designatedPriority.RRootID, tree->BridgeIdentifier);
+
+    /* e) Set new designatedTimes */
+    assign(ptp->designatedTimes, tree->rootTimes);
+    /* Keep the configured Hello_Time for the port.
+     * NOTE: this is in accordance with the spirit of 802.1D-2004.
+     *    Also, this does not contradict 802.1Q-2005(-2011), as in these
+     *    standards both designatedTimes and rootTimes structures
+     *    don't have Hello_Time member.
+     */
+    assign(ptp->designatedTimes.Hello_Time, ptp->portTimes.Hello_Time);
+    ptp_tx_dirty(ptp);
+
+    /* f) Set Disabled role */
+    if(ioDisabled == ptp->infoIs)
+    {
+        ptp->selectedRole = roleDisabled;
+        return;
+    }
+
+    if(!cist && (ioReceived == cist_tree->infoIs) && !prt->infoInternal)
+    {
+        /* g) Set role for the boundary port in MSTI */
+        if(roleRoot == cist_tree->selectedRole)
+        {
+            ptp->selectedRole = roleMaster;
+            if(!samePriorityAndTimers(&ptp->portPriority,
+                                      &ptp->designatedPriority,
+                                      &ptp->portTimes,
+                                      &ptp->designatedTimes,
+                                      /*cist*/ false))
+                ptp->updtInfo = true;
+            return;
+        }
+        /* Bad IEEE again! It says in 13.26.23 g) 2) that
+         * MSTI state should follow CIST state only for the case of
+         * Alternate port. This is obviously wrong!
+         * In the descriptive clause 13.13 f) it says:
+         *  "At a Boundary Port frames allocated to the CIST and
+         *   all MSTIs are forwarded or not forwarded alike.
+         *   This is because Port Role assignments are such that
+         *   if the CIST Port Role is Root Port, the MSTI Port Role
+         *   will be Master Port, and if the CIST Port Role is
+         *   Designated Port, Alternate Port, Backup Port,
+         *   or Disabled Port, each MSTI’s Port Role will be the same."
+         * So, ignore wrong 13.26.23 g) 2) and do as stated in 13.13 f) !
+         */
+        /* if(roleAlternate == cist_tree->selectedRole) */
+        {
+            ptp->selectedRole = cist_tree->selectedRole;
+            if(!samePriorityAndTimers(&ptp->portPriority,
+                                      &ptp->designatedPriority,
+                                      &ptp->portTimes,
+                                      &ptp->designatedTimes,
+                                      /*cist*/ false))
+                ptp->updtInfo = true;
+            return;
+        }
+    }
+ /* else if(cist || (ioReceived != cist_tree->infoIs) || prt->infoInternal) */
+
+    /* h) Set role for the aged info */
+    if(ioAged == ptp->infoIs)
+    {
+        ptp->selectedRole = roleDesignated;
+        ptp->updtInfo = true;
+        return;
+    }
+    /* i) Set role for the mine info */
+    if(ioMine == ptp->infoIs)
+    {
+        ptp->selectedRole = roleDesignated;
+        if(!samePriorityAndTimers(&ptp->portPriority,
+                                  &ptp->designatedPriority,
+                                  &ptp->portTimes,
+                                  &ptp->designatedTimes,
+                                  cist))
+            ptp->updtInfo = true;
+        return;
+    }
+    if(ioReceived == ptp->infoIs)
+    {
+        /* j) Set Root role */
+        if(root_ptp == ptp)
+        {
+            ptp->selectedRole = roleRoot;
+            ptp->updtInfo = false;
+        }
+        else
+        {
+            if(betterorsamePriority(&ptp->portPriority,
+                                     &ptp->designatedPriority,
+                                     0, 0, cist))
+            {
+                if(ptp->portPriority.DesignatedBridgeID.u
+                   != tree->BridgeIdentifier.u)
+                {
+                    /* k) Set Alternate role */
+                    ptp->selectedRole = roleAlternate;
+                }
+                else
+                {
+                    /* l) Set Backup role */
+                    ptp->selectedRole = roleBackup;
+                }
+                /* reset updtInfo for both k) and l) */
+                ptp->updtInfo = false;
+            }
+            else /* designatedPriority is better than portPriority */
+            {
+                /* m) Set Designated role */
+                ptp->selectedRole = roleDesignated;
+                ptp->updtInfo = true;
+            }
+        }
+        /* This is not in standard. But we really should set here
+         * reselect for all MSTIs so that updtRolesTree is called
+         * for each MSTI and due to above clause g) MSTI role is
+         * changed to Master or reflects CIST port role.
+         * Because in 802.1Q-2005 this will not happen when BPDU arrives
+         * at boundary port - the rcvdMsg is not set for the MSTIs and
+         * updtRolesTree is not called.
+         * Bad IEEE !!!
+         */
+        if(cist && (ptp->selectedRole != ptp->role))
+            reselectMSTIs(prt);
+    }
+}
+
+/* updtRolePort() and the marking of the MSTIs of the port, whose
+ * roles follow CIST selectedRole on the boundary ports (13.26.23 g)
+ */
+static void updtRolePortMark(per_tree_port_t *ptp, per_tree_port_t *root_ptp)
+{
+    port_role_t prevSelectedRole = ptp->selectedRole;
+    per_tree_port_t *msti_ptp = ptp;
+
+    updtRolePort(ptp, root_ptp);
+    if((0 == ptp->MSTID) && (prevSelectedRole != ptp->selectedRole))
+        list_for_each_entry_continue(msti_ptp, &ptp->port->trees, port_list)
+            ptp_roles_dirty(msti_ptp);
+}
+
+static void syncMasterIfRRootChanged(tree_t *tree,
+                                     bridge_identifier_t prevRRootID,
+                                     __be32 prevExtRootPathCost)
+{
+    /* syncMaster */
+    if((0 == tree->MSTID) && (tree->rootPriority.RRootID.u != prevRRootID.u)
+       && ((0 != tree->rootPriority.ExtRootPathCost)
+           || (0 != prevExtRootPathCost)
+          )
+      )
+        syncMaster(tree->bridge);
+}
+
+/* 13.26.23 updtRolesTree, as in the standard: look at all ports */
+static void updtRolesTreeFull(tree_t *tree)
+{
+    per_tree_port_t *ptp, *root_ptp = NULL;
+    port_priority_vector_t root_path_priority;
+    prio_key_t root_key, key;
+    bridge_identifier_t prevRRootID = tree->rootPriority.RRootID;
+    __be32 prevExtRootPathCost = tree->rootPriority.ExtRootPathCost;
+    bool cist = (0 == tree->MSTID);
+
+    /* a), b) Select new root priority vector = {rootPriority, rootPortId} */
+      /* Initial value = bridge priority vector = {BridgePriority, 0} */
+    assign(tree->rootPriority, tree->BridgePriority);
+    assign(tree->rootPortId, __constant_cpu_to_be16(0));
+    prio_key(&root_key, &tree->rootPriority, tree->rootPortId, cist);
+      /* Now check root path priority vectors of all ports in tree and see if
+       * there is a better vector */
+    FOREACH_PTP_IN_TREE(ptp, tree)
+    {
+        if(!calcRootPathPriority(ptp, &root_path_priority))
+            continue;
+        /* betterorsamePriority(), with the key of the best vector
+         * so far kept across iterations */
+        prio_key(&key, &root_path_priority, ptp->portId, cist);
+        if(0 >= prio_key_cmp(&key, &root_key))
+        {
+            assign(tree->rootPriority, root_path_priority);
+            assign(tree->rootPortId, ptp->portId);
+            root_key = key;
+            root_ptp = ptp;
+        }
+    }
+
+    /* c) Set new rootTimes */
+    updtRootTimes(tree, root_ptp);
+
+    syncMasterIfRRootChanged(tree, prevRRootID, prevExtRootPathCost);
+
+    /* d) - m) */
+    FOREACH_PTP_IN_TREE(ptp, tree)
+        updtRolePortMark(ptp, root_ptp);
+}
+
+/* 13.26.23 updtRolesTree, using rootHeap and rolesDirty.
+ * Root priority vector is the better one of the bridge priority vector
+ * and root path priority vector of the rootHeap top. Roles of the ports
+ * not in rolesDirty can change only if rootPriority, rootPortId or
+ * rootTimes change.
+ * Returns false if out of memory, the tree is left for the full selection.
+ */
+static bool updtRolesTreeIncr(tree_t *tree)
+{
+    per_tree_port_t *ptp, *root_ptp = NULL;
+    port_priority_vector_t prevRootPriority = tree->rootPriority;
+    port_identifier_t prevRootPortId = tree->rootPortId;
+    times_t prevRootTimes = tree->rootTimes;
+    prio_key_t bridge_key;
+
+    list_for_each_entry(ptp, &tree->rolesDirty, roles_dirty_list)
+        if(!root_heap_update(ptp))
+            return false;
+
+    /* a), b) */
+    assign(tree->rootPriority, tree->BridgePriority);
+    assign(tree->rootPortId, __constant_cpu_to_be16(0));
+    if(tree->rootHeapSize)
+    {
+        ptp = tree->rootHeap[0];
+        prio_key(&bridge_key, &tree->BridgePriority, 0, 0 == tree->MSTID);
+        if(0 >= prio_key_cmp(&ptp->rootPathKey, &bridge_key))
+        {
+            calcRootPathPriority(ptp, &tree->rootPriority);
+            assign(tree->rootPortId, ptp->portId);
+            root_ptp = ptp;
+        }
+    }
+
+    /* c) */
+    updtRootTimes(tree, root_ptp);
+
+    syncMasterIfRRootChanged(tree, prevRootPriority.RRootID,
+                             prevRootPriority.ExtRootPathCost);
+
+    /* d) - m) */
+    if(memcmp(&prevRootPriority, &tree->rootPriority, sizeof(prevRootPriority))
+       || (prevRootPortId != tree->rootPortId)
+       || memcmp(&prevRootTimes, &tree->rootTimes, sizeof(prevRootTimes)))
+    {
+        FOREACH_PTP_IN_TREE(ptp, tree)
+            updtRolePortMark(ptp, root_ptp);
+    }
+    else
+    {
+        list_for_each_entry(ptp, &tree->rolesDirty, roles_dirty_list)
+            updtRolePortMark(ptp, root_ptp);
+    }
+    return true;
+}
+
+/* Result of the role selection for one port, see updtRolesTreeVerify() */
+typedef struct
+{
+    port_role_t selectedRole;
+    bool updtInfo;
+    port_priority_vector_t designatedPriority;
+    times_t designatedTimes;
+} role_result_t;
+
+/* Run incremental selection, then the full one, and compare the results */
+static void updtRolesTreeVerify(tree_t *tree)
+{
+    per_tree_port_t *ptp;
+    port_priority_vector_t rootPriority;
+    port_identifier_t rootPortId;
+    times_t rootTimes;
+    role_result_t *results;
+    int i, num_ports = 0;
+    bool mismatch = false;
+
+    FOREACH_PTP_IN_TREE(ptp, tree)
+        ++num_ports;
+    if(!(results = calloc(num_ports + 1, sizeof(*results))))
+    {
+        ERROR_BRNAME(tree->bridge, "Out of memory");
+        updtRolesTreeFull(tree);
+        tree->rolesFullRecalc = true;
+        return;
+    }
+
+    if(!updtRolesTreeIncr(tree))
+    {
+        free(results);
+        updtRolesTreeFull(tree);
+        tree->rolesFullRecalc = true;
+        return;
+    }
+    assign(rootPriority, tree->rootPriority);
+    assign(rootPortId, tree->rootPortId);
+    assign(rootTimes, tree->rootTimes);
+    i = 0;
+    FOREACH_PTP_IN_TREE(ptp, tree)
+    {
+        results[i].selectedRole = ptp->selectedRole;
+        results[i].updtInfo = ptp->updtInfo;
+        assign(results[i].designatedPriority, ptp->designatedPriority);
+        assign(results[i].designatedTimes, ptp->designatedTimes);
+        ++i;
+    }
+
+    updtRolesTreeFull(tree);
+
+    if(memcmp(&rootPriority, &tree->rootPriority, sizeof(rootPriority))
+       || (rootPortId != tree->rootPortId)
+       || memcmp(&rootTimes, &tree->rootTimes, sizeof(rootTimes)))
+    {
+        ERROR_BRNAME(tree->bridge,
+                     "MSTI %hu: incremental role selection: root port %04hX,"
+                     " full: %04hX", __be16_to_cpu(tree->MSTID),
+                     __be16_to_cpu(rootPortId),
+                     __be16_to_cpu(tree->rootPortId));
+        mismatch = true;
     }
-
+    i = 0;
     FOREACH_PTP_IN_TREE(ptp, tree)
     {
-        port_t *prt = ptp->port;
-
-        /* d) Set new designatedPriority */
-        assign(ptp->designatedPriority, tree->rootPriority);
-        assign(ptp->designatedPriority.DesignatedBridgeID,
-               tree->BridgeIdentifier);
-        assign(ptp->designatedPriority.DesignatedPortID, ptp->portId);
-        /* I am not sure which condition to check here, as 802.1Q-2005 says:
-         * "... If {Port} is attached to a LAN that has one or more STP Bridges
-         *  attached (as determined by the Port Protocol Migration state
-         * machine) ..." -- why not to mention explicit var name? Bad IEEE.
-         * But I guess that sendSTP (i.e. !sendRSTP) var will do ;)
-         */
-        if(cist && !prt->sendRSTP)
-            assign(ptp->designatedPriority.RRootID, tree->BridgeIdentifier);
-
-        /* e) Set new designatedTimes */
-        assign(ptp->designatedTimes, tree->rootTimes);
-        /* Keep the configured Hello_Time for the port.
-         * NOTE: this is in accordance with the spirit of 802.1D-2004.
-         *    Also, this does not contradict 802.1Q-2005(-2011), as in these
-         *    standards both designatedTimes and rootTimes structures
-         *    don't have Hello_Time member.
-         */
-        assign(ptp->designatedTimes.Hello_Time, ptp->portTimes.Hello_Time);
+        if((results[i].selectedRole != ptp->selectedRole)
+           || (results[i].updtInfo != ptp->updtInfo)
+           || memcmp(&results[i].designatedPriority, &ptp->designatedPriority,
+                     sizeof(ptp->designatedPriority))
+           || memcmp(&results[i].designatedTimes, &ptp->designatedTimes,
+                     sizeof(ptp->designatedTimes)))
+        {
+            ERROR_MSTINAME(tree->bridge, ptp->port, ptp,
+                           "incremental role selection: role %d updtInfo %d,"
+                           " full: role %d updtInfo %d",
+                           results[i].selectedRole, results[i].updtInfo,
+                           ptp->selectedRole, ptp->updtInfo);
+            mismatch = true;
+        }
+        ++i;
     }
+    free(results);
 
-    /* syncMaster */
-    if(cist && cmp(tree->rootPriority.RRootID, !=, prevRRootID)
-       && ((0 != tree->rootPriority.ExtRootPathCost)
-           || (0 != prevExtRootPathCost)
-          )
-      )
-        syncMaster(tree->bridge);
+    /* The full selection result is in place now, rebuild the heap */
+    if(mismatch)
+        tree->rolesFullRecalc = true;
+}
 
-    FOREACH_PTP_IN_TREE(ptp, tree)
+/* 13.26.23 updtRolesTree */
+static void updtRolesTree(tree_t *tree)
+{
+    per_tree_port_t *ptp, *nxt;
+    bool cist = (0 == tree->MSTID);
+
+    if(tree->rolesFullRecalc)
     {
-        port_t *prt = ptp->port;
-        per_tree_port_t *cist_tree = GET_CIST_PTP_FROM_PORT(prt);
+        updtRolesTreeFull(tree);
+        tree->rolesFullRecalc = !root_heap_rebuild(tree);
+    }
+    else if(MSTP_verify_role_selection)
+        updtRolesTreeVerify(tree);
+    else if(!updtRolesTreeIncr(tree))
+    {
+        updtRolesTreeFull(tree);
+        tree->rolesFullRecalc = true;
+    }
 
-        /* f) Set Disabled role */
-        if(ioDisabled == ptp->infoIs)
-        {
-            ptp->selectedRole = roleDisabled;
+    list_for_each_entry_safe(ptp, nxt, &tree->rolesDirty, roles_dirty_list)
+    {
+        /* Full selection calls reselectMSTIs() for such port every time,
+         * so keep it for the next run */
+        if(cist && (ioReceived == ptp->infoIs)
+           && (ptp->selectedRole != ptp->role))
             continue;
-        }
-
-        if(!cist && (ioReceived == cist_tree->infoIs) && !prt->infoInternal)
-        {
-            /* g) Set role for the boundary port in MSTI */
-            if(roleRoot == cist_tree->selectedRole)
-            {
-                ptp->selectedRole = roleMaster;
-                if(!samePriorityAndTimers(&ptp->portPriority,
-                                          &ptp->designatedPriority,
-                                          &ptp->portTimes,
-                                          &ptp->designatedTimes,
-                                          /*cist*/ false))
-                    ptp->updtInfo = true;
-                continue;
-            }
-            /* Bad IEEE again! It says in 13.26.23 g) 2) that
-             * MSTI state should follow CIST state only for the case of
-             * Alternate port. This is obviously wrong!
-             * In the descriptive clause 13.13 f) it says:
-             *  "At a Boundary Port frames allocated to the CIST and
-             *   all MSTIs are forwarded or not forwarded alike.
-             *   This is because Port Role assignments are such that
-             *   if the CIST Port Role is Root Port, the MSTI Port Role
-             *   will be Master Port, and if the CIST Port Role is
-             *   Designated Port, Alternate Port, Backup Port,
-             *   or Disabled Port, each MSTI’s Port Role will be the same."
-             * So, ignore wrong 13.26.23 g) 2) and do as stated in 13.13 f) !
-             */
-            /* if(roleAlternate == cist_tree->selectedRole) */
-            {
-                ptp->selectedRole = cist_tree->selectedRole;
-                if(!samePriorityAndTimers(&ptp->portPriority,
-                                          &ptp->designatedPriority,
-                                          &ptp->portTimes,
-                                          &ptp->designatedTimes,
-                                          /*cist*/ false))
-                    ptp->updtInfo = true;
-                continue;
-            }
-        }
-        else
-     /* if(cist || (ioReceived != cist_tree->infoIs) || prt->infoInternal) */
-        {
-            /* h) Set role for the aged info */
-            if(ioAged == ptp->infoIs)
-            {
-                ptp->selectedRole = roleDesignated;
-                ptp->updtInfo = true;
-                continue;
-            }
-            /* i) Set role for the mine info */
-            if(ioMine == ptp->infoIs)
-            {
-                ptp->selectedRole = roleDesignated;
-                if(!samePriorityAndTimers(&ptp->portPriority,
-                                          &ptp->designatedPriority,
-                                          &ptp->portTimes,
-                                          &ptp->designatedTimes,
-                                          cist))
-                    ptp->updtInfo = true;
-                continue;
-            }
-            if(ioReceived == ptp->infoIs)
-            {
-                /* j) Set Root role */
-                if(root_ptp == ptp)
-                {
-                    ptp->selectedRole = roleRoot;
-                    ptp->updtInfo = false;
-                }
-                else
-                {
-                    if(betterorsamePriority(&ptp->portPriority,
-                                             &ptp->designatedPriority,
-                                             0, 0, cist))
-                    {
-                        if(cmp(ptp->portPriority.DesignatedBridgeID, !=,
-                               tree->BridgeIdentifier))
-                        {
-                            /* k) Set Alternate role */
-                            ptp->selectedRole = roleAlternate;
-                        }
-                        else
-                        {
-                            /* l) Set Backup role */
-                            ptp->selectedRole = roleBackup;
-                        }
-                        /* reset updtInfo for both k) and l) */
-                        ptp->updtInfo = false;
-                    }
-                    else /* designatedPriority is better than portPriority */
-                    {
-                        /* m) Set Designated role */
-                        ptp->selectedRole = roleDesignated;
-                        ptp->updtInfo = true;
-                    }
-                }
-                /* This is not in standard. But we really should set here
-                 * reselect for all MSTIs so that updtRolesTree is called
-                 * for each MSTI and due to above clause g) MSTI role is
-                 * changed to Master or reflects CIST port role.
-                 * Because in 802.1Q-2005 this will not happen when BPDU arrives
-                 * at boundary port - the rcvdMsg is not set for the MSTIs and
-                 * updtRolesTree is not called.
-                 * Bad IEEE !!!
-                 */
-                if(cist && (ptp->selectedRole != ptp->role))
-                    reselectMSTIs(prt);
-                continue;
-            }
-        }
+        list_del(&ptp->roles_dirty_list);
+        ptp->rolesDirty = false;
     }
 }
 
@@ -2807,7 +3729,8 @@ static void PTSM_tick(port_t *prt)
 {
     per_tree_port_t *ptp;
 
-    if(prt->helloWhen)
+    /* With the staggering helloWhen is decremented by MSTP_IN_hello_slot() */
+    if(prt->helloWhen && (MSTP_hello_slots < 2))
         --(prt->helloWhen);
     if(prt->mdelayWhile)
         --(prt->mdelayWhile);
@@ -2829,7 +3752,10 @@ static void PTSM_tick(port_t *prt)
         if(ptp->tcWhile)
         {
             if(0 == --(ptp->tcWhile))
+            {
+                ptp_tx_dirty(ptp);
                 set_TopologyChange(ptp->tree, false, prt);
+            }
         }
         if(ptp->rcvdInfoWhile)
             --(ptp->rcvdInfoWhile);
@@ -2843,14 +3769,16 @@ static bool PRSM_to_DISCARD(port_t *prt, bool dry_run)
     if(dry_run)
     {
         return (prt->PRSM_state != PRSM_DISCARD)
-               || prt->rcvdBpdu || prt->rcvdRSTP || prt->rcvdSTP
+               || prt->rcvdBpdu || prt->rxQueueLen
+               || prt->rcvdRSTP || prt->rcvdSTP
                || (prt->edgeDelayWhile != prt->bridge->Migrate_Time)
                || clearAllRcvdMsgs(prt, dry_run);
     }
 
-    prt->PRSM_state = PRSM_DISCARD;
+    PRT_SM_SET_STATE(prt, PRSM, PRSM_DISCARD);
 
     prt->rcvdBpdu = false;
+    prt->rxQueueLen = 0;
     prt->rcvdRSTP = false;
     prt->rcvdSTP = false;
     clearAllRcvdMsgs(prt, false /* actual run */);
@@ -2864,10 +3792,11 @@ static bool PRSM_to_DISCARD(port_t *prt, bool dry_run)
 
 static void PRSM_to_RECEIVE(port_t *prt)
 {
-    prt->PRSM_state = PRSM_RECEIVE;
+    PRT_SM_SET_STATE(prt, PRSM, PRSM_RECEIVE);
 
     updtBPDUVersion(prt);
     prt->rcvdInternal = fromSameRegion(prt);
+    prt_roles_dirty(prt);
     setRcvdMsgs(prt);
     prt->operEdge = false;
     prt->rcvdBpdu = false;
@@ -2882,6 +3811,14 @@ static bool PRSM_run(port_t *prt, bool dry_run)
     per_tree_port_t *ptp;
     bool rcvdAnyMsg;
 
+    /* Not in standard: feed the next queued BPDU */
+    if(!prt->rcvdBpdu && prt->rxQueueLen)
+    {
+        if(dry_run) /* at least rcvdBpdu will change */
+            return true;
+        rx_queue_pop(prt);
+    }
+
     if((prt->rcvdBpdu || (prt->edgeDelayWhile != prt->bridge->Migrate_Time))
        && !prt->portEnabled)
     {
@@ -2931,6 +3868,7 @@ static void PPMSM_to_CHECKING_RSTP(port_t *prt/*, bool begin*/)
     bridge_t *br = prt->bridge;
     prt->mcheck = false;
     prt->sendRSTP = rstpVersion(br);
+    prt_roles_dirty(prt);
     assign(prt->mdelayWhile, br->Migrate_Time);
 
     /* No need to run, no one condition will be met
@@ -2943,6 +3881,7 @@ static void PPMSM_to_SELECTING_STP(port_t *prt)
     prt->PPMSM_state = PPMSM_SELECTING_STP;
 
     prt->sendRSTP = false;
+    prt_roles_dirty(prt);
     assign(prt->mdelayWhile, prt->bridge->Migrate_Time);
 
     PPMSM_run(prt, false /* actual run */);
@@ -3097,6 +4036,7 @@ static bool PTSM_to_TRANSMIT_INIT(port_t *prt, bool begin, bool dry_run)
     prt->newInfo = true;
     prt->newInfoMsti = true;
     assign(prt->txCount, 0u);
+    prt->helloDue = 0;
 
     if(!begin && prt->portEnabled) /* prevent infinite loop */
         PTSM_run(prt, false /* actual run */);
@@ -3139,11 +4079,35 @@ static void PTSM_to_TRANSMIT_RSTP(port_t *prt)
     PTSM_run(prt, false /* actual run */);
 }
 
+/* helloWhen has expired. In a perfect world it was started in PTSM_to_IDLE()
+ * exactly the seconds it was started with ago (Hello Time, unless the
+ * staggering shortened it).
+ */
+static void hello_jitter_account(port_t *prt)
+{
+    bridge_t *br = prt->bridge;
+    __u64 now = monotonic_ns();
+    __u64 hello_ns = (__u64)prt->lastHelloInterval * 1000000000ull;
+    __u64 gap, jitter;
+
+    if(prt->lastHelloTime)
+    {
+        gap = now - prt->lastHelloTime;
+        jitter = ((gap > hello_ns) ? (gap - hello_ns) : (hello_ns - gap))
+                 / 1000;
+        log2_hist_add(br->helloJitter, jitter);
+        if(jitter > br->helloJitterMax)
+            br->helloJitterMax = jitter;
+        ++(br->numHellos);
+    }
+}
+
 static void PTSM_to_TRANSMIT_PERIODIC(port_t *prt)
 {
     prt->PTSM_state = PTSM_TRANSMIT_PERIODIC;
 
     per_tree_port_t *ptp = GET_CIST_PTP_FROM_PORT(prt);
+    hello_jitter_account(prt);
     bool cistDesignatedOrTCpropagatingRootPort =
         (roleDesignated == ptp->role)
         || ((roleRoot == ptp->role) && (0 != ptp->tcWhile));
@@ -3164,6 +4128,14 @@ static void PTSM_to_TRANSMIT_PERIODIC(port_t *prt)
     prt->newInfo = prt->newInfo || cistDesignatedOrTCpropagatingRootPort;
     prt->newInfoMsti = prt->newInfoMsti
                        || mstiDesignatedOrTCpropagatingRootPort;
+    if(prt->newInfo || prt->newInfoMsti)
+    {
+        ++(prt->bridge->txSlotPeriodic[prt->bridge->helloSlot]);
+        /* Until it is sent, which may be held back by txCount */
+        prt->helloDue = prt->bridge->tickDeadline;
+    }
+    else
+        prt->helloDue = 0;
 
     PTSM_run(prt, false /* actual run */);
 }
@@ -3173,7 +4145,9 @@ static void PTSM_to_IDLE(port_t *prt)
     prt->PTSM_state = PTSM_IDLE;
 
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
-    prt->helloWhen = cist->portTimes.Hello_Time;
+    prt->helloWhen = hello_interval(prt, cist->portTimes.Hello_Time);
+    prt->lastHelloTime = monotonic_ns();
+    prt->lastHelloInterval = prt->helloWhen;
 
     PTSM_run(prt, false /* actual run */);
 }
@@ -3287,13 +4261,14 @@ static bool PISM_run(per_tree_port_t *ptp, bool dry_run);
 static void PISM_to_DISABLED(per_tree_port_t *ptp, bool begin)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_DISABLED;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_DISABLED);
 
     ptp->rcvdMsg = false;
     ptp->proposing = false;
     ptp->proposed = false;
     ptp->agree = false;
     ptp->agreed = false;
+    ptp_tx_dirty(ptp);
     assign(ptp->rcvdInfoWhile, 0u);
     ptp->infoIs = ioDisabled;
     ptp->reselect = true;
@@ -3306,7 +4281,7 @@ static void PISM_to_DISABLED(per_tree_port_t *ptp, bool begin)
 static void PISM_to_AGED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_AGED;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_AGED);
 
     ptp->infoIs = ioAged;
     ptp->reselect = true;
@@ -3318,10 +4293,11 @@ static void PISM_to_AGED(per_tree_port_t *ptp)
 static void PISM_to_UPDATE(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_UPDATE;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_UPDATE);
 
     ptp->proposing = false;
     ptp->proposed = false;
+    ptp_tx_dirty(ptp);
     ptp->agreed = ptp->agreed && betterorsameInfo(ptp, ioMine);
     ptp->synced = ptp->synced && ptp->agreed;
     assign(ptp->portPriority, ptp->designatedPriority);
@@ -3333,7 +4309,7 @@ static void PISM_to_UPDATE(per_tree_port_t *ptp)
     if(0 == ptp->MSTID)
         prt->newInfo = true;
     else
-        prt->newInfoMsti = true;
+        sm_set_newInfoMsti(prt);
 
     PISM_run(ptp, false /* actual run */);
 }
@@ -3341,16 +4317,17 @@ static void PISM_to_UPDATE(per_tree_port_t *ptp)
 static void PISM_to_SUPERIOR_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_SUPERIOR_DESIGNATED;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_SUPERIOR_DESIGNATED);
 
     port_t *prt = ptp->port;
 
-    prt->infoInternal = prt->rcvdInternal;
+    sm_set_infoInternal(prt);
     ptp->agreed = false;
     ptp->proposing = false;
     recordProposal(ptp);
     setTcFlags(ptp);
     ptp->agree = ptp->agree && betterorsameInfo(ptp, ioReceived);
+    ptp_tx_dirty(ptp);
     recordAgreement(ptp);
     ptp->synced = ptp->synced && ptp->agreed;
     recordPriority(ptp);
@@ -3367,11 +4344,11 @@ static void PISM_to_SUPERIOR_DESIGNATED(per_tree_port_t *ptp)
 static void PISM_to_REPEATED_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_REPEATED_DESIGNATED;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_REPEATED_DESIGNATED);
 
     port_t *prt = ptp->port;
 
-    prt->infoInternal = prt->rcvdInternal;
+    sm_set_infoInternal(prt);
     recordProposal(ptp);
     setTcFlags(ptp);
     recordAgreement(ptp);
@@ -3384,7 +4361,7 @@ static void PISM_to_REPEATED_DESIGNATED(per_tree_port_t *ptp)
 static void PISM_to_INFERIOR_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_INFERIOR_DESIGNATED;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_INFERIOR_DESIGNATED);
 
     recordDispute(ptp);
     ptp->rcvdMsg = false;
@@ -3395,7 +4372,7 @@ static void PISM_to_INFERIOR_DESIGNATED(per_tree_port_t *ptp)
 static void PISM_to_NOT_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_NOT_DESIGNATED;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_NOT_DESIGNATED);
 
     recordAgreement(ptp);
     setTcFlags(ptp);
@@ -3407,7 +4384,7 @@ static void PISM_to_NOT_DESIGNATED(per_tree_port_t *ptp)
 static void PISM_to_OTHER(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_OTHER;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_OTHER);
 
     ptp->rcvdMsg = false;
 
@@ -3417,7 +4394,7 @@ static void PISM_to_OTHER(per_tree_port_t *ptp)
 static void PISM_to_CURRENT(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_CURRENT;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_CURRENT);
 
     PISM_run(ptp, false /* actual run */);
 }
@@ -3425,7 +4402,7 @@ static void PISM_to_CURRENT(per_tree_port_t *ptp)
 static void PISM_to_RECEIVE(per_tree_port_t *ptp)
 {
     PISM_LOG("");
-    ptp->PISM_state = PISM_RECEIVE;
+    PTP_SM_SET_STATE(ptp, PISM, PISM_RECEIVE);
 
     ptp->rcvdInfo = rcvInfo(ptp);
     recordMastered(ptp);
@@ -3636,12 +4613,13 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run);
 static void PRTSM_to_INIT_PORT(per_tree_port_t *ptp/*, bool begin*/)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_INIT_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_INIT_PORT);
 
     unsigned int MaxAge, FwdDelay;
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(ptp->port);
 
     ptp->role = roleDisabled;
+    ptp_tx_dirty(ptp);
     ptp->learn = false;
     ptp->forward = false;
     ptp->synced = false;
@@ -3665,7 +4643,7 @@ static void PRTSM_to_INIT_PORT(per_tree_port_t *ptp/*, bool begin*/)
 static void PRTSM_to_DISABLE_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DISABLE_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DISABLE_PORT);
 
     /* Although 802.1Q-2005 says here to do role = selectedRole
      * I have difficulties with it in the next scenario:
@@ -3687,6 +4665,7 @@ static void PRTSM_to_DISABLE_PORT(per_tree_port_t *ptp)
      *  instead of role = selectedRole.
      */
     ptp->role = roleDisabled;
+    ptp_tx_dirty(ptp);
     ptp->learn = false;
     ptp->forward = false;
 
@@ -3696,7 +4675,7 @@ static void PRTSM_to_DISABLE_PORT(per_tree_port_t *ptp)
 static void PRTSM_to_DISABLED_PORT(per_tree_port_t *ptp, unsigned int MaxAge)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DISABLED_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DISABLED_PORT);
 
     assign(ptp->fdWhile, MaxAge);
     ptp->synced = true;
@@ -3712,7 +4691,7 @@ static void PRTSM_to_DISABLED_PORT(per_tree_port_t *ptp, unsigned int MaxAge)
 static void PRTSM_to_MASTER_PROPOSED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_PROPOSED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_PROPOSED);
 
     setSyncTree(ptp->tree);
     ptp->proposed = false;
@@ -3723,11 +4702,12 @@ static void PRTSM_to_MASTER_PROPOSED(per_tree_port_t *ptp)
 static void PRTSM_to_MASTER_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_AGREED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_AGREED);
 
     ptp->proposed = false;
     ptp->sync = false;
     ptp->agree = true;
+    ptp_tx_dirty(ptp);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3735,7 +4715,7 @@ static void PRTSM_to_MASTER_AGREED(per_tree_port_t *ptp)
 static void PRTSM_to_MASTER_SYNCED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_SYNCED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_SYNCED);
 
     assign(ptp->rrWhile, 0u);
     ptp->synced = true;
@@ -3747,7 +4727,7 @@ static void PRTSM_to_MASTER_SYNCED(per_tree_port_t *ptp)
 static void PRTSM_to_MASTER_RETIRED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_RETIRED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_RETIRED);
 
     ptp->reRoot = false;
 
@@ -3757,7 +4737,7 @@ static void PRTSM_to_MASTER_RETIRED(per_tree_port_t *ptp)
 static void PRTSM_to_MASTER_FORWARD(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_FORWARD;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_FORWARD);
 
     ptp->forward = true;
     assign(ptp->fdWhile, 0u);
@@ -3769,7 +4749,7 @@ static void PRTSM_to_MASTER_FORWARD(per_tree_port_t *ptp)
 static void PRTSM_to_MASTER_LEARN(per_tree_port_t *ptp, unsigned int forwardDelay)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_LEARN;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_LEARN);
 
     ptp->learn = true;
     assign(ptp->fdWhile, forwardDelay);
@@ -3780,7 +4760,7 @@ static void PRTSM_to_MASTER_LEARN(per_tree_port_t *ptp, unsigned int forwardDela
 static void PRTSM_to_MASTER_DISCARD(per_tree_port_t *ptp, unsigned int forwardDelay)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_DISCARD;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_DISCARD);
 
     ptp->learn = false;
     ptp->forward = false;
@@ -3793,9 +4773,10 @@ static void PRTSM_to_MASTER_DISCARD(per_tree_port_t *ptp, unsigned int forwardDe
 static void PRTSM_to_MASTER_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_MASTER_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_MASTER_PORT);
 
     ptp->role = roleMaster;
+    ptp_tx_dirty(ptp);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3805,7 +4786,7 @@ static void PRTSM_to_MASTER_PORT(per_tree_port_t *ptp)
 static void PRTSM_to_ROOT_PROPOSED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ROOT_PROPOSED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ROOT_PROPOSED);
 
     setSyncTree(ptp->tree);
     ptp->proposed = false;
@@ -3816,17 +4797,18 @@ static void PRTSM_to_ROOT_PROPOSED(per_tree_port_t *ptp)
 static void PRTSM_to_ROOT_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ROOT_AGREED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ROOT_AGREED);
 
     ptp->proposed = false;
     ptp->sync = false;
     ptp->agree = true;
+    ptp_tx_dirty(ptp);
     /* newInfoXst = TRUE; */
     port_t *prt = ptp->port;
     if(0 == ptp->MSTID)
         prt->newInfo = true;
     else
-        prt->newInfoMsti = true;
+        sm_set_newInfoMsti(prt);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3834,7 +4816,7 @@ static void PRTSM_to_ROOT_AGREED(per_tree_port_t *ptp)
 static void PRTSM_to_ROOT_SYNCED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ROOT_SYNCED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ROOT_SYNCED);
 
     ptp->synced = true;
     ptp->sync = false;
@@ -3845,7 +4827,7 @@ static void PRTSM_to_ROOT_SYNCED(per_tree_port_t *ptp)
 static void PRTSM_to_REROOT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_REROOT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_REROOT);
 
     setReRootTree(ptp->tree);
 
@@ -3855,7 +4837,7 @@ static void PRTSM_to_REROOT(per_tree_port_t *ptp)
 static void PRTSM_to_ROOT_FORWARD(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ROOT_FORWARD;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ROOT_FORWARD);
 
     assign(ptp->fdWhile, 0u);
     ptp->forward = true;
@@ -3866,7 +4848,7 @@ static void PRTSM_to_ROOT_FORWARD(per_tree_port_t *ptp)
 static void PRTSM_to_ROOT_LEARN(per_tree_port_t *ptp, unsigned int forwardDelay)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ROOT_LEARN;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ROOT_LEARN);
 
     assign(ptp->fdWhile, forwardDelay);
     ptp->learn = true;
@@ -3877,7 +4859,7 @@ static void PRTSM_to_ROOT_LEARN(per_tree_port_t *ptp, unsigned int forwardDelay)
 static void PRTSM_to_REROOTED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_REROOTED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_REROOTED);
 
     ptp->reRoot = false;
 
@@ -3887,9 +4869,10 @@ static void PRTSM_to_REROOTED(per_tree_port_t *ptp)
 static void PRTSM_to_ROOT_PORT(per_tree_port_t *ptp, unsigned int FwdDelay)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ROOT_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ROOT_PORT);
 
     ptp->role = roleRoot;
+    ptp_tx_dirty(ptp);
     assign(ptp->rrWhile, FwdDelay);
 
     PRTSM_runr(ptp, true, false /* actual run */);
@@ -3900,11 +4883,12 @@ static void PRTSM_to_ROOT_PORT(per_tree_port_t *ptp, unsigned int FwdDelay)
 static void PRTSM_to_DESIGNATED_PROPOSE(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_PROPOSE;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_PROPOSE);
 
     port_t *prt = ptp->port;
 
     ptp->proposing = true;
+    ptp_tx_dirty(ptp);
     /* newInfoXst = TRUE; */
     if(0 == ptp->MSTID)
     { /* CIST */
@@ -3918,7 +4902,7 @@ static void PRTSM_to_DESIGNATED_PROPOSE(per_tree_port_t *ptp)
         prt->newInfo = true;
     }
     else
-        prt->newInfoMsti = true;
+        sm_set_newInfoMsti(prt);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3926,17 +4910,18 @@ static void PRTSM_to_DESIGNATED_PROPOSE(per_tree_port_t *ptp)
 static void PRTSM_to_DESIGNATED_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_AGREED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_AGREED);
 
     ptp->proposed = false;
     ptp->sync = false;
     ptp->agree = true;
+    ptp_tx_dirty(ptp);
     /* newInfoXst = TRUE; */
     port_t *prt = ptp->port;
     if(0 == ptp->MSTID)
         prt->newInfo = true;
     else
-        prt->newInfoMsti = true;
+        sm_set_newInfoMsti(prt);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3944,7 +4929,7 @@ static void PRTSM_to_DESIGNATED_AGREED(per_tree_port_t *ptp)
 static void PRTSM_to_DESIGNATED_SYNCED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_SYNCED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_SYNCED);
 
     assign(ptp->rrWhile, 0u);
     ptp->synced = true;
@@ -3956,7 +4941,7 @@ static void PRTSM_to_DESIGNATED_SYNCED(per_tree_port_t *ptp)
 static void PRTSM_to_DESIGNATED_RETIRED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_RETIRED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_RETIRED);
 
     ptp->reRoot = false;
 
@@ -3966,7 +4951,7 @@ static void PRTSM_to_DESIGNATED_RETIRED(per_tree_port_t *ptp)
 static void PRTSM_to_DESIGNATED_FORWARD(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_FORWARD;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_FORWARD);
 
     ptp->forward = true;
     assign(ptp->fdWhile, 0u);
@@ -3978,7 +4963,7 @@ static void PRTSM_to_DESIGNATED_FORWARD(per_tree_port_t *ptp)
 static void PRTSM_to_DESIGNATED_LEARN(per_tree_port_t *ptp, unsigned int forwardDelay)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_LEARN;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_LEARN);
 
     ptp->learn = true;
     assign(ptp->fdWhile, forwardDelay);
@@ -3989,7 +4974,7 @@ static void PRTSM_to_DESIGNATED_LEARN(per_tree_port_t *ptp, unsigned int forward
 static void PRTSM_to_DESIGNATED_DISCARD(per_tree_port_t *ptp, unsigned int forwardDelay)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_DISCARD;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_DISCARD);
 
     ptp->learn = false;
     ptp->forward = false;
@@ -4002,9 +4987,10 @@ static void PRTSM_to_DESIGNATED_DISCARD(per_tree_port_t *ptp, unsigned int forwa
 static void PRTSM_to_DESIGNATED_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_DESIGNATED_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_DESIGNATED_PORT);
 
     ptp->role = roleDesignated;
+    ptp_tx_dirty(ptp);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -4014,9 +5000,10 @@ static void PRTSM_to_DESIGNATED_PORT(per_tree_port_t *ptp)
 static void PRTSM_to_BLOCK_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_BLOCK_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_BLOCK_PORT);
 
     ptp->role = ptp->selectedRole;
+    ptp_tx_dirty(ptp);
     ptp->learn = false;
     ptp->forward = false;
 
@@ -4026,7 +5013,7 @@ static void PRTSM_to_BLOCK_PORT(per_tree_port_t *ptp)
 static void PRTSM_to_BACKUP_PORT(per_tree_port_t *ptp, unsigned int HelloTime)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_BACKUP_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_BACKUP_PORT);
 
     assign(ptp->rbWhile, 2 * HelloTime);
 
@@ -4036,7 +5023,7 @@ static void PRTSM_to_BACKUP_PORT(per_tree_port_t *ptp, unsigned int HelloTime)
 static void PRTSM_to_ALTERNATE_PROPOSED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ALTERNATE_PROPOSED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ALTERNATE_PROPOSED);
 
     setSyncTree(ptp->tree);
     ptp->proposed = false;
@@ -4047,16 +5034,17 @@ static void PRTSM_to_ALTERNATE_PROPOSED(per_tree_port_t *ptp)
 static void PRTSM_to_ALTERNATE_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ALTERNATE_AGREED;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ALTERNATE_AGREED);
 
     ptp->proposed = false;
     ptp->agree = true;
+    ptp_tx_dirty(ptp);
     /* newInfoXst = TRUE; */
     port_t *prt = ptp->port;
     if(0 == ptp->MSTID)
         prt->newInfo = true;
     else
-        prt->newInfoMsti = true;
+        sm_set_newInfoMsti(prt);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -4064,7 +5052,7 @@ static void PRTSM_to_ALTERNATE_AGREED(per_tree_port_t *ptp)
 static void PRTSM_to_ALTERNATE_PORT(per_tree_port_t *ptp, unsigned int forwardDelay)
 {
     PRTSM_LOG("");
-    ptp->PRTSM_state = PRTSM_ALTERNATE_PORT;
+    PTP_SM_SET_STATE(ptp, PRTSM, PRTSM_ALTERNATE_PORT);
 
     assign(ptp->fdWhile, forwardDelay);
     ptp->synced = true;
@@ -4078,10 +5066,10 @@ static void PRTSM_to_ALTERNATE_PORT(per_tree_port_t *ptp, unsigned int forwardDe
 static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
 {
     /* Following vars do not need recalculating on recursive calls */
-    static unsigned int MaxAge, FwdDelay, forwardDelay, HelloTime;
-    static port_t *prt;
-    static tree_t *tree;
-    static per_tree_port_t *cist;
+    static __thread unsigned int MaxAge, FwdDelay, forwardDelay, HelloTime;
+    static __thread port_t *prt;
+    static __thread tree_t *tree;
+    static __thread per_tree_port_t *cist;
     /* Following vars are recalculated on each state transition */
     bool allSynced, reRooted;
     /* Following vars are auxiliary and don't depend on recursive_call */
@@ -4540,7 +5528,7 @@ static bool PSTSM_run(per_tree_port_t *ptp, bool dry_run);
 
 static void PSTSM_to_DISCARDING(per_tree_port_t *ptp, bool begin)
 {
-    ptp->PSTSM_state = PSTSM_DISCARDING;
+    PTP_SM_SET_STATE(ptp, PSTSM, PSTSM_DISCARDING);
 
     /* This effectively sets BLOCKING state:
     disableLearning();
@@ -4549,10 +5537,11 @@ static void PSTSM_to_DISCARDING(per_tree_port_t *ptp, bool begin)
     if(BR_STATE_BLOCKING != ptp->state)
     {
         if(!ptp->port->deleted)
-            MSTP_OUT_set_state(ptp, BR_STATE_BLOCKING);
+            sm_set_state(ptp, BR_STATE_BLOCKING);
     }
     ptp->learning = false;
     ptp->forwarding = false;
+    ptp_tx_dirty(ptp);
 
     if(!begin)
         PSTSM_run(ptp, false /* actual run */);
@@ -4560,30 +5549,32 @@ static void PSTSM_to_DISCARDING(per_tree_port_t *ptp, bool begin)
 
 static void PSTSM_to_LEARNING(per_tree_port_t *ptp)
 {
-    ptp->PSTSM_state = PSTSM_LEARNING;
+    PTP_SM_SET_STATE(ptp, PSTSM, PSTSM_LEARNING);
 
     /* enableLearning(); */
     if(BR_STATE_LEARNING != ptp->state)
     {
         if(!ptp->port->deleted)
-            MSTP_OUT_set_state(ptp, BR_STATE_LEARNING);
+            sm_set_state(ptp, BR_STATE_LEARNING);
     }
     ptp->learning = true;
+    ptp_tx_dirty(ptp);
 
     PSTSM_run(ptp, false /* actual run */);
 }
 
 static void PSTSM_to_FORWARDING(per_tree_port_t *ptp)
 {
-    ptp->PSTSM_state = PSTSM_FORWARDING;
+    PTP_SM_SET_STATE(ptp, PSTSM, PSTSM_FORWARDING);
 
     /* enableForwarding(); */
     if(BR_STATE_FORWARDING != ptp->state)
     {
         if(!ptp->port->deleted)
-            MSTP_OUT_set_state(ptp, BR_STATE_FORWARDING);
+            sm_set_state(ptp, BR_STATE_FORWARDING);
     }
     ptp->forwarding = true;
+    ptp_tx_dirty(ptp);
 
     /* No need to run, no one condition will be met
       PSTSM_run(ptp, false); */
@@ -4634,10 +5625,11 @@ static bool PSTSM_run(per_tree_port_t *ptp, bool dry_run)
 
 static void TCSM_to_INACTIVE(per_tree_port_t *ptp, bool begin)
 {
-    ptp->TCSM_state = TCSM_INACTIVE;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_INACTIVE);
 
     set_fdbFlush(ptp);
     assign(ptp->tcWhile, 0u);
+    ptp_tx_dirty(ptp);
     set_TopologyChange(ptp->tree, false, ptp->port);
     if(0 == ptp->MSTID) /* CIST */
         ptp->port->tcAck = false;
@@ -4661,7 +5653,7 @@ static bool TCSM_to_LEARNING(per_tree_port_t *ptp, bool dry_run)
         return false;
     }
 
-    ptp->TCSM_state = TCSM_LEARNING;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_LEARNING);
 
     if(0 == ptp->MSTID) /* CIST */
     {
@@ -4678,7 +5670,7 @@ static bool TCSM_to_LEARNING(per_tree_port_t *ptp, bool dry_run)
 
 static void TCSM_to_DETECTED(per_tree_port_t *ptp)
 {
-    ptp->TCSM_state = TCSM_DETECTED;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_DETECTED);
 
     newTcWhile(ptp);
     setTcPropTree(ptp);
@@ -4687,14 +5679,14 @@ static void TCSM_to_DETECTED(per_tree_port_t *ptp)
     if(0 == ptp->MSTID)
         prt->newInfo = true;
     else
-        prt->newInfoMsti = true;
+        sm_set_newInfoMsti(prt);
 
     TCSM_run(ptp, false /* actual run */);
 }
 
 static void TCSM_to_NOTIFIED_TCN(per_tree_port_t *ptp)
 {
-    ptp->TCSM_state = TCSM_NOTIFIED_TCN;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_NOTIFIED_TCN);
 
     newTcWhile(ptp);
 
@@ -4703,7 +5695,7 @@ static void TCSM_to_NOTIFIED_TCN(per_tree_port_t *ptp)
 
 static void TCSM_to_NOTIFIED_TC(per_tree_port_t *ptp)
 {
-    ptp->TCSM_state = TCSM_NOTIFIED_TC;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_NOTIFIED_TC);
 
     ptp->rcvdTc = false;
     if(0 == ptp->MSTID) /* CIST */
@@ -4720,7 +5712,7 @@ static void TCSM_to_NOTIFIED_TC(per_tree_port_t *ptp)
 
 static void TCSM_to_PROPAGATING(per_tree_port_t *ptp)
 {
-    ptp->TCSM_state = TCSM_PROPAGATING;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_PROPAGATING);
 
     newTcWhile(ptp);
     set_fdbFlush(ptp);
@@ -4731,9 +5723,10 @@ static void TCSM_to_PROPAGATING(per_tree_port_t *ptp)
 
 static void TCSM_to_ACKNOWLEDGED(per_tree_port_t *ptp)
 {
-    ptp->TCSM_state = TCSM_ACKNOWLEDGED;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_ACKNOWLEDGED);
 
     assign(ptp->tcWhile, 0u);
+    ptp_tx_dirty(ptp);
     set_TopologyChange(ptp->tree, false, ptp->port);
     ptp->port->rcvdTcAck = false;
 
@@ -4742,7 +5735,7 @@ static void TCSM_to_ACKNOWLEDGED(per_tree_port_t *ptp)
 
 static void TCSM_to_ACTIVE(per_tree_port_t *ptp)
 {
-    ptp->TCSM_state = TCSM_ACTIVE;
+    PTP_SM_SET_STATE(ptp, TCSM, TCSM_ACTIVE);
 
     TCSM_run(ptp, false /* actual run */);
 }
@@ -4929,6 +5922,9 @@ static void br_state_machines_begin(bridge_t *br)
     per_tree_port_t *ptp;
     tree_t *tree;
 
+    /* Configuration might have changed, rebuild BPDUs on next tx */
+    br_invalidate_tx_bpdus(br);
+
     if(!br->bridgeEnabled)
         return;
 
@@ -4981,6 +5977,413 @@ static void br_state_machines_begin(bridge_t *br)
     br_state_machines_run(br);
 }
 
+/* Parallel execution of the per-tree state machines (not in standard).
+ *
+ * Within one pass of PISM, PRSSM, PRTSM, PSTSM or TCSM the machines of an
+ * MSTI read and write only the per-tree-port data of their own tree, the
+ * tree itself and the CIST per-tree-port data of the same port. So, once
+ * the CIST has been run for the pass, the MSTIs can be run concurrently,
+ * one tree per worker at a time, with the same result as the serial
+ * port-by-port order.
+ * The rest of the effects (port variables shared by the trees, outputs,
+ * trace records) are recorded in the per-tree smOps log and applied by
+ * the main thread after the pass, in the order the serial run would
+ * produce them: port by port and tree by tree inside the port (tree by
+ * tree for the PRSSM).
+ */
+typedef enum
+{
+    SM_OP_TRACE,          /* a = sm, b = from, c = to */
+    SM_OP_SET_STATE,      /* a = new state, b = previous state */
+    SM_OP_FLUSH,
+    SM_OP_RAPID_AGEING,   /* a = FwdDelay */
+    SM_OP_NEW_INFO_MSTI,
+    SM_OP_INFO_INTERNAL,
+} sm_op_type_t;
+
+typedef struct sm_op_s
+{
+    per_tree_port_t *ptp; /* whose machine made the output */
+    sm_op_type_t type;
+    int a, b, c;
+} sm_op_t;
+
+typedef enum
+{
+    SM_PHASE_PISM,
+    SM_PHASE_PRSSM,
+    SM_PHASE_PRTSM,
+    SM_PHASE_PSTSM,
+    SM_PHASE_TCSM,
+} sm_phase_t;
+
+/* Tree whose outputs are being deferred by this thread, NULL if none */
+static __thread tree_t *sm_defer_tree;
+
+static struct
+{
+    int num_threads;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned int generation;
+    bool quit;
+    /* Current pass */
+    sm_phase_t phase;
+    tree_t *trees[NUM_TREE_SLOTS];
+    int num_trees;
+    int next_tree; /* atomic */
+    int done_trees;
+    __u64 worker_ns; /* CPU time the worker threads spent on the pass */
+} sm_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void sm_op_add(per_tree_port_t *ptp, sm_op_type_t type,
+                      int a, int b, int c)
+{
+    tree_t *tree = sm_defer_tree;
+    sm_op_t *op;
+
+    if(tree->smOpsNum == tree->smOpsAlloc)
+    {
+        int new_alloc = tree->smOpsAlloc ? 2 * tree->smOpsAlloc : 64;
+        sm_op_t *new_ops = realloc(tree->smOps, new_alloc * sizeof(*new_ops));
+        if(!new_ops)
+        { /* Can't log from here, reported by sm_ops_apply() */
+            tree->smOpsLost = true;
+            return;
+        }
+        tree->smOps = new_ops;
+        tree->smOpsAlloc = new_alloc;
+    }
+    op = &tree->smOps[tree->smOpsNum++];
+    op->ptp = ptp;
+    op->type = type;
+    op->a = a;
+    op->b = b;
+    op->c = c;
+}
+
+static void sm_trace(per_tree_port_t *ptp, trace_sm_t sm, int from, int to)
+{
+    if(sm_defer_tree)
+    {
+        sm_op_add(ptp, SM_OP_TRACE, sm, from, to);
+        return;
+    }
+    trace_sm(ptp->port->bridge->sysdeps.if_index, ptp->port->sysdeps.if_index,
+             __be16_to_cpu(ptp->MSTID), sm, from, to);
+}
+
+static void sm_set_state(per_tree_port_t *ptp, int new_state)
+{
+    if(sm_defer_tree)
+    {
+        /* The machines look at ptp->state, so change it right now;
+         * sm_op_apply() restores previous state before the output */
+        sm_op_add(ptp, SM_OP_SET_STATE, new_state, ptp->state, 0);
+        ptp->state = new_state;
+        return;
+    }
+    MSTP_OUT_set_state(ptp, new_state);
+}
+
+static void sm_flush_all_mstids(per_tree_port_t *ptp)
+{
+    if(sm_defer_tree)
+    {
+        /* MSTP_OUT_flush_all_mstids() reports completion before return,
+         * do what MSTP_IN_all_mstids_flushed() would do */
+        sm_op_add(ptp, SM_OP_FLUSH, 0, 0, 0);
+        ptp->fdbFlush = false;
+        return;
+    }
+    ptp->calledFromFlushRoutine = true;
+    MSTP_OUT_flush_all_mstids(ptp);
+    ptp->calledFromFlushRoutine = false;
+}
+
+static void sm_rapid_ageing(port_t *prt, unsigned int FwdDelay)
+{
+    if(sm_defer_tree)
+    {
+        sm_op_add(prt->slot2ptp[sm_defer_tree->slot], SM_OP_RAPID_AGEING,
+                  FwdDelay, 0, 0);
+        return;
+    }
+    MSTP_OUT_set_ageing_time(prt, FwdDelay);
+    assign(prt->rapidAgeingWhile, FwdDelay);
+}
+
+static void sm_set_newInfoMsti(port_t *prt)
+{
+    if(sm_defer_tree)
+    {
+        sm_op_add(prt->slot2ptp[sm_defer_tree->slot], SM_OP_NEW_INFO_MSTI, 0, 0, 0);
+        return;
+    }
+    prt->newInfoMsti = true;
+}
+
+static void sm_set_infoInternal(port_t *prt)
+{
+    if(sm_defer_tree)
+    {
+        sm_op_add(prt->slot2ptp[sm_defer_tree->slot], SM_OP_INFO_INTERNAL, 0, 0, 0);
+        return;
+    }
+    prt->infoInternal = prt->rcvdInternal;
+    prt_roles_dirty(prt);
+}
+
+static void sm_op_apply(tree_t *tree, sm_op_t *op)
+{
+    per_tree_port_t *ptp = op->ptp;
+    port_t *prt = ptp->port;
+
+    switch(op->type)
+    {
+        case SM_OP_TRACE:
+            trace_sm(prt->bridge->sysdeps.if_index, prt->sysdeps.if_index,
+                     __be16_to_cpu(tree->MSTID), op->a, op->b, op->c);
+            break;
+        case SM_OP_SET_STATE:
+            ptp->state = op->b;
+            MSTP_OUT_set_state(ptp, op->a);
+            break;
+        case SM_OP_FLUSH:
+            ptp->calledFromFlushRoutine = true;
+            MSTP_OUT_flush_all_mstids(ptp);
+            ptp->calledFromFlushRoutine = false;
+            break;
+        case SM_OP_RAPID_AGEING:
+            MSTP_OUT_set_ageing_time(prt, op->a);
+            assign(prt->rapidAgeingWhile, (unsigned int)op->a);
+            break;
+        case SM_OP_NEW_INFO_MSTI:
+            prt->newInfoMsti = true;
+            break;
+        case SM_OP_INFO_INTERNAL:
+            prt->infoInternal = prt->rcvdInternal;
+            prt_roles_dirty(prt);
+            break;
+    }
+}
+
+/* Apply deferred outputs of all trees in the serial order */
+static void sm_ops_apply(bridge_t *br, sm_phase_t phase)
+{
+    int pos[NUM_TREE_SLOTS];
+    port_t *prt;
+    per_tree_port_t *ptp;
+    tree_t *tree;
+
+    FOREACH_TREE_IN_BRIDGE(tree, br)
+        pos[tree->slot] = 0;
+
+    if(SM_PHASE_PRSSM != phase)
+    {
+        FOREACH_PORT_IN_BRIDGE(prt, br)
+        {
+            FOREACH_PTP_IN_PORT(ptp, prt)
+            {
+                tree = ptp->tree;
+                while((pos[tree->slot] < tree->smOpsNum)
+                      && (tree->smOps[pos[tree->slot]].ptp == ptp))
+                    sm_op_apply(tree, &tree->smOps[pos[tree->slot]++]);
+            }
+        }
+    }
+
+    /* PRSSM runs tree by tree */
+    FOREACH_TREE_IN_BRIDGE(tree, br)
+    {
+        while(pos[tree->slot] < tree->smOpsNum)
+            sm_op_apply(tree, &tree->smOps[pos[tree->slot]++]);
+        tree->smOpsNum = 0;
+        if(tree->smOpsLost)
+        {
+            ERROR_BRNAME(br, "MSTI %hu: Out of memory, state machine outputs lost",
+                         __be16_to_cpu(tree->MSTID));
+            tree->smOpsLost = false;
+        }
+    }
+}
+
+static void tree_sm_phase(tree_t *tree, sm_phase_t phase)
+{
+    per_tree_port_t *ptp;
+
+    sm_defer_tree = tree;
+    switch(phase)
+    {
+        case SM_PHASE_PISM:
+            FOREACH_PTP_IN_TREE(ptp, tree)
+                PISM_run(ptp, false /* actual run */);
+            break;
+        case SM_PHASE_PRSSM:
+            PRSSM_run(tree, false /* actual run */);
+            break;
+        case SM_PHASE_PRTSM:
+            FOREACH_PTP_IN_TREE(ptp, tree)
+                PRTSM_run(ptp, false /* actual run */);
+            break;
+        case SM_PHASE_PSTSM:
+            FOREACH_PTP_IN_TREE(ptp, tree)
+                PSTSM_run(ptp, false /* actual run */);
+            break;
+        case SM_PHASE_TCSM:
+            FOREACH_PTP_IN_TREE(ptp, tree)
+                TCSM_run(ptp, false /* actual run */);
+            break;
+    }
+    sm_defer_tree = NULL;
+}
+
+/* Take trees of the current pass until none is left */
+static void sm_pool_work(bool worker)
+{
+    int i, done = 0;
+    __u64 start = worker ? cpu_acct_thread_now() : 0;
+
+    while((i = __atomic_fetch_add(&sm_pool.next_tree, 1, __ATOMIC_SEQ_CST))
+           < sm_pool.num_trees)
+    {
+        tree_sm_phase(sm_pool.trees[i], sm_pool.phase);
+        ++done;
+    }
+    if(!done)
+        return;
+    pthread_mutex_lock(&sm_pool.mutex);
+    if(worker)
+        sm_pool.worker_ns += cpu_acct_thread_now() - start;
+    sm_pool.done_trees += done;
+    if(sm_pool.done_trees == sm_pool.num_trees)
+        pthread_cond_signal(&sm_pool.done_cond);
+    pthread_mutex_unlock(&sm_pool.mutex);
+}
+
+static void *sm_worker_main(void *arg)
+{
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&sm_pool.mutex);
+    while(true)
+    {
+        while(!sm_pool.quit && (generation == sm_pool.generation))
+            pthread_cond_wait(&sm_pool.work_cond, &sm_pool.mutex);
+        if(sm_pool.quit)
+            break;
+        generation = sm_pool.generation;
+        pthread_mutex_unlock(&sm_pool.mutex);
+        sm_pool_work(true);
+        pthread_mutex_lock(&sm_pool.mutex);
+    }
+    pthread_mutex_unlock(&sm_pool.mutex);
+    return NULL;
+}
+
+static void sm_pool_stop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&sm_pool.mutex);
+    sm_pool.quit = true;
+    pthread_cond_broadcast(&sm_pool.work_cond);
+    pthread_mutex_unlock(&sm_pool.mutex);
+    for(i = 0; i < sm_pool.num_threads; ++i)
+        pthread_join(sm_pool.threads[i], NULL);
+    free(sm_pool.threads);
+    sm_pool.threads = NULL;
+    sm_pool.num_threads = 0;
+}
+
+/* Must be called after daemon(), as the threads do not survive fork() */
+int MSTP_IN_start_sm_threads(int num_threads)
+{
+    sigset_t set, oldset;
+    int r = 0;
+
+    if(0 >= num_threads)
+        return 0;
+    if(!(sm_pool.threads = calloc(num_threads, sizeof(*sm_pool.threads))))
+    {
+        ERROR("Out of memory");
+        return -1;
+    }
+
+    /* Signals are handled by the main thread only */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for(sm_pool.num_threads = 0; sm_pool.num_threads < num_threads;
+        ++sm_pool.num_threads)
+    {
+        if((r = pthread_create(&sm_pool.threads[sm_pool.num_threads], NULL,
+                               sm_worker_main, NULL)))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if(r)
+    {
+        ERROR("Couldn't start state machine thread: %s", strerror(r));
+        sm_pool_stop();
+        return -1;
+    }
+
+    atexit(sm_pool_stop);
+    INFO("Running MSTI state machines on %d threads", num_threads);
+    return 0;
+}
+
+static inline bool br_sm_parallel(bridge_t *br)
+{
+    /* Worth it only with at least one MSTI */
+    return sm_pool.num_threads
+           && (GET_CIST_TREE(br)->bridge_list.next != &br->trees);
+}
+
+/* Run one pass of the per-tree state machine: CIST first, then MSTIs
+ * on the worker threads (and on this one), then apply deferred outputs.
+ * The SM frame is paused while waiting for the workers and charged their
+ * CPU time instead.
+ */
+static void br_sm_phase_parallel(bridge_t *br, sm_phase_t phase)
+{
+    tree_t *tree = GET_CIST_TREE(br);
+    int num_trees = 0;
+
+    tree_sm_phase(tree, phase);
+
+    list_for_each_entry_continue(tree, &br->trees, bridge_list)
+        sm_pool.trees[num_trees++] = tree;
+
+    pthread_mutex_lock(&sm_pool.mutex);
+    sm_pool.phase = phase;
+    sm_pool.num_trees = num_trees;
+    sm_pool.done_trees = 0;
+    sm_pool.worker_ns = 0;
+    __atomic_store_n(&sm_pool.next_tree, 0, __ATOMIC_SEQ_CST);
+    ++(sm_pool.generation);
+    pthread_cond_broadcast(&sm_pool.work_cond);
+    pthread_mutex_unlock(&sm_pool.mutex);
+
+    sm_pool_work(false);
+
+    cpu_acct_pause();
+    pthread_mutex_lock(&sm_pool.mutex);
+    while(sm_pool.done_trees < sm_pool.num_trees)
+        pthread_cond_wait(&sm_pool.done_cond, &sm_pool.mutex);
+    pthread_mutex_unlock(&sm_pool.mutex);
+    cpu_acct_resume();
+    cpu_acct_charge(&br->sysdeps.cpu_acct, CPU_ACCT_SM, sm_pool.worker_ns);
+
+    sm_ops_apply(br, phase);
+}
+
 /* Run each state machine.
  * Return false iff all state machines in dry run indicate that
  * state will not be changed. Otherwise return true.
@@ -5030,6 +6433,16 @@ static bool __br_state_machines_run(bridge_t *br, bool dry_run)
             return true;
     }
 
+    if(!dry_run && br_sm_parallel(br))
+    {
+        br_sm_phase_parallel(br, SM_PHASE_PISM);
+        br_sm_phase_parallel(br, SM_PHASE_PRSSM);
+        br_sm_phase_parallel(br, SM_PHASE_PRTSM);
+        br_sm_phase_parallel(br, SM_PHASE_PSTSM);
+        br_sm_phase_parallel(br, SM_PHASE_TCSM);
+        return false;
+    }
+
     /* 13.32  Port Information state machine */
     FOREACH_PORT_IN_BRIDGE(prt, br)
     {
@@ -5081,31 +6494,51 @@ static bool __br_state_machines_run(bridge_t *br, bool dry_run)
 /* Run state machines until their state stabilizes.
  * Do not consume more than 1 second.
  */
-static void br_state_machines_run(bridge_t *br)
+static void br_state_machines_run_now(bridge_t *br)
 {
     struct timespec tv, tv_end;
     signed long delta;
+    cpu_acct_frame_t f;
 
     if(!br->bridgeEnabled)
         return;
 
+    cpu_acct_enter(&f, &br->sysdeps.cpu_acct, CPU_ACCT_SM);
     clock_gettime(CLOCK_MONOTONIC, &tv_end);
     ++(tv_end.tv_sec);
 
     do {
         if(!__br_state_machines_run(br, true /* dry run */))
-            return;
+            break;
         __br_state_machines_run(br, false /* actual run */);
 
         /* Check for the timeout */
         clock_gettime(CLOCK_MONOTONIC, &tv);
         if(0 < (delta = tv.tv_sec - tv_end.tv_sec))
-            return;
+            break;
         if(0 == delta)
         {
             delta = tv.tv_nsec - tv_end.tv_nsec;
             if(0 < delta)
-                return;
+                break;
         }
     } while(true);
+    cpu_acct_leave(&f);
+}
+
+/* Run state machines, unless config transaction is in progress.
+ * In the latter case the run is deferred to the MSTP_IN_config_commit().
+ */
+static void br_state_machines_run(bridge_t *br)
+{
+    if(!br->bridgeEnabled)
+        return;
+
+    if(br->config_depth)
+    {
+        br->config_run_pending = true;
+        return;
+    }
+
+    br_state_machines_run_now(br);
 }
@@ -17,6 +17,8 @@
 
 #include "bridge_ctl.h"
 #include "list.h"
+#include "slab.h"
+#include "log2_hist.h"
 
 /* Useful macro for counting number of elements in array */
 #define COUNT_OF(x) ((sizeof(x)/sizeof(0[x])) / ((size_t)(!(sizeof(x) % sizeof(0[x])))))
@@ -95,6 +97,13 @@ typedef struct
     __be32 ExtRootPathCost;
 } port_priority_vector_t;
 
+/* Priority vector (plus Port ID tie-breaker) as host order words,
+ * compares the same way as the vector. See prio_key() in mstp.c */
+typedef struct
+{
+    __u64 w[5];
+} prio_key_t;
+
 typedef struct
 {
     __u8 remainingHops;
@@ -358,6 +367,59 @@ typedef enum
  *  - BEGIN, tick, ageingTime.
  */
 
+struct tree_s;
+struct per_tree_port_s;
+struct sm_op_s;
+
+/* Slot numbers index the per-bridge and per-port tree lookup tables.
+ * Slot 0 is always the CIST.
+ */
+#define NUM_TREE_SLOTS  (MAX_IMPLEMENTATION_MSTIS + 1)
+#define NO_TREE_SLOT    0xFF
+
+/* Placement of the per_tree_port_t structures in memory */
+typedef enum
+{
+    ptpLayoutTree, /* ptps of one tree are adjacent (tree->ptp_slab) */
+    ptpLayoutPort, /* ptps of one port are adjacent (prt->ptp_slab) */
+} ptp_layout_t;
+
+/* Max number of slots the second is divided into for the hello staggering */
+#define MAX_HELLO_SLOTS 100
+
+/* Why a received BPDU was dropped */
+typedef enum
+{
+    rxDropPortDown,        /* port is not up */
+    rxDropBadHeader,       /* destination MAC, length or LLC header */
+    rxDropPoliced,         /* over the BPDU rate limit */
+    rxDropBpduGuard,       /* port shut down by BPDU guard */
+    rxDropBpduFilter,
+    rxDropBridgeDisabled,
+    rxDropInvalid,         /* failed 14.4 validation */
+    rxDropQueueFull,       /* previous BPDUs not processed yet */
+    rxDropCount
+} rx_drop_reason_t;
+
+/* BPDU types as told apart by 14.4 validation */
+typedef enum
+{
+    bpduKindConfig,
+    bpduKindTCN,
+    bpduKindRST,
+    bpduKindMST,
+    bpduKindCount
+} bpdu_kind_t;
+
+typedef struct
+{
+    __u64 rx_drops[rxDropCount];
+    __u64 rx[bpduKindCount];    /* valid BPDUs received, by type */
+    __u64 tx[bpduKindCount];
+    __u64 rx_msti_msgs;         /* MSTI configuration messages */
+    __u64 tx_msti_msgs;
+} port_bpdu_counters_t;
+
 typedef struct
 {
     struct list_head list; /* anchor in global list of bridges */
@@ -387,17 +449,50 @@ typedef struct
 
     __be16 vid2mstid[MAX_VID + 2];
 
+    /* Direct lookup of trees by MSTID, maintained by MSTP_IN_create_msti()
+     * and MSTP_IN_delete_msti(). Use find_tree_by_mstid() */
+    __u8 mstid2slot[MAX_MSTID + 1];
+    struct tree_s *slot2tree[NUM_TREE_SLOTS];
+
     /* not in standard */
     unsigned int uptime;
 
+    /* Config transaction nesting level and deferred state machines run,
+     * see MSTP_IN_config_begin() */
+    unsigned int config_depth;
+    bool config_run_pending;
+
+    /* Memory for trees and per-tree port data, see ptp_layout_t */
+    ptp_layout_t ptpLayout;
+    slab_t tree_slab;
+    slab_stats_t tree_stats, ptp_stats;
+
+    /* Current slot of the second, see MSTP_IN_hello_slot(), and the number
+     * of BPDUs (all and periodic ones) transmitted in each slot */
+    unsigned int helloSlot;
+    unsigned int helloSecond; /* seconds counted by MSTP_IN_hello_slot() */
+    unsigned long long txSlotTotal[MAX_HELLO_SLOTS];
+    unsigned long long txSlotPeriodic[MAX_HELLO_SLOTS];
+    /* Deviation of the time between hellos from the Hello Time, in us */
+    unsigned long long helloJitter[LOG2_HIST_BUCKETS];
+    unsigned long long helloJitterMax, numHellos;
+    /* How late the daemon is for this bridge, see MSTP_IN_tick_begin() */
+    __u64 tickDeadline; /* of the current tick, ns */
+    unsigned long long tickLag[LOG2_HIST_BUCKETS];
+    unsigned long long tickLagMax, numTicks;
+    unsigned long long helloTxDelay[LOG2_HIST_BUCKETS];
+    unsigned long long helloTxDelayMax, numHelloTx;
+    unsigned long long lagWarnings;
+
     sysdep_br_data_t sysdeps;
 } bridge_t;
 
-typedef struct
+typedef struct tree_s
 {
     struct list_head bridge_list; /* anchor in bridge's list of trees */
     bridge_t * bridge;
     __be16 MSTID; /* 0 == CIST */
+    __u8 slot; /* index in bridge's slot2tree and port's slot2ptp */
 
     /* List of the per-port data structures for this tree instance */
     struct list_head ports;
@@ -425,6 +520,25 @@ typedef struct
     /* State machines */
     PRSSM_states_t PRSSM_state;
 
+    /* Incremental role selection, see updtRolesTree().
+     * rootHeap is a binary min-heap of the ports which can become Root Port,
+     * keyed by their root path priority vector. rolesDirty lists the ports
+     * whose inputs to role selection changed since the last selection.
+     */
+    struct per_tree_port_s **rootHeap;
+    int rootHeapSize, rootHeapAlloc;
+    struct list_head rolesDirty;
+    bool rolesFullRecalc; /* next selection must look at all ports */
+
+    /* Outputs of the state machines of this tree, deferred while the
+     * trees are run in parallel (see br_sm_phase_parallel()) */
+    struct sm_op_s *smOps;
+    int smOpsNum, smOpsAlloc;
+    bool smOpsLost;
+
+    /* Per-tree port data of this tree (ptpLayoutTree) */
+    slab_t ptp_slab;
+
 } tree_t;
 
 typedef struct
@@ -440,6 +554,10 @@ typedef struct
     struct list_head trees;
 #define GET_CIST_PTP_FROM_PORT(prt) \
     list_entry((prt)->trees.next, per_tree_port_t, port_list)
+    /* Per-tree data of this port by tree slot. Use find_ptp_by_mstid() */
+    struct per_tree_port_s *slot2ptp[NUM_TREE_SLOTS];
+    /* Per-tree data of this port (ptpLayoutPort) */
+    slab_t ptp_slab;
 
     /* 13.21.(a,b,c) Per-port timers */
     unsigned int mdelayWhile, helloWhen, edgeDelayWhile;
@@ -449,6 +567,12 @@ typedef struct
     bool operEdge, portEnabled, infoInternal, rcvdInternal;
     bool mcheck, rcvdBpdu, rcvdRSTP, rcvdSTP, rcvdTcAck, rcvdTcn, sendRSTP;
     bool tcAck, newInfo, newInfoMsti;
+    /* When helloWhen was last started, ns, and with how many seconds */
+    __u64 lastHelloTime;
+    unsigned int lastHelloInterval;
+    /* Deadline of the tick at which helloWhen expired, while the periodic
+     * BPDU is yet to be sent; 0 otherwise */
+    __u64 helloDue;
 
     /* 6.4.3 */
     bool operPointToPointMAC;
@@ -466,6 +590,11 @@ typedef struct
     bool BaInconsistent;
     bool dontTxmtBpdu;
     bool bpduFilterPort;
+    /* BPDU ingress policer, see bridge_bpdu_rcv(). 0 rate = no policing */
+    unsigned int bpduPoliceRate;  /* BPDUs per second */
+    unsigned int bpduPoliceBurst; /* BPDUs */
+    __u64 bpduPoliceTat; /* theoretical arrival time of next BPDU, ns */
+    bool bpduRateExceeded;
 
     unsigned int rapidAgeingWhile;
     unsigned int brAssuRcvdInfoWhile;
@@ -479,20 +608,47 @@ typedef struct
     /* Copy of the received BPDU */
     bpdu_t rcvdBpduData;
     int rcvdBpduNumOfMstis;
+    int rcvdBpduSize; /* size of the BPDU in rcvdBpduData */
+
+    /* Validated BPDUs which arrived while rcvdBpdu was still set.
+     * They are handed to the Port Receive SM one by one, in order. */
+#define RX_BPDU_QUEUE_LEN   4
+    struct
+    {
+        bpdu_t bpdu;
+        int size;
+        int numOfMstis;
+    } rxQueue[RX_BPDU_QUEUE_LEN];
+    unsigned int rxQueueHead, rxQueueLen;
+
+    /* RST/MST BPDU kept ready to send. Fields that change only with the
+     * configuration are filled when txBpduValid is false, the MSTI messages
+     * of the trees marked txMsgDirty when txMsgsDirty is set, the CIST part
+     * is patched by txMstp() */
+    bpdu_t txBpdu;
+    int txBpduSize;
+    bool txBpduValid;
+    bool txMsgsDirty;
 
     bool deleted;
 
     sysdep_if_data_t sysdeps;
-    unsigned int num_rx_bpdu_filtered;
-    unsigned int num_rx_bpdu;
-    unsigned int num_rx_tcn;
-    unsigned int num_tx_bpdu;
-    unsigned int num_tx_tcn;
+    __u64 num_rx_bpdu;
+    __u64 num_rx_tcn;
+    __u64 num_rx_bpdu_repeated; /* handled by the repeated BPDU fast path */
+    __u64 num_rx_bpdu_queued; /* had to wait in rxQueue */
+    unsigned int rx_queue_high_water; /* max rxQueueLen */
+    unsigned int num_bpdu_rate_exceeded; /* times policer started dropping */
+    __u64 num_tx_bpdu;
+    __u64 num_tx_tcn;
+    unsigned int num_tx_errors; /* sends that failed */
+    unsigned int num_tx_eagain; /* sends dropped for lack of queue room */
     unsigned int num_trans_fwd;
     unsigned int num_trans_blk;
+    port_bpdu_counters_t bpdu_counters;
 } port_t;
 
-typedef struct
+typedef struct per_tree_port_s
 {
     struct list_head port_list; /* anchor in port's list of trees */
     struct list_head tree_list; /* anchor in tree's list of per-port data */
@@ -547,8 +703,34 @@ typedef struct
     /* Pointer to the corresponding MSTI Configuration Message
      * in the port->rcvdBpduData */
     msti_configuration_message_t *rcvdMstiConfig;
+
+    /* Incremental role selection state, see tree_t */
+    struct list_head roles_dirty_list; /* anchor in tree's rolesDirty */
+    bool rolesDirty;
+    /* MSTI message in port->txBpdu to be refilled, see ptp_tx_dirty() */
+    bool txMsgDirty;
+    int rootHeapPos; /* index in tree's rootHeap, -1 if not a candidate */
+    prio_key_t rootPathKey; /* valid when in rootHeap */
 } per_tree_port_t;
 
+/* O(1) lookup of tree by MSTID (host order), NULL if there is no such tree */
+static inline tree_t *find_tree_by_mstid(bridge_t *br, __u16 mstid)
+{
+    __u8 slot;
+
+    if((mstid > MAX_MSTID) || (NO_TREE_SLOT == (slot = br->mstid2slot[mstid])))
+        return NULL;
+    return br->slot2tree[slot];
+}
+
+/* O(1) lookup of per-tree port data by MSTID (host order), NULL if none */
+static inline per_tree_port_t *find_ptp_by_mstid(port_t *prt, __u16 mstid)
+{
+    tree_t *tree = find_tree_by_mstid(prt->bridge, mstid);
+
+    return tree ? prt->slot2ptp[tree->slot] : NULL;
+}
+
 /* External events (inputs) */
 bool MSTP_IN_bridge_create(bridge_t *br, __u8 *macaddr);
 bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno);
@@ -568,6 +750,14 @@ tree_t *MSTP_IN_create_msti(bridge_t *br, __u16 mstid);
 bool MSTP_IN_delete_msti(bridge_t *br, __u16 mstid);
 void MSTP_IN_set_mst_config_id(bridge_t *br, __u16 revision, __u8 *name);
 
+/* Config transaction (not in standard).
+ * Between begin and the matching commit the state machines are not run
+ * after each configuration change; they are run once by the outermost commit.
+ * Transactions may be nested.
+ */
+void MSTP_IN_config_begin(bridge_t *br);
+void MSTP_IN_config_commit(bridge_t *br);
+
 /* External actions (outputs) */
 void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state);
 void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid);
@@ -576,6 +766,35 @@ void MSTP_OUT_set_ageing_time(port_t *prt, unsigned int ageingTime);
 void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t *bpdu, int size);
 void MSTP_OUT_shutdown_port(port_t *prt);
 
+/* Check each incremental role selection against the full one */
+extern bool MSTP_verify_role_selection;
+
+/* Run the per-tree state machines of the MSTIs on num_threads worker
+ * threads (in addition to the main one). 0 = run everything serially.
+ */
+int MSTP_IN_start_sm_threads(int num_threads);
+
+/* Layout of the per-tree port data for bridges created from now on */
+extern ptp_layout_t MSTP_ptp_layout;
+
+/* Hello staggering: number of slots the second is divided into.
+ * With more than one slot each port gets its own slot of the Hello Time
+ * (Hello Time times that many slots), its helloWhen timer is decremented
+ * only in that slot of the second and runs out in that second of the
+ * Hello Time, so periodic BPDUs of different ports leave at different
+ * moments. Must be set before any bridge is created.
+ */
+extern unsigned int MSTP_hello_slots;
+void MSTP_IN_hello_slot(bridge_t *br, unsigned int slot);
+
+/* Called before the timers of br are run for a tick which was due at
+ * deadline_ns (CLOCK_MONOTONIC). Accounts how late that is, and later how
+ * late the periodic BPDUs go out against it. Either being later than
+ * MSTP_lag_limit_us (0 = no limit) is logged.
+ */
+extern unsigned int MSTP_lag_limit_us;
+void MSTP_IN_tick_begin(bridge_t *br, __u64 deadline_ns);
+
 /* Structures for communicating with user */
  /* 12.8.1.1 Read CIST Bridge Protocol Parameters */
 typedef struct
@@ -601,10 +820,61 @@ typedef struct
     unsigned int Ageing_Time;
     __u8 max_hops;
     __u8 bridge_hello_time;
+    unsigned int num_ports_pending; /* not in standard */
 } CIST_BridgeStatus;
 
 void MSTP_IN_get_cist_bridge_status(bridge_t *br, CIST_BridgeStatus *status);
 
+/* Memory used for the trees and per-tree port data (not in standard) */
+typedef struct
+{
+    ptp_layout_t ptp_layout;
+    unsigned int trees, tree_chunks;
+    unsigned int ptps, ptps_capacity, ptp_chunks;
+    unsigned long long bytes;
+    unsigned long long ptp_allocs, ptp_frees;
+} BridgeAllocStats;
+
+void MSTP_IN_get_alloc_stats(bridge_t *br, BridgeAllocStats *stats);
+
+/* BPDUs transmitted in each slot of the second (not in standard) */
+typedef struct
+{
+    unsigned int slots;
+    unsigned long long total[MAX_HELLO_SLOTS];
+    unsigned long long periodic[MAX_HELLO_SLOTS];
+} BridgeTxSlotStats;
+
+void MSTP_IN_get_tx_slot_stats(bridge_t *br, BridgeTxSlotStats *stats);
+
+/* Timer tick and hello timeliness (not in standard). The tick part is
+ * daemon-wide, the tick lag and hello parts are per bridge. Times are in
+ * microseconds, histograms are log2_hist_add() ones.
+ */
+typedef struct
+{
+    unsigned int slots;                  /* ticks per second */
+    unsigned long long ticks;            /* ticks run */
+    unsigned long long missed;           /* expirations handled late */
+    unsigned long long skipped;          /* expirations not run at all */
+    unsigned long long late_max;
+    unsigned long long late[LOG2_HIST_BUCKETS];   /* tick lateness */
+    unsigned long long missed_per_wakeup[LOG2_HIST_BUCKETS];
+    unsigned long long bridge_ticks;     /* ticks run for the bridge */
+    unsigned long long tick_lag_max;     /* tick deadline to timers run */
+    unsigned long long tick_lag[LOG2_HIST_BUCKETS];
+    unsigned long long hellos;
+    unsigned long long hello_jitter_max;
+    unsigned long long hello_jitter[LOG2_HIST_BUCKETS];
+    unsigned long long hello_tx;
+    unsigned long long hello_tx_delay_max; /* tick deadline to BPDU sent */
+    unsigned long long hello_tx_delay[LOG2_HIST_BUCKETS];
+    unsigned int lag_limit_us;           /* MSTP_lag_limit_us */
+    unsigned long long lag_warnings;     /* times the bridge crossed it */
+} TickStats;
+
+void MSTP_IN_get_bridge_tick_stats(bridge_t *br, TickStats *stats);
+
  /* 12.8.1.2 Read MSTI Bridge Protocol Parameters */
 typedef struct
 {
@@ -692,13 +962,21 @@ typedef struct
     bool bpdu_filter_port;
     bool network_port;
     bool ba_inconsistent;
-    unsigned int num_rx_bpdu_filtered;
-    unsigned int num_rx_bpdu;
-    unsigned int num_rx_tcn;
-    unsigned int num_tx_bpdu;
-    unsigned int num_tx_tcn;
+    __u64 num_rx_bpdu;
+    __u64 num_rx_tcn;
+    __u64 num_rx_bpdu_repeated;
+    __u64 num_rx_bpdu_queued;
+    unsigned int rx_queue_high_water;
+    unsigned int bpdu_police_rate;
+    unsigned int bpdu_police_burst;
+    unsigned int num_bpdu_rate_exceeded;
+    __u64 num_tx_bpdu;
+    __u64 num_tx_tcn;
+    unsigned int num_tx_errors;
+    unsigned int num_tx_eagain;
     unsigned int num_trans_fwd;
     unsigned int num_trans_blk;
+    port_bpdu_counters_t bpdu_counters;
     bool rcvdBpdu;
     bool rcvdRSTP;
     bool rcvdSTP;
@@ -768,6 +1046,12 @@ typedef struct
 
     bool bpdu_filter_port;
     bool set_bpdu_filter_port;
+
+    unsigned int bpdu_police_rate; /* not in standard, 0 = off */
+    bool set_bpdu_police_rate;
+
+    unsigned int bpdu_police_burst; /* not in standard */
+    bool set_bpdu_police_burst;
 } CIST_PortConfig;
 
 int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg);
@@ -0,0 +1,120 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+
+#include "mstp_trace.h"
+#include "mstp.h"
+#include "log.h"
+#include "probes.h"
+
+static trace_record_t trace_ring[TRACE_RING_SIZE];
+static unsigned int trace_head; /* total number of records ever written */
+
+static inline trace_record_t *trace_new_record(void)
+{
+    trace_record_t *rec = &trace_ring[trace_head++ & (TRACE_RING_SIZE - 1)];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time_ns = (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    return rec;
+}
+
+void trace_sm(int br_ifindex, int port_ifindex, __u16 mstid,
+              trace_sm_t sm, int from, int to)
+{
+    trace_record_t *rec = trace_new_record();
+
+    PROBE(sm_transition, br_ifindex, port_ifindex, mstid, sm, from, to);
+    rec->br_ifindex = br_ifindex;
+    rec->port_ifindex = port_ifindex;
+    rec->mstid = mstid;
+    rec->type = TRACE_SM;
+    rec->sm = sm;
+    rec->from = from;
+    rec->to = to;
+    rec->size = 0;
+    rec->digest = 0;
+}
+
+/* FNV-1a over the CIST priority vector (root, ext cost, regional root,
+ * port id), enough to tell whether two BPDUs carry the same information.
+ */
+static __u32 trace_bpdu_digest(const bpdu_t *bpdu, int size)
+{
+    const __u8 *p = (const __u8 *)&bpdu->cistRootID;
+    const __u8 *end = (const __u8 *)&bpdu->MessageAge;
+    __u32 h = 2166136261u;
+
+    if(size < offsetof(bpdu_t, MessageAge))
+        return 0;
+    while(p < end)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+void trace_bpdu(trace_type_t type, int br_ifindex, int port_ifindex,
+                const void *data, int size)
+{
+    const bpdu_t *bpdu = data;
+    trace_record_t *rec = trace_new_record();
+
+    rec->br_ifindex = br_ifindex;
+    rec->port_ifindex = port_ifindex;
+    rec->mstid = 0;
+    rec->type = type;
+    rec->sm = (size > offsetof(bpdu_t, bpduType)) ? bpdu->bpduType : 0;
+    rec->from = (size > offsetof(bpdu_t, protocolVersion))
+                ? bpdu->protocolVersion : 0;
+    rec->to = (size > offsetof(bpdu_t, flags)) ? bpdu->flags : 0;
+    rec->size = size;
+    rec->digest = trace_bpdu_digest(bpdu, size);
+    if(TRACE_RX_BPDU == type)
+        PROBE(bpdu_rx, br_ifindex, port_ifindex, rec->sm, size);
+    else
+        PROBE(bpdu_tx, br_ifindex, port_ifindex, rec->sm, size);
+}
+
+unsigned int trace_read(unsigned int seq, trace_record_t *recs,
+                        unsigned int max, unsigned int *first,
+                        unsigned int *head)
+{
+    unsigned int i, count, oldest;
+
+    oldest = (trace_head < TRACE_RING_SIZE) ? 0
+                                            : trace_head - TRACE_RING_SIZE;
+    if(0 > (int)(seq - oldest))
+        seq = oldest;
+    count = (0 < (int)(trace_head - seq)) ? trace_head - seq : 0;
+    if(count > max)
+        count = max;
+    for(i = 0; i < count; ++i)
+        recs[i] = trace_ring[(seq + i) & (TRACE_RING_SIZE - 1)];
+    *first = seq;
+    *head = trace_head;
+    return count;
+}
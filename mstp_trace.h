@@ -0,0 +1,114 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#ifndef MSTP_TRACE_H
+#define MSTP_TRACE_H
+
+#include <linux/types.h>
+#include <net/if.h>
+
+/*
+ * Always-on binary trace of state machine transitions and BPDUs.
+ * Records are kept in a fixed size ring and can be dumped to a file
+ * ("mstpctl dumptrace", which reads the ring over the ctl socket and
+ * writes the file itself), which is decoded by "mstpctl showtrace".
+ *
+ * Trace file layout (host byte order):
+ *   trace_file_header_t
+ *   trace_file_name_t   x num_names  (interface names known at dump time)
+ *   trace_record_t      x num_records (oldest first)
+ */
+
+#define TRACE_RING_SIZE     8192 /* records, must be a power of 2 */
+
+/* Records per get_trace request, a reply must fit in the ctl buffer */
+#define TRACE_CHUNK_RECORDS 256
+
+#define TRACE_FILE_MAGIC    "MSTPTRC"
+#define TRACE_FILE_VERSION  1
+
+typedef enum
+{
+    TRACE_SM = 1,   /* state machine transition */
+    TRACE_RX_BPDU,
+    TRACE_TX_BPDU,
+} trace_type_t;
+
+typedef enum
+{
+    TRACE_SM_PRSM = 1,
+    TRACE_SM_PISM,
+    TRACE_SM_PRTSM,
+    TRACE_SM_PSTSM,
+    TRACE_SM_TCSM,
+} trace_sm_t;
+
+typedef struct
+{
+    __u64 time_ns;          /* CLOCK_REALTIME */
+    __u32 br_ifindex;
+    __u32 port_ifindex;
+    __u16 mstid;            /* 0 for CIST and for BPDUs */
+    __u8 type;              /* trace_type_t */
+    /* TRACE_SM: sm = trace_sm_t, from/to = states of that machine.
+     * TRACE_*_BPDU: sm = bpduType, from = protocolVersion, to = flags.
+     */
+    __u8 sm;
+    __u8 from;
+    __u8 to;
+    __u16 size;             /* BPDU size */
+    __u32 digest;           /* BPDU: hash of the CIST priority vector */
+    __u32 reserved;
+} trace_record_t;
+
+typedef struct
+{
+    char magic[8];
+    __u32 version;
+    __u32 record_size;
+    __u32 num_names;
+    __u32 num_records;
+} trace_file_header_t;
+
+typedef struct
+{
+    __u32 ifindex;
+    char name[IFNAMSIZ];
+} trace_file_name_t;
+
+#ifndef NO_DAEMON
+
+void trace_sm(int br_ifindex, int port_ifindex, __u16 mstid,
+              trace_sm_t sm, int from, int to);
+void trace_bpdu(trace_type_t type, int br_ifindex, int port_ifindex,
+                const void *bpdu, int size);
+
+/* Copy up to max records to recs, starting with record number seq or
+ * with the oldest one still in the ring if seq was overwritten.
+ * Sets *first to the number of the first record copied and *head to the
+ * number of records ever written. Returns the number of records copied.
+ */
+unsigned int trace_read(unsigned int seq, trace_record_t *recs,
+                        unsigned int max, unsigned int *first,
+                        unsigned int *head);
+
+#endif /* NO_DAEMON */
+
+#endif /* MSTP_TRACE_H */
@@ -27,10 +27,14 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <dirent.h>
+#include <sys/inotify.h>
 #include <asm/byteorder.h>
 
 #include "io_buffer.h"
 #include "log.h"
+#include "bridge_track.h"
+#include "epoll_loop.h"
 
 #include "mstpd_conf.h"
 
@@ -125,6 +129,10 @@ struct conf_prt
     bool dont_txmt_set;
     bool bpdu_filter;
     bool bpdu_filter_set;
+    unsigned int bpdu_rate;
+    bool bpdu_rate_set;
+    unsigned int bpdu_burst;
+    bool bpdu_burst_set;
     __u16 prio;
     bool prio_set;
     __u32 int_cost;
@@ -212,6 +220,8 @@ static int conf_opt_prt_bpdu_guard(struct conf_ctx *ctx);
 static int conf_opt_prt_network(struct conf_ctx *ctx);
 static int conf_opt_prt_dont_txmt(struct conf_ctx *ctx);
 static int conf_opt_prt_bpdu_filter(struct conf_ctx *ctx);
+static int conf_opt_prt_bpdu_rate(struct conf_ctx *ctx);
+static int conf_opt_prt_bpdu_burst(struct conf_ctx *ctx);
 static int conf_opt_prt_mstid(struct conf_ctx *ctx);
 static int conf_opt_prt_prio(struct conf_ctx *ctx);
 static int conf_opt_prt_int_cost(struct conf_ctx *ctx);
@@ -228,6 +238,8 @@ const struct conf_opt conf_opts_prt[] =
     { "network", 1, 1, conf_opt_prt_network },
     { "dont-txmt", 1, 1, conf_opt_prt_dont_txmt },
     { "bpdu-filter", 1, 1, conf_opt_prt_bpdu_filter },
+    { "bpdu-rate", 1, 1, conf_opt_prt_bpdu_rate },
+    { "bpdu-burst", 1, 1, conf_opt_prt_bpdu_burst },
     { "mstid", 1, 1, conf_opt_prt_mstid },
     { "prio", 1, 1, conf_opt_prt_prio },
     { "int-cost", 1, 1, conf_opt_prt_int_cost },
@@ -748,6 +760,32 @@ CONF_FN_OPT_YESNO(conf_opt_prt_network, prt->network);
 CONF_FN_OPT_YESNO(conf_opt_prt_dont_txmt, prt->dont_txmt);
 CONF_FN_OPT_YESNO(conf_opt_prt_bpdu_filter, prt->bpdu_filter);
 
+static int conf_opt_prt_bpdu_rate(struct conf_ctx *ctx)
+{
+    unsigned int value;
+    if (str_getuint(ctx->argv[0], &value))
+    {
+        CTX_ERR(ctx, "Invalid %s value", ctx->optname);
+        return -1;
+    }
+    ctx->prt->bpdu_rate = value;
+    ctx->prt->bpdu_rate_set = true;
+    return 0;
+}
+
+static int conf_opt_prt_bpdu_burst(struct conf_ctx *ctx)
+{
+    unsigned int value;
+    if (str_getuint(ctx->argv[0], &value) || (value == 0))
+    {
+        CTX_ERR(ctx, "Invalid %s value", ctx->optname);
+        return -1;
+    }
+    ctx->prt->bpdu_burst = value;
+    ctx->prt->bpdu_burst_set = true;
+    return 0;
+}
+
 static int conf_opt_prt_mstid(struct conf_ctx *ctx)
 {
     struct conf_prt *cprt = ctx->prt;
@@ -976,6 +1014,10 @@ static void conf_prt_print(FILE *stream, struct conf_prt *cprt)
         fprintf(stream, "dont-txmt %s\n", conf_opt_yesno[cprt->dont_txmt]);
     if (cprt->bpdu_filter_set)
         fprintf(stream, "bpdu-filter %s\n", conf_opt_yesno[cprt->bpdu_filter]);
+    if (cprt->bpdu_rate_set)
+        fprintf(stream, "bpdu-rate %u\n", cprt->bpdu_rate);
+    if (cprt->bpdu_burst_set)
+        fprintf(stream, "bpdu-burst %u\n", cprt->bpdu_burst);
     if (cprt->prio_set)
         fprintf(stream, "prio %d\n", cprt->prio * 16);
     if (cprt->int_cost_set)
@@ -1080,6 +1122,88 @@ int conf_if_load(struct conf_ctx *ctx, struct iobuf *iob, const struct conf_opt
     return fnret;
 }
 
+/* Drop the option from the parsed config if the running value already
+ * matches it, so that only real changes reach MSTP_IN_set_* */
+#define CONF_DIFF(_cfg, _var, _cur) \
+    do { \
+        if ((_cfg)->_var ## _set && ((_cfg)->_var == (_cur))) \
+            (_cfg)->_var ## _set = false; \
+    } while (0)
+
+static void mstpd_conf_diff_br(bridge_t *br, struct conf_br *cbr)
+{
+    tree_t *tree;
+
+    CONF_DIFF(cbr, mode, br->ForceProtocolVersion);
+    CONF_DIFF(cbr, max_age, br->Max_Age);
+    CONF_DIFF(cbr, forward_delay, br->Forward_Delay);
+    CONF_DIFF(cbr, max_hops, br->MaxHops);
+    CONF_DIFF(cbr, hello, br->Hello_Time);
+    CONF_DIFF(cbr, ageing, br->Ageing_Time);
+    CONF_DIFF(cbr, tx_hold_count, br->Transmit_Hold_Count);
+
+    if (cbr->confid_set
+        && (cbr->confid_rev == __be16_to_cpu(br->MstConfigId.s.revision_level))
+        && (0 == strncmp((char *)cbr->confid_name,
+                         (char *)br->MstConfigId.s.configuration_name,
+                         sizeof(br->MstConfigId.s.configuration_name))))
+        cbr->confid_set = false;
+
+    tree = GET_CIST_TREE(br);
+    CONF_DIFF(cbr, prio,
+              GET_PRIORITY_FROM_IDENTIFIER(tree->BridgeIdentifier) >> 4);
+
+    for (int pos = 0; pos < cbr->mstids_cnt; pos++)
+    {
+        if (!(tree = find_tree_by_mstid(br, cbr->mstids[pos].id)))
+            continue;
+        CONF_DIFF(&cbr->mstids[pos], prio,
+                  GET_PRIORITY_FROM_IDENTIFIER(tree->BridgeIdentifier) >> 4);
+    }
+
+    if (cbr->vid2mstid_set)
+    {
+        int vid;
+        for (vid = 1; vid <= MAX_VID; vid++)
+            if (cbr->vid2mstid[vid] != __be16_to_cpu(br->vid2mstid[vid]))
+                break;
+        if (vid > MAX_VID)
+            cbr->vid2mstid_set = false;
+    }
+}
+
+static void mstpd_conf_diff_prt(port_t *prt, struct conf_prt *cprt)
+{
+    per_tree_port_t *ptp;
+
+    CONF_DIFF(cprt, admin_edge, prt->AdminEdgePort);
+    CONF_DIFF(cprt, auto_edge, prt->AutoEdge);
+    CONF_DIFF(cprt, p2p, prt->AdminP2P);
+    CONF_DIFF(cprt, rest_role, prt->restrictedRole);
+    CONF_DIFF(cprt, rest_tcn, prt->restrictedTcn);
+    CONF_DIFF(cprt, bpdu_guard, prt->BpduGuardPort);
+    CONF_DIFF(cprt, network, prt->NetworkPort);
+    CONF_DIFF(cprt, dont_txmt, prt->dontTxmtBpdu);
+    CONF_DIFF(cprt, bpdu_filter, prt->bpduFilterPort);
+    CONF_DIFF(cprt, bpdu_rate, prt->bpduPoliceRate);
+    CONF_DIFF(cprt, bpdu_burst, prt->bpduPoliceBurst);
+    CONF_DIFF(cprt, ext_cost, prt->AdminExternalPortPathCost);
+
+    ptp = GET_CIST_PTP_FROM_PORT(prt);
+    CONF_DIFF(cprt, prio, GET_PRIORITY_FROM_IDENTIFIER(ptp->portId) >> 4);
+    CONF_DIFF(cprt, int_cost, ptp->AdminInternalPortPathCost);
+
+    for (int pos = 0; pos < cprt->mstids_cnt; pos++)
+    {
+        if (!(ptp = find_ptp_by_mstid(prt, cprt->mstids[pos].id)))
+            continue;
+        CONF_DIFF(&cprt->mstids[pos], prio,
+                  GET_PRIORITY_FROM_IDENTIFIER(ptp->portId) >> 4);
+        CONF_DIFF(&cprt->mstids[pos], int_cost,
+                  ptp->AdminInternalPortPathCost);
+    }
+}
+
 static void mstpd_conf_apply_br(bridge_t *br, struct conf_br *cbr)
 {
     CIST_BridgeConfig ccfg;
@@ -1147,7 +1271,9 @@ static void mstpd_conf_apply_br(bridge_t *br, struct conf_br *cbr)
 
     for (int pos = 0; pos < cbr->mstids_cnt; pos++)
     {
-        tree_t *tree = MSTP_IN_create_msti(br, cbr->mstids[pos].id);
+        tree_t *tree = find_tree_by_mstid(br, cbr->mstids[pos].id);
+        if (!tree)
+            tree = MSTP_IN_create_msti(br, cbr->mstids[pos].id);
         if (tree)
         {
             if (cbr->mstids[pos].prio_set)
@@ -1239,6 +1365,20 @@ static void mstpd_conf_apply_prt(port_t *prt, struct conf_prt *cprt)
         cfg_apply = true;
     }
 
+    if (cprt->bpdu_rate_set)
+    {
+        ccfg.bpdu_police_rate = cprt->bpdu_rate;
+        ccfg.set_bpdu_police_rate = true;
+        cfg_apply = true;
+    }
+
+    if (cprt->bpdu_burst_set)
+    {
+        ccfg.bpdu_police_burst = cprt->bpdu_burst;
+        ccfg.set_bpdu_police_burst = true;
+        cfg_apply = true;
+    }
+
     if (cprt->ext_cost_set)
     {
         ccfg.admin_external_port_path_cost = cprt->ext_cost;
@@ -1295,15 +1435,9 @@ static void mstpd_conf_apply_prt(port_t *prt, struct conf_prt *cprt)
 
         if (cfg_apply)
         {
-            per_tree_port_t *ptp;
-            __be16 MSTID = __cpu_to_be16(cprt->mstids[pos].id);
-
-            list_for_each_entry(ptp, &prt->trees, port_list)
-                if (ptp->MSTID == MSTID)
-                {
-                    MSTP_IN_set_msti_port_config(ptp, &mcfg);
-                    break;
-                }
+            per_tree_port_t *ptp = find_ptp_by_mstid(prt, cprt->mstids[pos].id);
+            if (ptp)
+                MSTP_IN_set_msti_port_config(ptp, &mcfg);
 
             cfg_apply = false;
         }
@@ -1361,7 +1495,12 @@ bool mstpd_conf_load_br(bridge_t *br)
     ret = conf_if_load(&ctx, &iob, conf_opts_br);
     iobuf_cleanup(&iob);
     if (ret >= 0)
+    {
+        MSTP_IN_config_begin(br);
+        mstpd_conf_diff_br(br, &cbr);
         mstpd_conf_apply_br(br, &cbr);
+        MSTP_IN_config_commit(br);
+    }
     else
     {
         ERROR("%s: Unable to process config file %s", br->sysdeps.name, filename);
@@ -1416,7 +1555,12 @@ bool mstpd_conf_load_prt(port_t *prt)
     ret = conf_if_load(&ctx, &iob, conf_opts_prt);
     iobuf_cleanup(&iob);
     if (ret >= 0)
+    {
+        MSTP_IN_config_begin(br);
+        mstpd_conf_diff_prt(prt, &cprt);
         mstpd_conf_apply_prt(prt, &cprt);
+        MSTP_IN_config_commit(br);
+    }
     else
     {
         ERROR("%s: Unable to process config file %s", prt->sysdeps.name, filename);
@@ -1427,6 +1571,263 @@ bool mstpd_conf_load_prt(port_t *prt)
     return (ret == 0);
 }
 
+/*****************************************************************************
+  Config directory watcher
+*****************************************************************************/
+
+#define CONF_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO)
+#define CONF_WATCH_DIR_MASK (CONF_WATCH_MASK | IN_CREATE | IN_ONLYDIR)
+
+struct conf_watch
+{
+    int wd;
+    char br_name[IFNAMSIZ]; /* empty for MSTPD_CONFIG_DIR itself */
+};
+
+static struct epoll_event_handler conf_watch_event = { .fd = -1 };
+static struct conf_watch *conf_watches;
+static size_t conf_watches_cnt;
+
+static struct conf_watch *conf_watch_find(int wd)
+{
+    for (int pos = 0; pos < conf_watches_cnt; pos++)
+        if (conf_watches[pos].wd == wd)
+            return &conf_watches[pos];
+    return NULL;
+}
+
+static int conf_watch_add(const char *br_name)
+{
+    char dirname[128];
+    struct conf_watch *watches;
+    int wd;
+
+    if (*br_name)
+        snprintf(dirname, sizeof(dirname), MSTPD_CONFIG_DIR "/%s", br_name);
+    else
+        snprintf(dirname, sizeof(dirname), MSTPD_CONFIG_DIR);
+
+    wd = inotify_add_watch(conf_watch_event.fd, dirname,
+                           *br_name ? CONF_WATCH_MASK : CONF_WATCH_DIR_MASK);
+    if (wd < 0)
+    {
+        INFO("Unable to watch config dir %s: %m", dirname);
+        return -1;
+    }
+
+    /* inotify returns the same wd when the directory is already watched */
+    if (conf_watch_find(wd))
+        return 0;
+
+    watches = realloc(conf_watches,
+                      (conf_watches_cnt + 1) * sizeof(struct conf_watch));
+    if (!watches)
+    {
+        inotify_rm_watch(conf_watch_event.fd, wd);
+        return -1;
+    }
+    conf_watches = watches;
+    conf_watches[conf_watches_cnt].wd = wd;
+    strncpy(conf_watches[conf_watches_cnt].br_name, br_name, IFNAMSIZ - 1);
+    conf_watches[conf_watches_cnt].br_name[IFNAMSIZ - 1] = 0;
+    conf_watches_cnt++;
+
+    LOG("Watching config dir %s", dirname);
+    return 0;
+}
+
+static void conf_watch_del(int wd)
+{
+    for (int pos = 0; pos < conf_watches_cnt; pos++)
+        if (conf_watches[pos].wd == wd)
+        {
+            conf_watches[pos] = conf_watches[--conf_watches_cnt];
+            return;
+        }
+}
+
+/* Returns true and strips the suffix if name is "<ifname>.conf" */
+static bool conf_watch_ifname(char *ifname, const char *name)
+{
+    size_t len = strlen(name);
+
+    if ((len <= 5) || (len - 5 >= IFNAMSIZ) || strcmp(name + len - 5, ".conf"))
+        return false;
+
+    memcpy(ifname, name, len - 5);
+    ifname[len - 5] = 0;
+    return true;
+}
+
+static void conf_watch_reload_br(const char *br_name)
+{
+    bridge_t *br = find_br_byname(br_name);
+
+    if (!br)
+        return;
+
+    INFO("%s: Config file changed, reloading", br->sysdeps.name);
+    if (!mstpd_conf_load_br(br))
+        INFO("Failed applying config for %s", br->sysdeps.name);
+}
+
+static void conf_watch_reload_prt(const char *br_name, const char *prt_name)
+{
+    bridge_t *br = find_br_byname(br_name);
+    port_t *prt;
+
+    if (!br || !(prt = find_if_byname(br, prt_name)))
+        return;
+
+    INFO("%s: Config file changed, reloading", prt->sysdeps.name);
+    if (!mstpd_conf_load_prt(prt))
+        INFO("Failed applying config for %s", prt->sysdeps.name);
+}
+
+static void conf_watch_reload_br_ports(const char *br_name)
+{
+    bridge_t *br = find_br_byname(br_name);
+    port_t *prt;
+
+    if (!br)
+        return;
+
+    MSTP_IN_config_begin(br);
+    list_for_each_entry(prt, &br->ports, br_list)
+        if (!mstpd_conf_load_prt(prt))
+            INFO("Failed applying config for %s", prt->sysdeps.name);
+    MSTP_IN_config_commit(br);
+}
+
+static void conf_watch_process(struct inotify_event *ev)
+{
+    struct conf_watch *cw;
+    char ifname[IFNAMSIZ];
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        ERROR("Config watch queue overflow, some changes may be missed");
+        return;
+    }
+
+    if (!(cw = conf_watch_find(ev->wd)))
+        return;
+
+    if (ev->mask & IN_IGNORED)
+    {
+        LOG("Config dir for %s removed", *cw->br_name ? cw->br_name : "/");
+        conf_watch_del(ev->wd);
+        return;
+    }
+
+    if (!ev->len)
+        return;
+
+    if (*cw->br_name)
+    {
+        /* MSTPD_CONFIG_DIR/<br>/<prt>.conf */
+        if (!(ev->mask & IN_ISDIR) && conf_watch_ifname(ifname, ev->name))
+            conf_watch_reload_prt(cw->br_name, ifname);
+        return;
+    }
+
+    if (ev->mask & IN_ISDIR)
+    {
+        /* New per-bridge directory, it may already contain port files */
+        if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+            && (strlen(ev->name) < IFNAMSIZ)
+            && (0 == conf_watch_add(ev->name)))
+            conf_watch_reload_br_ports(ev->name);
+        return;
+    }
+
+    /* MSTPD_CONFIG_DIR/<br>.conf */
+    if ((ev->mask & CONF_WATCH_MASK) && conf_watch_ifname(ifname, ev->name))
+        conf_watch_reload_br(ifname);
+}
+
+static void conf_watch_rcv(uint32_t events, struct epoll_event_handler *h)
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t len;
+
+    while (0 < (len = read(h->fd, buf, sizeof(buf))))
+    {
+        for (char *ptr = buf; ptr < buf + len;
+             ptr += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (struct inotify_event *)ptr;
+            conf_watch_process(ev);
+        }
+    }
+
+    if ((len < 0) && (errno != EAGAIN))
+        ERROR("Config watch read failed: %m");
+}
+
+int mstpd_conf_watch_init(void)
+{
+    DIR *dir;
+    struct dirent *de;
+    int fd;
+
+    /* Config reload is optional, run without it if inotify is unavailable */
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+    {
+        INFO("inotify_init1 failed, config reload disabled: %m");
+        return 0;
+    }
+
+    conf_watch_event.fd = fd;
+    conf_watch_event.handler = conf_watch_rcv;
+    conf_watch_event.prio = EPOLL_PRIO_CTL;
+
+    /* Missing config dir is not fatal, config is optional */
+    if (conf_watch_add("") < 0)
+    {
+        close(fd);
+        conf_watch_event.fd = -1;
+        return 0;
+    }
+
+    if ((dir = opendir(MSTPD_CONFIG_DIR)))
+    {
+        while ((de = readdir(dir)))
+        {
+            if ((de->d_type != DT_DIR) || (de->d_name[0] == '.')
+                || (strlen(de->d_name) >= IFNAMSIZ))
+                continue;
+            conf_watch_add(de->d_name);
+        }
+        closedir(dir);
+    }
+
+    if (add_epoll(&conf_watch_event) < 0)
+    {
+        INFO("Config watch epoll failed, config reload disabled");
+        mstpd_conf_watch_fini();
+        return 0;
+    }
+
+    return 0;
+}
+
+void mstpd_conf_watch_fini(void)
+{
+    if (conf_watch_event.fd >= 0)
+    {
+        close(conf_watch_event.fd);
+        conf_watch_event.fd = -1;
+    }
+
+    free(conf_watches);
+    conf_watches = NULL;
+    conf_watches_cnt = 0;
+}
+
 //-------------------------------------------
 // TESTING TESTING TESTING
 //-------------------------------------------
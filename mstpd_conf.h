@@ -32,4 +32,8 @@ bool mstpd_conf_exist_br(const char *br_name);
 bool mstpd_conf_load_br(bridge_t *br);
 bool mstpd_conf_load_prt(port_t *prt);
 
+/* Watch MSTPD_CONFIG_DIR and re-apply changed config files */
+int mstpd_conf_watch_init(void);
+void mstpd_conf_watch_fini(void);
+
 #endif /* MSTPD_CONF_H */
@@ -26,21 +26,32 @@
 /* #define PACKET_DEBUG */
 
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
 #include <linux/if_packet.h>
+#include <linux/pkt_sched.h>
 #include <linux/filter.h>
+#include <linux/bpf.h>
 #include <asm/byteorder.h>
 
 #include "epoll_loop.h"
 #include "netif_utils.h"
 #include "bridge_ctl.h"
+#include "cpu_acct.h"
 #include "packet.h"
 #include "log.h"
 
 static struct epoll_event_handler packet_event;
+/* BPDUs go out of packet_event.fd, or of a socket of their own,
+ * see packet_tx_mode */
+static int packet_tx_fd = -1;
+
+packet_tx_mode_t packet_tx_mode = PACKET_TX_PLAIN;
 
 #ifdef PACKET_DEBUG
 static void dump_packet(const unsigned char *buf, int cc)
@@ -57,6 +68,14 @@ static void dump_packet(const unsigned char *buf, int cc)
 }
 #endif
 
+/* Failed send, maybe reported by the io_uring loop after the fact */
+static void packet_send_error(const struct msghdr *msg, int err)
+{
+    const struct sockaddr_ll *sl = msg->msg_name;
+
+    bridge_bpdu_tx_error(sl->sll_ifindex, err);
+}
+
 /*
  * To send/receive Spanning Tree packets we use PF_PACKET because
  * it allows the filtering we want but gives raw data
@@ -98,41 +117,89 @@ void packet_send(int ifindex, const struct iovec *iov, int iov_count, int len)
     }
 #endif
 
-    l = sendmsg(packet_event.fd, &msg, 0);
+    l = loop_sendmsg(packet_tx_fd, &msg, len, packet_send_error);
+    loop_account_io(0, 1);
 
     if(l < 0)
-    {
-        if(errno != EWOULDBLOCK)
-            ERROR("send failed: %m");
-    }
+        packet_send_error(&msg, errno);
     else if(l != len)
         ERROR("short write in sendto: %d instead of %d", l, len);
 }
 
-static void packet_rcv(uint32_t events, struct epoll_event_handler *h)
+/* BPDUs received per loop iteration */
+#define PACKET_RX_BUDGET 64
+
+#define PACKET_RX_SIZE 2048
+
+static void packet_deliver(const struct sockaddr_ll *sl,
+                           const unsigned char *buf, int cc)
+{
+#ifdef PACKET_DEBUG
+    printf("Receive Src ifindex %d %02x:%02x:%02x:%02x:%02x:%02x\n",
+           sl->sll_ifindex,
+           sl->sll_addr[0], sl->sll_addr[1], sl->sll_addr[2],
+           sl->sll_addr[3], sl->sll_addr[4], sl->sll_addr[5]);
+
+    dump_packet(buf, cc);
+#endif
+
+    loop_account_io(0, 1);
+    bridge_bpdu_rcv(sl->sll_ifindex, buf, cc);
+}
+
+static bool packet_rcv_one(int fd)
 {
     int cc;
-    unsigned char buf[2048];
+    unsigned char buf[PACKET_RX_SIZE];
     struct sockaddr_ll sl;
     socklen_t salen = sizeof sl;
+    cpu_acct_frame_t f;
 
-    cc = recvfrom(h->fd, &buf, sizeof(buf), 0, (struct sockaddr *) &sl, &salen);
+    /* Charged to the bridge once bridge_bpdu_rcv() knows it */
+    cpu_acct_enter(&f, NULL, CPU_ACCT_RX);
+    loop_account_io(1, 0);
+    cc = recvfrom(fd, &buf, sizeof(buf), 0, (struct sockaddr *) &sl, &salen);
     if(cc <= 0)
     {
+        cpu_acct_leave(&f);
+        /* Socket is drained */
+        if(cc < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+            return false;
         ERROR("recvfrom failed: %m");
-        return;
+        return false;
     }
 
-#ifdef PACKET_DEBUG
-    printf("Receive Src ifindex %d %02x:%02x:%02x:%02x:%02x:%02x\n",
-           sl.sll_ifindex,
-           sl.sll_addr[0], sl.sll_addr[1], sl.sll_addr[2],
-           sl.sll_addr[3], sl.sll_addr[4], sl.sll_addr[5]);
+    packet_deliver(&sl, buf, cc);
+    cpu_acct_leave(&f);
+    return true;
+}
 
-    dump_packet(buf, cc);
-#endif
+/* Datagram received by the io_uring event loop */
+static void packet_recv(struct epoll_event_handler *h, void *data, int len,
+                        int msg_flags, const void *from,
+                        unsigned int from_len)
+{
+    struct sockaddr_ll sl;
+    cpu_acct_frame_t f;
+
+    if(from_len < offsetof(struct sockaddr_ll, sll_addr))
+        return;
+    memset(&sl, 0, sizeof(sl));
+    memcpy(&sl, from, (from_len < sizeof(sl)) ? from_len : sizeof(sl));
+    cpu_acct_enter(&f, NULL, CPU_ACCT_RX);
+    packet_deliver(&sl, data, len);
+    cpu_acct_leave(&f);
+}
 
-    bridge_bpdu_rcv(sl.sll_ifindex, buf, cc);
+static void packet_rcv(uint32_t events, struct epoll_event_handler *h)
+{
+    unsigned int n;
+
+    for(n = 0; !h->budget || n < h->budget; ++n)
+    {
+        if(!packet_rcv_one(h->fd))
+            break;
+    }
 }
 
 /* Berkeley Packet filter code to filter out spanning tree packets.
@@ -147,6 +214,242 @@ static struct sock_filter stp_filter[] = {
     { 0x6, 0, 0, 0x00000000 },
 };
 
+static int attach_stp_filter(int s)
+{
+    struct sock_fprog prog =
+    {
+        .len = sizeof(stp_filter) / sizeof(stp_filter[0]),
+        .filter = stp_filter,
+    };
+
+    if(setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    {
+        ERROR("setsockopt packet filter failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * eBPF version of the filter. Besides SAP 42 it checks the destination
+ * (Bridge Group Address) and the ingress interface, which must be one of
+ * the ports in managed_ports map (maintained by packet_sock_add_port() and
+ * packet_sock_del_port()). So BPDUs of the bridges we don't handle are
+ * dropped in the kernel and never copied to us.
+ * If eBPF is not available, the classic filter above is used.
+ */
+#ifdef __NR_bpf
+
+#define MANAGED_PORTS_MAX   65536
+
+static int managed_ports_fd = -1;
+
+static inline int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(_code, _dst, _src, _off, _imm) \
+    ((struct bpf_insn){ .code = (_code), .dst_reg = (_dst), \
+                        .src_reg = (_src), .off = (_off), .imm = (_imm) })
+
+static int attach_stp_ebpf(int s)
+{
+    /* Return values are snap lengths, as in stp_filter.
+     * Jump offsets count instructions, LD_ABS offsets are in the frame,
+     * which starts with the Ethernet header.
+     */
+    enum { DROP = 0, ACCEPT = 0x480, MAP_FD_INSN = 16 };
+    struct bpf_insn prog[] =
+    {
+        /* r6 = ctx, needed by LD_ABS */
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        /* Destination 01:80:C2:00:00:00 */
+        INSN(BPF_LD | BPF_W | BPF_ABS, 0, 0, 0, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 19, 0x0180C200),
+        INSN(BPF_LD | BPF_H | BPF_ABS, 0, 0, 0, 4),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 17, 0),
+        /* 802.3 length, not EtherType */
+        INSN(BPF_LD | BPF_H | BPF_ABS, 0, 0, 0, 12),
+        INSN(BPF_JMP | BPF_JGT | BPF_K, BPF_REG_0, 0, 15, 1500),
+        /* LLC DSAP, SSAP = 0x42 and U type PDU */
+        INSN(BPF_LD | BPF_H | BPF_ABS, 0, 0, 0, 14),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 13, 0x4242),
+        INSN(BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, 16),
+        INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 0x3),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 10, 0x3),
+        /* Ingress port must be in managed_ports */
+        INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_6,
+             offsetof(struct __sk_buff, ifindex), 0),
+        INSN(BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_1, -4, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+             0 /* map fd, set below */),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0),
+        /* accept */
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, ACCEPT),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* drop */
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, DROP),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    union bpf_attr attr;
+    int prog_fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_HASH;
+    attr.key_size = sizeof(__u32);
+    attr.value_size = sizeof(__u8);
+    attr.max_entries = MANAGED_PORTS_MAX;
+    attr.map_flags = BPF_F_NO_PREALLOC;
+    if(0 > (managed_ports_fd = sys_bpf(BPF_MAP_CREATE, &attr)))
+    {
+        INFO("Can't create eBPF map (%m), using classic packet filter");
+        return -1;
+    }
+    prog[MAP_FD_INSN].imm = managed_ports_fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (__u64)(unsigned long)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (__u64)(unsigned long)"GPL";
+    if(0 > (prog_fd = sys_bpf(BPF_PROG_LOAD, &attr)))
+    {
+        INFO("Can't load eBPF packet filter (%m), using classic one");
+        goto err;
+    }
+    if(setsockopt(s, SOL_SOCKET, SO_ATTACH_BPF, &prog_fd, sizeof(prog_fd)) < 0)
+    {
+        INFO("Can't attach eBPF packet filter (%m), using classic one");
+        close(prog_fd);
+        goto err;
+    }
+    /* Socket holds a reference to the program */
+    close(prog_fd);
+    INFO("Using eBPF packet filter");
+    return 0;
+
+err:
+    close(managed_ports_fd);
+    managed_ports_fd = -1;
+    return -1;
+}
+
+/* Something went wrong with managed_ports: let all BPDUs in again */
+static void fallback_to_stp_filter(void)
+{
+    if(attach_stp_filter(packet_event.fd))
+        return;
+    close(managed_ports_fd);
+    managed_ports_fd = -1;
+    INFO("Switched to classic packet filter");
+}
+
+void packet_sock_add_port(int ifindex)
+{
+    union bpf_attr attr;
+    __u32 key = ifindex;
+    __u8 value = 1;
+
+    if(0 > managed_ports_fd)
+        return;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = managed_ports_fd;
+    attr.key = (__u64)(unsigned long)&key;
+    attr.value = (__u64)(unsigned long)&value;
+    attr.flags = BPF_ANY;
+    if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr))
+    {
+        ERROR("Can't add ifindex %d to eBPF packet filter: %m", ifindex);
+        fallback_to_stp_filter();
+    }
+}
+
+void packet_sock_del_port(int ifindex)
+{
+    union bpf_attr attr;
+    __u32 key = ifindex;
+
+    if(0 > managed_ports_fd)
+        return;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = managed_ports_fd;
+    attr.key = (__u64)(unsigned long)&key;
+    if(sys_bpf(BPF_MAP_DELETE_ELEM, &attr) && (ENOENT != errno))
+        ERROR("Can't remove ifindex %d from eBPF packet filter: %m", ifindex);
+}
+
+#else /* __NR_bpf */
+
+static int attach_stp_ebpf(int s)
+{
+    return -1;
+}
+
+void packet_sock_add_port(int ifindex)
+{
+}
+
+void packet_sock_del_port(int ifindex)
+{
+}
+
+#endif /* __NR_bpf */
+
+/*
+ * Socket for sending only (protocol 0, so nothing is received on it),
+ * whose packets the egress qdisc puts in the band of network control
+ * traffic rather than behind the data, or which skip the qdisc entirely.
+ * Returns -1 if the socket can't be set up, then the receive socket is
+ * used for sending as well.
+ */
+static int packet_tx_sock_init(void)
+{
+    int s, val;
+
+    if(0 > (s = socket(PF_PACKET, SOCK_RAW, 0)))
+    {
+        ERROR("tx socket failed: %m");
+        return -1;
+    }
+    if(fcntl(s, F_SETFL, O_NONBLOCK) < 0)
+    {
+        ERROR("fcntl set nonblock failed: %m");
+        goto err;
+    }
+    /* Priorities above TC_PRIO_INTERACTIVE need CAP_NET_ADMIN */
+    val = TC_PRIO_CONTROL;
+    if(setsockopt(s, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val)) < 0)
+    {
+        ERROR("setsockopt SO_PRIORITY failed: %m");
+        goto err;
+    }
+    if(PACKET_TX_BYPASS == packet_tx_mode)
+    {
+        /* Straight to the driver. The BPDUs then no longer show up in
+         * packet captures on the port, and a full device queue is
+         * reported to us instead of being waited out in the qdisc */
+        val = 1;
+        if(setsockopt(s, SOL_PACKET, PACKET_QDISC_BYPASS, &val, sizeof(val)))
+        {
+            INFO("Can't bypass the qdisc (%m), sending with priority only");
+            packet_tx_mode = PACKET_TX_PRIO;
+        }
+    }
+    INFO("Sending BPDUs with priority %d%s", TC_PRIO_CONTROL,
+         (PACKET_TX_BYPASS == packet_tx_mode) ? ", bypassing the qdisc" : "");
+    packet_tx_fd = s;
+    return 0;
+
+err:
+    close(s);
+    return -1;
+}
+
 /*
  * Open up a raw packet socket to catch all 802.2 packets.
  * and install a packet filter to only see STP (SAP 42)
@@ -157,11 +460,6 @@ static struct sock_filter stp_filter[] = {
 int packet_sock_init(void)
 {
     int s;
-    struct sock_fprog prog =
-    {
-        .len = sizeof(stp_filter) / sizeof(stp_filter[0]),
-        .filter = stp_filter,
-    };
 
     s = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_802_2));
     if(s < 0)
@@ -170,17 +468,29 @@ int packet_sock_init(void)
         return -1;
     }
 
-    if(setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
-        ERROR("setsockopt packet filter failed: %m");
+    if(attach_stp_ebpf(s) && attach_stp_filter(s))
+        ;
     else if(fcntl(s, F_SETFL, O_NONBLOCK) < 0)
         ERROR("fcntl set nonblock failed: %m");
     else
     {
         packet_event.fd = s;
         packet_event.handler = packet_rcv;
+        packet_event.prio = EPOLL_PRIO_BPDU;
+        packet_event.budget = PACKET_RX_BUDGET;
+        packet_event.recv_handler = packet_recv;
+        packet_event.rx_size = PACKET_RX_SIZE;
+        packet_event.rx_from_len = sizeof(struct sockaddr_ll);
 
         if(0 == add_epoll(&packet_event))
+        {
+            if((PACKET_TX_PLAIN == packet_tx_mode) || packet_tx_sock_init())
+            {
+                packet_tx_mode = PACKET_TX_PLAIN;
+                packet_tx_fd = s;
+            }
             return 0;
+        }
     }
 
     close(s);
@@ -27,7 +27,20 @@
 
 #include <sys/uio.h>
 
+/* How BPDUs are sent, must be set before packet_sock_init() */
+typedef enum
+{
+    PACKET_TX_PLAIN,  /* on the receive socket */
+    PACKET_TX_PRIO,   /* on a socket of their own with TC_PRIO_CONTROL */
+    PACKET_TX_BYPASS, /* the same, skipping the qdisc */
+} packet_tx_mode_t;
+
+extern packet_tx_mode_t packet_tx_mode;
+
 void packet_send(int ifindex, const struct iovec *iov, int iov_count, int len);
 int packet_sock_init(void);
+/* Tell kernel packet filter which interfaces are the ports we handle */
+void packet_sock_add_port(int ifindex);
+void packet_sock_del_port(int ifindex);
 
 #endif /* PACKET_SOCK_H */
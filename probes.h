@@ -0,0 +1,38 @@
+/*****************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+
+******************************************************************************/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT (statically defined tracing) probes of the "mstpd" provider, for
+ * bpftrace, perf or SystemTap. Built in with --enable-usdt; a probe is a
+ * single nop until something attaches to it. Arguments are ifindexes,
+ * host order MSTIDs and raw state numbers.
+ * See utils/bpftrace/ for examples.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(mstpd, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) do {} while(0)
+#endif
+
+#endif /* PROBES_H */